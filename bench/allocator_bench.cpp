@@ -0,0 +1,103 @@
+#include <benchmark/benchmark.h>
+#include <random>
+#include <vector>
+#include "block_store.h"
+
+// Fragmentation over time: a random mix of power of two extent allocations and frees
+// run against each allocator, reporting how usable the free space is at the end.
+// The extents live until a random later step, so the free space gets chopped up the way
+// a long-running device does.
+
+namespace {
+
+struct extent
+{
+	size_t id, count, length;
+};
+
+// Longest run of free blocks in our mirror of the device
+size_t largest_free_run(const std::vector<bool> &used)
+{
+	size_t best = 0, run = 0;
+	for (bool bit : used)
+	{
+		run = bit ? 0 : run + 1;
+		best = run > best ? run : best;
+	}
+	return best;
+}
+
+void fragmentation_over_time(benchmark::State &state, block_store_allocator_t allocator)
+{
+	const size_t steps = state.range(0);
+	size_t failures = 0, attempts = 0, largest = 0, free_blocks = 0;
+	for (auto _ : state)
+	{
+		block_store_options_t options = {};
+		options.allocator = allocator;
+		block_store_t *bs = block_store_create_with(&options);
+		std::mt19937 rng(520);
+		std::vector<extent> live;
+		std::vector<bool> used(BLOCK_STORE_NUM_BLOCKS, false);
+		for (size_t i = BITMAP_START_BLOCK; i < BITMAP_START_BLOCK + BITMAP_NUM_BLOCKS; i++)
+		{
+			used[i] = true;
+		}
+		size_t used_blocks = BITMAP_NUM_BLOCKS;
+		failures = attempts = 0;
+
+		for (size_t step = 0; step < steps; step++)
+		{
+			if (live.empty() || rng() % 2 == 0)
+			{
+				size_t count = size_t(1) << (rng() % 5);
+				size_t length = count;  // Already a power of two, so the buddy allocator won't round it
+				if (used_blocks + length > BLOCK_STORE_NUM_BLOCKS)
+				{
+					continue;  // Not a fragmentation failure, the device is just full
+				}
+				attempts++;
+				size_t id = block_store_allocate_extent(bs, count);
+				if (id == SIZE_MAX)
+				{
+					failures++;
+					continue;
+				}
+				for (size_t b = id; b < id + length; b++)
+				{
+					used[b] = true;
+				}
+				used_blocks += length;
+				live.push_back({id, count, length});
+			}
+			else
+			{
+				size_t victim = rng() % live.size();
+				extent e = live[victim];
+				live[victim] = live.back();
+				live.pop_back();
+				block_store_release_extent(bs, e.id, e.count);
+				for (size_t b = e.id; b < e.id + e.length; b++)
+				{
+					used[b] = false;
+				}
+				used_blocks -= e.length;
+			}
+		}
+		largest = largest_free_run(used);
+		free_blocks = BLOCK_STORE_NUM_BLOCKS - used_blocks;
+		block_store_destroy(bs);
+	}
+	state.counters["failed_allocs"] = failures;
+	state.counters["fail_rate"] = attempts ? double(failures) / attempts : 0.0;
+	state.counters["largest_free"] = largest;
+	state.counters["free_blocks"] = free_blocks;
+	// 0 means all the free space is one extent, close to 1 means it's all slivers
+	state.counters["fragmentation"] = free_blocks ? 1.0 - double(largest) / free_blocks : 0.0;
+}
+
+}  // namespace
+
+BENCHMARK_CAPTURE(fragmentation_over_time, bitmap_ffz, BLOCK_STORE_ALLOCATOR_BITMAP)->Arg(1000)->Arg(10000)->Arg(100000);
+BENCHMARK_CAPTURE(fragmentation_over_time, buddy, BLOCK_STORE_ALLOCATOR_BUDDY)->Arg(1000)->Arg(10000)->Arg(100000);
+
@@ -0,0 +1,37 @@
+#include <benchmark/benchmark.h>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Where results go by default, the build sets it to its own directory so runs never litter the sources
+#ifndef HW3_BENCH_OUT
+#define HW3_BENCH_OUT "hw3_bench.json"
+#endif
+
+// Same as BENCHMARK_MAIN, except results also land in hw3_bench.json unless
+// --benchmark_out says otherwise, so every run leaves something to track over time.
+int main(int argc, char **argv)
+{
+	std::vector<char *> args(argv, argv + argc);
+	bool has_out = false;
+	for (int i = 1; i < argc; i++)
+	{
+		has_out = has_out || strncmp(argv[i], "--benchmark_out=", strlen("--benchmark_out=")) == 0;
+	}
+	std::string out = std::string("--benchmark_out=") + HW3_BENCH_OUT;
+	char format[] = "--benchmark_out_format=json";
+	if (!has_out)
+	{
+		args.push_back(&out[0]);
+		args.push_back(format);
+	}
+	int count = (int) args.size();
+	benchmark::Initialize(&count, args.data());
+	if (benchmark::ReportUnrecognizedArguments(count, args.data()))
+	{
+		return 1;
+	}
+	benchmark::RunSpecifiedBenchmarks();
+	benchmark::Shutdown();
+	return 0;
+}
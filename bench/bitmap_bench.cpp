@@ -0,0 +1,202 @@
+#include <benchmark/benchmark.h>
+#include <random>
+#include "bitmap.h"
+
+// Raw bitmap primitives at a few sizes. Maps are filled from the front up to the
+// requested percentage so bitmap_ffz has to walk past every set bit.
+
+namespace {
+
+bitmap_t *filled_bitmap(size_t bits, size_t percent)
+{
+	bitmap_t *bitmap = bitmap_create(bits);
+	for (size_t i = 0; i < bits * percent / 100; i++)
+	{
+		bitmap_set(bitmap, i);
+	}
+	return bitmap;
+}
+
+// Same density, but spread out at random so for_each sees a realistic pattern
+bitmap_t *random_bitmap(size_t bits, size_t percent)
+{
+	bitmap_t *bitmap = bitmap_create(bits);
+	std::mt19937 rng(31);
+	for (size_t i = 0; i < bits; i++)
+	{
+		if (rng() % 100 < percent)
+		{
+			bitmap_set(bitmap, i);
+		}
+	}
+	return bitmap;
+}
+
+void bitmap_ffz_bench(benchmark::State &state)
+{
+	bitmap_t *bitmap = filled_bitmap(state.range(0), state.range(1));
+	for (auto _ : state)
+	{
+		benchmark::DoNotOptimize(bitmap_ffz(bitmap));
+	}
+	state.SetBytesProcessed(state.iterations() * (state.range(0) * state.range(1) / 100 / 8));
+	bitmap_destroy(bitmap);
+}
+
+void bitmap_total_set_bench(benchmark::State &state)
+{
+	bitmap_t *bitmap = random_bitmap(state.range(0), 50);
+	for (auto _ : state)
+	{
+		benchmark::DoNotOptimize(bitmap_total_set(bitmap));
+	}
+	state.SetBytesProcessed(state.iterations() * bitmap_get_bytes(bitmap));
+	bitmap_destroy(bitmap);
+}
+
+void count_bit(size_t bit, void *arg)
+{
+	*(size_t *) arg += bit;
+}
+
+void bitmap_for_each_bench(benchmark::State &state)
+{
+	bitmap_t *bitmap = random_bitmap(state.range(0), state.range(1));
+	for (auto _ : state)
+	{
+		size_t sum = 0;
+		bitmap_for_each(bitmap, count_bit, &sum);
+		benchmark::DoNotOptimize(sum);
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+	bitmap_destroy(bitmap);
+}
+
+// Enumerating set bits without a call per bit, how the block store walks allocated blocks
+void bitmap_next_set_batch_bench(benchmark::State &state)
+{
+	bitmap_t *bitmap = random_bitmap(state.range(0), state.range(1));
+	size_t batch[256];
+	for (auto _ : state)
+	{
+		size_t sum = 0;
+		size_t found = bitmap_next_set_batch(bitmap, 0, batch, 256);
+		while (found)
+		{
+			for (size_t i = 0; i < found; i++)
+			{
+				sum += batch[i];
+			}
+			found = found < 256 ? 0 : bitmap_next_set_batch(bitmap, batch[found - 1] + 1, batch, 256);
+		}
+		benchmark::DoNotOptimize(sum);
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+	bitmap_destroy(bitmap);
+}
+
+// Range operations against the per bit loops they replace
+void bitmap_set_range_bench(benchmark::State &state)
+{
+	bitmap_t *bitmap = bitmap_create(state.range(0));
+	for (auto _ : state)
+	{
+		bitmap_set_range(bitmap, 1, state.range(0) - 2);
+		bitmap_reset_range(bitmap, 1, state.range(0) - 2);
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0) * 2);
+	bitmap_destroy(bitmap);
+}
+
+void bitmap_set_range_per_bit_bench(benchmark::State &state)
+{
+	bitmap_t *bitmap = bitmap_create(state.range(0));
+	for (auto _ : state)
+	{
+		for (size_t i = 1; i + 1 < (size_t) state.range(0); i++)
+		{
+			bitmap_set(bitmap, i);
+		}
+		for (size_t i = 1; i + 1 < (size_t) state.range(0); i++)
+		{
+			bitmap_reset(bitmap, i);
+		}
+		benchmark::ClobberMemory();
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0) * 2);
+	bitmap_destroy(bitmap);
+}
+
+void bitmap_test_range_all_bench(benchmark::State &state)
+{
+	bitmap_t *bitmap = filled_bitmap(state.range(0), 100);
+	for (auto _ : state)
+	{
+		benchmark::DoNotOptimize(bitmap_test_range_all(bitmap, 1, state.range(0) - 2));
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+	bitmap_destroy(bitmap);
+}
+
+void bitmap_test_range_all_per_bit_bench(benchmark::State &state)
+{
+	bitmap_t *bitmap = filled_bitmap(state.range(0), 100);
+	for (auto _ : state)
+	{
+		bool all = true;
+		for (size_t i = 1; all && i + 1 < (size_t) state.range(0); i++)
+		{
+			all = bitmap_test(bitmap, i);
+		}
+		benchmark::DoNotOptimize(all);
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+	bitmap_destroy(bitmap);
+}
+
+void bitmap_xor_bench(benchmark::State &state)
+{
+	bitmap_t *bitmap = random_bitmap(state.range(0), 50);
+	bitmap_t *other = random_bitmap(state.range(0), 10);
+	for (auto _ : state)
+	{
+		bitmap_xor(bitmap, other);
+		benchmark::ClobberMemory();
+	}
+	state.SetBytesProcessed(state.iterations() * bitmap_get_bytes(bitmap));
+	bitmap_destroy(other);
+	bitmap_destroy(bitmap);
+}
+
+void bitmap_xor_per_bit_bench(benchmark::State &state)
+{
+	bitmap_t *bitmap = random_bitmap(state.range(0), 50);
+	bitmap_t *other = random_bitmap(state.range(0), 10);
+	for (auto _ : state)
+	{
+		for (size_t i = 0; i < (size_t) state.range(0); i++)
+		{
+			if (bitmap_test(other, i))
+			{
+				bitmap_flip(bitmap, i);
+			}
+		}
+		benchmark::ClobberMemory();
+	}
+	state.SetBytesProcessed(state.iterations() * bitmap_get_bytes(bitmap));
+	bitmap_destroy(other);
+	bitmap_destroy(bitmap);
+}
+
+}  // namespace
+
+BENCHMARK(bitmap_ffz_bench)->ArgNames({"bits", "fill%"})->ArgsProduct({{512, 1 << 16, 1 << 20}, {0, 50, 99}});
+BENCHMARK(bitmap_total_set_bench)->ArgName("bits")->Arg(512)->Arg(1 << 16)->Arg(1 << 20);
+BENCHMARK(bitmap_for_each_bench)->ArgNames({"bits", "fill%"})->ArgsProduct({{512, 1 << 16, 1 << 20}, {1, 50}});
+BENCHMARK(bitmap_next_set_batch_bench)->ArgNames({"bits", "fill%"})->ArgsProduct({{512, 1 << 16, 1 << 20}, {1, 50}});
+BENCHMARK(bitmap_set_range_bench)->ArgName("bits")->Arg(512)->Arg(1 << 16)->Arg(1 << 20);
+BENCHMARK(bitmap_set_range_per_bit_bench)->ArgName("bits")->Arg(512)->Arg(1 << 16)->Arg(1 << 20);
+BENCHMARK(bitmap_test_range_all_bench)->ArgName("bits")->Arg(512)->Arg(1 << 16)->Arg(1 << 20);
+BENCHMARK(bitmap_test_range_all_per_bit_bench)->ArgName("bits")->Arg(512)->Arg(1 << 16)->Arg(1 << 20);
+BENCHMARK(bitmap_xor_bench)->ArgName("bits")->Arg(512)->Arg(1 << 16)->Arg(1 << 20);
+BENCHMARK(bitmap_xor_per_bit_bench)->ArgName("bits")->Arg(512)->Arg(1 << 16)->Arg(1 << 20);
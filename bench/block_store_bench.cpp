@@ -0,0 +1,446 @@
+#include <benchmark/benchmark.h>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include "block_store.h"
+#include "block_store.hpp"
+
+// Block store API costs: allocation at different fill levels, block I/O per transfer
+// size, sequential scans, whole-image serialize/deserialize, persistence to an image file
+// and a shared device under thread contention.
+
+namespace {
+
+const size_t kLargeDevice = 1 << 16;
+
+block_store_t *sized_store(size_t num_blocks)
+{
+	block_store_options_t options = {};
+	options.num_blocks = num_blocks;
+	return block_store_create_with(&options);
+}
+
+// Allocate and immediately release, so the fill level stays put. The device is filled
+// from the front, which is the worst case for the first fit scan.
+void allocate_release(benchmark::State &state)
+{
+	block_store_t *bs = sized_store(kLargeDevice);
+	const size_t target = kLargeDevice * state.range(0) / 100;
+	while (block_store_get_used_blocks(bs) < target)
+	{
+		block_store_allocate(bs);
+	}
+	for (auto _ : state)
+	{
+		size_t id = block_store_allocate(bs);
+		benchmark::DoNotOptimize(id);
+		block_store_release(bs, id);
+	}
+	state.SetItemsProcessed(state.iterations());
+	block_store_destroy(bs);
+}
+
+// Single blocks and 64 block extents (range) on a device of kHugeDevice blocks filled from the
+// front, so the free space sits past millions of used blocks. Zone free counts let both searches
+// skip the full zones a word or run scan of the bitmap would otherwise walk.
+constexpr size_t kHugeDevice = size_t(1) << 22;
+constexpr size_t kHugeFillExtent = 4096;
+
+void huge_allocate_release(benchmark::State &state)
+{
+	block_store_t *bs = sized_store(kHugeDevice);
+	const size_t target = kHugeDevice / 100 * 99;
+	while (block_store_allocate(bs) < BITMAP_START_BLOCK)
+	{
+		// Too few blocks in front of the bitmap for a fill extent, take them one at a time
+	}
+	while (block_store_get_used_blocks(bs) + kHugeFillExtent <= target)
+	{
+		block_store_allocate_extent(bs, kHugeFillExtent);
+	}
+	const size_t count = state.range(0);
+	for (auto _ : state)
+	{
+		const size_t id = count == 1 ? block_store_allocate(bs) : block_store_allocate_extent(bs, count);
+		benchmark::DoNotOptimize(id);
+		block_store_release_extent(bs, id, count);
+	}
+	state.SetItemsProcessed(state.iterations());
+	block_store_destroy(bs);
+}
+
+// Same loop on a shared memory device, where every claim and release is an atomic
+// read-modify-write on the bitmap word so other processes can allocate at the same time
+void shared_allocate_release(benchmark::State &state)
+{
+	const std::string name = "/hw3_bench_shared_" + std::to_string(getpid());
+	block_store_options_t options = {};
+	options.num_blocks = kLargeDevice;
+	block_store_unlink_shared(name.c_str());
+	block_store_t *bs = block_store_create_shared(name.c_str(), &options);
+	block_store_unlink_shared(name.c_str()); // Gone with the mapping, even if the run dies
+	const size_t target = kLargeDevice * state.range(0) / 100;
+	while (block_store_get_used_blocks(bs) < target)
+	{
+		block_store_allocate(bs);
+	}
+	for (auto _ : state)
+	{
+		size_t id = block_store_allocate(bs);
+		benchmark::DoNotOptimize(id);
+		block_store_release(bs, id);
+	}
+	state.SetItemsProcessed(state.iterations());
+	block_store_destroy(bs);
+}
+
+// Same loop on the header only template, where the whole thing inlines
+void template_allocate_release(benchmark::State &state)
+{
+	std::unique_ptr<BlockStore<BLOCK_SIZE_BYTES, kLargeDevice>> store(new BlockStore<BLOCK_SIZE_BYTES, kLargeDevice>());
+	const size_t target = kLargeDevice * state.range(0) / 100;
+	while (store->used_blocks() < target)
+	{
+		store->allocate();
+	}
+	for (auto _ : state)
+	{
+		size_t id = store->allocate();
+		benchmark::DoNotOptimize(id);
+		store->release(id);
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+
+// Single block reads at random over a 256 MiB device, where TLB misses dominate
+// Prefaulted in both cases so only the page size differs
+void random_read(benchmark::State &state, block_store_memory_t memory)
+{
+	const size_t num_blocks = (size_t) 1 << 23;
+	block_store_options_t options = {};
+	options.num_blocks = num_blocks;
+	options.memory = memory;
+	options.prefault = true;
+	block_store_t *bs = block_store_create_with(&options);
+	if (bs == NULL)
+	{
+		state.SkipWithError("could not create the device");
+		return;
+	}
+	uint8_t buffer[BLOCK_SIZE_BYTES];
+	uint64_t x = 88172645463325252ull;
+	for (auto _ : state)
+	{
+		x ^= x << 13;  // xorshift, cheap enough not to hide the miss
+		x ^= x >> 7;
+		x ^= x << 17;
+		block_store_read(bs, x % num_blocks, buffer);
+		benchmark::DoNotOptimize(buffer);
+	}
+	state.SetItemsProcessed(state.iterations());
+	block_store_destroy(bs);
+}
+
+// Block size is fixed at compile time, so "block size" here is how many consecutive
+// blocks one logical transfer covers.
+void write_blocks(benchmark::State &state)
+{
+	block_store_t *bs = sized_store(kLargeDevice);
+	const size_t blocks = state.range(0);
+	std::vector<uint8_t> buffer(blocks * BLOCK_SIZE_BYTES, 0xA5);
+	std::mt19937 rng(31);
+	for (auto _ : state)
+	{
+		size_t first = rng() % (kLargeDevice - blocks);
+		for (size_t i = 0; i < blocks; i++)
+		{
+			block_store_write(bs, first + i, &buffer[i * BLOCK_SIZE_BYTES]);
+		}
+	}
+	state.SetBytesProcessed(state.iterations() * buffer.size());
+	block_store_destroy(bs);
+}
+
+void read_blocks(benchmark::State &state)
+{
+	block_store_t *bs = sized_store(kLargeDevice);
+	const size_t blocks = state.range(0);
+	std::vector<uint8_t> buffer(blocks * BLOCK_SIZE_BYTES);
+	std::mt19937 rng(31);
+	for (auto _ : state)
+	{
+		size_t first = rng() % (kLargeDevice - blocks);
+		for (size_t i = 0; i < blocks; i++)
+		{
+			block_store_read(bs, first + i, &buffer[i * BLOCK_SIZE_BYTES]);
+		}
+		benchmark::DoNotOptimize(buffer.data());
+	}
+	state.SetBytesProcessed(state.iterations() * buffer.size());
+	block_store_destroy(bs);
+}
+
+void serialize(benchmark::State &state)
+{
+	block_store_t *bs = sized_store(state.range(0));
+	const std::string path = "bench_serialize.bs";
+	for (auto _ : state)
+	{
+		benchmark::DoNotOptimize(block_store_serialize(bs, path.c_str()));
+	}
+	state.SetBytesProcessed(state.iterations() * state.range(0) * BLOCK_SIZE_BYTES);
+	block_store_destroy(bs);
+	remove(path.c_str());
+}
+
+void deserialize(benchmark::State &state)
+{
+	block_store_t *image = sized_store(state.range(0));
+	const std::string path = "bench_deserialize.bs";
+	block_store_serialize(image, path.c_str());
+	block_store_destroy(image);
+	for (auto _ : state)
+	{
+		block_store_t *bs = block_store_deserialize(path.c_str());
+		benchmark::DoNotOptimize(bs);
+		block_store_destroy(bs);
+	}
+	state.SetBytesProcessed(state.iterations() * state.range(0) * BLOCK_SIZE_BYTES);
+	remove(path.c_str());
+}
+
+// Front to back scans of a whole device with read-ahead off (0) or on (1). A lazily loaded
+// store starts cold each time: without read-ahead every block is its own pread of the image,
+// with it a scan reads whole windows and the prefetch thread keeps the next one coming. The
+// image stays in the page cache, so this is the syscall cost rather than the disk's.
+constexpr size_t kScanDevice = size_t(1) << 16;
+
+void scan(benchmark::State &state, bool lazy)
+{
+	const std::string path = "bench_scan.bs";
+	block_store_t *image = sized_store(kScanDevice);
+	block_store_serialize(image, path.c_str());
+	uint8_t buffer[BLOCK_SIZE_BYTES];
+	for (auto _ : state)
+	{
+		block_store_t *bs = lazy ? block_store_deserialize_lazy(path.c_str(), false) : image;
+		block_store_set_readahead(bs, state.range(0) ? BLOCK_STORE_READAHEAD_DEFAULT_BLOCKS : 0);
+		for (size_t i = 0; i < kScanDevice; i++)
+		{
+			block_store_read(bs, i, buffer);
+			benchmark::DoNotOptimize(buffer);
+		}
+		if (lazy)
+		{
+			block_store_destroy(bs);
+		}
+	}
+	state.SetBytesProcessed(state.iterations() * kScanDevice * BLOCK_SIZE_BYTES);
+	block_store_destroy(image);
+	remove(path.c_str());
+}
+
+// Striped images on tmpfs, one thread per file. The device is full of data so none of it
+// turns into holes, and tmpfs takes the disks out so what's left is how well the copies
+// spread over cores.
+constexpr size_t kStripedDevice = size_t(1) << 20;
+constexpr size_t kStripeBlocks = 1024;
+
+std::vector<std::string> stripe_paths(size_t files)
+{
+	std::vector<std::string> paths;
+	for (size_t i = 0; i < files; i++)
+	{
+		paths.push_back("/dev/shm/bench_stripe" + std::to_string(i) + ".bs");
+	}
+	return paths;
+}
+
+std::vector<const char *> c_paths(const std::vector<std::string> &paths)
+{
+	std::vector<const char *> names;
+	for (const std::string &path : paths)
+	{
+		names.push_back(path.c_str());
+	}
+	return names;
+}
+
+block_store_t *filled_store(size_t num_blocks)
+{
+	block_store_t *bs = sized_store(num_blocks);
+	uint8_t buffer[BLOCK_SIZE_BYTES];
+	memset(buffer, 0x5A, sizeof(buffer));
+	for (size_t i = 0; i < num_blocks; i++)
+	{
+		if (i < BITMAP_START_BLOCK || i >= BITMAP_START_BLOCK + num_blocks / (BLOCK_SIZE_BYTES * 8))
+		{
+			block_store_write(bs, i, buffer);
+		}
+	}
+	return bs;
+}
+
+void striped_serialize(benchmark::State &state)
+{
+	block_store_t *bs = filled_store(kStripedDevice);
+	const std::vector<std::string> paths = stripe_paths(state.range(0));
+	const std::vector<const char *> names = c_paths(paths);
+	for (auto _ : state)
+	{
+		benchmark::DoNotOptimize(block_store_serialize_striped(bs, names.data(), names.size(), kStripeBlocks));
+	}
+	state.SetBytesProcessed(state.iterations() * kStripedDevice * BLOCK_SIZE_BYTES);
+	block_store_destroy(bs);
+	for (const char *name : names)
+	{
+		remove(name);
+	}
+}
+
+void striped_deserialize(benchmark::State &state)
+{
+	block_store_t *image = filled_store(kStripedDevice);
+	const std::vector<std::string> paths = stripe_paths(state.range(0));
+	const std::vector<const char *> names = c_paths(paths);
+	block_store_serialize_striped(image, names.data(), names.size(), kStripeBlocks);
+	block_store_destroy(image);
+	for (auto _ : state)
+	{
+		block_store_t *bs = block_store_deserialize_striped(names.data(), names.size(), kStripeBlocks);
+		benchmark::DoNotOptimize(bs);
+		block_store_destroy(bs);
+	}
+	state.SetBytesProcessed(state.iterations() * kStripedDevice * BLOCK_SIZE_BYTES);
+	for (const char *name : names)
+	{
+		remove(name);
+	}
+}
+
+// The block store isn't thread safe, so sharing one means a lock around every call.
+// Compare that against each thread owning its own device.
+block_store_t *shared_bs = nullptr;
+std::mutex shared_lock;
+
+void create_shared(const benchmark::State &)
+{
+	shared_bs = sized_store(kLargeDevice);
+}
+
+void destroy_shared(const benchmark::State &)
+{
+	block_store_destroy(shared_bs);
+	shared_bs = nullptr;
+}
+
+void contended_allocate_write(benchmark::State &state)
+{
+	uint8_t buffer[BLOCK_SIZE_BYTES] = {0};
+	for (auto _ : state)
+	{
+		std::lock_guard<std::mutex> guard(shared_lock);
+		size_t id = block_store_allocate(shared_bs);
+		block_store_write(shared_bs, id, buffer);
+		block_store_release(shared_bs, id);
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+
+void private_allocate_write(benchmark::State &state)
+{
+	block_store_t *bs = sized_store(kLargeDevice);
+	uint8_t buffer[BLOCK_SIZE_BYTES] = {0};
+	for (auto _ : state)
+	{
+		size_t id = block_store_allocate(bs);
+		block_store_write(bs, id, buffer);
+		block_store_release(bs, id);
+	}
+	state.SetItemsProcessed(state.iterations());
+	block_store_destroy(bs);
+}
+
+// Random writes with every change streamed to an in-process standby (range 1) or not (range 0)
+// The primary only copies each change into the log buffer, the standby applies them on another thread
+void replicated_write(benchmark::State &state)
+{
+	block_store_t *bs = sized_store(kLargeDevice);
+	block_store_t *standby = sized_store(kLargeDevice);
+	block_store_replication_t config = {};
+	config.replica = standby;
+	if (state.range(0) != 0)
+	{
+		block_store_replicate_start(bs, &config);
+	}
+	std::mt19937 rng(43);
+	uint8_t buffer[BLOCK_SIZE_BYTES] = {0};
+	for (auto _ : state)
+	{
+		block_store_write(bs, rng() % kLargeDevice, buffer);
+	}
+	if (state.range(0) != 0 && !block_store_replicate_stop(bs))
+	{
+		state.SkipWithError("standby incomplete");
+	}
+	state.SetItemsProcessed(state.iterations());
+	block_store_destroy(bs);
+	block_store_destroy(standby);
+}
+
+// Appends to a persistent device at each durability level (range), each one also rewriting a
+// header block, the small write pattern of a log with a superblock. Immediate durability pays a
+// pwrite and an fdatasync per change; the others merge the appends into long runs, write the
+// header once per flush and sync (batched) once per flush.
+void persisted_write(benchmark::State &state)
+{
+	block_store_t *bs = sized_store(kLargeDevice);
+	block_store_persistence_t config = {};
+	config.durability = block_store_durability_t(state.range(0));
+	const std::string path = "bench_persist.bs";
+	block_store_persist_start(bs, path.c_str(), &config);
+	uint8_t buffer[BLOCK_SIZE_BYTES] = {0};
+	const size_t first = BITMAP_START_BLOCK + kLargeDevice / (BLOCK_SIZE_BYTES * 8);
+	size_t next = 0;
+	for (auto _ : state)
+	{
+		block_store_write(bs, first + next++ % (kLargeDevice - first), buffer);
+		block_store_write(bs, 0, buffer);
+	}
+	block_store_persist_stats_t stats = {};
+	block_store_get_persist_stats(bs, &stats);
+	state.SetItemsProcessed(state.iterations());
+	state.counters["writes/op"] = double(stats.write_calls) / state.iterations();
+	state.counters["syncs/op"] = double(stats.sync_calls) / state.iterations();
+	if (!block_store_persist_stop(bs))
+	{
+		state.SkipWithError("image incomplete");
+	}
+	block_store_destroy(bs);
+	remove(path.c_str());
+}
+
+}  // namespace
+
+BENCHMARK(allocate_release)->ArgName("fill%")->Arg(0)->Arg(50)->Arg(90)->Arg(99);
+BENCHMARK(huge_allocate_release)->ArgName("blocks")->Arg(1)->Arg(64);
+BENCHMARK(shared_allocate_release)->ArgName("fill%")->Arg(0)->Arg(50)->Arg(90)->Arg(99);
+BENCHMARK(template_allocate_release)->ArgName("fill%")->Arg(0)->Arg(50)->Arg(90)->Arg(99);
+BENCHMARK_CAPTURE(random_read, heap, BLOCK_STORE_MEMORY_HEAP);
+BENCHMARK_CAPTURE(random_read, huge_pages, BLOCK_STORE_MEMORY_HUGE_PAGES);
+BENCHMARK(write_blocks)->ArgName("blocks")->RangeMultiplier(4)->Range(1, 256);
+BENCHMARK(read_blocks)->ArgName("blocks")->RangeMultiplier(4)->Range(1, 256);
+BENCHMARK(serialize)->ArgName("blocks")->RangeMultiplier(8)->Range(BLOCK_STORE_NUM_BLOCKS, 1 << 18)->Unit(benchmark::kMicrosecond);
+BENCHMARK(deserialize)->ArgName("blocks")->RangeMultiplier(8)->Range(BLOCK_STORE_NUM_BLOCKS, 1 << 18)->Unit(benchmark::kMicrosecond);
+BENCHMARK_CAPTURE(scan, in_memory, false)->ArgName("readahead")->Arg(0)->Arg(1)->Unit(benchmark::kMicrosecond);
+BENCHMARK_CAPTURE(scan, lazy, true)->ArgName("readahead")->Arg(0)->Arg(1)->Unit(benchmark::kMicrosecond)->UseRealTime();
+BENCHMARK(striped_serialize)->ArgName("files")->RangeMultiplier(2)->Range(1, 8)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(striped_deserialize)->ArgName("files")->RangeMultiplier(2)->Range(1, 8)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(contended_allocate_write)->Setup(create_shared)->Teardown(destroy_shared)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK(private_allocate_write)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK(replicated_write)->ArgName("replicated")->Arg(0)->Arg(1)->UseRealTime();
+BENCHMARK(persisted_write)->ArgName("durability")->Arg(BLOCK_STORE_DURABILITY_BUFFERED)->Arg(BLOCK_STORE_DURABILITY_BATCHED)->Arg(BLOCK_STORE_DURABILITY_IMMEDIATE)->UseRealTime();
@@ -0,0 +1,50 @@
+#include <benchmark/benchmark.h>
+#include <random>
+#include <vector>
+#include "block_fs.h"
+#include "block_store.h"
+
+// What the block layer delivers to file workloads: one file on a freshly formatted device,
+// read or written with requests of the given size, either front to back or at random
+// request aligned offsets. Sequential reads go through the read-ahead window, random ones
+// straight to the blocks; compare with read_blocks and write_blocks for the raw device.
+
+namespace {
+
+constexpr size_t kFsDevice = size_t(1) << 20;
+constexpr size_t kFileBytes = size_t(8) << 20;
+
+void file_io(benchmark::State &state, bool writing, bool sequential)
+{
+	block_store_options_t options = {};
+	options.num_blocks = kFsDevice;
+	block_store_t *bs = block_store_create_with(&options);
+	block_fs_t *fs = block_fs_format(bs);
+	block_fs_file_t *file = block_fs_create(fs, "bench");
+	std::vector<uint8_t> buffer(state.range(0), 0x3C);
+	for (size_t offset = 0; offset < kFileBytes; offset += buffer.size())
+	{
+		block_fs_write(file, offset, buffer.data(), buffer.size());
+	}
+	const size_t requests = kFileBytes / buffer.size();
+	std::mt19937 rng(44);
+	size_t next = 0;
+	for (auto _ : state)
+	{
+		const size_t offset = (sequential ? next++ % requests : rng() % requests) * buffer.size();
+		const size_t done = writing ? block_fs_write(file, offset, buffer.data(), buffer.size()) : block_fs_read(file, offset, buffer.data(), buffer.size());
+		benchmark::DoNotOptimize(done);
+	}
+	state.SetBytesProcessed(state.iterations() * buffer.size());
+	state.counters["extents"] = block_fs_extents(file);
+	block_fs_close(file);
+	block_fs_unmount(fs);
+	block_store_destroy(bs);
+}
+
+}  // namespace
+
+BENCHMARK_CAPTURE(file_io, sequential_read, false, true)->ArgName("bytes")->RangeMultiplier(8)->Range(64, 32768);
+BENCHMARK_CAPTURE(file_io, random_read, false, false)->ArgName("bytes")->RangeMultiplier(8)->Range(64, 32768);
+BENCHMARK_CAPTURE(file_io, sequential_write, true, true)->ArgName("bytes")->RangeMultiplier(8)->Range(64, 32768);
+BENCHMARK_CAPTURE(file_io, random_write, true, false)->ArgName("bytes")->RangeMultiplier(8)->Range(64, 32768);
@@ -0,0 +1,89 @@
+#include <benchmark/benchmark.h>
+#include <cmath>
+#include <random>
+#include <vector>
+#include "block_kv.h"
+#include "block_store.h"
+
+// Point gets and puts on a bulk loaded B+tree of kKvKeys keys, with keys drawn uniformly or from
+// a Zipf distribution (theta 0.99, as YCSB uses, hot keys scattered over the key space). The
+// range is the node cache size in pages: a small cache shows the block reads behind a miss,
+// a skewed workload keeps its hot paths cached with far fewer pages than a uniform one.
+
+namespace {
+
+constexpr size_t kKvKeys = size_t(1) << 18;
+constexpr size_t kKvDevice = size_t(1) << 20;
+constexpr size_t kKvDraws = size_t(1) << 20;
+
+// Gray et al.'s generator, the one YCSB uses: O(1) per draw once zeta(n) is known
+class Zipf
+{
+public:
+	Zipf(size_t n, double theta) : n_(n), theta_(theta)
+	{
+		for (size_t i = 1; i <= n; i++)
+		{
+			zeta_n_ += 1.0 / std::pow(double(i), theta);
+		}
+		const double zeta_2 = 1.0 + 1.0 / std::pow(2.0, theta);
+		alpha_ = 1.0 / (1.0 - theta);
+		eta_ = (1.0 - std::pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta_2 / zeta_n_);
+	}
+
+	size_t operator()(std::mt19937_64 &rng)
+	{
+		const double u = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+		const double uz = u * zeta_n_;
+		size_t rank = uz < 1.0 ? 0 : uz < 1.0 + std::pow(0.5, theta_) ? 1 : size_t(n_ * std::pow(eta_ * u - eta_ + 1.0, alpha_));
+		rank = rank < n_ ? rank : n_ - 1;
+		return (rank * 0x9E3779B97F4A7C15ull) % n_; // Scatter the popular ranks
+	}
+
+private:
+	size_t n_;
+	double theta_;
+	double zeta_n_ = 0.0;
+	double alpha_ = 0.0;
+	double eta_ = 0.0;
+};
+
+void kv_ops(benchmark::State &state, bool zipf, bool writing)
+{
+	block_store_options_t options = {};
+	options.num_blocks = kKvDevice;
+	block_store_t *bs = block_store_create_with(&options);
+	block_kv_t *kv = block_kv_create(bs, state.range(0));
+	std::vector<uint64_t> keys(kKvKeys);
+	for (size_t i = 0; i < kKvKeys; i++)
+	{
+		keys[i] = 2 * i;
+	}
+	block_kv_bulk_load(kv, keys.data(), keys.data(), kKvKeys);
+	Zipf skewed(kKvKeys, 0.99);
+	std::mt19937_64 rng(46);
+	std::vector<uint64_t> draws(kKvDraws); // Drawn up front, a Zipf draw costs more than a cached get
+	for (uint64_t &key : draws)
+	{
+		key = 2 * (zipf ? skewed(rng) : rng() % kKvKeys);
+	}
+	uint64_t value = 0;
+	size_t next = 0;
+	for (auto _ : state)
+	{
+		const uint64_t key = draws[next++ % kKvDraws];
+		const bool done = writing ? block_kv_put(kv, key, ++value) : block_kv_get(kv, key, &value);
+		benchmark::DoNotOptimize(done);
+	}
+	state.SetItemsProcessed(state.iterations());
+	state.counters["height"] = block_kv_height(kv);
+	block_kv_close(kv);
+	block_store_destroy(bs);
+}
+
+}  // namespace
+
+BENCHMARK_CAPTURE(kv_ops, uniform_get, false, false)->ArgName("cache")->Arg(64)->Arg(4096)->Arg(32768);
+BENCHMARK_CAPTURE(kv_ops, zipf_get, true, false)->ArgName("cache")->Arg(64)->Arg(4096)->Arg(32768);
+BENCHMARK_CAPTURE(kv_ops, uniform_put, false, true)->ArgName("cache")->Arg(64)->Arg(4096)->Arg(32768);
+BENCHMARK_CAPTURE(kv_ops, zipf_put, true, true)->ArgName("cache")->Arg(64)->Arg(4096)->Arg(32768);
@@ -0,0 +1,102 @@
+#include <benchmark/benchmark.h>
+#include <cstdlib>
+#include <random>
+#include <vector>
+#include "block_store.h"
+
+// Allocation policy comparison: a handful of files grow a block at a time, interleaved,
+// while whole files are deleted at random. We report how far each allocation had to scan
+// from where its policy started looking, and how far apart consecutive blocks of a file ended up.
+
+namespace {
+
+const size_t kFiles = 8;
+
+enum policy_mode
+{
+	FIRST_FIT,
+	NEXT_FIT,
+	ROUND_ROBIN,
+	NEAR_HINT,
+};
+
+void allocation_policy(benchmark::State &state, policy_mode mode)
+{
+	const size_t groups = (BLOCK_STORE_NUM_BLOCKS + BLOCK_STORE_GROUP_BLOCKS - 1) / BLOCK_STORE_GROUP_BLOCKS;
+	double scanned = 0, gaps = 0;
+	size_t allocations = 0, links = 0;
+	for (auto _ : state)
+	{
+		state.PauseTiming();
+		block_store_options_t options = {};
+		options.policy = mode == NEXT_FIT ? BLOCK_STORE_POLICY_NEXT_FIT : mode == ROUND_ROBIN ? BLOCK_STORE_POLICY_ROUND_ROBIN : BLOCK_STORE_POLICY_FIRST_FIT;
+		block_store_t *bs = block_store_create_with(&options);
+		std::mt19937 rng(29);
+		std::vector<std::vector<size_t>> files(kFiles);
+		size_t cursor = 0, group = 0;
+		state.ResumeTiming();
+
+		for (size_t step = 0; step < 4096; step++)
+		{
+			std::vector<size_t> &file = files[rng() % kFiles];
+			if (rng() % 16 == 0)
+			{
+				for (size_t id : file)
+				{
+					block_store_release(bs, id);
+				}
+				file.clear();
+				continue;
+			}
+
+			// Where the policy starts scanning, so we can tell how far it had to go
+			size_t start = 0;
+			size_t id;
+			if (mode == NEAR_HINT && !file.empty())
+			{
+				start = file.back();
+				id = block_store_allocate_near(bs, start);
+			}
+			else
+			{
+				start = mode == NEXT_FIT ? cursor : mode == ROUND_ROBIN ? group * BLOCK_STORE_GROUP_BLOCKS : 0;
+				id = block_store_allocate(bs);
+				group = (group + 1) % groups;
+			}
+			if (id == SIZE_MAX)
+			{
+				continue;
+			}
+			cursor = (id + 1) % BLOCK_STORE_NUM_BLOCKS;
+			allocations++;
+			if (mode == NEAR_HINT && !file.empty())
+			{
+				scanned += 2 * (double) std::labs((long) id - (long) start);  // Searches both directions
+			}
+			else
+			{
+				scanned += (id + BLOCK_STORE_NUM_BLOCKS - start) % BLOCK_STORE_NUM_BLOCKS + 1;
+			}
+			if (!file.empty())
+			{
+				gaps += std::labs((long) id - (long) file.back());
+				links++;
+			}
+			file.push_back(id);
+		}
+
+		state.PauseTiming();
+		block_store_destroy(bs);
+		state.ResumeTiming();
+	}
+	state.counters["bits_scanned_per_alloc"] = allocations ? scanned / allocations : 0.0;
+	// 1 means every file is perfectly sequential on the device
+	state.counters["avg_gap_within_file"] = links ? gaps / links : 0.0;
+}
+
+}  // namespace
+
+BENCHMARK_CAPTURE(allocation_policy, first_fit, FIRST_FIT);
+BENCHMARK_CAPTURE(allocation_policy, next_fit, NEXT_FIT);
+BENCHMARK_CAPTURE(allocation_policy, round_robin, ROUND_ROBIN);
+BENCHMARK_CAPTURE(allocation_policy, near_hint, NEAR_HINT);
@@ -0,0 +1,64 @@
+#include <benchmark/benchmark.h>
+#include <random>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include "block_client.h"
+#include "block_server.h"
+#include "block_store.h"
+
+// Block server throughput against pipeline depth: each iteration sends depth calls in one
+// batch and waits for all the answers. Depth 1 is a round trip per call, which is what the
+// plain block_client_* calls cost; deeper batches spread the syscalls and wakeups over more
+// calls. The server runs on a thread in this process, so on one core it shares the CPU
+// with the client the same way a server process would.
+
+namespace {
+
+constexpr size_t kServedDevice = size_t(1) << 16;
+
+void served_ops(benchmark::State &state, block_protocol_op_t op)
+{
+	block_store_options_t options = {};
+	options.num_blocks = kServedDevice;
+	block_store_t *bs = block_store_create_with(&options);
+	const std::string path = "/tmp/hw3_bench_" + std::to_string(getpid()) + ".sock";
+	block_server_t *server = block_server_create(bs, path.c_str());
+	std::thread loop([server] { block_server_run(server); });
+	block_client_t *client = block_client_connect(path.c_str());
+
+	const size_t depth = state.range(0);
+	std::vector<uint8_t> blocks(depth * BLOCK_SIZE_BYTES, 0x5A);
+	std::vector<block_client_op_t> ops(depth);
+	std::mt19937 rng(41);
+	for (size_t i = 0; i < depth; i++)
+	{
+		ops[i].op = op;
+		ops[i].buffer = &blocks[i * BLOCK_SIZE_BYTES];
+	}
+	for (auto _ : state)
+	{
+		for (size_t i = 0; i < depth; i++)
+		{
+			ops[i].arg = rng() % kServedDevice;
+		}
+		if (!block_client_batch(client, ops.data(), depth))
+		{
+			state.SkipWithError("connection failed");
+			break;
+		}
+	}
+	state.SetItemsProcessed(state.iterations() * depth);
+
+	block_client_close(client);
+	block_server_stop(server);
+	loop.join();
+	block_server_destroy(server);
+	block_store_destroy(bs);
+}
+
+}  // namespace
+
+BENCHMARK_CAPTURE(served_ops, read, BLOCK_PROTOCOL_READ)->ArgName("depth")->RangeMultiplier(4)->Range(1, 1024)->UseRealTime();
+BENCHMARK_CAPTURE(served_ops, write, BLOCK_PROTOCOL_WRITE)->ArgName("depth")->RangeMultiplier(4)->Range(1, 1024)->UseRealTime();
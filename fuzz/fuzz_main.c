@@ -0,0 +1,186 @@
+// Stand-in for libFuzzer when the fuzz targets are built without it (BLOCK_STORE_FUZZ off, or no clang)
+//
+// usage: hw3_fuzz_image <files...>           runs each file as one input, to replay a crash or a corpus
+//        hw3_fuzz_image [--runs n] [--seed s] mutates images of random devices n times (default 1000)
+//
+// Mutated inputs start from a real image, so most of them get past the superblock and size checks
+// and into the bitmap; the mutations flip bits (mostly in the bitmap), overwrite bytes, cut or pad
+// the end and now and then change a superblock field and seal it again, so the geometry checks
+// see more than checksum failures
+
+#define _GNU_SOURCE  // memfd_create, like the target
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "block_store.h"
+#include "image.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+// Small and fast, the same runs for the same seed everywhere
+static uint64_t next_random(uint64_t *const state)
+{
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+static int run_file(const char *const filename)
+{
+	FILE *file = fopen(filename, "rb");
+	if(file == NULL)
+	{
+		perror(filename);
+		return 1;
+	}
+	fseek(file, 0, SEEK_END);
+	const long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	uint8_t *data = (uint8_t *)malloc(size > 0 ? size : 1);
+	if(data == NULL || fread(data, 1, size, file) != (size_t)size)
+	{
+		fprintf(stderr, "Failed to read %s\n", filename);
+		free(data);
+		fclose(file);
+		return 1;
+	}
+	fclose(file);
+	LLVMFuzzerTestOneInput(data, size);
+	free(data);
+	return 0;
+}
+
+// The image of a device of a random size after some random allocations, behind a random mode byte
+static uint8_t *random_image(uint64_t *const state, size_t *const size)
+{
+	block_store_options_t options = {0};
+	options.num_blocks = BITMAP_START_BLOCK + 1 + next_random(state) % 2048;
+	block_store_t *bs = block_store_create_with(&options);
+	if(bs == NULL)
+	{
+		return NULL;
+	}
+	const size_t allocations = next_random(state) % options.num_blocks;
+	for(size_t i = 0; i < allocations; i++)
+	{
+		const size_t block_id = block_store_allocate(bs);
+		const uint64_t fill = next_random(state);
+		uint8_t block[BLOCK_SIZE_BYTES];
+		memset(block, (int)(fill & 0xFF), sizeof(block));
+		block_store_write(bs, block_id, block);
+		if(fill & 0x100)
+		{
+			block_store_release(bs, block_id);
+		}
+	}
+
+	const int fd = memfd_create("seed", 0);
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	const size_t length = fd >= 0 ? block_store_serialize(bs, path) : 0;
+	block_store_destroy(bs);
+	uint8_t *data = length > 0 ? (uint8_t *)malloc(length + 1 + BLOCK_SIZE_BYTES) : NULL;
+	if(data == NULL || pread(fd, data + 1, length, 0) != (ssize_t)length)
+	{
+		free(data);
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+	data[0] = (uint8_t)next_random(state);
+	*size = length + 1;
+	return data;
+}
+
+static void mutate(uint64_t *const state, uint8_t *const data, size_t *const size)
+{
+	const size_t length = *size - 1;
+	const size_t bitmap_bytes = ((length - BLOCK_STORE_IMAGE_HEADER_BYTES) / BLOCK_SIZE_BYTES + 7) / 8;
+	const size_t mutations = next_random(state) % 4;
+	for(size_t i = 0; i < mutations; i++)
+	{
+		const uint64_t r = next_random(state);
+		switch(r % 5)
+		{
+			case 0:  // A bit of the bitmap, the part of the image the parser has to trust
+				data[1 + BLOCK_STORE_IMAGE_HEADER_BYTES + BITMAP_START_BLOCK * BLOCK_SIZE_BYTES + (r >> 8) % bitmap_bytes] ^= (uint8_t)(1u << ((r >> 2) % 8));
+				break;
+			case 1:
+				data[1 + (r >> 8) % length] = (uint8_t)(r >> 2);
+				break;
+			case 2:  // A superblock byte, with the checksum made to match
+			{
+				image_superblock_t sb;
+				memcpy(&sb, data + 1, sizeof(sb));
+				((uint8_t *)&sb)[(r >> 8) % sizeof(sb)] ^= (uint8_t)(1u << ((r >> 2) % 8));
+				image_superblock_seal(&sb);
+				memcpy(data + 1, &sb, sizeof(sb));
+				break;
+			}
+			case 3:  // Cut the end off, not always on a block boundary
+				*size -= (r >> 8) % (BLOCK_SIZE_BYTES + 1);
+				return;
+			default:  // Pad the end, room for that was left by random_image
+				memset(data + *size, 0, BLOCK_SIZE_BYTES);
+				*size += 1 + (r >> 8) % BLOCK_SIZE_BYTES;
+				return;
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	size_t runs = 1000;
+	uint64_t state = 0x9E3779B97F4A7C15ull;
+	int files = 0;
+	for(int i = 1; i < argc; i++)
+	{
+		if(strcmp(argv[i], "--runs") == 0 && i + 1 < argc)
+		{
+			runs = strtoull(argv[++i], NULL, 10);
+		}
+		else if(strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+		{
+			state = strtoull(argv[++i], NULL, 10) | 1;
+		}
+		else if(argv[i][0] == '-')
+		{
+			continue;  // A libFuzzer flag, there is nothing here for it to change
+		}
+		else
+		{
+			files++;
+			if(run_file(argv[i]) != 0)
+			{
+				return 1;
+			}
+		}
+	}
+	if(files > 0)
+	{
+		printf("%d inputs passed\n", files);
+		return 0;
+	}
+
+	for(size_t run = 0; run < runs; run++)
+	{
+		size_t size = 0;
+		uint8_t *data = random_image(&state, &size);
+		if(data == NULL)
+		{
+			fprintf(stderr, "Failed to make an image to mutate\n");
+			return 1;
+		}
+		mutate(&state, data, &size);
+		LLVMFuzzerTestOneInput(data, size);
+		free(data);
+	}
+	printf("%zu inputs passed\n", runs);
+	return 0;
+}
@@ -0,0 +1,219 @@
+// libFuzzer entry point for the image parsers: block_store_deserialize, its lazy variant and
+// block_store_deserialize_striped all take whatever bytes the fuzzer comes up with
+//
+// usage: hw3_fuzz_image [corpus dirs or files] -max_len=16384   (built with BLOCK_STORE_FUZZ)
+//        hw3_fuzz_image [files...] | [--runs n]                   (otherwise, see fuzz_main.c)
+//
+// The first input byte picks the parser and, for striped images, the layout; the rest is the
+// image. A parser has to agree with block_store_check_image, and anything it accepts has to come
+// back as a sane device: the same size, the same bitmap, the same blocks when serialized again,
+// and exactly its free blocks handed out when allocating until full. A violation aborts, which
+// libFuzzer reports as a crash with the input saved
+
+#define _GNU_SOURCE  // memfd_create, images never touch the disk
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "block_store.h"
+#include "image.h"
+
+#define FUZZ_STRIPE_FILES_MAX 4
+
+#define CHECK(condition) \
+	do \
+	{ \
+		if(!(condition)) \
+		{ \
+			fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #condition); \
+			abort(); \
+		} \
+	} while(0)
+
+// An anonymous file and the path the library can open it by
+typedef struct
+{
+	int fd;
+	char path[64];
+} memfile_t;
+
+static void memfile_open(memfile_t *const file)
+{
+	file->fd = memfd_create("image", 0);
+	CHECK(file->fd >= 0);
+	snprintf(file->path, sizeof(file->path), "/proc/self/fd/%d", file->fd);
+}
+
+static void memfile_write(const memfile_t *const file, const uint8_t *data, size_t length)
+{
+	CHECK(ftruncate(file->fd, 0) == 0);
+	size_t offset = 0;
+	while(offset < length)
+	{
+		const ssize_t written = pwrite(file->fd, data + offset, length - offset, offset);
+		CHECK(written > 0);
+		offset += written;
+	}
+}
+
+// Whether the file holds the same blocks as the image; the rest of the header page is free to differ
+static int memfile_same_blocks(const memfile_t *const file, const uint8_t *const image, const size_t length)
+{
+	struct stat st;
+	CHECK(fstat(file->fd, &st) == 0);
+	if((size_t)st.st_size != length)
+	{
+		return 0;
+	}
+	uint8_t chunk[4096];
+	for(size_t offset = BLOCK_STORE_IMAGE_HEADER_BYTES; offset < length; offset += sizeof(chunk))
+	{
+		const size_t want = length - offset < sizeof(chunk) ? length - offset : sizeof(chunk);
+		CHECK(pread(file->fd, chunk, want, offset) == (ssize_t)want);
+		if(memcmp(chunk, image + offset, want) != 0)
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// The image's own answer to whether a block is in use, straight from its bitmap bytes
+static int image_bit(const uint8_t *const image, const size_t block_id)
+{
+	return (image[BLOCK_STORE_IMAGE_HEADER_BYTES + BITMAP_START_BLOCK * BLOCK_SIZE_BYTES + block_id / 8] >> (block_id % 8)) & 1;
+}
+
+// Whether the superblock, already checked, marks the file as one of a striped set
+static int image_is_striped(const uint8_t *const image)
+{
+	image_superblock_t sb;
+	memcpy(&sb, image, sizeof(sb));
+	return (sb.incompat_features & IMAGE_INCOMPAT_STRIPED) != 0;
+}
+
+// Holds an accepted image to everything it promises
+static void check_device(block_store_t *const bs, const uint8_t *const image, const size_t length)
+{
+	const size_t num_blocks = block_store_get_num_blocks(bs);
+	CHECK(BLOCK_STORE_IMAGE_HEADER_BYTES + num_blocks * BLOCK_SIZE_BYTES == length);
+	const size_t bitmap_blocks = (num_blocks + BLOCK_SIZE_BYTES * 8 - 1) / (BLOCK_SIZE_BYTES * 8);
+	size_t used = 0;
+	for(size_t i = 0; i < num_blocks; i++)
+	{
+		used += image_bit(image, i);
+	}
+	CHECK(block_store_get_used_blocks(bs) == used);
+	CHECK(block_store_get_free_blocks(bs) == num_blocks - used);
+
+	memfile_t out;
+	memfile_open(&out);
+	CHECK(block_store_serialize(bs, out.path) == length);
+	CHECK(memfile_same_blocks(&out, image, length));
+	CHECK(block_store_check_image(out.path) == BLOCK_STORE_IMAGE_OK);
+	close(out.fd);
+
+	// Every block handed out was free in the image and is never one of the bitmap's
+	size_t *taken = (size_t *)malloc((num_blocks - used + 1) * sizeof(size_t));
+	CHECK(taken != NULL);
+	size_t count = 0;
+	for(size_t block_id = block_store_allocate(bs); block_id != SIZE_MAX; block_id = block_store_allocate(bs))
+	{
+		CHECK(count < num_blocks - used);
+		CHECK(block_id < num_blocks && !image_bit(image, block_id));
+		CHECK(block_id < BITMAP_START_BLOCK || block_id >= BITMAP_START_BLOCK + bitmap_blocks);
+		CHECK(!block_store_request(bs, block_id));
+		taken[count++] = block_id;
+	}
+	CHECK(count == num_blocks - used);
+	CHECK(block_store_get_free_blocks(bs) == 0);
+
+	uint8_t block[BLOCK_SIZE_BYTES], back[BLOCK_SIZE_BYTES];
+	memset(block, 0xA5, sizeof(block));
+	if(count > 0)
+	{
+		CHECK(block_store_write(bs, taken[0], block) == BLOCK_SIZE_BYTES);
+		CHECK(block_store_read(bs, taken[0], back) == BLOCK_SIZE_BYTES);
+		CHECK(memcmp(block, back, sizeof(block)) == 0);
+	}
+	for(size_t i = 0; i < count; i++)
+	{
+		block_store_release(bs, taken[i]);
+	}
+	CHECK(block_store_get_used_blocks(bs) == used);
+	free(taken);
+}
+
+// Writes the device out striped and reads it back, the copy has to be as good as the original
+static block_store_t *restripe(block_store_t *const bs, const size_t files, const size_t stripe_blocks)
+{
+	memfile_t stripes[FUZZ_STRIPE_FILES_MAX];
+	const char *paths[FUZZ_STRIPE_FILES_MAX];
+	for(size_t i = 0; i < files; i++)
+	{
+		memfile_open(&stripes[i]);
+		paths[i] = stripes[i].path;
+	}
+	const size_t length = block_store_get_num_blocks(bs) * BLOCK_SIZE_BYTES + files * BLOCK_STORE_IMAGE_HEADER_BYTES;
+	CHECK(block_store_serialize_striped(bs, paths, files, stripe_blocks) == length);
+	block_store_t *copy = block_store_deserialize_striped(paths, files, stripe_blocks);
+	CHECK(copy != NULL);
+	for(size_t i = 0; i < files; i++)
+	{
+		close(stripes[i].fd);
+	}
+	return copy;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	if(size < 1)
+	{
+		return 0;
+	}
+	const uint8_t mode = data[0];
+	const uint8_t *const image = data + 1;
+	const size_t length = size - 1;
+
+	memfile_t file;
+	memfile_open(&file);
+	memfile_write(&file, image, length);
+	const block_store_image_status_t status = block_store_check_image(file.path);
+	block_store_t *bs = NULL;
+	if(mode % 3 == 2)
+	{
+		// The bytes as the only file of a striped set, which only a striped superblock can open
+		const char *paths[1] = {file.path};
+		bs = block_store_deserialize_striped(paths, 1, 1 + (mode >> 4));
+		CHECK(bs == NULL || (status == BLOCK_STORE_IMAGE_OK && image_is_striped(image)));
+		block_store_destroy(bs);
+		bs = block_store_deserialize(file.path);
+	}
+	else
+	{
+		bs = mode % 3 == 0 ? block_store_deserialize(file.path) : block_store_deserialize_lazy(file.path, false);
+	}
+	close(file.fd);  // A lazy store opened its own descriptor
+	if(bs == NULL)
+	{
+		// Only images the check turns away may be turned away, a stripe file is only whole with its set
+		CHECK(status != BLOCK_STORE_IMAGE_OK || image_is_striped(image));
+		return 0;
+	}
+	CHECK(status == BLOCK_STORE_IMAGE_OK && !image_is_striped(image));
+	if(mode % 3 == 2)
+	{
+		block_store_t *copy = restripe(bs, 1 + (mode >> 2) % FUZZ_STRIPE_FILES_MAX, 1 + (mode >> 4));
+		block_store_destroy(bs);
+		bs = copy;
+	}
+	check_device(bs, image, length);
+	block_store_destroy(bs);
+	return 0;
+}
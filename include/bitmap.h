@@ -53,6 +53,72 @@ void bitmap_flip(bitmap_t *const bitmap, const size_t bit);
 ///
 void bitmap_invert(bitmap_t *const bitmap);
 
+///
+/// Sets every bit in a range
+/// \param bitmap The bitmap
+/// \param start The first bit to set
+/// \param count The number of bits to set (ranges running past the end are ignored)
+///
+void bitmap_set_range(bitmap_t *const bitmap, const size_t start, const size_t count);
+
+///
+/// Clears every bit in a range
+/// \param bitmap The bitmap
+/// \param start The first bit to clear
+/// \param count The number of bits to clear (ranges running past the end are ignored)
+///
+void bitmap_reset_range(bitmap_t *const bitmap, const size_t start, const size_t count);
+
+///
+/// Checks that every bit in a range is set
+/// \param bitmap The bitmap
+/// \param start The first bit to query
+/// \param count The number of bits to query
+/// \return true if all of them are set (or count is 0), false otherwise or if the range runs past the end
+///
+bool bitmap_test_range_all(const bitmap_t *const bitmap, const size_t start, const size_t count);
+
+///
+/// Checks whether any bit in a range is set
+/// \param bitmap The bitmap
+/// \param start The first bit to query
+/// \param count The number of bits to query
+/// \return true if at least one of them is set, false otherwise or if the range runs past the end
+///
+bool bitmap_test_range_any(const bitmap_t *const bitmap, const size_t start, const size_t count);
+
+///
+/// dst = dst & src, bit for bit
+/// \param dst The bitmap to update
+/// \param src The bitmap to combine it with, must have the same number of bits
+/// \return true on success, false if the sizes differ
+///
+bool bitmap_and(bitmap_t *const dst, const bitmap_t *const src);
+
+///
+/// dst = dst | src, bit for bit
+/// \param dst The bitmap to update
+/// \param src The bitmap to combine it with, must have the same number of bits
+/// \return true on success, false if the sizes differ
+///
+bool bitmap_or(bitmap_t *const dst, const bitmap_t *const src);
+
+///
+/// dst = dst ^ src, bit for bit (the bits that differ, for diffing snapshots)
+/// \param dst The bitmap to update
+/// \param src The bitmap to combine it with, must have the same number of bits
+/// \return true on success, false if the sizes differ
+///
+bool bitmap_xor(bitmap_t *const dst, const bitmap_t *const src);
+
+///
+/// dst = dst & ~src, bit for bit (the bits set in dst but not in src)
+/// \param dst The bitmap to update
+/// \param src The bitmap to combine it with, must have the same number of bits
+/// \return true on success, false if the sizes differ
+///
+bool bitmap_andnot(bitmap_t *const dst, const bitmap_t *const src);
+
 ///
 /// Find first set
 /// \param bitmap The bitmap
@@ -73,15 +139,68 @@ size_t bitmap_ffz(const bitmap_t *const bitmap);
 /// \return the total number of bits that are set in the bitmap
 ///
 size_t bitmap_total_set(const bitmap_t *const bitmap);
+///
+/// Finds the next set bit, skipping clear words without looking at their bits
+/// \param bitmap The bitmap
+/// \param from The first bit to look at
+/// \return The first one bit at or after from, SIZE_MAX on error/not found
+///
+size_t bitmap_next_set(const bitmap_t *const bitmap, const size_t from);
+
+///
+/// Finds the next clear bit, skipping full words without looking at their bits
+/// \param bitmap The bitmap
+/// \param from The first bit to look at
+/// \return The first zero bit at or after from, SIZE_MAX on error/not found
+///
+size_t bitmap_next_zero(const bitmap_t *const bitmap, const size_t from);
+
+///
+/// Finds the previous set bit, going down a word at a time
+/// \param bitmap The bitmap
+/// \param from The last bit to look at, past the end means from the last bit of the map
+/// \return The last one bit at or before from, SIZE_MAX on error/not found
+///
+size_t bitmap_prev_set(const bitmap_t *const bitmap, const size_t from);
+
+///
+/// Finds the previous clear bit, going down a word at a time
+/// \param bitmap The bitmap
+/// \param from The last bit to look at, past the end means from the last bit of the map
+/// \return The last zero bit at or before from, SIZE_MAX on error/not found
+///
+size_t bitmap_prev_zero(const bitmap_t *const bitmap, const size_t from);
+
+///
+/// Collects the next set bits into an array, a word at a time
+/// Carry on from the last bit returned plus one to get the rest
+/// \param bitmap The bitmap
+/// \param from The first bit to look at
+/// \param bits Array to fill with bit numbers, in increasing order
+/// \param max Size of the array
+/// \return Number of bits written to the array, less than max once the end of the map is reached
+///
+size_t bitmap_next_set_batch(const bitmap_t *const bitmap, const size_t from, size_t *const bits, const size_t max);
+
 ///
 /// For each loop for all set bits
 ///  (Arguments passed to func are saved across calls)
+/// Bits are gathered in batches, so bits func changes may or may not be visited
 /// \param bitmap The bitmap
 /// \param func The function to apply (first parameter will be size_t with the bit number)
 /// \param args A generic pointer to pass to the called function
 ///
 void bitmap_for_each(const bitmap_t *const bitmap, void (*func)(size_t, void *), void *arg);
 
+///
+/// For each loop over maximal runs of clear bits, scanning a word at a time
+///  (Arguments passed to func are saved across calls)
+/// \param bitmap The bitmap
+/// \param func The function to apply (parameters are the first bit of the run and its length)
+/// \param args A generic pointer to pass to the called function
+///
+void bitmap_for_each_zero_run(const bitmap_t *const bitmap, void (*func)(size_t, size_t, void *), void *arg);
+
 ///
 /// Resets bitmap contents to the desired pattern
 /// (pattern not guarenteed accurate for final bits
@@ -0,0 +1,68 @@
+#ifndef BLOCK_CLIENT_H__
+#define BLOCK_CLIENT_H__
+
+#ifdef __cplusplus
+	extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "block_protocol.h"
+
+// Client side of block_server: the block_store.h calls, run on a device in another process
+// Each call below is one round trip; block_client_batch pipelines any number of them in one
+// A client is not thread safe, give each thread its own connection
+
+typedef struct block_client block_client_t;
+
+// One call in a batch
+typedef struct
+{
+	block_protocol_op_t op;
+	size_t arg;      // Block id, where the op takes one
+	void *buffer;    // BLOCK_SIZE_BYTES to read into or write from, for reads and writes
+	size_t result;   // Filled in with what the block_store.h call would have returned
+} block_client_op_t;
+
+///
+/// Connects to a server
+/// \param path Socket path the server was created with
+/// \return The client, NULL on error
+///
+block_client_t *block_client_connect(const char *const path);
+
+///
+/// Disconnects
+/// \param client The client
+///
+void block_client_close(block_client_t *const client);
+
+///
+/// Sends every call without waiting for answers, then collects the answers
+/// \param client The client
+/// \param ops The calls, results are written back in place
+/// \param count Number of calls
+/// \return true if every call got an answer, false if the connection failed
+///
+bool block_client_batch(block_client_t *const client, block_client_op_t *const ops, const size_t count);
+
+///
+/// Same as the block_store.h calls of the same name, on the server's device
+/// Failures of the connection look like failures of the call
+///
+size_t block_client_allocate(block_client_t *const client);
+bool block_client_request(block_client_t *const client, const size_t block_id);
+void block_client_release(block_client_t *const client, const size_t block_id);
+size_t block_client_read(block_client_t *const client, const size_t block_id, void *buffer);
+size_t block_client_write(block_client_t *const client, const size_t block_id, const void *buffer);
+size_t block_client_get_used_blocks(block_client_t *const client);
+size_t block_client_get_free_blocks(block_client_t *const client);
+size_t block_client_get_num_blocks(block_client_t *const client);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
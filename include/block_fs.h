@@ -0,0 +1,129 @@
+#ifndef BLOCK_FS_H__
+#define BLOCK_FS_H__
+
+#ifdef __cplusplus
+	extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "block_store.h"
+
+// Named files on top of a block_store, everything kept in the device's own blocks
+// Block 0 is the superblock, pointing at the inode of a flat root directory
+// Every file has one inode block holding its size and its first two extents (runs of
+// contiguous blocks), the rest of its extents go in a chain of map blocks
+// Files grow in place when the blocks after their last extent are free and by whole
+// extents otherwise, so sequentially written files stay in a handful of extents
+// Reads that follow on from the previous one on the same handle are served from a
+// read-ahead window that doubles up to BLOCK_FS_READAHEAD_BLOCKS
+// Block ids are stored in 32 bits, so the device can't have more than UINT32_MAX blocks
+// A file system is not thread safe, and nothing else may use the device's blocks while it is mounted
+// (other than allocating blocks of its own)
+
+#define BLOCK_FS_NAME_MAX 23            // Longest file name, in bytes
+#define BLOCK_FS_READAHEAD_BLOCKS 256   // Largest read-ahead window
+
+typedef struct block_fs block_fs_t;
+typedef struct block_fs_file block_fs_file_t;
+
+///
+/// Creates an empty file system on a device, block 0 has to be free
+/// \param bs BS device, still owned by the caller and must outlive the file system
+/// \return The mounted file system, NULL on error
+///
+block_fs_t *block_fs_format(block_store_t *const bs);
+
+///
+/// Mounts the file system block_fs_format left on a device
+/// \param bs BS device, still owned by the caller and must outlive the file system
+/// \return The mounted file system, NULL on error (or if the device doesn't hold one)
+///
+block_fs_t *block_fs_mount(block_store_t *const bs);
+
+///
+/// Unmounts a file system, every file has to be closed first
+/// Everything is already in the device, this only frees memory
+/// \param fs The file system
+///
+void block_fs_unmount(block_fs_t *const fs);
+
+///
+/// Creates an empty file and opens it
+/// \param fs The file system
+/// \param name File name, 1 to BLOCK_FS_NAME_MAX bytes
+/// \return The open file, NULL on error (or if the name is taken)
+///
+block_fs_file_t *block_fs_create(block_fs_t *const fs, const char *const name);
+
+///
+/// Opens an existing file, a file can be open more than once and every handle sees the same data
+/// \param fs The file system
+/// \param name File name
+/// \return The open file, NULL on error (or if there is no such file)
+///
+block_fs_file_t *block_fs_open(block_fs_t *const fs, const char *const name);
+
+///
+/// Closes a file handle
+/// \param file The file
+///
+void block_fs_close(block_fs_file_t *const file);
+
+///
+/// Reads from a file, stopping at its end
+/// \param file The file
+/// \param offset Byte offset to read from
+/// \param buffer Where the data goes
+/// \param length Bytes to read
+/// \return Bytes read (0 at or past the end), SIZE_MAX on error
+///
+size_t block_fs_read(block_fs_file_t *const file, const size_t offset, void *const buffer, const size_t length);
+
+///
+/// Writes to a file, growing it if the write ends past its end (any gap reads as zeros)
+/// \param file The file
+/// \param offset Byte offset to write at
+/// \param buffer The data
+/// \param length Bytes to write
+/// \return Bytes written, SIZE_MAX on error (the device is full, the file is left as it was)
+///
+size_t block_fs_write(block_fs_file_t *const file, const size_t offset, const void *const buffer, const size_t length);
+
+///
+/// Sets the size of a file, shrinking frees the blocks past the new end and growing adds zeros
+/// \param file The file
+/// \param size New size in bytes
+/// \return true on success, false on error
+///
+bool block_fs_truncate(block_fs_file_t *const file, const size_t size);
+
+///
+/// Gets the size of a file
+/// \param file The file
+/// \return Size in bytes, SIZE_MAX on error
+///
+size_t block_fs_size(const block_fs_file_t *const file);
+
+///
+/// Counts the extents a file is stored in
+/// \param file The file
+/// \return Number of extents, SIZE_MAX on error
+///
+size_t block_fs_extents(const block_fs_file_t *const file);
+
+///
+/// Removes a file and frees its blocks, it can't be open
+/// \param fs The file system
+/// \param name File name
+/// \return true if the file was removed
+///
+bool block_fs_unlink(block_fs_t *const fs, const char *const name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef BLOCK_KV_H__
+#define BLOCK_KV_H__
+
+#ifdef __cplusplus
+	extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "block_store.h"
+
+// A B+tree of 64 bit keys and values whose nodes are pages of BLOCK_KV_PAGE_BLOCKS blocks
+// The tree is found from a meta block, whose id block_kv_id gives out; keep it (in a block_fs
+// file, say) to block_kv_open the tree again, from the same device or a serialized image of it
+// Pages go through a write-back cache of decoded nodes with clock eviction, so a hot working set
+// costs no block reads at all; nothing reaches the device until block_kv_flush or block_kv_close
+// Deletes free pages as they empty, they don't merge half empty ones
+// Not thread safe, one tree per handle
+
+#define BLOCK_KV_PAGE_BLOCKS 8 // 256 byte pages: 15 records per leaf, 21 children per inner node
+
+typedef struct block_kv block_kv_t;
+
+///
+/// Creates an empty tree on a device
+/// \param bs BS device, still owned by the caller and must outlive the tree
+/// \param cache_pages Pages kept in memory, 0 for 1024
+/// \return The tree, NULL on error
+///
+block_kv_t *block_kv_create(block_store_t *const bs, const size_t cache_pages);
+
+///
+/// Opens a tree that was flushed to a device
+/// \param bs BS device, still owned by the caller and must outlive the tree
+/// \param id The tree's meta block, from block_kv_id
+/// \param cache_pages Pages kept in memory, 0 for 1024
+/// \return The tree, NULL on error (or if there is no tree there)
+///
+block_kv_t *block_kv_open(block_store_t *const bs, const size_t id, const size_t cache_pages);
+
+///
+/// Gets the block a tree is opened from
+/// \param kv The tree
+/// \return The meta block id, SIZE_MAX on error
+///
+size_t block_kv_id(const block_kv_t *const kv);
+
+///
+/// Writes every changed page and the meta block to the device, ready to serialize
+/// \param kv The tree
+/// \return true on success
+///
+bool block_kv_flush(block_kv_t *const kv);
+
+///
+/// Flushes and closes a tree, its pages stay on the device
+/// \param kv The tree
+/// \return true if the flush succeeded
+///
+bool block_kv_close(block_kv_t *const kv);
+
+///
+/// Looks a key up
+/// \param kv The tree
+/// \param key The key
+/// \param value Where the value goes, may be NULL
+/// \return true if the key is in the tree
+///
+bool block_kv_get(block_kv_t *const kv, const uint64_t key, uint64_t *const value);
+
+///
+/// Adds a key or replaces its value
+/// \param kv The tree
+/// \param key The key
+/// \param value The value
+/// \return true on success, false on error (the device is full, the tree is left as it was)
+///
+bool block_kv_put(block_kv_t *const kv, const uint64_t key, const uint64_t value);
+
+///
+/// Removes a key
+/// \param kv The tree
+/// \param key The key
+/// \return true if the key was there
+///
+bool block_kv_delete(block_kv_t *const kv, const uint64_t key);
+
+///
+/// Visits the keys from low to high (both included) in order
+/// \param kv The tree
+/// \param low First key
+/// \param high Last key
+/// \param visit Called for every key, returns false to stop early
+/// \param arg Passed through to visit
+/// \return Number of keys visited, SIZE_MAX on error
+///
+size_t block_kv_scan(block_kv_t *const kv, const uint64_t low, const uint64_t high, bool (*visit)(uint64_t, uint64_t, void *), void *arg);
+
+///
+/// Fills an empty tree from sorted keys bottom up, with full pages and no splits
+/// \param kv The tree, must be empty
+/// \param keys Strictly increasing keys
+/// \param values Their values
+/// \param count Number of keys
+/// \return true on success, false on error (the tree is left empty)
+///
+bool block_kv_bulk_load(block_kv_t *const kv, const uint64_t *const keys, const uint64_t *const values, const size_t count);
+
+///
+/// Counts the keys in a tree
+/// \param kv The tree
+/// \return Number of keys, SIZE_MAX on error
+///
+size_t block_kv_count(const block_kv_t *const kv);
+
+///
+/// Gets the number of levels in a tree, 1 while the root is a leaf
+/// \param kv The tree
+/// \return Height, 0 on error
+///
+size_t block_kv_height(const block_kv_t *const kv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,109 @@
+#ifndef BLOCK_MEMORY_H__
+#define BLOCK_MEMORY_H__
+
+#ifdef __cplusplus
+	extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "block_store.h"
+
+// Backing memory for a device's block array, picked by the memory options in block_store_options_t
+// Always comes back zeroed, however it was obtained
+
+typedef enum { BLOCK_MEMORY_HEAP = 0, BLOCK_MEMORY_MAPPED, BLOCK_MEMORY_ARENA, BLOCK_MEMORY_SHARED } block_memory_kind_t;
+
+typedef struct
+{
+	uint8_t *data;
+	size_t size;               // Bytes the device uses
+	size_t length;             // Bytes actually mapped (or the whole arena), may be more than size
+	block_memory_kind_t kind;  // How to give it back
+	bool huge_pages;           // Backed by reserved (MAP_HUGETLB) huge pages
+	uint8_t *header;           // Shared segments: a page in front of data for the store's own bookkeeping
+} block_memory_t;
+
+///
+/// Gets memory for a block array
+/// Huge page and NUMA placement are best effort: without reserved huge pages the mapping falls
+///  back to transparent huge pages, and kernels without NUMA support just ignore the placement
+/// \param memory Filled with the memory and how to free it
+/// \param bytes Size of the block array
+/// \param options Creation options, NULL for plain zeroed heap memory
+/// \return true on success, false if no memory could be had (or the arena is too small)
+///
+bool block_memory_create(block_memory_t *const memory, const size_t bytes, const block_store_options_t *const options);
+
+///
+/// Creates a named POSIX shared memory segment (shm_open) and maps it, zeroed
+/// The segment is one header page followed by the block array, so other processes can find
+///  the device's size and state with block_memory_attach_shared
+/// \param memory Filled with the mapping, header points at the header page
+/// \param name Segment name, "/something"
+/// \param bytes Size of the block array
+/// \param touch Prefault every page up front
+/// \return true on success, false on error or if the segment already exists
+///
+bool block_memory_create_shared(block_memory_t *const memory, const char *const name, const size_t bytes, const bool touch);
+
+///
+/// Maps an existing segment from block_memory_create_shared
+/// \param memory Filled with the mapping, size is whatever follows the header page
+/// \param name Segment name
+/// \return true on success, false on error
+///
+bool block_memory_attach_shared(block_memory_t *const memory, const char *const name);
+
+///
+/// Removes a segment's name, mappings of it stay valid until they are destroyed
+/// \param name Segment name
+/// \return true if the name was removed
+///
+bool block_memory_unlink_shared(const char *const name);
+
+///
+/// Grows or shrinks the memory, keeping its contents up to the smaller size
+/// Mappings are resized with mremap, so growing doesn't copy the data (it may still move)
+/// \param memory The memory, data may change
+/// \param bytes The new size, anything past the old size reads as zeros
+/// \return true on success, false if it can't grow or is shared (memory is unchanged)
+///
+bool block_memory_resize(block_memory_t *const memory, const size_t bytes);
+
+///
+/// Zeroes part of the memory, returning the whole pages inside it to the OS (arenas and shared segments are only zeroed)
+/// \param memory The memory
+/// \param offset First byte to discard
+/// \param length Number of bytes to discard
+///
+void block_memory_discard(block_memory_t *const memory, const size_t offset, const size_t length);
+
+///
+/// Hints that part of the memory is about to be read: mappings are asked to fault their pages in
+///  (MADV_WILLNEED) and every cache line is prefetched, so a scan finds it close by
+/// \param memory The memory
+/// \param offset First byte to prefetch
+/// \param length Number of bytes to prefetch
+///
+void block_memory_prefetch(const block_memory_t *const memory, const size_t offset, const size_t length);
+
+///
+/// Gets the granularity block_memory_discard can give memory back in
+/// \return The page size in bytes
+///
+size_t block_memory_page_size(void);
+
+///
+/// Gives back memory from block_memory_create, arenas are left alone and shared segments are only unmapped
+/// \param memory The memory
+///
+void block_memory_destroy(block_memory_t *const memory);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
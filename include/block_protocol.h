@@ -0,0 +1,61 @@
+#ifndef BLOCK_PROTOCOL_H__
+#define BLOCK_PROTOCOL_H__
+
+#ifdef __cplusplus
+	extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "block_store.h"
+
+// Wire format between block_server and block_client, over a Unix domain socket in host byte order
+// A client sends any number of requests back to back without waiting, the server answers each one
+// in the order they came in. Writes carry the block after the request, reads get it after the
+// response (zeros if the read failed), so every message size follows from its op alone
+
+typedef enum
+{
+	BLOCK_PROTOCOL_ALLOCATE = 0,  // result = id, SIZE_MAX if full
+	BLOCK_PROTOCOL_REQUEST,       // arg = id, result = 1 on success
+	BLOCK_PROTOCOL_RELEASE,       // arg = id
+	BLOCK_PROTOCOL_READ,          // arg = id, result = bytes read, the block follows
+	BLOCK_PROTOCOL_WRITE,         // arg = id, the block follows; result = bytes written
+	BLOCK_PROTOCOL_USED_BLOCKS,   // result = used blocks
+	BLOCK_PROTOCOL_FREE_BLOCKS,   // result = free blocks
+	BLOCK_PROTOCOL_NUM_BLOCKS,    // result = device size
+	BLOCK_PROTOCOL_OP_COUNT,
+} block_protocol_op_t;
+
+typedef struct
+{
+	uint32_t op;   // block_protocol_op_t, anything else and the server hangs up
+	uint32_t tag;  // Echoed back, lets a client check responses line up
+	uint64_t arg;
+} block_protocol_request_t;
+
+typedef struct
+{
+	uint32_t op;
+	uint32_t tag;
+	uint64_t result;  // Same value the block_store.h call returns, SIZE_MAX widened to UINT64_MAX
+} block_protocol_response_t;
+
+// Bytes following a request or a response of this op
+static inline size_t block_protocol_request_payload(const uint32_t op)
+{
+	return op == BLOCK_PROTOCOL_WRITE ? BLOCK_SIZE_BYTES : 0;
+}
+
+static inline size_t block_protocol_response_payload(const uint32_t op)
+{
+	return op == BLOCK_PROTOCOL_READ ? BLOCK_SIZE_BYTES : 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef BLOCK_SERVER_H__
+#define BLOCK_SERVER_H__
+
+#ifdef __cplusplus
+	extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "block_store.h"
+
+// Serves one block_store to other processes over a Unix domain socket, see block_protocol.h
+// A single thread runs an epoll loop over every connection, so calls into the device never
+// overlap and the device needs no locking. Whatever a client has pipelined is answered in one
+// batch per wakeup: one read in, every complete request handled, one write out
+
+typedef struct block_server block_server_t;
+
+///
+/// Binds the socket, replacing a stale one at the same path
+/// \param bs The device to serve, still owned by the caller and only touched by block_server_run
+/// \param path Socket path
+/// \return The server, NULL on error
+///
+block_server_t *block_server_create(block_store_t *const bs, const char *const path);
+
+///
+/// Serves clients until block_server_stop is called
+/// \param server The server
+/// \return true if it stopped because it was asked to, false on error
+///
+bool block_server_run(block_server_t *const server);
+
+///
+/// Asks a running server to return from block_server_run, safe from other threads and signal handlers
+/// \param server The server
+///
+void block_server_stop(block_server_t *const server);
+
+///
+/// Closes every connection and removes the socket, the device is left to the caller
+/// \param server The server, must not be running
+///
+void block_server_destroy(block_server_t *const server);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -7,6 +7,7 @@ extern "C"
 #endif
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdbool.h>
 
 	// Constants
@@ -17,6 +18,13 @@ extern "C"
 #define BLOCK_STORE_NUM_BYTES (BLOCK_STORE_NUM_BLOCKS * BLOCK_SIZE_BYTES)
 #define BITMAP_START_BLOCK 127
 #define BITMAP_NUM_BLOCKS (BITMAP_SIZE_BYTES / BLOCK_SIZE_BYTES)
+#define BLOCK_STORE_GROUP_BLOCKS 64        // Blocks per allocation group for round robin allocation
+#define BLOCK_STORE_FRAG_BUCKETS 32        // Power of two buckets in the free run histogram
+#define BLOCK_STORE_HIST_BUCKETS 252       // Log-linear buckets in the stats histograms (see histogram.h)
+#define BLOCK_STORE_ZONE_BLOCKS 32768        // Blocks per zone of the free space summary, see block_store_get_zone
+#define BLOCK_STORE_READAHEAD_MIN_BLOCKS 16        // A sequential scan's first read-ahead window
+#define BLOCK_STORE_READAHEAD_DEFAULT_BLOCKS 1024        // Largest window lazily loaded devices start with
+#define BLOCK_STORE_IMAGE_HEADER_BYTES 4096        // Header page in front of the blocks of an image file, see image.h
 
 	// Declaring the struct but not implementing in the header allows us to prevent users
 	//  from using the object directly and monkeying with the contents
@@ -24,12 +32,189 @@ extern "C"
 	// This enforces a black box device, but it can be restricting
 	typedef struct block_store block_store_t;
 
+	// Strategies for picking free blocks, chosen when the device is created
+	typedef enum
+	{
+		BLOCK_STORE_ALLOCATOR_BITMAP = 0, // First fit scan of the free block bitmap
+		BLOCK_STORE_ALLOCATOR_BUDDY,      // Binary buddy system, extents are rounded up to powers of two
+	} block_store_allocator_t;
+
+	// Where block_store_allocate starts looking for a free block (bitmap allocator only)
+	typedef enum
+	{
+		BLOCK_STORE_POLICY_FIRST_FIT = 0, // Lowest free block
+		BLOCK_STORE_POLICY_NEXT_FIT,      // First free block after the previous allocation, wrapping around
+		BLOCK_STORE_POLICY_ROUND_ROBIN,   // Each allocation starts in the next allocation group
+	} block_store_policy_t;
+
+	// Where the block array lives
+	typedef enum
+	{
+		BLOCK_STORE_MEMORY_HEAP = 0,   // Plain calloc
+		BLOCK_STORE_MEMORY_HUGE_PAGES, // 2 MiB pages, reserved ones (MAP_HUGETLB) if there are any,
+		                               //  otherwise transparent huge pages requested with madvise
+		BLOCK_STORE_MEMORY_ARENA,      // Caller supplied, see arena in block_store_options_t
+	} block_store_memory_t;
+
+	// Creation time settings, zero initialize for the defaults
+	typedef struct
+	{
+		block_store_allocator_t allocator;
+		block_store_policy_t policy;
+		size_t num_blocks; // Device size in blocks, 0 for BLOCK_STORE_NUM_BLOCKS
+		                   //  (must leave room for the bitmap at BITMAP_START_BLOCK)
+		block_store_memory_t memory;
+		void *arena;        // BLOCK_STORE_MEMORY_ARENA only: at least num_blocks * BLOCK_SIZE_BYTES bytes,
+		size_t arena_bytes; //  zeroed by create, never freed by the device and must outlive it
+		bool prefault;      // Fault in every page at creation instead of on first access
+		bool numa_local;    // Linux: prefer the NUMA node of the creating thread for the blocks
+		bool discard;       // Released blocks are zeroed and whole free pages go back to the OS, see block_store_discard
+	} block_store_options_t;
+
+	// What a primary does when its standby falls a whole log buffer behind
+	typedef enum
+	{
+		BLOCK_STORE_BACKPRESSURE_WAIT = 0, // Changes wait for room, the primary runs at the standby's pace
+		BLOCK_STORE_BACKPRESSURE_DETACH,   // Replication stops and the standby is left incomplete
+	} block_store_backpressure_t;
+
+	// Where block_store_replicate_start sends changes, zero initialize then set replica or fd
+	typedef struct
+	{
+		block_store_t *replica; // In-process standby, same size, bitmap allocator, not used by anyone else meanwhile
+		int fd;                 // Used when replica is NULL: file or pipe the log is written to, see block_store_apply_log
+		size_t buffer_bytes;    // Log buffer, 0 for 1 MiB
+		block_store_backpressure_t backpressure;
+	} block_store_replication_t;
+
+	// How much a persistent device may lose in a crash, see block_store_persist_start
+	typedef enum
+	{
+		BLOCK_STORE_DURABILITY_BUFFERED = 0, // Flushes hand blocks to the OS, only barriers wait for the disk
+		BLOCK_STORE_DURABILITY_BATCHED,      // Every flush ends in one fdatasync covering all of its changes
+		BLOCK_STORE_DURABILITY_IMMEDIATE,    // Nothing is buffered, each change is written and synced on its own
+	} block_store_durability_t;
+
+	// How block_store_persist_start buffers changes, zero initialize for the defaults
+	typedef struct
+	{
+		block_store_durability_t durability;
+		size_t buffer_blocks;       // Changed blocks held before a flush, 0 for 1024
+		uint32_t flush_interval_ms; // Also flush once the oldest held change is this old, 0 for no limit
+		                            //  (checked as changes come in, an idle device waits for a barrier)
+	} block_store_persistence_t;
+
+	// Image file traffic of a persistent device, from block_store_get_persist_stats
+	typedef struct
+	{
+		uint64_t changes;        // Block changes made: writes, bitmap updates, discards
+		uint64_t write_calls;    // pwrite and hole punching calls
+		uint64_t sync_calls;     // fdatasync calls
+		uint64_t blocks_written;
+		uint64_t flushes;
+	} block_store_persist_stats_t;
+
+	// Shape of the free space, from block_store_get_frag_report
+	typedef struct
+	{
+		size_t free_blocks;      // Total free blocks
+		size_t free_runs;        // Number of maximal runs of contiguous free blocks
+		size_t largest_free_run; // Length of the longest run, the biggest extent that can be allocated
+		size_t run_histogram[BLOCK_STORE_FRAG_BUCKETS]; // Bucket k counts runs of length 2^k up to 2^(k+1) - 1
+	} block_store_frag_report_t;
+
+	// One zone of the free space summary, from block_store_get_zone
+	typedef struct
+	{
+		size_t first_block;
+		size_t blocks;           // BLOCK_STORE_ZONE_BLOCKS, fewer in the last zone
+		size_t free_blocks;
+		size_t largest_free_run; // Longest run of free blocks inside the zone
+	} block_store_zone_t;
+
+	// What block_store_check_image found, the deserialize functions refuse anything but OK
+	typedef enum
+	{
+		BLOCK_STORE_IMAGE_OK = 0,
+		BLOCK_STORE_IMAGE_UNREADABLE,    // Missing, unreadable or too short to hold a superblock
+		BLOCK_STORE_IMAGE_LEGACY,        // Raw blocks from before images had a header, see block_store_convert_legacy
+		BLOCK_STORE_IMAGE_BAD_MAGIC,     // Not a block store image at all
+		BLOCK_STORE_IMAGE_BAD_VERSION,   // A format version this library doesn't read
+		BLOCK_STORE_IMAGE_BAD_CHECKSUM,  // The superblock is damaged
+		BLOCK_STORE_IMAGE_UNSUPPORTED,   // Needs features this library doesn't have, or another block size
+		BLOCK_STORE_IMAGE_BAD_GEOMETRY,  // The superblock contradicts itself or the file size
+		BLOCK_STORE_IMAGE_BAD_BITMAP,    // The bitmap doesn't mark its own blocks as used
+	} block_store_image_status_t;
+
+	// Operations tracked by block_store_get_stats
+	typedef enum
+	{
+		BLOCK_STORE_OP_READ = 0,
+		BLOCK_STORE_OP_WRITE,
+		BLOCK_STORE_OP_ALLOCATE,    // Also requests and extents
+		BLOCK_STORE_OP_RELEASE,
+		BLOCK_STORE_OP_SERIALIZE,
+		BLOCK_STORE_OP_DESERIALIZE, // Counted on the device that was loaded
+		BLOCK_STORE_OP_COUNT,
+	} block_store_op_t;
+
+	typedef struct
+	{
+		uint64_t count;
+		uint64_t total_ns;
+		uint64_t latency_ns[BLOCK_STORE_HIST_BUCKETS]; // Latency histogram, see block_store_stats_percentile
+	} block_store_op_stats_t;
+
+	// Snapshot from block_store_get_stats
+	typedef struct
+	{
+		block_store_op_stats_t ops[BLOCK_STORE_OP_COUNT];
+		uint64_t scans;         // Allocations that searched the bitmap (the buddy allocator doesn't)
+		uint64_t words_scanned; // 64 bit bitmap words those searches covered
+		uint64_t scan_words[BLOCK_STORE_HIST_BUCKETS]; // Histogram of words covered per search
+	} block_store_stats_t;
+
 	///
 	/// This creates a new BS device, ready to go
 	/// \return Pointer to a new block storage device, NULL on error
 	///
 	block_store_t *block_store_create();
 
+	///
+	/// This creates a new BS device with the given settings
+	/// \param options Creation settings, NULL for the defaults
+	/// \return Pointer to a new block storage device, NULL on error
+	///
+	block_store_t *block_store_create_with(const block_store_options_t *const options);
+
+	///
+	/// Creates a new BS device in a named POSIX shared memory segment, which other processes
+	///  can then block_store_attach to and use at memory speed, no copies or sockets involved
+	/// Allocation, request and release are atomic on the bitmap itself, so any number of
+	///  processes can allocate at once; extents, defrag, resize, discard and the buddy
+	///  allocator need the whole bitmap to themselves and are not available
+	/// Reads and writes of the same block from different processes need their own coordination
+	/// \param name Segment name, "/something"
+	/// \param options Creation settings, NULL for the defaults (memory, arena and discard don't apply)
+	/// \return Pointer to a new block storage device, NULL on error or if the segment exists
+	///
+	block_store_t *block_store_create_shared(const char *const name, const block_store_options_t *const options);
+
+	///
+	/// Opens a device made by block_store_create_shared in another (or this) process
+	/// block_store_destroy only detaches, the device lives on until block_store_unlink_shared
+	/// \param name Segment name
+	/// \return Pointer to the device, NULL on error
+	///
+	block_store_t *block_store_attach(const char *const name);
+
+	///
+	/// Removes a shared segment's name, processes already attached keep their device
+	/// \param name Segment name
+	/// \return true if the name was removed
+	///
+	bool block_store_unlink_shared(const char *const name);
+
 	///
 	/// Destroys the provided block storage device
 	/// This is an idempotent operation, so there is no return value
@@ -44,6 +229,22 @@ extern "C"
 	///
 	size_t block_store_allocate(block_store_t *const bs);
 
+	///
+	/// Allocates the free block closest to a goal block, so related data stays together
+	/// \param bs BS device
+	/// \param hint The goal block id, usually a neighbour of the data being added
+	/// \return Allocated block's id, SIZE_MAX on error
+	///
+	size_t block_store_allocate_near(block_store_t *const bs, const size_t hint);
+
+	///
+	/// Changes the policy block_store_allocate uses to pick free blocks
+	/// \param bs BS device
+	/// \param policy The new policy
+	/// \return true if the policy was applied
+	///
+	bool block_store_set_policy(block_store_t *const bs, const block_store_policy_t policy);
+
 	///
 	/// Attempts to allocate the requested block id
 	/// \param bs the block store object
@@ -59,6 +260,132 @@ extern "C"
 	///
 	void block_store_release(block_store_t *const bs, const size_t block_id);
 
+	///
+	/// Searches for a run of contiguous free blocks and marks all of them as in use
+	///  (the buddy allocator rounds count up to the next power of two)
+	/// \param bs BS device
+	/// \param count Number of blocks wanted
+	/// \return Id of the first block of the extent, SIZE_MAX on error
+	///
+	size_t block_store_allocate_extent(block_store_t *const bs, const size_t count);
+
+	///
+	/// Frees an extent handed out by block_store_allocate_extent
+	/// \param bs BS device
+	/// \param block_id The first block of the extent
+	/// \param count The count the extent was allocated with
+	///
+	void block_store_release_extent(block_store_t *const bs, const size_t block_id, const size_t count);
+
+	///
+	/// Zeroes the free blocks in a range and returns every page of the block array that holds
+	///  nothing but free blocks to the OS, so a store shrinks after bulk deletes
+	/// Blocks in use are left alone, discarded blocks read back as zeros once allocated again
+	/// Stores created with the discard option do this on every release
+	/// \param bs BS device
+	/// \param block_id First block of the range
+	/// \param count Number of blocks in the range
+	/// \return Number of free blocks zeroed, SIZE_MAX on error
+	///
+	size_t block_store_discard(block_store_t *const bs, const size_t block_id, const size_t count);
+
+	///
+	/// Runs one bounded slice of an incremental defragmentation pass, sliding blocks in use
+	///  down into the holes below them, extents stay contiguous and keep their order
+	/// Foreground reads and writes may run freely between slices; blocks allocated or
+	///  released behind the pass are picked up by the next one
+	/// Keep calling until it returns 0 to fully compact the device
+	/// \param bs BS device
+	/// \param max_moves Most blocks to move in this slice
+	/// \param relocate Called with the old and new id of each moved block, may be NULL
+	///  (arguments passed to relocate are saved across calls)
+	/// \param arg A generic pointer to pass to relocate
+	/// \return Number of blocks moved in this slice, 0 once the device is compact
+	///
+	size_t block_store_defrag(block_store_t *const bs, const size_t max_moves, void (*relocate)(size_t, size_t, void *), void *arg);
+
+	///
+	/// Grows or shrinks a device in place, the blocks below the new size keep their ids and data
+	/// Growing extends the block array (mapped memory is remapped rather than copied) and the bitmap;
+	///  a longer bitmap takes the blocks right after the current bitmap blocks, any of them in use
+	///  move to the lowest free blocks of the grown device, the same way defrag reports its moves
+	/// Shrinking only works when every block being dropped is free, defrag first to get there
+	/// Lazily deserialized stores finish loading first
+	/// \param bs BS device
+	/// \param num_blocks New size of the device
+	/// \param relocate Called with the old and new id of each moved block, may be NULL, but then
+	///  growing fails while the blocks the bitmap needs are in use
+	/// \param arg A generic pointer to pass to relocate
+	/// \return true on success, false if the device can't be resized (it is left as it was)
+	///
+	bool block_store_resize(block_store_t *const bs, const size_t num_blocks, void (*relocate)(size_t, size_t, void *), void *arg);
+
+	///
+	/// Starts streaming every change to a standby: block writes, bitmap changes, discards and resizes
+	/// The standby first gets a snapshot of the blocks holding data, never a whole image, then the
+	///  changes in order; a thread ships them in batches so the primary only copies into a buffer
+	/// \param bs BS device (not shared)
+	/// \param config Where the changes go and what happens when they back up
+	/// \return true if replication started, false on error
+	///
+	bool block_store_replicate_start(block_store_t *const bs, const block_store_replication_t *const config);
+
+	///
+	/// Waits until every change made so far has reached the standby
+	/// \param bs BS device
+	/// \return true if the standby is an exact copy, false if it was detached, failed or never started
+	///
+	bool block_store_replicate_flush(block_store_t *const bs);
+
+	///
+	/// Ships the remaining changes and stops replicating, block_store_destroy does this too
+	/// \param bs BS device
+	/// \return true if the standby received every change, false if it is incomplete
+	///
+	bool block_store_replicate_stop(block_store_t *const bs);
+
+	///
+	/// Applies a change log written by block_store_replicate_start to a standby, reading until end of file
+	/// \param replica The standby, same size as the primary when the log started, bitmap allocator
+	/// \param fd File or pipe holding the log
+	/// \return Number of changes applied, SIZE_MAX on error (a change didn't fit or the log was cut short)
+	///
+	size_t block_store_apply_log(block_store_t *const replica, const int fd);
+
+	///
+	/// Keeps an image file in step with the device from now on, so it survives without serializing
+	/// The file is written as by block_store_serialize, then every change marks its blocks dirty;
+	///  runs of dirty blocks go out in one write each when the buffer fills, when the flush interval
+	///  passes and at barriers, and a block written many times in between is written once
+	/// \param bs BS device (not shared)
+	/// \param filename The image, replaced; block_store_deserialize reads it back
+	/// \param config Durability and buffering, NULL for the defaults
+	/// \return true on success, false on error or if the device is already persistent
+	///
+	bool block_store_persist_start(block_store_t *const bs, const char *const filename, const block_store_persistence_t *const config);
+
+	///
+	/// Writes every held change out and waits for the disk, whatever the durability level
+	/// \param bs BS device
+	/// \return true if the image is an exact, durable copy; false if a write ever failed or the device isn't persistent
+	///
+	bool block_store_persist_barrier(block_store_t *const bs);
+
+	///
+	/// Ends with a barrier and closes the image, block_store_destroy does this too
+	/// \param bs BS device
+	/// \return true if the image is an exact, durable copy
+	///
+	bool block_store_persist_stop(block_store_t *const bs);
+
+	///
+	/// Counts the image file traffic since block_store_persist_start
+	/// \param bs BS device
+	/// \param stats Where the counters go
+	/// \return true on success, false on error or if the device isn't persistent
+	///
+	bool block_store_get_persist_stats(const block_store_t *const bs, block_store_persist_stats_t *const stats);
+
 	///
 	/// Counts the number of blocks marked as in use
 	/// \param bs BS device
@@ -80,6 +407,66 @@ extern "C"
 	///
 	size_t block_store_get_total_blocks();
 
+	///
+	/// Returns the number of blocks in a particular device, which differs from
+	///  block_store_get_total_blocks when it was created or loaded with another size
+	/// \param bs BS device
+	/// \return Total blocks, SIZE_MAX on error
+	///
+	size_t block_store_get_num_blocks(const block_store_t *const bs);
+
+	///
+	/// Describes how the free space is fragmented
+	/// \param bs BS device
+	/// \param report Filled with the free run histogram and largest free extent
+	/// \return true on success, false on error
+	///
+	bool block_store_get_frag_report(const block_store_t *const bs, block_store_frag_report_t *const report);
+
+	///
+	/// Describes one zone of BLOCK_STORE_ZONE_BLOCKS blocks
+	/// Every device keeps per zone free counts (and longest free runs, refreshed as needed) next to
+	///  its bitmap, allocations use them to go straight to a zone with room instead of scanning
+	/// \param bs BS device (not shared, other processes change those bitmaps behind our back)
+	/// \param zone Zone number, the device has num_blocks / BLOCK_STORE_ZONE_BLOCKS of them, rounded up
+	/// \param info Where the description goes
+	/// \return true on success, false on error or past the last zone
+	///
+	bool block_store_get_zone(const block_store_t *const bs, const size_t zone, block_store_zone_t *const info);
+
+	///
+	/// Collects operation counts, latency histograms and allocation scan lengths
+	/// Only available when built with BLOCK_STORE_STATS, otherwise nothing is recorded
+	/// \param bs BS device
+	/// \param stats Filled with the totals across all threads
+	/// \return true on success, false on error or when stats are compiled out
+	///
+	bool block_store_get_stats(const block_store_t *const bs, block_store_stats_t *const stats);
+
+	///
+	/// Estimates a percentile from one of the histograms in block_store_stats_t
+	/// \param histogram BLOCK_STORE_HIST_BUCKETS counters
+	/// \param percentile Between 0 and 100
+	/// \return Upper bound of the bucket holding the percentile, 0 if the histogram is empty
+	///
+	uint64_t block_store_stats_percentile(const uint64_t *const histogram, const double percentile);
+
+	///
+	/// Starts logging every block_store call, from every thread and device, to a binary trace file
+	/// Calls go into lock-free per-thread ring buffers that a background thread writes out,
+	///  so tracing never blocks the caller (a record is dropped if its ring is full)
+	/// The format is in trace.h, hw3_replay plays a trace back against a fresh device
+	/// \param filename The file to write, overwritten if it exists
+	/// \return true if the trace started, false on error or if a trace is already running
+	///
+	bool block_store_trace_start(const char *const filename);
+
+	///
+	/// Stops the running trace and writes out everything still buffered
+	/// \return Number of records in the file, SIZE_MAX if no trace was running or the file could not be written
+	///
+	size_t block_store_trace_stop(void);
+
 	///
 	/// Reads data from the specified block and writes it to the designated buffer
 	/// \param bs BS device
@@ -100,19 +487,107 @@ extern "C"
 
 	///
 	/// Imports BS device from the given file - for grads/bonus
+	/// The image is checked like block_store_check_image does before anything is read
 	/// \param filename The file to load
 	/// \return Pointer to new BS device, NULL on error
 	///
 	block_store_t *block_store_deserialize(const char *const filename);
 
+	///
+	/// Checks that a file is an image the deserialize functions will take, without reading its blocks
+	/// Only the superblock, the file size and the bitmap's bits for its own blocks are looked at
+	/// A single file of a striped image passes if its superblock and size are right
+	/// \param filename The file to check
+	/// \return BLOCK_STORE_IMAGE_OK, or what is wrong with it
+	///
+	block_store_image_status_t block_store_check_image(const char *const filename);
+
+	///
+	/// Rewrites an image from before images had a header (nothing but the raw blocks) in the current format
+	/// \param legacy The old image, its size gives the device size
+	/// \param filename Where the new image goes, may be legacy itself
+	/// \return Number of bytes written, 0 on error or if legacy isn't a raw image
+	///
+	size_t block_store_convert_legacy(const char *const legacy, const char *const filename);
+
+	///
+	/// Imports BS device from the given file without reading it all up front
+	/// Only the free block bitmap is read eagerly, every other block is read from the
+	///  file on its first block_store_read (a block_store_write replaces it without reading)
+	/// The file must stay in place until the device is fully resident or destroyed
+	/// \param filename The file to load
+	/// \param background Also start a thread that faults in the remaining blocks
+	/// \return Pointer to new BS device, NULL on error
+	///
+	block_store_t *block_store_deserialize_lazy(const char *const filename, const bool background);
+
+	///
+	/// Counts the blocks that have been brought into memory
+	/// \param bs BS device
+	/// \return Resident blocks (all of them for non-lazy devices), SIZE_MAX on error
+	///
+	size_t block_store_get_resident_blocks(const block_store_t *const bs);
+
+	///
+	/// Faults in every block of a lazily loaded device that is not resident yet
+	/// \param bs BS device
+	/// \return true once the whole device is in memory, false on error
+	///
+	bool block_store_load_all(block_store_t *const bs);
+
+	///
+	/// Sets how far ahead block_store_read prefetches once it sees a sequential scan
+	/// Up to four interleaved scans are followed; a scan's window opens at BLOCK_STORE_READAHEAD_MIN_BLOCKS
+	///  and doubles, up to max_blocks, each time the reader comes within half a window of its end
+	/// Lazily loaded devices start with BLOCK_STORE_READAHEAD_DEFAULT_BLOCKS and read the window from the
+	///  image in the background, other devices start with read-ahead off and only get cache hints
+	/// \param bs BS device
+	/// \param max_blocks Largest window in blocks, 0 turns read-ahead off
+	/// \return true on success, false on error
+	///
+	bool block_store_set_readahead(block_store_t *const bs, const size_t max_blocks);
+
+	///
+	/// Hints that a run of blocks is about to be read, without waiting for them
+	/// Lazily loaded devices start reading the blocks from the image (posix_fadvise and a prefetch
+	///  thread), resident devices pull them towards the cache
+	/// \param bs BS device
+	/// \param block_id First block
+	/// \param count Number of blocks, cut short at the end of the device
+	/// \return true if the hint was taken, false on error
+	///
+	bool block_store_prefetch(const block_store_t *const bs, const size_t block_id, const size_t count);
+
 	///
 	/// Writes the entirety of the BS device to file, overwriting it if it exists - for grads/bonus
+	/// The image is a BLOCK_STORE_IMAGE_HEADER_BYTES header holding the geometry, then the raw blocks
 	/// \param bs BS device
 	/// \param filename The file to write to
 	/// \return Number of bytes written, 0 on error
 	///
 	size_t block_store_serialize(const block_store_t *const bs, const char *const filename);
 
+	///
+	/// Writes the device striped over several files, each one written by its own thread
+	/// Stripe s (blocks s * stripe_blocks on) goes to file s % files, so files on separate
+	///  disks write at their combined bandwidth; each file has its own header naming its place in the set
+	/// \param bs BS device
+	/// \param filenames The files to write to, overwritten if they exist
+	/// \param files Number of files
+	/// \param stripe_blocks Blocks per stripe
+	/// \return Number of bytes written over all files, 0 on error
+	///
+	size_t block_store_serialize_striped(const block_store_t *const bs, const char *const *const filenames, const size_t files, const size_t stripe_blocks);
+
+	///
+	/// Imports a BS device written by block_store_serialize_striped, reading the files in parallel
+	/// \param filenames The files to load, in the order they were written
+	/// \param files Number of files
+	/// \param stripe_blocks Blocks per stripe, as written
+	/// \return Pointer to new BS device, NULL on error (or if the files are out of order, of another device or another stripe width)
+	///
+	block_store_t *block_store_deserialize_striped(const char *const *const filenames, const size_t files, const size_t stripe_blocks);
+
 #ifdef __cplusplus
 }
 #endif
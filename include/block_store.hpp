@@ -0,0 +1,299 @@
+#ifndef BLOCK_STORE_HPP__
+#define BLOCK_STORE_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include "block_store.h"
+#include "image.h"
+
+// Header only C++ version of the block store with its geometry fixed at compile time
+// Everything here inlines, so allocation and block access cost no calls at all
+// The block array is laid out exactly like the C device: the free block bitmap sits at
+// BITMAP_START_BLOCK, one bit per block, and an image is the same header page (image.h)
+// followed by the raw blocks, so with the default block size block_store_serialize and
+// BlockStore::serialize write the same file (the C side can only read back images using
+// BLOCK_SIZE_BYTES blocks, the superblock says which size an image has)
+// Like bitmap, the unchecked accessors assume you're using them right
+
+// Non owning view of one block's bytes, a minimal std::span for C++11
+template <typename T, std::size_t Size>
+class BlockView
+{
+	public:
+		explicit BlockView(T *data) noexcept : data_(data) {}
+		// A writable view converts to a read only one
+		template <typename U>
+		BlockView(const BlockView<U, Size> &other) noexcept : data_(other.data()) {}
+
+		T *data() const noexcept { return data_; }
+		static constexpr std::size_t size() noexcept { return Size; }
+		T *begin() const noexcept { return data_; }
+		T *end() const noexcept { return data_ + Size; }
+		T &operator[](const std::size_t index) const noexcept { return data_[index]; }
+
+	private:
+		T *data_;
+};
+
+template <std::size_t BlockSize = BLOCK_SIZE_BYTES, std::size_t NumBlocks = BLOCK_STORE_NUM_BLOCKS>
+class BlockStore
+{
+	public:
+		static constexpr std::size_t block_size = BlockSize;
+		static constexpr std::size_t num_blocks = NumBlocks;
+		static constexpr std::size_t bitmap_start = BITMAP_START_BLOCK;
+		static constexpr std::size_t bitmap_blocks = (NumBlocks + BlockSize * 8 - 1) / (BlockSize * 8);
+		static constexpr std::size_t array_bytes = BlockSize * NumBlocks;
+		static constexpr std::size_t image_bytes = BLOCK_STORE_IMAGE_HEADER_BYTES + array_bytes;  // Size of an image file
+		static constexpr std::size_t npos = SIZE_MAX;  // Failed allocation, like the C API
+
+		static_assert(BlockSize > 0 && BlockSize <= UINT32_MAX, "blocks must hold something, and the superblock has 32 bits for their size");
+		static_assert(bitmap_start + bitmap_blocks <= NumBlocks, "too small to hold its own bitmap at BITMAP_START_BLOCK");
+
+		typedef BlockView<std::uint8_t, BlockSize> view_type;
+		typedef BlockView<const std::uint8_t, BlockSize> const_view_type;
+
+		/// Creates an empty device, only the bitmap blocks are in use
+		BlockStore() : blocks_(new std::uint8_t[array_bytes]()), used_(0), hint_(0)
+		{
+			for (std::size_t id = bitmap_start; id < bitmap_start + bitmap_blocks; ++id)
+			{
+				mark_used(id);
+			}
+		}
+
+		// The blocks are heap allocated, so moves are a pointer swap
+		// A moved from store is empty: valid() is false and only assignment and destruction are allowed
+		BlockStore(BlockStore &&other) noexcept : blocks_(std::move(other.blocks_)), used_(other.used_), hint_(other.hint_)
+		{
+			other.used_ = 0;
+		}
+		BlockStore &operator=(BlockStore &&other) noexcept
+		{
+			if (this != &other)  // Moving into itself would leave the blocks but zero the count
+			{
+				blocks_ = std::move(other.blocks_);
+				used_ = other.used_;
+				hint_ = other.hint_;
+				other.used_ = 0;
+			}
+			return *this;
+		}
+		BlockStore(const BlockStore &) = delete;
+		BlockStore &operator=(const BlockStore &) = delete;
+
+		bool valid() const noexcept { return blocks_ != nullptr; }
+
+		///
+		/// Allocates the lowest free block
+		/// \return The block id, npos if the device is full
+		///
+		std::size_t allocate() noexcept
+		{
+			for (; hint_ * 64 < NumBlocks; ++hint_)  // Every word below the hint is full
+			{
+				const std::uint64_t free_bits = ~load_word(hint_);
+				if (free_bits)
+				{
+					const std::size_t id = hint_ * 64 + static_cast<std::size_t>(__builtin_ctzll(free_bits));
+					mark_used(id);
+					return id;
+				}
+			}
+			return npos;
+		}
+
+		///
+		/// Allocates a specific block
+		/// \param id The block wanted
+		/// \return true if it was free and is now in use
+		///
+		bool request(const std::size_t id) noexcept
+		{
+			if (id >= NumBlocks || test(id))
+			{
+				return false;
+			}
+			mark_used(id);
+			return true;
+		}
+
+		///
+		/// Frees a block, releasing a free block, one of the bitmap's own or an out of range id does nothing
+		/// \param id The block to free
+		///
+		void release(const std::size_t id) noexcept
+		{
+			if (id < NumBlocks && (id < bitmap_start || id >= bitmap_start + bitmap_blocks) && test(id))
+			{
+				bitmap()[id >> 3] &= static_cast<std::uint8_t>(~(1u << (id & 7)));
+				--used_;
+				hint_ = id / 64 < hint_ ? id / 64 : hint_;
+			}
+		}
+
+		/// Whether a block is in use, id must be in range
+		bool test(const std::size_t id) const noexcept
+		{
+			return (bitmap()[id >> 3] >> (id & 7)) & 1u;
+		}
+
+		std::size_t used_blocks() const noexcept { return used_; }
+		std::size_t free_blocks() const noexcept { return NumBlocks - used_; }
+
+		/// Unchecked views of a block's bytes, id must be in range
+		view_type block(const std::size_t id) noexcept { return view_type(blocks_.get() + id * BlockSize); }
+		const_view_type block(const std::size_t id) const noexcept { return const_view_type(blocks_.get() + id * BlockSize); }
+
+		///
+		/// Copies a block out
+		/// \param id Source block id
+		/// \param buffer BlockSize bytes to write to
+		/// \return Number of bytes read, 0 on error
+		///
+		std::size_t read(const std::size_t id, void *const buffer) const noexcept
+		{
+			if (id >= NumBlocks || buffer == nullptr)
+			{
+				return 0;
+			}
+			std::memcpy(buffer, blocks_.get() + id * BlockSize, BlockSize);
+			return BlockSize;
+		}
+
+		///
+		/// Copies a block in
+		/// \param id Destination block id
+		/// \param buffer BlockSize bytes to read from
+		/// \return Number of bytes written, 0 on error
+		///
+		std::size_t write(const std::size_t id, const void *const buffer) noexcept
+		{
+			if (id >= NumBlocks || buffer == nullptr)
+			{
+				return 0;
+			}
+			std::memcpy(blocks_.get() + id * BlockSize, buffer, BlockSize);
+			return BlockSize;
+		}
+
+		///
+		/// Writes the device to an image file, overwriting it if it exists
+		/// \param filename The file to write to
+		/// \return Number of bytes written, 0 on error
+		///
+		std::size_t serialize(const char *const filename) const
+		{
+			if (filename == nullptr)
+			{
+				return 0;
+			}
+			std::FILE *file = std::fopen(filename, "wb");
+			if (file == nullptr)
+			{
+				return 0;
+			}
+			std::uint8_t header[BLOCK_STORE_IMAGE_HEADER_BYTES] = {};
+			image_superblock_t sb;
+			image_superblock_init(&sb, NumBlocks, static_cast<std::uint32_t>(BlockSize));
+			std::memcpy(header, &sb, sizeof(sb));
+			const bool written = std::fwrite(header, 1, sizeof(header), file) == sizeof(header)
+				&& std::fwrite(blocks_.get(), 1, array_bytes, file) == array_bytes;
+			return (std::fclose(file) == 0 && written) ? image_bytes : 0;
+		}
+
+		///
+		/// Replaces the device with an image file, which must be exactly this geometry
+		/// \param filename The file to load
+		/// \return true on success, false on error (the device is left untouched)
+		///
+		bool deserialize(const char *const filename)
+		{
+			if (filename == nullptr)
+			{
+				return false;
+			}
+			std::FILE *file = std::fopen(filename, "rb");
+			if (file == nullptr)
+			{
+				return false;
+			}
+			std::uint8_t header[BLOCK_STORE_IMAGE_HEADER_BYTES];
+			image_superblock_t sb;
+			std::unique_ptr<std::uint8_t[]> loaded(new std::uint8_t[array_bytes]);
+			bool complete = std::fread(header, 1, sizeof(header), file) == sizeof(header);
+			std::memcpy(&sb, header, sizeof(sb));
+			complete = complete && image_superblock_check(&sb, static_cast<std::uint32_t>(BlockSize)) == BLOCK_STORE_IMAGE_OK
+				&& sb.incompat_features == 0 && sb.num_blocks == NumBlocks
+				&& std::fread(loaded.get(), 1, array_bytes, file) == array_bytes && std::fgetc(file) == EOF;
+			std::fclose(file);
+			for (std::size_t id = bitmap_start; complete && id < bitmap_start + bitmap_blocks; ++id)
+			{
+				complete = (loaded[bitmap_start * BlockSize + (id >> 3)] >> (id & 7)) & 1u;  // Refused by the C side too
+			}
+			if (!complete)
+			{
+				return false;  // Not an image of this device
+			}
+			blocks_ = std::move(loaded);
+			used_ = 0;
+			hint_ = 0;
+			for (std::size_t word = 0; word * 64 < NumBlocks; ++word)
+			{
+				used_ += static_cast<std::size_t>(__builtin_popcountll(load_word(word) & valid_mask(word)));
+			}
+			return true;
+		}
+
+	private:
+		std::uint8_t *bitmap() noexcept { return blocks_.get() + bitmap_start * BlockSize; }
+		const std::uint8_t *bitmap() const noexcept { return blocks_.get() + bitmap_start * BlockSize; }
+
+		void mark_used(const std::size_t id) noexcept
+		{
+			bitmap()[id >> 3] |= static_cast<std::uint8_t>(1u << (id & 7));
+			++used_;
+		}
+
+		// Bits of a word that are real blocks
+		static std::uint64_t valid_mask(const std::size_t word) noexcept
+		{
+			const std::size_t valid = NumBlocks - word * 64;
+			return valid >= 64 ? ~std::uint64_t(0) : (std::uint64_t(1) << valid) - 1;
+		}
+
+		// 64 bitmap bits starting at block word * 64, bits past the end of the device read as used
+		std::uint64_t load_word(const std::size_t word) const noexcept
+		{
+			const std::size_t first = word * 8;
+			const std::size_t bytes = (NumBlocks + 7) / 8 - first < 8 ? (NumBlocks + 7) / 8 - first : 8;
+			std::uint64_t bits = 0;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+			std::memcpy(&bits, bitmap() + first, bytes);  // Byte i of the map is already byte i of the word
+#else
+			for (std::size_t i = 0; i < bytes; ++i)
+			{
+				bits |= std::uint64_t(bitmap()[first + i]) << (8 * i);
+			}
+#endif
+			return bits | ~valid_mask(word);
+		}
+
+		std::unique_ptr<std::uint8_t[]> blocks_;
+		std::size_t used_;
+		std::size_t hint_;  // Lowest bitmap word that may have a free block
+};
+
+// Storage for the constants, C++11 needs these when they are bound to references
+template <std::size_t B, std::size_t N> constexpr std::size_t BlockStore<B, N>::block_size;
+template <std::size_t B, std::size_t N> constexpr std::size_t BlockStore<B, N>::num_blocks;
+template <std::size_t B, std::size_t N> constexpr std::size_t BlockStore<B, N>::bitmap_start;
+template <std::size_t B, std::size_t N> constexpr std::size_t BlockStore<B, N>::bitmap_blocks;
+template <std::size_t B, std::size_t N> constexpr std::size_t BlockStore<B, N>::array_bytes;
+template <std::size_t B, std::size_t N> constexpr std::size_t BlockStore<B, N>::image_bytes;
+template <std::size_t B, std::size_t N> constexpr std::size_t BlockStore<B, N>::npos;
+
+#endif
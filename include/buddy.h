@@ -0,0 +1,69 @@
+#ifndef BUDDY_H__
+#define BUDDY_H__
+
+#ifdef __cplusplus
+	extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef struct buddy buddy_t;
+
+// Binary buddy allocator over a range of unit ids, with one free list per order
+// An order k block covers 2^k units and always starts on a multiple of 2^k
+// Like bitmap, this assumes you're using it right: freeing units that aren't allocated
+// or passing out of range ids WILL corrupt the free lists
+
+///
+/// Creates a buddy allocator for n units with every unit allocated
+///  (free the units you want handed out with buddy_free)
+/// \param n_units The number of units managed
+/// \return New allocator pointer, NULL on error
+///
+buddy_t *buddy_create(const size_t n_units);
+
+///
+/// Destructs and destroys the allocator
+/// \param buddy The allocator
+///
+void buddy_destroy(buddy_t *buddy);
+
+///
+/// Allocates an aligned block of 2^order units, splitting larger blocks as needed
+/// \param buddy The allocator
+/// \param order Log2 of the number of units wanted
+/// \return The first unit of the block, SIZE_MAX if no block is big enough
+///
+size_t buddy_alloc(buddy_t *const buddy, const unsigned order);
+
+///
+/// Allocates one specific unit, splitting whichever free block contains it
+/// \param buddy The allocator
+/// \param unit The unit wanted
+/// \return true if the unit was free and is now allocated
+///
+bool buddy_claim(buddy_t *const buddy, const size_t unit);
+
+///
+/// Frees an aligned block of 2^order units and coalesces it with its free buddies
+/// \param buddy The allocator
+/// \param unit The first unit of the block
+/// \param order Log2 of the number of units in the block
+///
+void buddy_free(buddy_t *const buddy, const size_t unit, const unsigned order);
+
+///
+/// Gets the largest order a block can have in this allocator
+/// \param buddy The allocator
+/// \return Log2 of the largest block size
+///
+unsigned buddy_max_order(const buddy_t *const buddy);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
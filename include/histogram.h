@@ -0,0 +1,54 @@
+#ifndef HISTOGRAM_H__
+#define HISTOGRAM_H__
+
+#ifdef __cplusplus
+	extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+
+// Log-linear (HDR style) bucketing for latencies and other wide ranging values
+// Every power of two is split into HISTOGRAM_SUB_BUCKETS equal buckets, so any value
+// is reported to within 25% no matter its magnitude, and the whole uint64_t range fits
+// in a fixed number of counters. Values below 2 * HISTOGRAM_SUB_BUCKETS get exact buckets.
+
+#define HISTOGRAM_SUB_BITS 2
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS (2 * HISTOGRAM_SUB_BUCKETS + (64 - HISTOGRAM_SUB_BITS - 1) * HISTOGRAM_SUB_BUCKETS)
+
+///
+/// Finds the bucket a value is counted in
+/// \param value The value
+/// \return Bucket index, less than HISTOGRAM_BUCKETS
+///
+size_t histogram_bucket(const uint64_t value);
+
+///
+/// Gets the smallest value counted in a bucket
+/// \param bucket Bucket index
+/// \return Lowest value of the bucket
+///
+uint64_t histogram_bucket_floor(const size_t bucket);
+
+///
+/// Gets the largest value counted in a bucket
+/// \param bucket Bucket index
+/// \return Highest value of the bucket
+///
+uint64_t histogram_bucket_ceiling(const size_t bucket);
+
+///
+/// Estimates a percentile from bucket counts
+/// \param counts HISTOGRAM_BUCKETS counters
+/// \param percentile Between 0 and 100
+/// \return Upper bound of the bucket holding the percentile, 0 if nothing was counted
+///
+uint64_t histogram_percentile(const uint64_t *const counts, const double percentile);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,146 @@
+#ifndef IMAGE_H__
+#define IMAGE_H__
+
+#ifdef __cplusplus
+	extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include "block_store.h"
+
+// On disk layout of a block store image, written by block_store_serialize, kept up by
+// block_store_persist_start and read by every deserialize
+// A file is one BLOCK_STORE_IMAGE_HEADER_BYTES header page, then the blocks exactly as they sit in
+// memory (free block bitmap included), so the block array starts page aligned and can be mapped
+// straight from the file. The header page starts with an image_superblock_t, in host byte order
+// like traces (an image from a host of the other byte order fails the version check); the rest of
+// the page is reserved and ignored by readers
+// Functions here are inline so the header only BlockStore template writes the same images
+
+#define IMAGE_MAGIC "BSIMAGE1"
+#define IMAGE_VERSION 1
+
+// Feature flags: readers skip compat features they don't know, and refuse images with unknown incompat ones
+#define IMAGE_INCOMPAT_STRIPED 0x1u  // One file of a block_store_serialize_striped image, holding only its stripes
+#define IMAGE_INCOMPAT_KNOWN (IMAGE_INCOMPAT_STRIPED)
+
+typedef struct
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t header_bytes;       // Offset of the first block in the file
+	uint32_t block_size;
+	uint32_t checksum;           // CRC32C of the superblock with this field zeroed
+	uint64_t num_blocks;         // The whole device, however many files it is spread over
+	uint64_t bitmap_start;       // First block of the free block bitmap
+	uint64_t bitmap_blocks;
+	uint32_t compat_features;
+	uint32_t incompat_features;
+	uint64_t stripe_blocks;      // Striped only: blocks per stripe
+	uint32_t stripe_file;        // Striped only: which file this is, stripe s lives in file s % stripe_files
+	uint32_t stripe_files;
+	uint64_t file_blocks;        // Blocks in this file, num_blocks unless striped
+} image_superblock_t;
+
+// Castagnoli CRC, bit at a time; a superblock is too short for a table to pay off
+static inline uint32_t image_crc32c(const uint8_t *const data, const size_t length)
+{
+	uint32_t crc = ~UINT32_C(0);
+	for(size_t i = 0; i < length; i++)
+	{
+		crc ^= data[i];
+		for(int bit = 0; bit < 8; bit++)
+		{
+			crc = (crc >> 1) ^ (UINT32_C(0x82F63B78) & (0u - (crc & 1u)));
+		}
+	}
+	return ~crc;
+}
+
+static inline uint32_t image_checksum(const image_superblock_t *const sb)
+{
+	image_superblock_t copy = *sb;
+	copy.checksum = 0;
+	return image_crc32c((const uint8_t *)&copy, sizeof(copy));
+}
+
+// Blocks the bitmap of a device takes up
+static inline uint64_t image_bitmap_blocks(const uint64_t num_blocks, const uint32_t block_size)
+{
+	return (num_blocks + block_size * UINT64_C(8) - 1) / (block_size * UINT64_C(8));
+}
+
+///
+/// Recomputes the checksum, after the fields were filled in or changed
+/// \param sb The superblock
+///
+static inline void image_superblock_seal(image_superblock_t *const sb)
+{
+	sb->checksum = image_checksum(sb);
+}
+
+///
+/// Fills in the superblock of a whole, unstriped image
+/// \param sb The superblock
+/// \param num_blocks Device size
+/// \param block_size Bytes per block
+///
+static inline void image_superblock_init(image_superblock_t *const sb, const uint64_t num_blocks, const uint32_t block_size)
+{
+	memset(sb, 0, sizeof(*sb));
+	memcpy(sb->magic, IMAGE_MAGIC, sizeof(sb->magic));
+	sb->version = IMAGE_VERSION;
+	sb->header_bytes = BLOCK_STORE_IMAGE_HEADER_BYTES;
+	sb->block_size = block_size;
+	sb->num_blocks = num_blocks;
+	sb->bitmap_start = BITMAP_START_BLOCK;
+	sb->bitmap_blocks = image_bitmap_blocks(num_blocks, block_size);
+	sb->file_blocks = num_blocks;
+	image_superblock_seal(sb);
+}
+
+///
+/// Checks a superblock on its own, without looking at the rest of the file
+/// \param sb The superblock as read
+/// \param block_size Bytes per block the reader works with
+/// \return BLOCK_STORE_IMAGE_OK, or what is wrong with it
+///
+static inline block_store_image_status_t image_superblock_check(const image_superblock_t *const sb, const uint32_t block_size)
+{
+	if(memcmp(sb->magic, IMAGE_MAGIC, sizeof(sb->magic)) != 0)
+	{
+		return BLOCK_STORE_IMAGE_BAD_MAGIC;
+	}
+	if(sb->version != IMAGE_VERSION)
+	{
+		return BLOCK_STORE_IMAGE_BAD_VERSION;
+	}
+	if(sb->checksum != image_checksum(sb))
+	{
+		return BLOCK_STORE_IMAGE_BAD_CHECKSUM;
+	}
+	if((sb->incompat_features & ~IMAGE_INCOMPAT_KNOWN) != 0 || sb->block_size != block_size)
+	{
+		return BLOCK_STORE_IMAGE_UNSUPPORTED;
+	}
+	const bool striped = (sb->incompat_features & IMAGE_INCOMPAT_STRIPED) != 0;
+	if(sb->header_bytes != BLOCK_STORE_IMAGE_HEADER_BYTES || sb->bitmap_start != BITMAP_START_BLOCK
+		|| sb->bitmap_blocks != image_bitmap_blocks(sb->num_blocks, block_size) || sb->num_blocks < sb->bitmap_start + sb->bitmap_blocks
+		|| sb->num_blocks > (UINT64_MAX - sb->header_bytes) / block_size
+		|| (striped ? (sb->stripe_blocks == 0 || sb->stripe_files == 0 || sb->stripe_file >= sb->stripe_files || sb->file_blocks > sb->num_blocks)
+			: (sb->file_blocks != sb->num_blocks || sb->stripe_blocks != 0 || sb->stripe_files != 0 || sb->stripe_file != 0)))
+	{
+		return BLOCK_STORE_IMAGE_BAD_GEOMETRY;
+	}
+	return BLOCK_STORE_IMAGE_OK;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef PERSIST_H__
+#define PERSIST_H__
+
+#ifdef __cplusplus
+	extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "block_store.h"
+
+// Keeps an image file (see image.h) in step with a device for block_store_persist_start
+// Changes only mark their blocks dirty; a flush then writes every run of dirty blocks (short clean
+// gaps included) with one pwrite, so rewriting a block costs nothing extra and neighbours share a
+// call. Flushes happen when the buffer fills, when the oldest change has waited long enough and at
+// barriers, and end in one fdatasync for every change in them when the durability level asks for it
+// Write errors stick: the image is out of step from then on and every later flush reports it
+// With a flush interval a flusher thread also wakes up when the oldest change is due, so a device
+// that went quiet doesn't hold on to changes; it writes straight from the device's blocks, so the
+// device changes blocks and reports them only while holding persist_lock, and every call below
+// but create and destroy is made with the lock held
+
+typedef struct persist persist_t;
+
+///
+/// Takes over an image file that already holds the device as it is now
+/// \param fd The image, opened for writing, closed by persist_destroy
+/// \param blocks The device's block array
+/// \param num_blocks Device size
+/// \param config Durability and flush settings, NULL for the defaults
+/// \return The state, NULL on error (fd is left open)
+///
+persist_t *persist_create(const int fd, const uint8_t *const blocks, const size_t num_blocks, const block_store_persistence_t *const config);
+
+///
+/// Keeps the flusher thread away while blocks change, held from before the change until it is reported
+/// \param persist The state
+///
+void persist_lock(persist_t *const persist);
+
+///
+/// Lets the flusher thread back in
+/// \param persist The state
+///
+void persist_unlock(persist_t *const persist);
+
+///
+/// Records a change to a run of blocks, flushing if that fills the buffer or the oldest change is due
+/// \param persist The state
+/// \param blocks The device's block array
+/// \param first First changed block
+/// \param count Number of blocks
+///
+void persist_mark(persist_t *const persist, const uint8_t *const blocks, const size_t first, const size_t count);
+
+///
+/// Records that a run of blocks was zeroed, punching a hole in the image instead of writing zeros when the file system can
+/// \param persist The state
+/// \param blocks The device's block array
+/// \param first First zeroed block
+/// \param count Number of blocks
+///
+void persist_zero(persist_t *const persist, const uint8_t *const blocks, const size_t first, const size_t count);
+
+///
+/// Writes every buffered change out
+/// \param persist The state
+/// \param blocks The device's block array
+/// \param sync fdatasync afterwards whatever the durability level
+/// \return true if the image matches the device (and is on disk, when synced)
+///
+bool persist_flush(persist_t *const persist, const uint8_t *const blocks, const bool sync);
+
+///
+/// Follows a resize of the device: the image gets the new superblock, is truncated or extended, and changes past the end are dropped
+/// \param persist The state
+/// \param blocks The device's block array, which may have moved
+/// \param num_blocks New device size
+///
+void persist_resize(persist_t *const persist, const uint8_t *const blocks, const size_t num_blocks);
+
+///
+/// Copies the counters out
+/// \param persist The state
+/// \param stats Where they go
+///
+void persist_get_stats(const persist_t *const persist, block_store_persist_stats_t *const stats);
+
+///
+/// Flushes, syncs and closes the image
+/// \param persist The state, may be NULL
+/// \param blocks The device's block array
+/// \return true if the image ended up matching the device
+///
+bool persist_destroy(persist_t *const persist, const uint8_t *const blocks);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
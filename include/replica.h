@@ -0,0 +1,88 @@
+#ifndef REPLICA_H__
+#define REPLICA_H__
+
+#ifdef __cplusplus
+	extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "block_store.h"
+
+// Change log shipped from a primary to its standby by block_store_replicate_start
+// A log is a stream of replica_record_t, in host byte order; writes carry the new block
+// right after their record. Applying a log in order to a device that started out the same
+// leaves the two identical, and every record can be applied more than once
+// The log starts with RESET and a snapshot: one WRITE for every block holding anything
+// (the bitmap blocks included) and a SYNC once the standby has caught up
+
+typedef enum
+{
+	REPLICA_OP_RESET = 0,  // block = device size, the standby is zeroed and must be that size
+	REPLICA_OP_WRITE,      // block = id, BLOCK_SIZE_BYTES follow
+	REPLICA_OP_SET,        // block = first id, count = blocks marked in use
+	REPLICA_OP_CLEAR,      // block = first id, count = blocks marked free
+	REPLICA_OP_ZERO,       // block = first id, count = blocks zeroed (discarded)
+	REPLICA_OP_RESIZE,     // block = new device size
+	REPLICA_OP_SYNC,       // End of the snapshot, the standby recounts its bitmap
+	REPLICA_OP_COUNT,
+} replica_op_t;
+
+typedef struct
+{
+	uint32_t op;     // replica_op_t
+	uint32_t count;
+	uint64_t block;
+} replica_record_t;
+
+typedef struct replica_log replica_log_t;
+
+///
+/// Starts the shipper thread for a primary
+/// \param config Where the log goes and how full it may get
+/// \return The log, NULL on error
+///
+replica_log_t *replica_log_create(const block_store_replication_t *const config);
+
+///
+/// Adds one record, waiting for room or giving up on the standby as the backpressure policy says
+/// \param log The log
+/// \param record The change
+/// \param block The new block for writes, NULL otherwise
+/// \param snapshot Part of the initial snapshot, which always waits: the standby is no use without it
+/// \return false once the log has been abandoned (detached or failed), the change was not logged
+///
+bool replica_log_append(replica_log_t *const log, const replica_record_t *const record, const void *const block, const bool snapshot);
+
+///
+/// Waits until everything appended so far has been applied or written out
+/// \param log The log
+/// \return true if the standby is still complete
+///
+bool replica_log_flush(replica_log_t *const log);
+
+///
+/// Ships whatever is left and stops the shipper
+/// \param log The log
+/// \return true if the standby received every change
+///
+bool replica_log_destroy(replica_log_t *const log);
+
+///
+/// Applies the whole records at the front of a buffer to a standby, defined next to the device
+/// \param replica The standby
+/// \param log Log bytes
+/// \param length Number of bytes, may end part way through a record
+/// \param records Incremented once per record applied
+/// \param failed Set if a record doesn't fit the standby, nothing after it can be applied
+/// \return Bytes consumed, the rest is an incomplete record
+///
+size_t replica_apply(block_store_t *const replica, const uint8_t *const log, const size_t length, size_t *const records, bool *const failed);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef TRACE_H__
+#define TRACE_H__
+
+#ifdef __cplusplus
+	extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Binary trace format written by block_store_trace_start and read by the replay tool
+// A file is one trace_header_t followed by fixed size trace_record_t entries, in host byte order
+// Records from different threads are grouped by flush, not sorted; sort on timestamp_ns to get call order
+
+#define TRACE_MAGIC "BSTRACE1"
+#define TRACE_VERSION 1
+#define TRACE_NONE UINT32_MAX  // No block id / failed result
+
+typedef enum
+{
+	TRACE_OP_ALLOCATE = 0,   // result = id handed out
+	TRACE_OP_ALLOCATE_NEAR,  // arg = hint, result = id handed out
+	TRACE_OP_ALLOCATE_EXTENT,  // arg = count, result = first id handed out
+	TRACE_OP_REQUEST,        // arg = id, result = 1 on success
+	TRACE_OP_RELEASE,        // arg = id
+	TRACE_OP_READ,           // arg = id
+	TRACE_OP_WRITE,          // arg = id
+	TRACE_OP_SERIALIZE,
+	TRACE_OP_DESERIALIZE,    // result = blocks in the loaded device
+	TRACE_OP_RELEASE_EXTENT,  // arg = first id, result = count
+	TRACE_OP_COUNT,
+} trace_op_t;
+
+typedef struct
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;  // sizeof(trace_record_t), so readers can reject files they don't understand
+	uint64_t records;      // Filled in when the trace stops
+	uint64_t dropped;      // Records lost to full ring buffers
+} trace_header_t;
+
+typedef struct
+{
+	uint64_t timestamp_ns;  // Since the trace started
+	uint32_t arg;
+	uint32_t result;
+	uint32_t thread;        // Small per-trace thread number
+	uint16_t op;            // trace_op_t
+	uint16_t reserved;
+} trace_record_t;
+
+///
+/// Logs one call into the calling thread's ring buffer if a trace is running
+/// Never blocks: if the ring is full the record is dropped and counted
+/// \param op The trace_op_t of the call
+/// \param arg Operation argument, see trace_op_t
+/// \param result Operation result, see trace_op_t
+///
+void trace_record(const trace_op_t op, const size_t arg, const size_t result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,101 @@
+#ifndef ZONE_MAP_H__
+#define ZONE_MAP_H__
+
+#ifdef __cplusplus
+	extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "bitmap.h"
+#include "block_store.h"
+
+// Free space summary of a free block bitmap, one entry per BLOCK_STORE_ZONE_BLOCKS blocks
+// Free counts are kept exact as blocks change hands, so finding a zone with room is one search of
+// a bitmap with a bit per zone; the free runs at the ends and the largest one inside a zone are
+// worked out again only when an extent search needs them after the zone changed
+// The bitmap stays the authority, the map is told about every change made to it
+
+typedef struct zone_map zone_map_t;
+
+///
+/// Makes a map for a device, which zone_map_rebuild then fills in
+/// Kept apart so resizing can get the memory before it changes anything
+/// \param num_blocks Device size
+/// \return The map, NULL on error
+///
+zone_map_t *zone_map_create(const size_t num_blocks);
+
+///
+/// Summarizes a bitmap as it is now, after it was replaced or changed behind the map's back
+/// \param zones The map, made for the bitmap's size
+/// \param fbm The free block bitmap, set bits are in use
+///
+void zone_map_rebuild(zone_map_t *const zones, const bitmap_t *const fbm);
+
+///
+/// Records blocks turning used (their bits were clear and are now set)
+/// \param zones The map
+/// \param first First block
+/// \param count Number of blocks
+///
+void zone_map_used(zone_map_t *const zones, const size_t first, const size_t count);
+
+///
+/// Records blocks turning free (their bits were set and are now clear)
+/// \param zones The map
+/// \param first First block
+/// \param count Number of blocks
+///
+void zone_map_freed(zone_map_t *const zones, const size_t first, const size_t count);
+
+///
+/// Finds the first free block at or after a block, skipping zones with nothing free
+/// \param zones The map
+/// \param fbm The bitmap it summarizes
+/// \param from Where to start
+/// \return The block, SIZE_MAX if there is none
+///
+size_t zone_map_next_free(const zone_map_t *const zones, const bitmap_t *const fbm, const size_t from);
+
+///
+/// Finds the last free block at or before a block, skipping zones with nothing free
+/// \param zones The map
+/// \param fbm The bitmap it summarizes
+/// \param from Where to start
+/// \return The block, SIZE_MAX if there is none
+///
+size_t zone_map_prev_free(const zone_map_t *const zones, const bitmap_t *const fbm, const size_t from);
+
+///
+/// Finds the first run of free blocks long enough, searching only zones that can hold it or start it
+/// \param zones The map
+/// \param fbm The bitmap it summarizes
+/// \param count Length of the run
+/// \return First block of the run, SIZE_MAX if there is none
+///
+size_t zone_map_find_run(zone_map_t *const zones, const bitmap_t *const fbm, const size_t count);
+
+///
+/// Describes one zone
+/// \param zones The map
+/// \param fbm The bitmap it summarizes
+/// \param zone Zone number
+/// \param info Where the description goes
+/// \return false if there is no such zone
+///
+bool zone_map_get(zone_map_t *const zones, const bitmap_t *const fbm, const size_t zone, block_store_zone_t *const info);
+
+///
+/// Frees a map
+/// \param zones The map, may be NULL
+///
+void zone_map_destroy(zone_map_t *const zones);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
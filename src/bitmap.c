@@ -1,6 +1,11 @@
 #include "bitmap.h"
 #include <string.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BITMAP_X86 1
+#endif
+
 // Just the one for now. Indicates we're an overlay and should not free
 // (also, make sure that ALL is as wide as ll of the flags)
 typedef enum { NONE = 0x00, OVERLAY = 0x01, ALL = 0xFF } BITMAP_FLAGS;
@@ -59,6 +64,364 @@ static const uint8_t bit_totals[256] = {B6(0), B6(1), B6(1), B6(2)};
 // A place to generalize the creation process and setup
 bitmap_t *bitmap_initialize(size_t n_bits, BITMAP_FLAGS flags);
 
+// Word sized view of the byte array, for scans that skip whole words at a time
+// Bit i of the map is bit (i & 63) of word (i >> 6) no matter the host byte order
+#define WORD_BITS 64
+
+// Loads the 64 bits starting at bit word * 64. Bits past the end of the map read as fill.
+static inline uint64_t load_word(const bitmap_t *const bitmap, const size_t word, const bool fill)
+{
+	const size_t first_byte = word * (WORD_BITS / 8);
+	uint64_t bits = 0;
+	if (first_byte + sizeof(bits) <= bitmap->byte_count)
+	{
+		memcpy(&bits, bitmap->data + first_byte, sizeof(bits));  // data isn't aligned, memcpy becomes one load
+	}
+	else
+	{
+		memcpy(&bits, bitmap->data + first_byte, bitmap->byte_count - first_byte);
+	}
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	bits = __builtin_bswap64(bits);
+#endif
+	const size_t valid = bitmap->bit_count - word * WORD_BITS;
+	if (valid < WORD_BITS)
+	{
+		const uint64_t tail = ~((UINT64_C(1) << valid) - 1);
+		bits = fill ? (bits | tail) : (bits & ~tail);
+	}
+	return bits;
+}
+
+// First bit at or after from that has the wanted value, SIZE_MAX if there is none
+static size_t scan_word_from(const bitmap_t *const bitmap, const size_t from, const bool want_set)
+{
+	if (from >= bitmap->bit_count)
+	{
+		return SIZE_MAX;
+	}
+	const size_t word_count = (bitmap->bit_count + WORD_BITS - 1) / WORD_BITS;
+	size_t word = from / WORD_BITS;
+	// Flip the word when hunting zeros so we can always look for the lowest one bit
+	uint64_t bits = want_set ? load_word(bitmap, word, false) : ~load_word(bitmap, word, true);
+	bits &= ~UINT64_C(0) << (from % WORD_BITS);
+	while (!bits)
+	{
+		if (++word == word_count)
+		{
+			return SIZE_MAX;
+		}
+		bits = want_set ? load_word(bitmap, word, false) : ~load_word(bitmap, word, true);
+	}
+	return word * WORD_BITS + (size_t) __builtin_ctzll(bits);
+}
+
+// Last bit at or before from that has the wanted value, SIZE_MAX if there is none
+static size_t scan_word_back(const bitmap_t *const bitmap, const size_t from, const bool want_set)
+{
+	if (bitmap->bit_count == 0)
+	{
+		return SIZE_MAX;
+	}
+	const size_t last = from < bitmap->bit_count ? from : bitmap->bit_count - 1;
+	size_t word = last / WORD_BITS;
+	// Same flip as going forward, then the highest one bit is the answer
+	uint64_t bits = want_set ? load_word(bitmap, word, false) : ~load_word(bitmap, word, true);
+	bits &= ~UINT64_C(0) >> (WORD_BITS - 1 - last % WORD_BITS);
+	while (!bits)
+	{
+		if (word-- == 0)
+		{
+			return SIZE_MAX;
+		}
+		bits = want_set ? load_word(bitmap, word, false) : ~load_word(bitmap, word, true);
+	}
+	return word * WORD_BITS + (WORD_BITS - 1 - (size_t) __builtin_clzll(bits));
+}
+
+// Bulk kernels for the range and whole map operations
+// x86 gets SSE2 and, when the CPU has it, AVX2 (picked per call, __builtin_cpu_supports is one load)
+// Each vector kernel returns how many bytes it got through, the portable loop finishes the rest
+
+typedef enum { COMBINE_AND, COMBINE_OR, COMBINE_XOR, COMBINE_ANDNOT } COMBINE_OP;
+
+static inline uint64_t combine_word(const uint64_t a, const uint64_t b, const COMBINE_OP op)
+{
+	switch (op)
+	{
+		case COMBINE_AND:
+			return a & b;
+		case COMBINE_OR:
+			return a | b;
+		case COMBINE_XOR:
+			return a ^ b;
+		default:
+			return a & ~b;
+	}
+}
+
+#ifdef BITMAP_X86
+__attribute__((target("avx2"))) static size_t combine_avx2(uint8_t *dst, const uint8_t *src, const size_t n, const COMBINE_OP op)
+{
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32)
+	{
+		const __m256i a = _mm256_loadu_si256((const __m256i *) (dst + i));
+		const __m256i b = _mm256_loadu_si256((const __m256i *) (src + i));
+		__m256i r;
+		switch (op)
+		{
+			case COMBINE_AND:
+				r = _mm256_and_si256(a, b);
+				break;
+			case COMBINE_OR:
+				r = _mm256_or_si256(a, b);
+				break;
+			case COMBINE_XOR:
+				r = _mm256_xor_si256(a, b);
+				break;
+			default:
+				r = _mm256_andnot_si256(b, a);  // andnot complements its first operand
+				break;
+		}
+		_mm256_storeu_si256((__m256i *) (dst + i), r);
+	}
+	return i;
+}
+
+__attribute__((target("sse2"))) static size_t combine_sse2(uint8_t *dst, const uint8_t *src, const size_t n, const COMBINE_OP op)
+{
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16)
+	{
+		const __m128i a = _mm_loadu_si128((const __m128i *) (dst + i));
+		const __m128i b = _mm_loadu_si128((const __m128i *) (src + i));
+		__m128i r;
+		switch (op)
+		{
+			case COMBINE_AND:
+				r = _mm_and_si128(a, b);
+				break;
+			case COMBINE_OR:
+				r = _mm_or_si128(a, b);
+				break;
+			case COMBINE_XOR:
+				r = _mm_xor_si128(a, b);
+				break;
+			default:
+				r = _mm_andnot_si128(b, a);
+				break;
+		}
+		_mm_storeu_si128((__m128i *) (dst + i), r);
+	}
+	return i;
+}
+
+// Whether n bytes all equal value, a vector at a time
+__attribute__((target("avx2"))) static bool bytes_equal_avx2(const uint8_t *data, const size_t n, const uint8_t value, size_t *const done)
+{
+	const __m256i want = _mm256_set1_epi8((char) value);
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32)
+	{
+		const __m256i bytes = _mm256_loadu_si256((const __m256i *) (data + i));
+		if ((unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, want)) != 0xFFFFFFFFu)
+		{
+			return false;
+		}
+	}
+	*done = i;
+	return true;
+}
+
+__attribute__((target("sse2"))) static bool bytes_equal_sse2(const uint8_t *data, const size_t n, const uint8_t value, size_t *const done)
+{
+	const __m128i want = _mm_set1_epi8((char) value);
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16)
+	{
+		const __m128i bytes = _mm_loadu_si128((const __m128i *) (data + i));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, want)) != 0xFFFF)
+		{
+			return false;
+		}
+	}
+	*done = i;
+	return true;
+}
+#endif
+
+static void combine_bytes(uint8_t *dst, const uint8_t *src, const size_t n, const COMBINE_OP op)
+{
+	size_t i = 0;
+#ifdef BITMAP_X86
+	i = __builtin_cpu_supports("avx2") ? combine_avx2(dst, src, n, op) : combine_sse2(dst, src, n, op);
+#endif
+	for (; i + sizeof(uint64_t) <= n; i += sizeof(uint64_t))
+	{
+		uint64_t a, b;
+		memcpy(&a, dst + i, sizeof(a));
+		memcpy(&b, src + i, sizeof(b));
+		a = combine_word(a, b, op);  // Byte order doesn't matter, every bit lines up with itself
+		memcpy(dst + i, &a, sizeof(a));
+	}
+	for (; i < n; ++i)
+	{
+		dst[i] = (uint8_t) combine_word(dst[i], src[i], op);
+	}
+}
+
+static bool bytes_equal(const uint8_t *data, const size_t n, const uint8_t value)
+{
+	size_t i = 0;
+#ifdef BITMAP_X86
+	if (!(__builtin_cpu_supports("avx2") ? bytes_equal_avx2(data, n, value, &i) : bytes_equal_sse2(data, n, value, &i)))
+	{
+		return false;
+	}
+#endif
+	const uint64_t want = value * UINT64_C(0x0101010101010101);
+	for (; i + sizeof(uint64_t) <= n; i += sizeof(uint64_t))
+	{
+		uint64_t bytes;
+		memcpy(&bytes, data + i, sizeof(bytes));
+		if (bytes != want)
+		{
+			return false;
+		}
+	}
+	for (; i < n; ++i)
+	{
+		if (data[i] != value)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// Splits a bit range into a partial first byte, whole middle bytes and a partial last byte
+// Masks are for the edge bytes, when the range fits in one byte only first_mask is used
+typedef struct
+{
+	size_t first_byte, last_byte;
+	uint8_t first_mask, last_mask;
+} byte_span_t;
+
+static bool range_span(const bitmap_t *const bitmap, const size_t start, const size_t count, byte_span_t *const span)
+{
+	if (bitmap == NULL || count == 0 || start >= bitmap->bit_count || count > bitmap->bit_count - start)
+	{
+		return false;
+	}
+	const size_t last = start + count - 1;
+	span->first_byte = start >> 3;
+	span->last_byte = last >> 3;
+	span->first_mask = (uint8_t) (0xFF << (start & 0x07));
+	span->last_mask = mask_down_inclusive[last & 0x07];
+	if (span->first_byte == span->last_byte)
+	{
+		span->first_mask &= span->last_mask;
+	}
+	return true;
+}
+
+void bitmap_set_range(bitmap_t *const bitmap, const size_t start, const size_t count)
+{
+	byte_span_t span;
+	if (range_span(bitmap, start, count, &span))
+	{
+		bitmap->data[span.first_byte] |= span.first_mask;
+		if (span.last_byte > span.first_byte)
+		{
+			memset(bitmap->data + span.first_byte + 1, 0xFF, span.last_byte - span.first_byte - 1);
+			bitmap->data[span.last_byte] |= span.last_mask;
+		}
+	}
+}
+
+void bitmap_reset_range(bitmap_t *const bitmap, const size_t start, const size_t count)
+{
+	byte_span_t span;
+	if (range_span(bitmap, start, count, &span))
+	{
+		bitmap->data[span.first_byte] &= (uint8_t) ~span.first_mask;
+		if (span.last_byte > span.first_byte)
+		{
+			memset(bitmap->data + span.first_byte + 1, 0x00, span.last_byte - span.first_byte - 1);
+			bitmap->data[span.last_byte] &= (uint8_t) ~span.last_mask;
+		}
+	}
+}
+
+bool bitmap_test_range_all(const bitmap_t *const bitmap, const size_t start, const size_t count)
+{
+	if (count == 0)
+	{
+		return bitmap != NULL;
+	}
+	byte_span_t span;
+	if (!range_span(bitmap, start, count, &span) || (bitmap->data[span.first_byte] & span.first_mask) != span.first_mask)
+	{
+		return false;
+	}
+	if (span.last_byte == span.first_byte)
+	{
+		return true;
+	}
+	return (bitmap->data[span.last_byte] & span.last_mask) == span.last_mask
+		&& bytes_equal(bitmap->data + span.first_byte + 1, span.last_byte - span.first_byte - 1, 0xFF);
+}
+
+bool bitmap_test_range_any(const bitmap_t *const bitmap, const size_t start, const size_t count)
+{
+	byte_span_t span;
+	if (!range_span(bitmap, start, count, &span))
+	{
+		return false;
+	}
+	if (bitmap->data[span.first_byte] & span.first_mask)
+	{
+		return true;
+	}
+	if (span.last_byte == span.first_byte)
+	{
+		return false;
+	}
+	return (bitmap->data[span.last_byte] & span.last_mask)
+		|| !bytes_equal(bitmap->data + span.first_byte + 1, span.last_byte - span.first_byte - 1, 0x00);
+}
+
+static bool bitmap_combine(bitmap_t *const dst, const bitmap_t *const src, const COMBINE_OP op)
+{
+	if (dst == NULL || src == NULL || dst->bit_count != src->bit_count)
+	{
+		return false;
+	}
+	combine_bytes(dst->data, src->data, dst->byte_count, op);
+	return true;
+}
+
+bool bitmap_and(bitmap_t *const dst, const bitmap_t *const src)
+{
+	return bitmap_combine(dst, src, COMBINE_AND);
+}
+
+bool bitmap_or(bitmap_t *const dst, const bitmap_t *const src)
+{
+	return bitmap_combine(dst, src, COMBINE_OR);
+}
+
+bool bitmap_xor(bitmap_t *const dst, const bitmap_t *const src)
+{
+	return bitmap_combine(dst, src, COMBINE_XOR);
+}
+
+bool bitmap_andnot(bitmap_t *const dst, const bitmap_t *const src)
+{
+	return bitmap_combine(dst, src, COMBINE_ANDNOT);
+}
+
 void bitmap_set(bitmap_t *const bitmap, const size_t bit) 
 {
 	bitmap->data[bit >> 3] |= mask[bit & 0x07];
@@ -89,28 +452,57 @@ void bitmap_invert(bitmap_t *const bitmap)
 
 size_t bitmap_ffs(const bitmap_t *const bitmap) 
 {
-	if (bitmap) 
-	{
-		size_t result = 0;
-		for (; result < bitmap->bit_count && !bitmap_test(bitmap, result); ++result) 
-		{
-		}
-		return (result == bitmap->bit_count ? SIZE_MAX : result);
-	}
-	return SIZE_MAX;
+	return bitmap_next_set(bitmap, 0);
 }
 
 size_t bitmap_ffz(const bitmap_t *const bitmap) 
 {
-	if (bitmap) 
+	return bitmap_next_zero(bitmap, 0);
+}
+
+size_t bitmap_next_set(const bitmap_t *const bitmap, const size_t from)
+{
+	return bitmap ? scan_word_from(bitmap, from, true) : SIZE_MAX;
+}
+
+size_t bitmap_next_zero(const bitmap_t *const bitmap, const size_t from)
+{
+	return bitmap ? scan_word_from(bitmap, from, false) : SIZE_MAX;
+}
+
+size_t bitmap_prev_set(const bitmap_t *const bitmap, const size_t from)
+{
+	return bitmap ? scan_word_back(bitmap, from, true) : SIZE_MAX;
+}
+
+size_t bitmap_prev_zero(const bitmap_t *const bitmap, const size_t from)
+{
+	return bitmap ? scan_word_back(bitmap, from, false) : SIZE_MAX;
+}
+
+size_t bitmap_next_set_batch(const bitmap_t *const bitmap, const size_t from, size_t *const bits, const size_t max)
+{
+	size_t found = 0;
+	if (bitmap && bits && from < bitmap->bit_count)
 	{
-		size_t result = 0;
-		for (; result < bitmap->bit_count && bitmap_test(bitmap, result); ++result) 
+		const size_t word_count = (bitmap->bit_count + WORD_BITS - 1) / WORD_BITS;
+		size_t word = from / WORD_BITS;
+		uint64_t pending = load_word(bitmap, word, false) & (~UINT64_C(0) << (from % WORD_BITS));
+		while (found < max)
 		{
+			while (!pending)
+			{
+				if (++word == word_count)
+				{
+					return found;
+				}
+				pending = load_word(bitmap, word, false);
+			}
+			bits[found++] = word * WORD_BITS + (size_t) __builtin_ctzll(pending);
+			pending &= pending - 1;  // Drop the bit we just took
 		}
-		return (result == bitmap->bit_count ? SIZE_MAX : result);
 	}
-	return SIZE_MAX;
+	return found;
 }
 
 size_t bitmap_total_set(const bitmap_t *const bitmap) 
@@ -140,12 +532,33 @@ void bitmap_for_each(const bitmap_t *const bitmap, void (*func)(size_t, void *),
 {
 	if (bitmap && func) 
 	{
-		for (size_t idx = 0; idx < bitmap->bit_count; ++idx) 
+		size_t batch[WORD_BITS];
+		size_t found = bitmap_next_set_batch(bitmap, 0, batch, WORD_BITS);
+		while (found)
+		{
+			for (size_t idx = 0; idx < found; ++idx)
+			{
+				func(batch[idx], arg);
+			}
+			found = found < WORD_BITS ? 0 : bitmap_next_set_batch(bitmap, batch[found - 1] + 1, batch, WORD_BITS);
+		}
+	}
+}
+
+void bitmap_for_each_zero_run(const bitmap_t *const bitmap, void (*func)(size_t, size_t, void *), void *arg)
+{
+	if (bitmap && func)
+	{
+		size_t start = scan_word_from(bitmap, 0, false);
+		while (start != SIZE_MAX)
 		{
-			if (bitmap_test(bitmap, idx)) 
+			size_t end = scan_word_from(bitmap, start, true);
+			if (end == SIZE_MAX)
 			{
-				func(idx, arg);
+				end = bitmap->bit_count;  // Run goes to the end of the map
 			}
+			func(start, end - start, arg);
+			start = scan_word_from(bitmap, end, false);
 		}
 	}
 }
@@ -0,0 +1,206 @@
+// Unix domain sockets and MSG_NOSIGNAL are outside of X/Open
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "block_client.h"
+
+struct block_client
+{
+	int fd;
+	uint8_t *buffer; //Requests then responses of the current batch, kept between batches
+	size_t capacity;
+};
+
+block_client_t *block_client_connect(const char *const path)
+{
+	struct sockaddr_un address = {0};
+	if(path == NULL || strlen(path) >= sizeof(address.sun_path))
+	{
+		return NULL;
+	}
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
+	block_client_t *client = (block_client_t *)calloc(1, sizeof(block_client_t));
+	if(client == NULL)
+	{
+		return NULL;
+	}
+	client->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(client->fd < 0 || connect(client->fd, (struct sockaddr *)&address, sizeof(address)) != 0)
+	{
+		perror("Failed to connect to the block server");
+		if(client->fd >= 0)
+		{
+			close(client->fd);
+		}
+		free(client);
+		return NULL;
+	}
+	return client;
+}
+
+void block_client_close(block_client_t *const client)
+{
+	if(client)
+	{
+		close(client->fd);
+		free(client->buffer);
+		free(client);
+	}
+}
+
+// Sends the requests and receives the responses at the same time, so a batch bigger than the socket
+// buffers can't deadlock with a server that stops reading until its answers are taken
+static bool exchange(const int fd, const uint8_t *const requests, const size_t request_bytes, uint8_t *const responses, const size_t response_bytes)
+{
+	size_t sent = 0, received = 0;
+	while(received < response_bytes)
+	{
+		struct pollfd wait = {fd, POLLIN | (sent < request_bytes ? POLLOUT : 0), 0};
+		if(poll(&wait, 1, -1) < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			return false;
+		}
+		if(wait.revents & POLLOUT)
+		{
+			ssize_t bytes = send(fd, requests + sent, request_bytes - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+			if(bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			{
+				return false;
+			}
+			sent += bytes > 0 ? (size_t)bytes : 0;
+		}
+		if(wait.revents & (POLLIN | POLLHUP | POLLERR))
+		{
+			ssize_t bytes = recv(fd, responses + received, response_bytes - received, MSG_DONTWAIT);
+			if(bytes == 0 || (bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+			{
+				return false; //The server went away
+			}
+			received += bytes > 0 ? (size_t)bytes : 0;
+		}
+	}
+	return true;
+}
+
+bool block_client_batch(block_client_t *const client, block_client_op_t *const ops, const size_t count)
+{
+	if(client == NULL || (ops == NULL && count != 0) || count > UINT32_MAX)
+	{
+		return false;
+	}
+	size_t request_bytes = 0, response_bytes = 0;
+	for(size_t i = 0; i < count; i++)
+	{
+		if(ops[i].op >= BLOCK_PROTOCOL_OP_COUNT || ((ops[i].op == BLOCK_PROTOCOL_READ || ops[i].op == BLOCK_PROTOCOL_WRITE) && ops[i].buffer == NULL))
+		{
+			return false;
+		}
+		request_bytes += sizeof(block_protocol_request_t) + block_protocol_request_payload(ops[i].op);
+		response_bytes += sizeof(block_protocol_response_t) + block_protocol_response_payload(ops[i].op);
+	}
+	if(request_bytes + response_bytes > client->capacity)
+	{
+		uint8_t *buffer = (uint8_t *)realloc(client->buffer, request_bytes + response_bytes);
+		if(buffer == NULL)
+		{
+			return false;
+		}
+		client->buffer = buffer;
+		client->capacity = request_bytes + response_bytes;
+	}
+
+	uint8_t *request = client->buffer;
+	for(size_t i = 0; i < count; i++)
+	{
+		const block_protocol_request_t header = {ops[i].op, (uint32_t)i, ops[i].arg};
+		memcpy(request, &header, sizeof(header));
+		request += sizeof(header);
+		if(block_protocol_request_payload(ops[i].op) != 0)
+		{
+			memcpy(request, ops[i].buffer, BLOCK_SIZE_BYTES);
+			request += BLOCK_SIZE_BYTES;
+		}
+	}
+	uint8_t *const responses = client->buffer + request_bytes;
+	if(!exchange(client->fd, client->buffer, request_bytes, responses, response_bytes))
+	{
+		return false;
+	}
+
+	const uint8_t *response = responses;
+	for(size_t i = 0; i < count; i++)
+	{
+		block_protocol_response_t header;
+		memcpy(&header, response, sizeof(header));
+		response += sizeof(header);
+		if(header.op != (uint32_t)ops[i].op || header.tag != (uint32_t)i)
+		{
+			return false; //Out of step with the server, the connection is no good any more
+		}
+		ops[i].result = header.result == UINT64_MAX ? SIZE_MAX : (size_t)header.result;
+		if(block_protocol_response_payload(ops[i].op) != 0)
+		{
+			memcpy(ops[i].buffer, response, BLOCK_SIZE_BYTES);
+			response += BLOCK_SIZE_BYTES;
+		}
+	}
+	return true;
+}
+
+// One call, one round trip; failure is whatever the block_store.h call returns on error
+static size_t call(block_client_t *const client, const block_protocol_op_t op, const size_t arg, void *const buffer, const size_t failed)
+{
+	block_client_op_t call_op = {op, arg, buffer, failed};
+	return block_client_batch(client, &call_op, 1) ? call_op.result : failed;
+}
+
+size_t block_client_allocate(block_client_t *const client)
+{
+	return call(client, BLOCK_PROTOCOL_ALLOCATE, 0, NULL, SIZE_MAX);
+}
+
+bool block_client_request(block_client_t *const client, const size_t block_id)
+{
+	return call(client, BLOCK_PROTOCOL_REQUEST, block_id, NULL, 0) == 1;
+}
+
+void block_client_release(block_client_t *const client, const size_t block_id)
+{
+	call(client, BLOCK_PROTOCOL_RELEASE, block_id, NULL, 0);
+}
+
+size_t block_client_read(block_client_t *const client, const size_t block_id, void *buffer)
+{
+	return buffer == NULL ? 0 : call(client, BLOCK_PROTOCOL_READ, block_id, buffer, 0);
+}
+
+size_t block_client_write(block_client_t *const client, const size_t block_id, const void *buffer)
+{
+	return buffer == NULL ? 0 : call(client, BLOCK_PROTOCOL_WRITE, block_id, (void *)buffer, 0);
+}
+
+size_t block_client_get_used_blocks(block_client_t *const client)
+{
+	return call(client, BLOCK_PROTOCOL_USED_BLOCKS, 0, NULL, SIZE_MAX);
+}
+
+size_t block_client_get_free_blocks(block_client_t *const client)
+{
+	return call(client, BLOCK_PROTOCOL_FREE_BLOCKS, 0, NULL, SIZE_MAX);
+}
+
+size_t block_client_get_num_blocks(block_client_t *const client)
+{
+	return call(client, BLOCK_PROTOCOL_NUM_BLOCKS, 0, NULL, SIZE_MAX);
+}
@@ -0,0 +1,801 @@
+#include <string.h>
+
+#include "block_fs.h"
+
+#define FS_MAGIC "BLOCKFS1"
+#define FS_SUPERBLOCK 0
+#define INODE_EXTENTS 2      // Extents kept in the inode block itself
+#define MAP_EXTENTS 3        // Extents per map block
+#define READAHEAD_START 4    // First read-ahead window once reads turn out to be sequential
+
+// On device structures, one block each and in host byte order
+typedef struct
+{
+	uint32_t start;
+	uint32_t length;
+} fs_extent_t;
+
+typedef struct
+{
+	char magic[8];
+	uint64_t root;          // Inode of the root directory
+	uint64_t reserved[2];
+} fs_superblock_t;
+
+typedef struct
+{
+	uint64_t size;          // Bytes
+	uint32_t extent_count;
+	uint32_t map;           // First map block, 0 for none (block 0 is the superblock)
+	fs_extent_t extents[INODE_EXTENTS];
+} fs_inode_block_t;
+
+typedef struct
+{
+	fs_extent_t extents[MAP_EXTENTS];
+	uint32_t next;          // Next map block, 0 at the end of the chain
+	uint32_t unused;
+} fs_map_block_t;
+
+typedef struct
+{
+	char name[BLOCK_FS_NAME_MAX + 1]; // NUL padded
+	uint64_t inode;
+} fs_dirent_t;
+
+_Static_assert(sizeof(fs_superblock_t) <= BLOCK_SIZE_BYTES && sizeof(fs_inode_block_t) <= BLOCK_SIZE_BYTES &&
+	sizeof(fs_map_block_t) <= BLOCK_SIZE_BYTES && sizeof(fs_dirent_t) == BLOCK_SIZE_BYTES, "file system structures have to fit in a block");
+
+// An extent as kept in memory, with where it starts in the file so lookups can binary search
+typedef struct
+{
+	size_t file_block;
+	size_t block;
+	size_t length;
+} fs_run_t;
+
+// Loaded once however many handles have the file open, so they all see every change
+typedef struct fs_inode
+{
+	size_t id;              // Inode block
+	size_t size;
+	size_t blocks;          // Blocks in the extents, ceil(size / BLOCK_SIZE_BYTES)
+	fs_run_t *runs;
+	size_t run_count, run_capacity;
+	size_t *maps;           // Map blocks in chain order
+	size_t map_count;
+	uint64_t generation;    // Bumped on every change, read-ahead windows from before are stale
+	unsigned refs;
+	struct fs_inode *next;
+} fs_inode_t;
+
+struct block_fs
+{
+	block_store_t *bs;
+	fs_inode_t *root;       // The directory, loaded for as long as the file system is mounted
+	fs_inode_t *inodes;     // Every loaded inode, root included
+};
+
+struct block_fs_file
+{
+	block_fs_t *fs;
+	fs_inode_t *inode;
+	size_t next_offset;     // Where a sequential read would carry on
+	size_t window;          // Read-ahead window in blocks, 0 while reads are random
+	size_t cached_first, cached_count; // File blocks held in cache
+	uint64_t cached_generation;
+	uint8_t cache[BLOCK_FS_READAHEAD_BLOCKS * BLOCK_SIZE_BYTES];
+};
+
+static const uint8_t zero_block[BLOCK_SIZE_BYTES];
+
+static size_t blocks_for(const size_t bytes)
+{
+	return bytes / BLOCK_SIZE_BYTES + (bytes % BLOCK_SIZE_BYTES != 0);
+}
+
+static size_t maps_for(const size_t extents)
+{
+	return extents > INODE_EXTENTS ? (extents - INODE_EXTENTS + MAP_EXTENTS - 1) / MAP_EXTENTS : 0;
+}
+
+// Frees a run of blocks in power of two pieces, which the buddy allocator takes back exactly as they are
+static void release_run(block_store_t *const bs, size_t block, size_t length)
+{
+	for(size_t piece = (size_t)1 << (sizeof(size_t) * 8 - 1); length > 0; piece >>= 1)
+	{
+		if(length & piece)
+		{
+			block_store_release_extent(bs, block, piece);
+			block += piece;
+			length -= piece;
+		}
+	}
+}
+
+// Device block holding a file block, and how many blocks after it are in the same extent
+static size_t map_block(const fs_inode_t *const inode, const size_t file_block, size_t *const contiguous)
+{
+	size_t low = 0, high = inode->run_count;
+	while(high - low > 1)
+	{
+		const size_t middle = (low + high) / 2;
+		if(inode->runs[middle].file_block <= file_block)
+		{
+			low = middle;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+	const fs_run_t *run = &inode->runs[low];
+	*contiguous = run->length - (file_block - run->file_block);
+	return run->block + (file_block - run->file_block);
+}
+
+static bool add_run(fs_inode_t *const inode, const size_t block, const size_t length)
+{
+	if(inode->run_count == inode->run_capacity)
+	{
+		const size_t capacity = inode->run_capacity == 0 ? 4 : 2 * inode->run_capacity;
+		fs_run_t *runs = (fs_run_t *)realloc(inode->runs, capacity * sizeof(fs_run_t));
+		if(runs == NULL)
+		{
+			return false;
+		}
+		inode->runs = runs;
+		inode->run_capacity = capacity;
+	}
+	inode->runs[inode->run_count++] = (fs_run_t){inode->blocks, block, length};
+	inode->blocks += length;
+	return true;
+}
+
+// Writes the inode block and every map block from the one holding extent from on
+// The map chain is grown or cut to fit the extents first
+static bool inode_save(block_fs_t *const fs, fs_inode_t *const inode, size_t from)
+{
+	const size_t needed = maps_for(inode->run_count);
+	if(needed > inode->map_count)
+	{
+		size_t *maps = (size_t *)realloc(inode->maps, needed * sizeof(size_t));
+		if(maps == NULL)
+		{
+			return false;
+		}
+		inode->maps = maps;
+		const size_t old_count = inode->map_count;
+		while(inode->map_count < needed)
+		{
+			const size_t hint = inode->map_count == 0 ? inode->id : inode->maps[inode->map_count - 1];
+			const size_t id = block_store_allocate_near(fs->bs, hint);
+			if(id == SIZE_MAX)
+			{
+				return false; //The maps we did get are kept, the caller's rollback cuts them again
+			}
+			inode->maps[inode->map_count++] = id;
+		}
+		const size_t link = old_count == 0 ? 0 : INODE_EXTENTS + (old_count - 1) * MAP_EXTENTS; //The old last map points at the first new one
+		from = from < link ? from : link;
+	}
+	while(inode->map_count > needed)
+	{
+		block_store_release(fs->bs, inode->maps[--inode->map_count]);
+		const size_t link = needed == 0 ? 0 : INODE_EXTENTS + (needed - 1) * MAP_EXTENTS; //The new last map ends the chain
+		from = from < link ? from : link;
+	}
+
+	fs_inode_block_t header = {0};
+	header.size = inode->size;
+	header.extent_count = (uint32_t)inode->run_count;
+	header.map = inode->map_count == 0 ? 0 : (uint32_t)inode->maps[0];
+	for(size_t i = 0; i < INODE_EXTENTS && i < inode->run_count; i++)
+	{
+		header.extents[i] = (fs_extent_t){(uint32_t)inode->runs[i].block, (uint32_t)inode->runs[i].length};
+	}
+	uint8_t block[BLOCK_SIZE_BYTES] = {0};
+	memcpy(block, &header, sizeof(header));
+	if(block_store_write(fs->bs, inode->id, block) != BLOCK_SIZE_BYTES)
+	{
+		return false;
+	}
+	for(size_t m = from < INODE_EXTENTS ? 0 : (from - INODE_EXTENTS) / MAP_EXTENTS; m < inode->map_count; m++)
+	{
+		fs_map_block_t map = {0};
+		for(size_t i = 0; i < MAP_EXTENTS; i++)
+		{
+			const size_t extent = INODE_EXTENTS + m * MAP_EXTENTS + i;
+			if(extent < inode->run_count)
+			{
+				map.extents[i] = (fs_extent_t){(uint32_t)inode->runs[extent].block, (uint32_t)inode->runs[extent].length};
+			}
+		}
+		map.next = m + 1 < inode->map_count ? (uint32_t)inode->maps[m + 1] : 0;
+		memset(block, 0, sizeof(block));
+		memcpy(block, &map, sizeof(map));
+		if(block_store_write(fs->bs, inode->maps[m], block) != BLOCK_SIZE_BYTES)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// Frees blocks from the end of a file until it has blocks of them
+static void shrink_blocks(block_fs_t *const fs, fs_inode_t *const inode, const size_t blocks)
+{
+	while(inode->blocks > blocks)
+	{
+		fs_run_t *last = &inode->runs[inode->run_count - 1];
+		const size_t drop = last->length < inode->blocks - blocks ? last->length : inode->blocks - blocks;
+		release_run(fs->bs, last->block + last->length - drop, drop);
+		last->length -= drop;
+		inode->blocks -= drop;
+		if(last->length == 0)
+		{
+			inode->run_count--;
+		}
+	}
+}
+
+// Adds blocks to the end of a file until it has blocks of them, the new ones hold whatever was there
+// The last extent is grown in place while the blocks after it are free, after that whole extents are
+// allocated, halving the ask when no free run is that long
+static bool grow_blocks(block_fs_t *const fs, fs_inode_t *const inode, const size_t blocks)
+{
+	const size_t old_blocks = inode->blocks;
+	const size_t num_blocks = block_store_get_num_blocks(fs->bs);
+	while(inode->blocks < blocks)
+	{
+		if(inode->run_count > 0)
+		{
+			fs_run_t *last = &inode->runs[inode->run_count - 1];
+			while(inode->blocks < blocks && last->block + last->length < num_blocks && last->length < UINT32_MAX &&
+				block_store_request(fs->bs, last->block + last->length))
+			{
+				last->length++;
+				inode->blocks++;
+			}
+			if(inode->blocks == blocks)
+			{
+				break;
+			}
+		}
+		const size_t want = blocks - inode->blocks < UINT32_MAX ? blocks - inode->blocks : UINT32_MAX;
+		size_t piece = 1;
+		while(piece <= want / 2)
+		{
+			piece *= 2; //Powers of two, so the buddy allocator hands out exactly what we asked for
+		}
+		size_t start;
+		while((start = block_store_allocate_extent(fs->bs, piece)) == SIZE_MAX && piece > 1)
+		{
+			piece /= 2;
+		}
+		if(start == SIZE_MAX || !add_run(inode, start, piece))
+		{
+			if(start != SIZE_MAX)
+			{
+				release_run(fs->bs, start, piece);
+			}
+			shrink_blocks(fs, inode, old_blocks); //Out of space, give back what we got
+			return false;
+		}
+	}
+	return true;
+}
+
+// Rewrites blocks [first, end) of a file with zeros
+static bool zero_blocks(block_fs_t *const fs, const fs_inode_t *const inode, size_t first, const size_t end)
+{
+	while(first < end)
+	{
+		size_t contiguous;
+		const size_t block = map_block(inode, first, &contiguous);
+		for(size_t i = 0; i < contiguous && first < end; i++, first++)
+		{
+			if(block_store_write(fs->bs, block + i, zero_block) != BLOCK_SIZE_BYTES)
+			{
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+// Reads count whole blocks of a file from first on, a run at a time
+static bool read_blocks(block_fs_t *const fs, const fs_inode_t *const inode, size_t first, size_t count, uint8_t *buffer)
+{
+	while(count > 0)
+	{
+		size_t contiguous;
+		const size_t block = map_block(inode, first, &contiguous);
+		for(size_t i = 0; i < contiguous && count > 0; i++, first++, count--, buffer += BLOCK_SIZE_BYTES)
+		{
+			if(block_store_read(fs->bs, block + i, buffer) != BLOCK_SIZE_BYTES)
+			{
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+// Sets the size and the blocks behind it, the bytes past the end of the last block are always zero
+static bool inode_truncate(block_fs_t *const fs, fs_inode_t *const inode, const size_t size)
+{
+	const size_t old_blocks = inode->blocks;
+	const size_t old_runs = inode->run_count;
+	const size_t blocks = blocks_for(size);
+	if(blocks > old_blocks && (!grow_blocks(fs, inode, blocks) || !zero_blocks(fs, inode, old_blocks, blocks)))
+	{
+		shrink_blocks(fs, inode, old_blocks);
+		return false;
+	}
+	shrink_blocks(fs, inode, blocks);
+	if(size < inode->size && size % BLOCK_SIZE_BYTES != 0)
+	{
+		uint8_t tail[BLOCK_SIZE_BYTES];
+		size_t contiguous;
+		const size_t block = map_block(inode, blocks - 1, &contiguous);
+		if(block_store_read(fs->bs, block, tail) != BLOCK_SIZE_BYTES)
+		{
+			return false;
+		}
+		memset(tail + size % BLOCK_SIZE_BYTES, 0, BLOCK_SIZE_BYTES - size % BLOCK_SIZE_BYTES);
+		block_store_write(fs->bs, block, tail);
+	}
+	const size_t old_size = inode->size;
+	inode->size = size;
+	inode->generation++;
+	if(!inode_save(fs, inode, old_runs == 0 ? 0 : old_runs - 1))
+	{
+		shrink_blocks(fs, inode, old_blocks < blocks ? old_blocks : blocks);
+		inode->size = old_size < size ? old_size : size;
+		inode_save(fs, inode, 0);
+		return false;
+	}
+	return true;
+}
+
+static size_t inode_write(block_fs_t *const fs, fs_inode_t *const inode, const size_t offset, const uint8_t *buffer, const size_t length)
+{
+	if(length == 0)
+	{
+		return 0;
+	}
+	if(offset + length < offset)
+	{
+		return SIZE_MAX;
+	}
+	const size_t end = offset + length;
+	const size_t old_blocks = inode->blocks;
+	const size_t old_runs = inode->run_count;
+	const size_t first = offset / BLOCK_SIZE_BYTES;
+	const size_t blocks = blocks_for(end);
+	if(blocks > old_blocks)
+	{
+		if(!grow_blocks(fs, inode, blocks) || (first > old_blocks && !zero_blocks(fs, inode, old_blocks, first)))
+		{
+			shrink_blocks(fs, inode, old_blocks);
+			return SIZE_MAX;
+		}
+	}
+	inode->generation++;
+
+	size_t file_block = first, done = 0;
+	while(done < length)
+	{
+		size_t contiguous;
+		const size_t block = map_block(inode, file_block, &contiguous);
+		for(size_t i = 0; i < contiguous && done < length; i++, file_block++)
+		{
+			const size_t within = (offset + done) % BLOCK_SIZE_BYTES;
+			const size_t part = length - done < BLOCK_SIZE_BYTES - within ? length - done : BLOCK_SIZE_BYTES - within;
+			if(part == BLOCK_SIZE_BYTES)
+			{
+				block_store_write(fs->bs, block + i, buffer + done);
+			}
+			else
+			{
+				uint8_t merged[BLOCK_SIZE_BYTES] = {0};
+				if(file_block < old_blocks)
+				{
+					block_store_read(fs->bs, block + i, merged); //Blocks that are new to the file start out as zeros
+				}
+				memcpy(merged + within, buffer + done, part);
+				block_store_write(fs->bs, block + i, merged);
+			}
+			done += part;
+		}
+	}
+
+	if(end > inode->size || blocks > old_blocks)
+	{
+		const size_t old_size = inode->size;
+		inode->size = end > inode->size ? end : inode->size;
+		if(!inode_save(fs, inode, old_runs == 0 ? 0 : old_runs - 1))
+		{
+			inode->size = old_size;
+			shrink_blocks(fs, inode, old_blocks);
+			inode_save(fs, inode, 0);
+			return SIZE_MAX;
+		}
+	}
+	return length;
+}
+
+// Finds a loaded inode or reads it in, either way taking a reference
+static fs_inode_t *inode_get(block_fs_t *const fs, const size_t id)
+{
+	for(fs_inode_t *inode = fs->inodes; inode != NULL; inode = inode->next)
+	{
+		if(inode->id == id)
+		{
+			inode->refs++;
+			return inode;
+		}
+	}
+	const size_t num_blocks = block_store_get_num_blocks(fs->bs);
+	uint8_t block[BLOCK_SIZE_BYTES];
+	fs_inode_block_t header;
+	if(id == FS_SUPERBLOCK || id >= num_blocks || block_store_read(fs->bs, id, block) != BLOCK_SIZE_BYTES)
+	{
+		return NULL;
+	}
+	memcpy(&header, block, sizeof(header));
+	fs_inode_t *inode = (fs_inode_t *)calloc(1, sizeof(fs_inode_t));
+	if(inode == NULL)
+	{
+		return NULL;
+	}
+	inode->id = id;
+	inode->size = (size_t)header.size;
+	size_t map = header.map;
+	bool valid = header.extent_count <= num_blocks;
+	for(size_t i = 0; valid && i < header.extent_count; i++)
+	{
+		fs_extent_t extent;
+		if(i < INODE_EXTENTS)
+		{
+			extent = header.extents[i];
+		}
+		else
+		{
+			if((i - INODE_EXTENTS) % MAP_EXTENTS == 0)
+			{
+				size_t *maps = (size_t *)realloc(inode->maps, (inode->map_count + 1) * sizeof(size_t));
+				valid = maps != NULL && map != FS_SUPERBLOCK && map < num_blocks && block_store_read(fs->bs, map, block) == BLOCK_SIZE_BYTES;
+				inode->maps = maps != NULL ? maps : inode->maps;
+				if(!valid)
+				{
+					break;
+				}
+				inode->maps[inode->map_count++] = map;
+				fs_map_block_t chain;
+				memcpy(&chain, block, sizeof(chain));
+				map = chain.next;
+			}
+			memcpy(&extent, block + ((i - INODE_EXTENTS) % MAP_EXTENTS) * sizeof(fs_extent_t), sizeof(extent));
+		}
+		valid = extent.length != 0 && extent.start < num_blocks && extent.length <= num_blocks - extent.start && add_run(inode, extent.start, extent.length);
+	}
+	if(!valid || inode->blocks != blocks_for(inode->size))
+	{
+		free(inode->runs);
+		free(inode->maps);
+		free(inode);
+		return NULL; //Not an inode, or a damaged one
+	}
+	inode->refs = 1;
+	inode->next = fs->inodes;
+	fs->inodes = inode;
+	return inode;
+}
+
+static void inode_put(block_fs_t *const fs, fs_inode_t *const inode)
+{
+	if(--inode->refs > 0)
+	{
+		return;
+	}
+	for(fs_inode_t **link = &fs->inodes; *link != NULL; link = &(*link)->next)
+	{
+		if(*link == inode)
+		{
+			*link = inode->next;
+			break;
+		}
+	}
+	free(inode->runs);
+	free(inode->maps);
+	free(inode);
+}
+
+// Directory entries are one block each, so entry i is block i of the directory
+static size_t dir_lookup(block_fs_t *const fs, const char *const name, size_t *const index)
+{
+	const size_t entries = fs->root->size / sizeof(fs_dirent_t);
+	for(size_t i = 0; i < entries; i++)
+	{
+		size_t contiguous;
+		fs_dirent_t entry;
+		if(block_store_read(fs->bs, map_block(fs->root, i, &contiguous), &entry) != BLOCK_SIZE_BYTES)
+		{
+			return 0;
+		}
+		if(strncmp(entry.name, name, sizeof(entry.name)) == 0)
+		{
+			*index = i;
+			return (size_t)entry.inode;
+		}
+	}
+	return 0; //Block 0 is the superblock, never an inode
+}
+
+static bool valid_name(const char *const name)
+{
+	return name != NULL && name[0] != '\0' && strlen(name) <= BLOCK_FS_NAME_MAX;
+}
+
+static block_fs_file_t *file_open(block_fs_t *const fs, const size_t id)
+{
+	block_fs_file_t *file = (block_fs_file_t *)calloc(1, sizeof(block_fs_file_t));
+	if(file == NULL)
+	{
+		return NULL;
+	}
+	file->fs = fs;
+	file->inode = inode_get(fs, id);
+	if(file->inode == NULL)
+	{
+		free(file);
+		return NULL;
+	}
+	return file;
+}
+
+block_fs_t *block_fs_mount(block_store_t *const bs)
+{
+	uint8_t block[BLOCK_SIZE_BYTES];
+	fs_superblock_t super;
+	if(bs == NULL || block_store_get_num_blocks(bs) > UINT32_MAX || block_store_read(bs, FS_SUPERBLOCK, block) != BLOCK_SIZE_BYTES)
+	{
+		return NULL;
+	}
+	memcpy(&super, block, sizeof(super));
+	if(memcmp(super.magic, FS_MAGIC, sizeof(super.magic)) != 0)
+	{
+		return NULL;
+	}
+	block_fs_t *fs = (block_fs_t *)calloc(1, sizeof(block_fs_t));
+	if(fs == NULL)
+	{
+		return NULL;
+	}
+	fs->bs = bs;
+	fs->root = inode_get(fs, (size_t)super.root);
+	if(fs->root == NULL)
+	{
+		free(fs);
+		return NULL;
+	}
+	return fs;
+}
+
+block_fs_t *block_fs_format(block_store_t *const bs)
+{
+	if(bs == NULL || block_store_get_num_blocks(bs) > UINT32_MAX || !block_store_request(bs, FS_SUPERBLOCK))
+	{
+		return NULL;
+	}
+	const size_t root = block_store_allocate_near(bs, FS_SUPERBLOCK + 1);
+	if(root == SIZE_MAX)
+	{
+		block_store_release(bs, FS_SUPERBLOCK);
+		return NULL;
+	}
+	uint8_t block[BLOCK_SIZE_BYTES] = {0};
+	fs_superblock_t super = {{0}, root, {0, 0}};
+	memcpy(super.magic, FS_MAGIC, sizeof(super.magic));
+	memcpy(block, &super, sizeof(super));
+	block_store_write(bs, root, zero_block); //An empty inode, no size and no extents
+	block_store_write(bs, FS_SUPERBLOCK, block);
+	block_fs_t *fs = block_fs_mount(bs);
+	if(fs == NULL)
+	{
+		block_store_release(bs, root);
+		block_store_release(bs, FS_SUPERBLOCK);
+	}
+	return fs;
+}
+
+void block_fs_unmount(block_fs_t *const fs)
+{
+	if(fs)
+	{
+		while(fs->inodes != NULL)
+		{
+			fs_inode_t *inode = fs->inodes;
+			fs->inodes = inode->next;
+			free(inode->runs);
+			free(inode->maps);
+			free(inode);
+		}
+		free(fs);
+	}
+}
+
+block_fs_file_t *block_fs_create(block_fs_t *const fs, const char *const name)
+{
+	size_t index;
+	if(fs == NULL || !valid_name(name) || dir_lookup(fs, name, &index) != 0)
+	{
+		return NULL;
+	}
+	const size_t id = block_store_allocate_near(fs->bs, fs->root->id);
+	if(id == SIZE_MAX)
+	{
+		return NULL;
+	}
+	fs_dirent_t entry = {{0}, id};
+	memcpy(entry.name, name, strlen(name)); //valid_name capped the length and entry starts zeroed, so the NUL padding is already there
+	if(block_store_write(fs->bs, id, zero_block) != BLOCK_SIZE_BYTES ||
+		inode_write(fs, fs->root, fs->root->size, (const uint8_t *)&entry, sizeof(entry)) == SIZE_MAX)
+	{
+		block_store_release(fs->bs, id);
+		return NULL;
+	}
+	return file_open(fs, id);
+}
+
+block_fs_file_t *block_fs_open(block_fs_t *const fs, const char *const name)
+{
+	size_t index;
+	const size_t id = fs != NULL && valid_name(name) ? dir_lookup(fs, name, &index) : 0;
+	return id == 0 ? NULL : file_open(fs, id);
+}
+
+void block_fs_close(block_fs_file_t *const file)
+{
+	if(file)
+	{
+		inode_put(file->fs, file->inode);
+		free(file);
+	}
+}
+
+size_t block_fs_read(block_fs_file_t *const file, const size_t offset, void *const buffer, size_t length)
+{
+	if(file == NULL || (buffer == NULL && length != 0))
+	{
+		return SIZE_MAX;
+	}
+	const fs_inode_t *inode = file->inode;
+	if(offset >= inode->size)
+	{
+		return 0;
+	}
+	length = length < inode->size - offset ? length : inode->size - offset;
+
+	//Reads carrying on from the last one double the window, anything else turns read-ahead off
+	if(offset == file->next_offset)
+	{
+		file->window = file->window == 0 ? READAHEAD_START : file->window * 2;
+		file->window = file->window < BLOCK_FS_READAHEAD_BLOCKS ? file->window : BLOCK_FS_READAHEAD_BLOCKS;
+	}
+	else
+	{
+		file->window = 0;
+	}
+	file->next_offset = offset + length;
+	if(file->cached_generation != inode->generation)
+	{
+		file->cached_count = 0; //Written since the window was read
+	}
+
+	uint8_t *out = (uint8_t *)buffer;
+	size_t done = 0;
+	while(done < length)
+	{
+		const size_t file_block = (offset + done) / BLOCK_SIZE_BYTES;
+		const size_t within = (offset + done) % BLOCK_SIZE_BYTES;
+		const size_t part = length - done < BLOCK_SIZE_BYTES - within ? length - done : BLOCK_SIZE_BYTES - within;
+		if(file_block - file->cached_first >= file->cached_count && file->window != 0)
+		{
+			//Fill the window from here, at least as far as this read goes
+			const size_t wanted = blocks_for(offset + length) - file_block;
+			size_t count = wanted > file->window ? wanted : file->window;
+			count = count < BLOCK_FS_READAHEAD_BLOCKS ? count : BLOCK_FS_READAHEAD_BLOCKS;
+			count = count < inode->blocks - file_block ? count : inode->blocks - file_block;
+			file->cached_count = 0;
+			if(!read_blocks(file->fs, inode, file_block, count, file->cache))
+			{
+				return SIZE_MAX;
+			}
+			file->cached_first = file_block;
+			file->cached_count = count;
+			file->cached_generation = inode->generation;
+		}
+		if(file_block - file->cached_first < file->cached_count)
+		{
+			memcpy(out + done, file->cache + (file_block - file->cached_first) * BLOCK_SIZE_BYTES + within, part);
+		}
+		else
+		{
+			uint8_t block[BLOCK_SIZE_BYTES];
+			size_t contiguous;
+			if(block_store_read(file->fs->bs, map_block(inode, file_block, &contiguous), block) != BLOCK_SIZE_BYTES)
+			{
+				return SIZE_MAX;
+			}
+			memcpy(out + done, block + within, part);
+		}
+		done += part;
+	}
+	return length;
+}
+
+size_t block_fs_write(block_fs_file_t *const file, const size_t offset, const void *const buffer, const size_t length)
+{
+	if(file == NULL || (buffer == NULL && length != 0))
+	{
+		return SIZE_MAX;
+	}
+	return inode_write(file->fs, file->inode, offset, (const uint8_t *)buffer, length);
+}
+
+bool block_fs_truncate(block_fs_file_t *const file, const size_t size)
+{
+	return file != NULL && (size == file->inode->size || inode_truncate(file->fs, file->inode, size));
+}
+
+size_t block_fs_size(const block_fs_file_t *const file)
+{
+	return file == NULL ? SIZE_MAX : file->inode->size;
+}
+
+size_t block_fs_extents(const block_fs_file_t *const file)
+{
+	return file == NULL ? SIZE_MAX : file->inode->run_count;
+}
+
+bool block_fs_unlink(block_fs_t *const fs, const char *const name)
+{
+	size_t index;
+	const size_t id = fs != NULL && valid_name(name) ? dir_lookup(fs, name, &index) : 0;
+	if(id == 0)
+	{
+		return false;
+	}
+	for(fs_inode_t *inode = fs->inodes; inode != NULL; inode = inode->next)
+	{
+		if(inode->id == id)
+		{
+			return false; //Still open
+		}
+	}
+	fs_inode_t *inode = inode_get(fs, id);
+	if(inode == NULL || !inode_truncate(fs, inode, 0))
+	{
+		if(inode != NULL)
+		{
+			inode_put(fs, inode);
+		}
+		return false;
+	}
+	inode_put(fs, inode);
+	block_store_release(fs->bs, id);
+
+	//The last entry takes the removed one's place
+	const size_t last = fs->root->size / sizeof(fs_dirent_t) - 1;
+	if(index != last)
+	{
+		fs_dirent_t entry;
+		size_t contiguous;
+		block_store_read(fs->bs, map_block(fs->root, last, &contiguous), &entry);
+		inode_write(fs, fs->root, index * sizeof(fs_dirent_t), (const uint8_t *)&entry, sizeof(entry));
+	}
+	return inode_truncate(fs, fs->root, last * sizeof(fs_dirent_t));
+}
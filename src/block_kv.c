@@ -0,0 +1,728 @@
+#include <string.h>
+
+#include "block_kv.h"
+
+#define KV_MAGIC "BSKVTRE1"
+#define KV_PAGE_BYTES (BLOCK_KV_PAGE_BLOCKS * BLOCK_SIZE_BYTES)
+#define KV_LEAF_SLOTS ((KV_PAGE_BYTES - 8) / 16)
+#define KV_INNER_KEYS ((KV_PAGE_BYTES - 8 - 4) / 12)
+#define KV_DEFAULT_CACHE 1024
+#define KV_POOL_MAX 64            // Spare pages, enough for a split at every level of any tree that fits
+
+// A page as it sits on the device and in the cache, in host byte order
+// Inner nodes: children[i] holds the keys below keys[i], children[count] the rest
+typedef struct
+{
+	uint16_t count;               // Records in a leaf, keys in an inner node
+	uint16_t is_leaf;
+	uint32_t unused;
+	union
+	{
+		struct
+		{
+			uint64_t keys[KV_LEAF_SLOTS];
+			uint64_t values[KV_LEAF_SLOTS];
+		} leaf;
+		struct
+		{
+			uint64_t keys[KV_INNER_KEYS];
+			uint32_t children[KV_INNER_KEYS + 1];
+		} inner;
+	};
+} kv_node_t;
+
+typedef struct
+{
+	char magic[8];
+	uint64_t root;
+	uint64_t count;
+	uint32_t height;
+	uint32_t page_blocks;
+} kv_meta_t;
+
+_Static_assert(sizeof(kv_node_t) <= KV_PAGE_BYTES, "B+tree nodes have to fit in a page");
+_Static_assert(sizeof(kv_meta_t) <= BLOCK_SIZE_BYTES, "the meta block is one block");
+
+typedef struct
+{
+	size_t id;                    // First block of the page, SIZE_MAX for an empty slot
+	size_t chain;                 // Next slot in the same hash bucket
+	bool dirty, referenced;
+	kv_node_t node;
+} kv_slot_t;
+
+struct block_kv
+{
+	block_store_t *bs;
+	size_t id;                    // Meta block
+	size_t root;
+	size_t count;
+	size_t height;
+	kv_slot_t *slots;
+	size_t slot_count;
+	size_t *buckets;              // Hash of page id to first slot, SIZE_MAX when empty
+	size_t bucket_mask;
+	size_t hand;                  // Clock hand for eviction
+	size_t pool[KV_POOL_MAX];     // Allocated ahead so a put never fails half way through its splits
+	size_t pool_count;
+};
+
+static size_t bucket_of(const block_kv_t *const kv, const size_t id)
+{
+	return (id * 0x9E3779B97F4A7C15ull >> 17) & kv->bucket_mask;
+}
+
+static bool page_store(block_kv_t *const kv, const size_t id, const kv_node_t *const node)
+{
+	uint8_t page[KV_PAGE_BYTES] = {0};
+	memcpy(page, node, sizeof(*node));
+	for(size_t i = 0; i < BLOCK_KV_PAGE_BLOCKS; i++)
+	{
+		if(block_store_write(kv->bs, id + i, page + i * BLOCK_SIZE_BYTES) != BLOCK_SIZE_BYTES)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool page_load(block_kv_t *const kv, const size_t id, kv_node_t *const node)
+{
+	uint8_t page[KV_PAGE_BYTES];
+	for(size_t i = 0; i < BLOCK_KV_PAGE_BLOCKS; i++)
+	{
+		if(block_store_read(kv->bs, id + i, page + i * BLOCK_SIZE_BYTES) != BLOCK_SIZE_BYTES)
+		{
+			return false;
+		}
+	}
+	memcpy(node, page, sizeof(*node));
+	return node->is_leaf ? node->count <= KV_LEAF_SLOTS : node->count <= KV_INNER_KEYS;
+}
+
+static void cache_unlink(block_kv_t *const kv, const size_t slot)
+{
+	for(size_t *link = &kv->buckets[bucket_of(kv, kv->slots[slot].id)]; *link != SIZE_MAX; link = &kv->slots[*link].chain)
+	{
+		if(*link == slot)
+		{
+			*link = kv->slots[slot].chain;
+			break;
+		}
+	}
+	kv->slots[slot].id = SIZE_MAX;
+}
+
+// Finds the slot holding a page, or makes room for it (loading it from the device if load is set)
+static kv_slot_t *cache_slot(block_kv_t *const kv, const size_t id, const bool load)
+{
+	const size_t bucket = bucket_of(kv, id);
+	for(size_t slot = kv->buckets[bucket]; slot != SIZE_MAX; slot = kv->slots[slot].chain)
+	{
+		if(kv->slots[slot].id == id)
+		{
+			kv->slots[slot].referenced = true;
+			return &kv->slots[slot];
+		}
+	}
+	//Clock: pass over slots used since the hand last came by, take the first one that wasn't
+	while(kv->slots[kv->hand].id != SIZE_MAX && kv->slots[kv->hand].referenced)
+	{
+		kv->slots[kv->hand].referenced = false;
+		kv->hand = (kv->hand + 1) % kv->slot_count;
+	}
+	const size_t slot = kv->hand;
+	kv->hand = (kv->hand + 1) % kv->slot_count;
+	kv_slot_t *victim = &kv->slots[slot];
+	if(victim->id != SIZE_MAX)
+	{
+		if(victim->dirty && !page_store(kv, victim->id, &victim->node))
+		{
+			return NULL;
+		}
+		cache_unlink(kv, slot);
+	}
+	if(load && !page_load(kv, id, &victim->node))
+	{
+		return NULL;
+	}
+	victim->id = id;
+	victim->dirty = false;
+	victim->referenced = true;
+	victim->chain = kv->buckets[bucket];
+	kv->buckets[bucket] = slot;
+	return victim;
+}
+
+static bool node_read(block_kv_t *const kv, const size_t id, kv_node_t *const node)
+{
+	const kv_slot_t *slot = cache_slot(kv, id, true);
+	if(slot == NULL)
+	{
+		return false;
+	}
+	memcpy(node, &slot->node, sizeof(*node));
+	return true;
+}
+
+static bool node_write(block_kv_t *const kv, const size_t id, const kv_node_t *const node)
+{
+	kv_slot_t *slot = cache_slot(kv, id, false);
+	if(slot == NULL)
+	{
+		return false;
+	}
+	memcpy(&slot->node, node, sizeof(*node));
+	slot->dirty = true;
+	return true;
+}
+
+static size_t page_alloc(block_kv_t *const kv)
+{
+	return kv->pool_count == 0 ? block_store_allocate_extent(kv->bs, BLOCK_KV_PAGE_BLOCKS) : kv->pool[--kv->pool_count];
+}
+
+static void page_free(block_kv_t *const kv, const size_t id)
+{
+	const size_t bucket = bucket_of(kv, id);
+	for(size_t slot = kv->buckets[bucket]; slot != SIZE_MAX; slot = kv->slots[slot].chain)
+	{
+		if(kv->slots[slot].id == id)
+		{
+			cache_unlink(kv, slot); //Gone, never written back
+			break;
+		}
+	}
+	block_store_release_extent(kv->bs, id, BLOCK_KV_PAGE_BLOCKS);
+}
+
+// A split can reach every level and add a root, so that many pages are set aside before a put starts
+static bool pool_fill(block_kv_t *const kv, const size_t pages)
+{
+	while(kv->pool_count < pages && kv->pool_count < KV_POOL_MAX)
+	{
+		const size_t id = block_store_allocate_extent(kv->bs, BLOCK_KV_PAGE_BLOCKS);
+		if(id == SIZE_MAX)
+		{
+			return false;
+		}
+		kv->pool[kv->pool_count++] = id;
+	}
+	return kv->pool_count >= pages;
+}
+
+static void pool_drain(block_kv_t *const kv)
+{
+	while(kv->pool_count > 0)
+	{
+		block_store_release_extent(kv->bs, kv->pool[--kv->pool_count], BLOCK_KV_PAGE_BLOCKS);
+	}
+}
+
+// First index whose key is above key (inner nodes) or not below it (leaves, with above false)
+static size_t search(const uint64_t *const keys, const size_t count, const uint64_t key, const bool above)
+{
+	size_t low = 0, high = count;
+	while(low < high)
+	{
+		const size_t middle = (low + high) / 2;
+		if(keys[middle] < key || (above && keys[middle] == key))
+		{
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+	return low;
+}
+
+static block_kv_t *kv_alloc(block_store_t *const bs, size_t cache_pages)
+{
+	cache_pages = cache_pages == 0 ? KV_DEFAULT_CACHE : cache_pages;
+	block_kv_t *kv = (block_kv_t *)calloc(1, sizeof(block_kv_t));
+	if(kv == NULL)
+	{
+		return NULL;
+	}
+	size_t buckets = 1;
+	while(buckets < 2 * cache_pages)
+	{
+		buckets *= 2;
+	}
+	kv->bs = bs;
+	kv->slot_count = cache_pages;
+	kv->bucket_mask = buckets - 1;
+	kv->slots = (kv_slot_t *)calloc(cache_pages, sizeof(kv_slot_t));
+	kv->buckets = (size_t *)malloc(buckets * sizeof(size_t));
+	if(kv->slots == NULL || kv->buckets == NULL)
+	{
+		free(kv->slots);
+		free(kv->buckets);
+		free(kv);
+		return NULL;
+	}
+	memset(kv->buckets, 0xFF, buckets * sizeof(size_t));
+	for(size_t i = 0; i < cache_pages; i++)
+	{
+		kv->slots[i].id = SIZE_MAX;
+	}
+	return kv;
+}
+
+static void kv_free(block_kv_t *const kv)
+{
+	free(kv->slots);
+	free(kv->buckets);
+	free(kv);
+}
+
+block_kv_t *block_kv_create(block_store_t *const bs, const size_t cache_pages)
+{
+	if(bs == NULL || block_store_get_num_blocks(bs) > UINT32_MAX)
+	{
+		return NULL; //Children are 32 bit block ids
+	}
+	block_kv_t *kv = kv_alloc(bs, cache_pages);
+	if(kv == NULL)
+	{
+		return NULL;
+	}
+	kv->id = block_store_allocate(bs);
+	kv->root = kv->id == SIZE_MAX ? SIZE_MAX : page_alloc(kv);
+	kv->height = 1;
+	const kv_node_t empty = {0, 1, 0, {{{0}, {0}}}};
+	if(kv->root == SIZE_MAX || !node_write(kv, kv->root, &empty) || !block_kv_flush(kv))
+	{
+		if(kv->root != SIZE_MAX)
+		{
+			page_free(kv, kv->root);
+		}
+		if(kv->id != SIZE_MAX)
+		{
+			block_store_release(bs, kv->id);
+		}
+		kv_free(kv);
+		return NULL;
+	}
+	return kv;
+}
+
+block_kv_t *block_kv_open(block_store_t *const bs, const size_t id, const size_t cache_pages)
+{
+	uint8_t block[BLOCK_SIZE_BYTES];
+	kv_meta_t meta;
+	if(bs == NULL || block_store_read(bs, id, block) != BLOCK_SIZE_BYTES)
+	{
+		return NULL;
+	}
+	memcpy(&meta, block, sizeof(meta));
+	if(memcmp(meta.magic, KV_MAGIC, sizeof(meta.magic)) != 0 || meta.page_blocks != BLOCK_KV_PAGE_BLOCKS ||
+		meta.root > block_store_get_num_blocks(bs) - BLOCK_KV_PAGE_BLOCKS)
+	{
+		return NULL;
+	}
+	block_kv_t *kv = kv_alloc(bs, cache_pages);
+	if(kv == NULL)
+	{
+		return NULL;
+	}
+	kv->id = id;
+	kv->root = (size_t)meta.root;
+	kv->count = (size_t)meta.count;
+	kv->height = meta.height;
+	return kv;
+}
+
+size_t block_kv_id(const block_kv_t *const kv)
+{
+	return kv == NULL ? SIZE_MAX : kv->id;
+}
+
+bool block_kv_flush(block_kv_t *const kv)
+{
+	if(kv == NULL)
+	{
+		return false;
+	}
+	for(size_t i = 0; i < kv->slot_count; i++)
+	{
+		if(kv->slots[i].id != SIZE_MAX && kv->slots[i].dirty)
+		{
+			if(!page_store(kv, kv->slots[i].id, &kv->slots[i].node))
+			{
+				return false;
+			}
+			kv->slots[i].dirty = false;
+		}
+	}
+	pool_drain(kv); //An image taken now shouldn't hold pages nothing points to
+	uint8_t block[BLOCK_SIZE_BYTES] = {0};
+	kv_meta_t meta = {{0}, kv->root, kv->count, (uint32_t)kv->height, BLOCK_KV_PAGE_BLOCKS};
+	memcpy(meta.magic, KV_MAGIC, sizeof(meta.magic));
+	memcpy(block, &meta, sizeof(meta));
+	return block_store_write(kv->bs, kv->id, block) == BLOCK_SIZE_BYTES;
+}
+
+bool block_kv_close(block_kv_t *const kv)
+{
+	if(kv == NULL)
+	{
+		return false;
+	}
+	const bool flushed = block_kv_flush(kv);
+	kv_free(kv);
+	return flushed;
+}
+
+bool block_kv_get(block_kv_t *const kv, const uint64_t key, uint64_t *const value)
+{
+	if(kv == NULL)
+	{
+		return false;
+	}
+	kv_node_t node;
+	size_t id = kv->root;
+	for(;;)
+	{
+		if(!node_read(kv, id, &node))
+		{
+			return false;
+		}
+		if(node.is_leaf)
+		{
+			break;
+		}
+		id = node.inner.children[search(node.inner.keys, node.count, key, true)];
+	}
+	const size_t slot = search(node.leaf.keys, node.count, key, false);
+	if(slot == node.count || node.leaf.keys[slot] != key)
+	{
+		return false;
+	}
+	if(value != NULL)
+	{
+		*value = node.leaf.values[slot];
+	}
+	return true;
+}
+
+// Puts into the subtree at id; when the node splits its new right half is returned through split_id,
+// starting at split_key. Pages come from the pool, so once the pool is full this can only fail on
+// a page that can't be read, before anything was changed
+static bool insert(block_kv_t *const kv, const size_t id, const uint64_t key, const uint64_t value, uint64_t *const split_key, size_t *const split_id)
+{
+	kv_node_t node;
+	if(!node_read(kv, id, &node))
+	{
+		return false;
+	}
+	*split_id = SIZE_MAX;
+	if(node.is_leaf)
+	{
+		const size_t slot = search(node.leaf.keys, node.count, key, false);
+		if(slot < node.count && node.leaf.keys[slot] == key)
+		{
+			node.leaf.values[slot] = value;
+			return node_write(kv, id, &node);
+		}
+		kv->count++;
+		if(node.count < KV_LEAF_SLOTS)
+		{
+			memmove(&node.leaf.keys[slot + 1], &node.leaf.keys[slot], (node.count - slot) * sizeof(uint64_t));
+			memmove(&node.leaf.values[slot + 1], &node.leaf.values[slot], (node.count - slot) * sizeof(uint64_t));
+			node.leaf.keys[slot] = key;
+			node.leaf.values[slot] = value;
+			node.count++;
+			return node_write(kv, id, &node);
+		}
+		//Full: lay out all the records with the new one, the upper half moves to a new page
+		uint64_t keys[KV_LEAF_SLOTS + 1], values[KV_LEAF_SLOTS + 1];
+		memcpy(keys, node.leaf.keys, slot * sizeof(uint64_t));
+		memcpy(values, node.leaf.values, slot * sizeof(uint64_t));
+		keys[slot] = key;
+		values[slot] = value;
+		memcpy(&keys[slot + 1], &node.leaf.keys[slot], (KV_LEAF_SLOTS - slot) * sizeof(uint64_t));
+		memcpy(&values[slot + 1], &node.leaf.values[slot], (KV_LEAF_SLOTS - slot) * sizeof(uint64_t));
+		const size_t left = (KV_LEAF_SLOTS + 1) / 2;
+		kv_node_t right = {(uint16_t)(KV_LEAF_SLOTS + 1 - left), 1, 0, {{{0}, {0}}}};
+		memcpy(node.leaf.keys, keys, left * sizeof(uint64_t));
+		memcpy(node.leaf.values, values, left * sizeof(uint64_t));
+		memcpy(right.leaf.keys, &keys[left], right.count * sizeof(uint64_t));
+		memcpy(right.leaf.values, &values[left], right.count * sizeof(uint64_t));
+		node.count = (uint16_t)left;
+		*split_key = right.leaf.keys[0];
+		*split_id = page_alloc(kv);
+		return node_write(kv, id, &node) && node_write(kv, *split_id, &right);
+	}
+
+	const size_t child = search(node.inner.keys, node.count, key, true);
+	uint64_t child_key;
+	size_t child_id;
+	if(!insert(kv, node.inner.children[child], key, value, &child_key, &child_id))
+	{
+		return false;
+	}
+	if(child_id == SIZE_MAX)
+	{
+		return true;
+	}
+	uint64_t keys[KV_INNER_KEYS + 1];
+	uint32_t children[KV_INNER_KEYS + 2];
+	memcpy(keys, node.inner.keys, child * sizeof(uint64_t));
+	memcpy(children, node.inner.children, (child + 1) * sizeof(uint32_t));
+	keys[child] = child_key;
+	children[child + 1] = (uint32_t)child_id;
+	memcpy(&keys[child + 1], &node.inner.keys[child], (node.count - child) * sizeof(uint64_t));
+	memcpy(&children[child + 2], &node.inner.children[child + 1], (node.count - child) * sizeof(uint32_t));
+	if(node.count < KV_INNER_KEYS)
+	{
+		node.count++;
+		memcpy(node.inner.keys, keys, node.count * sizeof(uint64_t));
+		memcpy(node.inner.children, children, (node.count + 1) * sizeof(uint32_t));
+		return node_write(kv, id, &node);
+	}
+	//Full: the middle key moves up, the keys after it go to a new page
+	const size_t left = (KV_INNER_KEYS + 1) / 2;
+	kv_node_t right = {(uint16_t)(KV_INNER_KEYS - left), 0, 0, {{{0}, {0}}}};
+	memcpy(right.inner.keys, &keys[left + 1], right.count * sizeof(uint64_t));
+	memcpy(right.inner.children, &children[left + 1], (right.count + 1) * sizeof(uint32_t));
+	node.count = (uint16_t)left;
+	memcpy(node.inner.keys, keys, left * sizeof(uint64_t));
+	memcpy(node.inner.children, children, (left + 1) * sizeof(uint32_t));
+	*split_key = keys[left];
+	*split_id = page_alloc(kv);
+	return node_write(kv, id, &node) && node_write(kv, *split_id, &right);
+}
+
+bool block_kv_put(block_kv_t *const kv, const uint64_t key, const uint64_t value)
+{
+	if(kv == NULL || !pool_fill(kv, kv->height + 1))
+	{
+		return false;
+	}
+	uint64_t split_key;
+	size_t split_id;
+	if(!insert(kv, kv->root, key, value, &split_key, &split_id))
+	{
+		return false;
+	}
+	if(split_id != SIZE_MAX)
+	{
+		kv_node_t root = {1, 0, 0, {{{0}, {0}}}};
+		root.inner.keys[0] = split_key;
+		root.inner.children[0] = (uint32_t)kv->root;
+		root.inner.children[1] = (uint32_t)split_id;
+		kv->root = page_alloc(kv);
+		kv->height++;
+		return node_write(kv, kv->root, &root);
+	}
+	return true;
+}
+
+// Deletes from the subtree at id, setting emptied when the node lost its last entry and was freed
+static bool erase(block_kv_t *const kv, const size_t id, const uint64_t key, bool *const emptied)
+{
+	kv_node_t node;
+	if(!node_read(kv, id, &node))
+	{
+		return false;
+	}
+	*emptied = false;
+	if(node.is_leaf)
+	{
+		const size_t slot = search(node.leaf.keys, node.count, key, false);
+		if(slot == node.count || node.leaf.keys[slot] != key)
+		{
+			return false;
+		}
+		node.count--;
+		memmove(&node.leaf.keys[slot], &node.leaf.keys[slot + 1], (node.count - slot) * sizeof(uint64_t));
+		memmove(&node.leaf.values[slot], &node.leaf.values[slot + 1], (node.count - slot) * sizeof(uint64_t));
+		kv->count--;
+		if(node.count == 0 && id != kv->root)
+		{
+			page_free(kv, id);
+			*emptied = true;
+			return true;
+		}
+		return node_write(kv, id, &node);
+	}
+
+	const size_t child = search(node.inner.keys, node.count, key, true);
+	bool child_emptied;
+	if(!erase(kv, node.inner.children[child], key, &child_emptied))
+	{
+		return false;
+	}
+	if(!child_emptied)
+	{
+		return true;
+	}
+	if(node.count == 0)
+	{
+		if(id != kv->root)
+		{
+			page_free(kv, id);
+			*emptied = true;
+			return true;
+		}
+		const kv_node_t empty = {0, 1, 0, {{{0}, {0}}}};
+		kv->height = 1;
+		return node_write(kv, id, &empty); //The whole tree emptied out, start again from a leaf
+	}
+	//Drop the child and the key that bounds it on the side away from its neighbour
+	const size_t key_slot = child == 0 ? 0 : child - 1;
+	memmove(&node.inner.keys[key_slot], &node.inner.keys[key_slot + 1], (node.count - key_slot - 1) * sizeof(uint64_t));
+	memmove(&node.inner.children[child], &node.inner.children[child + 1], (node.count - child) * sizeof(uint32_t));
+	node.count--;
+	if(node.count == 0 && id == kv->root)
+	{
+		kv->root = node.inner.children[0]; //A root with one child is just a step down
+		kv->height--;
+		page_free(kv, id);
+		return true;
+	}
+	return node_write(kv, id, &node);
+}
+
+bool block_kv_delete(block_kv_t *const kv, const uint64_t key)
+{
+	bool emptied;
+	return kv != NULL && erase(kv, kv->root, key, &emptied);
+}
+
+static bool scan(block_kv_t *const kv, const size_t id, const uint64_t low, const uint64_t high, bool (*visit)(uint64_t, uint64_t, void *), void *arg, size_t *const visited, bool *const failed)
+{
+	kv_node_t node;
+	if(!node_read(kv, id, &node))
+	{
+		*failed = true;
+		return false;
+	}
+	if(node.is_leaf)
+	{
+		for(size_t i = search(node.leaf.keys, node.count, low, false); i < node.count && node.leaf.keys[i] <= high; i++)
+		{
+			(*visited)++;
+			if(!visit(node.leaf.keys[i], node.leaf.values[i], arg))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+	for(size_t i = search(node.inner.keys, node.count, low, true); i <= node.count && (i == 0 || node.inner.keys[i - 1] <= high); i++)
+	{
+		if(!scan(kv, node.inner.children[i], low, high, visit, arg, visited, failed))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+size_t block_kv_scan(block_kv_t *const kv, const uint64_t low, const uint64_t high, bool (*visit)(uint64_t, uint64_t, void *), void *arg)
+{
+	if(kv == NULL || visit == NULL)
+	{
+		return SIZE_MAX;
+	}
+	size_t visited = 0;
+	bool failed = false;
+	if(low <= high)
+	{
+		scan(kv, kv->root, low, high, visit, arg, &visited, &failed);
+	}
+	return failed ? SIZE_MAX : visited;
+}
+
+bool block_kv_bulk_load(block_kv_t *const kv, const uint64_t *const keys, const uint64_t *const values, const size_t count)
+{
+	if(kv == NULL || kv->count != 0 || (count != 0 && (keys == NULL || values == NULL)))
+	{
+		return false;
+	}
+	for(size_t i = 1; i < count; i++)
+	{
+		if(keys[i - 1] >= keys[i])
+		{
+			return false;
+		}
+	}
+	if(count == 0)
+	{
+		return true;
+	}
+
+	//Every level spreads its entries evenly over as few pages as hold them
+	const size_t leaves = (count + KV_LEAF_SLOTS - 1) / KV_LEAF_SLOTS;
+	size_t *ids = (size_t *)malloc(2 * leaves * sizeof(size_t)); //Every page of every level, for the rollback
+	uint64_t *firsts = (uint64_t *)malloc(leaves * sizeof(uint64_t));
+	size_t pages = 0;
+	bool ok = ids != NULL && firsts != NULL;
+	for(size_t n = 0, done = 0; ok && n < leaves; n++)
+	{
+		kv_node_t leaf = {(uint16_t)(count / leaves + (n < count % leaves)), 1, 0, {{{0}, {0}}}};
+		memcpy(leaf.leaf.keys, &keys[done], leaf.count * sizeof(uint64_t));
+		memcpy(leaf.leaf.values, &values[done], leaf.count * sizeof(uint64_t));
+		firsts[n] = keys[done];
+		done += leaf.count;
+		ids[pages] = block_store_allocate_extent(kv->bs, BLOCK_KV_PAGE_BLOCKS);
+		ok = ids[pages] != SIZE_MAX && page_store(kv, ids[pages], &leaf); //Straight to the device, a load would only churn the cache
+		pages += ids[pages] != SIZE_MAX;
+	}
+	size_t level = 0, nodes = leaves, height = 1;
+	while(ok && nodes > 1)
+	{
+		const size_t parents = (nodes + KV_INNER_KEYS) / (KV_INNER_KEYS + 1);
+		for(size_t n = 0, done = 0; ok && n < parents; n++)
+		{
+			kv_node_t inner = {(uint16_t)(nodes / parents + (n < nodes % parents) - 1), 0, 0, {{{0}, {0}}}};
+			for(size_t c = 0; c <= inner.count; c++)
+			{
+				inner.inner.children[c] = (uint32_t)ids[level + done + c];
+				if(c > 0)
+				{
+					inner.inner.keys[c - 1] = firsts[done + c];
+				}
+			}
+			firsts[n] = firsts[done]; //Smallest key under this node, for the level above
+			done += inner.count + 1;
+			ids[pages] = block_store_allocate_extent(kv->bs, BLOCK_KV_PAGE_BLOCKS);
+			ok = ids[pages] != SIZE_MAX && page_store(kv, ids[pages], &inner);
+			pages += ids[pages] != SIZE_MAX;
+		}
+		level += nodes;
+		nodes = parents;
+		height++;
+	}
+	if(!ok)
+	{
+		for(size_t i = 0; ids != NULL && i < pages; i++)
+		{
+			block_store_release_extent(kv->bs, ids[i], BLOCK_KV_PAGE_BLOCKS);
+		}
+		free(ids);
+		free(firsts);
+		return false;
+	}
+	page_free(kv, kv->root); //The empty leaf
+	kv->root = ids[pages - 1];
+	kv->height = height;
+	kv->count = count;
+	free(ids);
+	free(firsts);
+	return true;
+}
+
+size_t block_kv_count(const block_kv_t *const kv)
+{
+	return kv == NULL ? SIZE_MAX : kv->count;
+}
+
+size_t block_kv_height(const block_kv_t *const kv)
+{
+	return kv == NULL ? 0 : kv->height;
+}
@@ -0,0 +1,341 @@
+// mmap flags, madvise hints and syscall() are all outside of X/Open
+#define _GNU_SOURCE
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "block_memory.h"
+
+#define HUGE_PAGE_BYTES ((size_t)2 << 20)
+#define CACHE_LINE_BYTES 64
+
+// From linux/mempolicy.h, which we would otherwise need libnuma's headers for
+#define MEMORY_POLICY_PREFERRED 1
+
+static size_t round_up(const size_t bytes, const size_t multiple)
+{
+	return (bytes + multiple - 1) / multiple * multiple;
+}
+
+static void *map_anonymous(const size_t length, const int flags)
+{
+	void *data = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+	return data == MAP_FAILED ? NULL : data;
+}
+
+// Transparent huge pages only back 2 MiB aligned ranges, so over map and trim the ends
+static void *map_huge_aligned(const size_t length)
+{
+	uint8_t *raw = (uint8_t *) map_anonymous(length + HUGE_PAGE_BYTES, 0);
+	if (raw == NULL)
+	{
+		return NULL;
+	}
+	uint8_t *aligned = (uint8_t *) round_up((uintptr_t) raw, HUGE_PAGE_BYTES);
+	if (aligned > raw)
+	{
+		munmap(raw, aligned - raw);
+	}
+	const size_t tail = (raw + length + HUGE_PAGE_BYTES) - (aligned + length);
+	if (tail > 0)
+	{
+		munmap(aligned + length, tail);
+	}
+	return aligned;
+}
+
+// Prefers the NUMA node the creating thread runs on, whichever thread touches the pages first
+static void place_on_local_node(void *const data, const size_t length)
+{
+	unsigned cpu = 0, node = 0;
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0 || node >= 64)
+	{
+		return;
+	}
+	const unsigned long nodes = 1UL << node;
+	syscall(SYS_mbind, data, length, MEMORY_POLICY_PREFERRED, &nodes, (unsigned long) node + 2, 0);  // Only a hint, failures are fine
+}
+
+// Touches every page so the first real access doesn't pay for the fault
+static void prefault(uint8_t *const data, const size_t length)
+{
+	const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+	for (size_t offset = 0; offset < length; offset += page)
+	{
+		((volatile uint8_t *) data)[offset] = 0;
+	}
+}
+
+bool block_memory_create(block_memory_t *const memory, const size_t bytes, const block_store_options_t *const options)
+{
+	if (memory == NULL || bytes == 0)
+	{
+		return false;
+	}
+	memset(memory, 0, sizeof(*memory));
+	memory->size = bytes;
+	const block_store_memory_t kind = options ? options->memory : BLOCK_STORE_MEMORY_HEAP;
+	const bool numa_local = options && options->numa_local;
+	const bool touch = options && options->prefault;
+
+	if (kind == BLOCK_STORE_MEMORY_ARENA)
+	{
+		if (options->arena == NULL || options->arena_bytes < bytes)
+		{
+			return false;
+		}
+		memory->data = (uint8_t *) options->arena;
+		memory->length = options->arena_bytes;  // Room to grow into
+		memory->kind = BLOCK_MEMORY_ARENA;
+		memset(memory->data, 0, bytes);  // Devices start out zeroed, which faults the arena in as well
+		return true;
+	}
+
+	if (kind == BLOCK_STORE_MEMORY_HEAP && !numa_local)
+	{
+		memory->data = (uint8_t *) calloc(bytes, 1);
+		memory->length = bytes;
+		memory->kind = BLOCK_MEMORY_HEAP;
+		if (memory->data && touch)
+		{
+			prefault(memory->data, bytes);
+		}
+		return memory->data != NULL;
+	}
+
+	// Everything else needs page aligned memory of its own, which mmap hands out already zeroed
+	memory->kind = BLOCK_MEMORY_MAPPED;
+	if (kind == BLOCK_STORE_MEMORY_HUGE_PAGES)
+	{
+		memory->length = round_up(bytes, HUGE_PAGE_BYTES);
+		memory->data = (uint8_t *) map_anonymous(memory->length, MAP_HUGETLB);  // Only works if the admin reserved some
+		memory->huge_pages = (memory->data != NULL);
+		if (memory->data == NULL)
+		{
+			memory->data = (uint8_t *) map_huge_aligned(memory->length);
+			if (memory->data)
+			{
+				madvise(memory->data, memory->length, MADV_HUGEPAGE);
+			}
+		}
+	}
+	else
+	{
+		memory->length = round_up(bytes, (size_t) sysconf(_SC_PAGESIZE));
+		memory->data = (uint8_t *) map_anonymous(memory->length, 0);
+	}
+	if (memory->data == NULL)
+	{
+		return false;
+	}
+	if (numa_local)
+	{
+		place_on_local_node(memory->data, memory->length);  // Before the first touch, which is what places a page
+	}
+	if (touch)
+	{
+		prefault(memory->data, memory->length);
+	}
+	return true;
+}
+
+// Maps a whole segment, the header page first
+static bool map_shared(block_memory_t *const memory, const int fd, const size_t segment)
+{
+	const size_t page = block_memory_page_size();
+	uint8_t *base = (uint8_t *) mmap(NULL, segment, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);  // The mapping keeps the segment alive
+	if (base == MAP_FAILED)
+	{
+		return false;
+	}
+	memory->header = base;
+	memory->data = base + page;
+	memory->length = segment - page;
+	memory->kind = BLOCK_MEMORY_SHARED;
+	return true;
+}
+
+bool block_memory_create_shared(block_memory_t *const memory, const char *const name, const size_t bytes, const bool touch)
+{
+	if (memory == NULL || name == NULL || bytes == 0)
+	{
+		return false;
+	}
+	memset(memory, 0, sizeof(*memory));
+	const size_t page = block_memory_page_size();
+	const size_t segment = page + round_up(bytes, page);
+	const int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+	if (fd < 0)
+	{
+		return false;
+	}
+	if (ftruncate(fd, segment) != 0)
+	{
+		close(fd);
+		shm_unlink(name);
+		return false;
+	}
+	if (!map_shared(memory, fd, segment))  // New segments read as zeros
+	{
+		shm_unlink(name);
+		return false;
+	}
+	memory->size = bytes;
+	if (touch)
+	{
+		prefault(memory->data, memory->length);
+	}
+	return true;
+}
+
+bool block_memory_attach_shared(block_memory_t *const memory, const char *const name)
+{
+	if (memory == NULL || name == NULL)
+	{
+		return false;
+	}
+	memset(memory, 0, sizeof(*memory));
+	const int fd = shm_open(name, O_RDWR, 0);
+	struct stat st;
+	if (fd < 0)
+	{
+		return false;
+	}
+	if (fstat(fd, &st) != 0 || (size_t) st.st_size <= block_memory_page_size())
+	{
+		close(fd);
+		return false;  // Not one of ours, or its creator hasn't sized it yet
+	}
+	if (!map_shared(memory, fd, (size_t) st.st_size))
+	{
+		return false;
+	}
+	memory->size = memory->length;
+	return true;
+}
+
+bool block_memory_unlink_shared(const char *const name)
+{
+	return shm_unlink(name) == 0;
+}
+
+bool block_memory_resize(block_memory_t *const memory, const size_t bytes)
+{
+	if (memory == NULL || memory->data == NULL || bytes == 0 || memory->kind == BLOCK_MEMORY_SHARED)
+	{
+		return false;  // Every other process has the segment mapped at its current size
+	}
+	const size_t old_size = memory->size;
+	if (memory->kind == BLOCK_MEMORY_ARENA)
+	{
+		if (bytes > memory->length)
+		{
+			return false;  // The arena is all there is
+		}
+	}
+	else if (memory->kind == BLOCK_MEMORY_HEAP)
+	{
+		uint8_t *data = (uint8_t *) realloc(memory->data, bytes);  // Large blocks are mremapped by malloc too
+		if (data == NULL)
+		{
+			return false;
+		}
+		memory->data = data;
+		memory->length = bytes;
+	}
+	else
+	{
+		const size_t page = memory->huge_pages ? HUGE_PAGE_BYTES : block_memory_page_size();
+		const size_t length = round_up(bytes, page);
+		if (length != memory->length)
+		{
+			void *data = mremap(memory->data, memory->length, length, MREMAP_MAYMOVE);  // New pages come zeroed
+			if (data == MAP_FAILED)
+			{
+				return false;
+			}
+			memory->data = (uint8_t *) data;
+			memory->length = length;
+		}
+	}
+	if (bytes > old_size)
+	{
+		// Whatever was past the old size is stale (or uninitialized from realloc), the device expects zeros
+		memset(memory->data + old_size, 0, bytes - old_size);
+	}
+	memory->size = bytes;
+	return true;
+}
+
+size_t block_memory_page_size(void)
+{
+	return (size_t) sysconf(_SC_PAGESIZE);
+}
+
+void block_memory_discard(block_memory_t *const memory, const size_t offset, const size_t length)
+{
+	if (memory == NULL || memory->data == NULL || length == 0 || offset + length > memory->length)
+	{
+		return;
+	}
+	uint8_t *const start = memory->data + offset;
+	uint8_t *const end = start + length;
+	// Reserved huge pages can only be dropped whole, which a part of the device rarely is
+	const size_t page = memory->huge_pages ? HUGE_PAGE_BYTES : block_memory_page_size();
+	uint8_t *const first_page = (uint8_t *) round_up((uintptr_t) start, page);
+	uint8_t *const last_page = (uint8_t *) ((uintptr_t) end / page * page);
+	// Private anonymous pages read back as zeros once dropped, caller arenas may be anything and
+	// shared pages keep their contents, so those only get zeroed
+	if ((memory->kind == BLOCK_MEMORY_HEAP || memory->kind == BLOCK_MEMORY_MAPPED) && first_page < last_page && madvise(first_page, last_page - first_page, MADV_DONTNEED) == 0)
+	{
+		memset(start, 0, first_page - start);
+		memset(last_page, 0, end - last_page);
+	}
+	else
+	{
+		memset(start, 0, length);
+	}
+}
+
+void block_memory_prefetch(const block_memory_t *const memory, const size_t offset, const size_t length)
+{
+	if (memory == NULL || memory->data == NULL || length == 0 || offset + length > memory->length)
+	{
+		return;
+	}
+	const uint8_t *const start = memory->data + offset;
+	if (memory->kind == BLOCK_MEMORY_MAPPED || memory->kind == BLOCK_MEMORY_SHARED)
+	{
+		const size_t page = memory->huge_pages ? HUGE_PAGE_BYTES : block_memory_page_size();
+		uint8_t *const first_page = (uint8_t *) ((uintptr_t) start / page * page);
+		madvise(first_page, round_up((uintptr_t) (start + length), page) - (uintptr_t) first_page, MADV_WILLNEED);  // Only a hint, failing is fine
+	}
+	for (size_t line = 0; line < length; line += CACHE_LINE_BYTES)
+	{
+		__builtin_prefetch(start + line, 0, 1);  // Low temporal locality, a scan reads each line once
+	}
+}
+
+void block_memory_destroy(block_memory_t *const memory)
+{
+	if (memory && memory->data)
+	{
+		if (memory->kind == BLOCK_MEMORY_HEAP)
+		{
+			free(memory->data);
+		}
+		else if (memory->kind == BLOCK_MEMORY_MAPPED)
+		{
+			munmap(memory->data, memory->length);
+		}
+		else if (memory->kind == BLOCK_MEMORY_SHARED)
+		{
+			munmap(memory->header, memory->length + (memory->data - memory->header));  // The segment lives on until it is unlinked
+		}
+		memory->data = NULL;  // Arenas belong to the caller
+	}
+}
@@ -0,0 +1,370 @@
+// accept4, epoll, eventfd and MSG_NOSIGNAL are all outside of X/Open
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "block_protocol.h"
+#include "block_server.h"
+
+#define SERVER_INPUT_BYTES 65536            // Read per wakeup, about 1300 pipelined writes
+#define SERVER_OUTPUT_LIMIT ((size_t)1 << 20)  // Stop taking requests from a client that isn't reading its answers
+#define SERVER_EVENTS 64
+
+typedef struct connection
+{
+	int fd;
+	uint8_t input[SERVER_INPUT_BYTES];
+	size_t input_length;
+	uint8_t *output;
+	size_t output_sent, output_length, output_capacity;
+	uint32_t events; //What epoll is watching this connection for
+	struct connection *prev, *next;
+} connection_t;
+
+struct block_server
+{
+	block_store_t *bs;
+	int listen_fd;
+	int stop_fd; //eventfd, written by block_server_stop
+	int epoll_fd;
+	struct sockaddr_un address;
+	bool bound; //The socket file is ours to remove
+	connection_t *connections; //Every open connection, so destroy can close them
+};
+
+static void close_connection(block_server_t *const server, connection_t *const connection)
+{
+	epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+	close(connection->fd);
+	if(connection->prev != NULL)
+	{
+		connection->prev->next = connection->next;
+	}
+	else
+	{
+		server->connections = connection->next;
+	}
+	if(connection->next != NULL)
+	{
+		connection->next->prev = connection->prev;
+	}
+	free(connection->output);
+	free(connection);
+}
+
+static void accept_connections(block_server_t *const server)
+{
+	int fd;
+	while((fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+	{
+		connection_t *connection = (connection_t *)calloc(1, sizeof(connection_t));
+		struct epoll_event event = {EPOLLIN, {.ptr = connection}};
+		if(connection == NULL || epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0)
+		{
+			free(connection);
+			close(fd); //Turn the client away rather than the server down
+			continue;
+		}
+		connection->fd = fd;
+		connection->events = EPOLLIN;
+		connection->next = server->connections;
+		if(server->connections != NULL)
+		{
+			server->connections->prev = connection;
+		}
+		server->connections = connection;
+	}
+}
+
+// Makes room for one more response at the end of the output
+static bool reserve_output(connection_t *const connection, const size_t bytes)
+{
+	if(connection->output_sent == connection->output_length)
+	{
+		connection->output_sent = connection->output_length = 0; //Everything went out, start over at the front
+	}
+	if(connection->output_length + bytes <= connection->output_capacity)
+	{
+		return true;
+	}
+	size_t capacity = connection->output_capacity ? connection->output_capacity * 2 : 4096;
+	while(capacity < connection->output_length + bytes)
+	{
+		capacity *= 2;
+	}
+	uint8_t *output = (uint8_t *)realloc(connection->output, capacity);
+	if(output == NULL)
+	{
+		return false;
+	}
+	connection->output = output;
+	connection->output_capacity = capacity;
+	return true;
+}
+
+// Runs one request against the device, the response and any block it carries are written to response
+static void handle_request(block_store_t *const bs, const block_protocol_request_t *const request, const uint8_t *const payload, uint8_t *const response)
+{
+	block_protocol_response_t header = {request->op, request->tag, 0};
+	uint8_t *const block = response + sizeof(header);
+	size_t result = 0;
+	switch(request->op)
+	{
+		case BLOCK_PROTOCOL_ALLOCATE:
+			result = block_store_allocate(bs);
+			break;
+		case BLOCK_PROTOCOL_REQUEST:
+			result = block_store_request(bs, request->arg);
+			break;
+		case BLOCK_PROTOCOL_RELEASE:
+			block_store_release(bs, request->arg);
+			break;
+		case BLOCK_PROTOCOL_READ:
+			result = block_store_read(bs, request->arg, block);
+			if(result == 0)
+			{
+				memset(block, 0, BLOCK_SIZE_BYTES); //The client still expects a block to follow
+			}
+			break;
+		case BLOCK_PROTOCOL_WRITE:
+			result = block_store_write(bs, request->arg, payload);
+			break;
+		case BLOCK_PROTOCOL_USED_BLOCKS:
+			result = block_store_get_used_blocks(bs);
+			break;
+		case BLOCK_PROTOCOL_FREE_BLOCKS:
+			result = block_store_get_free_blocks(bs);
+			break;
+		default:
+			result = block_store_get_num_blocks(bs);
+			break;
+	}
+	header.result = result == SIZE_MAX ? UINT64_MAX : (uint64_t)result;
+	memcpy(response, &header, sizeof(header));
+}
+
+// Answers every complete request in the input, up to the output limit
+static bool serve_input(block_server_t *const server, connection_t *const connection)
+{
+	size_t offset = 0;
+	while(connection->output_length - connection->output_sent < SERVER_OUTPUT_LIMIT && connection->input_length - offset >= sizeof(block_protocol_request_t))
+	{
+		block_protocol_request_t request;
+		memcpy(&request, connection->input + offset, sizeof(request));
+		if(request.op >= BLOCK_PROTOCOL_OP_COUNT)
+		{
+			return false; //Not speaking our protocol, nothing after this can be trusted
+		}
+		const size_t length = sizeof(request) + block_protocol_request_payload(request.op);
+		if(connection->input_length - offset < length)
+		{
+			break; //The rest is still on its way
+		}
+		const size_t response_length = sizeof(block_protocol_response_t) + block_protocol_response_payload(request.op);
+		if(!reserve_output(connection, response_length))
+		{
+			return false;
+		}
+		handle_request(server->bs, &request, connection->input + offset + sizeof(request), connection->output + connection->output_length);
+		connection->output_length += response_length;
+		offset += length;
+	}
+	memmove(connection->input, connection->input + offset, connection->input_length - offset);
+	connection->input_length -= offset;
+	return true;
+}
+
+// Sends as much of the output as the socket takes without blocking
+static bool flush_output(connection_t *const connection)
+{
+	while(connection->output_sent < connection->output_length)
+	{
+		ssize_t sent = send(connection->fd, connection->output + connection->output_sent, connection->output_length - connection->output_sent, MSG_NOSIGNAL);
+		if(sent < 0)
+		{
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+		}
+		connection->output_sent += sent;
+	}
+	return true;
+}
+
+// Reads while there is room and answers are going out, waits to write while answers are queued
+static bool update_events(block_server_t *const server, connection_t *const connection)
+{
+	const size_t pending = connection->output_length - connection->output_sent;
+	uint32_t events = 0;
+	if(pending < SERVER_OUTPUT_LIMIT && connection->input_length < SERVER_INPUT_BYTES)
+	{
+		events |= EPOLLIN;
+	}
+	if(pending > 0)
+	{
+		events |= EPOLLOUT;
+	}
+	if(events == connection->events)
+	{
+		return true;
+	}
+	struct epoll_event event = {events, {.ptr = connection}};
+	connection->events = events;
+	return epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, connection->fd, &event) == 0;
+}
+
+static bool serve_connection(block_server_t *const server, connection_t *const connection, const uint32_t events)
+{
+	if(events & EPOLLIN)
+	{
+		ssize_t received = recv(connection->fd, connection->input + connection->input_length, SERVER_INPUT_BYTES - connection->input_length, 0);
+		if(received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+		{
+			return false; //Hung up
+		}
+		connection->input_length += received > 0 ? (size_t)received : 0;
+	}
+	else if(events & (EPOLLERR | EPOLLHUP))
+	{
+		return false;
+	}
+	//Answers that went out make room for requests held back by the output limit, so serve either way
+	return flush_output(connection) && serve_input(server, connection) && flush_output(connection) && update_events(server, connection);
+}
+
+block_server_t *block_server_create(block_store_t *const bs, const char *const path)
+{
+	if(bs == NULL || path == NULL || strlen(path) >= sizeof(((struct sockaddr_un *)NULL)->sun_path))
+	{
+		return NULL;
+	}
+	block_server_t *server = (block_server_t *)calloc(1, sizeof(block_server_t));
+	if(server == NULL)
+	{
+		return NULL;
+	}
+	server->bs = bs;
+	server->address.sun_family = AF_UNIX;
+	strcpy(server->address.sun_path, path);
+	server->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	server->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if(server->listen_fd < 0 || server->stop_fd < 0 || server->epoll_fd < 0)
+	{
+		block_server_destroy(server);
+		return NULL;
+	}
+	//A socket nobody answers on was left behind by a server that died, a live one is left alone
+	const int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	const bool live = probe >= 0 && connect(probe, (struct sockaddr *)&server->address, sizeof(server->address)) == 0;
+	if(probe >= 0)
+	{
+		close(probe);
+	}
+	if(live)
+	{
+		fprintf(stderr, "A server is already running on %s\n", path);
+		block_server_destroy(server);
+		return NULL;
+	}
+	unlink(path);
+	server->bound = bind(server->listen_fd, (struct sockaddr *)&server->address, sizeof(server->address)) == 0;
+	struct epoll_event listen_event = {EPOLLIN, {.ptr = &server->listen_fd}};
+	struct epoll_event stop_event = {EPOLLIN, {.ptr = &server->stop_fd}};
+	if(!server->bound || listen(server->listen_fd, SOMAXCONN) != 0
+		|| epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->listen_fd, &listen_event) != 0
+		|| epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->stop_fd, &stop_event) != 0)
+	{
+		perror("Failed to set up the server socket");
+		block_server_destroy(server);
+		return NULL;
+	}
+	return server;
+}
+
+bool block_server_run(block_server_t *const server)
+{
+	if(server == NULL)
+	{
+		return false;
+	}
+	struct epoll_event events[SERVER_EVENTS];
+	for(;;)
+	{
+		const int ready = epoll_wait(server->epoll_fd, events, SERVER_EVENTS, -1);
+		if(ready < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			return false;
+		}
+		for(int i = 0; i < ready; i++)
+		{
+			if(events[i].data.ptr == &server->stop_fd)
+			{
+				uint64_t count;
+				if(read(server->stop_fd, &count, sizeof(count)) != (ssize_t)sizeof(count))
+				{
+					continue;
+				}
+				return true;
+			}
+			if(events[i].data.ptr == &server->listen_fd)
+			{
+				accept_connections(server);
+				continue;
+			}
+			connection_t *connection = (connection_t *)events[i].data.ptr;
+			if(!serve_connection(server, connection, events[i].events))
+			{
+				close_connection(server, connection);
+			}
+		}
+	}
+}
+
+void block_server_stop(block_server_t *const server)
+{
+	if(server != NULL)
+	{
+		const uint64_t one = 1;
+		if(write(server->stop_fd, &one, sizeof(one)) != (ssize_t)sizeof(one))
+		{
+			return; //Only fails if stop was already asked for a few billion times
+		}
+	}
+}
+
+void block_server_destroy(block_server_t *const server)
+{
+	if(server)
+	{
+		while(server->connections != NULL)
+		{
+			close_connection(server, server->connections);
+		}
+		if(server->listen_fd >= 0)
+		{
+			close(server->listen_fd);
+		}
+		if(server->bound)
+		{
+			unlink(server->address.sun_path);
+		}
+		if(server->stop_fd >= 0)
+		{
+			close(server->stop_fd);
+		}
+		if(server->epoll_fd >= 0)
+		{
+			close(server->epoll_fd);
+		}
+		free(server);
+	}
+}
@@ -1,111 +1,2104 @@
+// posix_fadvise is outside of X/Open 500
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdint.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
 
 #include "bitmap.h"
+#include "buddy.h"
+#include "block_memory.h"
+#include "histogram.h"
+#include "trace.h"
+#include "replica.h"
+#include "persist.h"
+#include "zone_map.h"
+#include "image.h"
 #include "block_store.h"
 // include more if you need
 
+_Static_assert(BLOCK_STORE_HIST_BUCKETS == HISTOGRAM_BUCKETS, "block_store.h histogram size is out of date");
+_Static_assert(sizeof(image_superblock_t) == 80 && sizeof(image_superblock_t) <= BLOCK_STORE_IMAGE_HEADER_BYTES, "the superblock has no padding and fits its page");
+
+#if defined(BLOCK_STORE_STATS) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#include <time.h>
+#elif defined(BLOCK_STORE_STATS)
+#include <time.h>
+#endif
+
+// Blocks the background loader faults in per lock acquisition, so foreground calls never wait long
+#define LAZY_LOAD_BATCH_BLOCKS 64
+
+// Hinted ranges waiting for a lazy store's prefetch thread, hints past this many are dropped
+#define PREFETCH_QUEUE 16
+
+// Blocks faulted in per read of the image when a whole range is wanted
+#define PREFETCH_CHUNK_BLOCKS 256
+
+// Sequential scans block_store_read follows at once, a new scan replaces the least recently used
+#define READAHEAD_STREAMS 4
+
+// State kept while a lazily deserialized store still has blocks sitting in its image file
+typedef struct
+{
+	int fd; //The image file the missing blocks are read from
+	bitmap_t *resident; //Set bits are blocks that have been copied into memory
+	atomic_size_t missing; //Number of blocks not yet resident, 0 once everything is loaded
+	pthread_mutex_t lock; //Guards resident and the file reads
+	pthread_t loader; //Optional background thread faulting in the remaining blocks
+	bool has_loader;
+	atomic_bool stop_loader;
+	pthread_t prefetcher; //Started by the first prefetch, reads hinted ranges ahead of the reader
+	bool has_prefetcher;
+	bool stop_prefetcher; //Guarded by lock, like the queue
+	pthread_cond_t prefetch_wake;
+	size_t prefetch_first[PREFETCH_QUEUE], prefetch_end[PREFETCH_QUEUE]; //Ring of hinted ranges
+	size_t prefetch_head, prefetch_queued;
+} lazy_state_t;
+
+// One sequential scan being followed by read-ahead
+typedef struct
+{
+	size_t next; //Block the scan reads next if it keeps going
+	size_t ahead; //Everything before this has been prefetched
+	size_t window; //0 until the scan has read two blocks in a row
+	uint64_t used; //Last access, for least recently used replacement
+} readahead_stream_t;
+
+typedef struct
+{
+	pthread_mutex_t lock; //Readers share the streams, even on stores that are otherwise read only
+	size_t max_window; //Largest window in blocks, 0 while read-ahead is off
+	uint64_t clock;
+	readahead_stream_t streams[READAHEAD_STREAMS];
+} readahead_t;
+
+// Sits in the header page of a shared segment, it is all another process needs to attach
+// Shared stores allocate with atomic read-modify-writes on the bitmap words themselves, so
+// the atomics have to work between processes mapping the same memory at different addresses
+#define SHARED_MAGIC "BSSHARE1"
+_Static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_LONG_LOCK_FREE == 2, "shared stores need lock free, address free atomics");
+
+typedef struct
+{
+	char magic[8];
+	uint64_t num_blocks;
+	atomic_size_t used_blocks; //Takes the place of block_store_t.used_blocks, which every process has its own copy of
+	atomic_bool ready; //Set last by the creator, nobody attaches to a half built device
+} shared_header_t;
+
+#ifdef BLOCK_STORE_STATS
+// Every thread counts into a shard of its own, so counting is a plain load and store on a line nobody else writes
+// Shards belong to a thread slot rather than the thread, a slot is handed to the next new thread once its
+// thread exits, so a device keeps at most one shard per thread that ever ran at the same time
+typedef struct stats_slot
+{
+	struct stats_slot *next; //Free list link, while no thread holds the slot
+} stats_slot_t;
+
+typedef struct stats_shard
+{
+	const stats_slot_t *slot; //The only writer
+	struct stats_shard *next;
+	atomic_uint_fast64_t count[BLOCK_STORE_OP_COUNT];
+	atomic_uint_fast64_t total_ns[BLOCK_STORE_OP_COUNT];
+	atomic_uint_fast64_t latency[BLOCK_STORE_OP_COUNT][HISTOGRAM_BUCKETS];
+	atomic_uint_fast64_t scans; //Allocations that searched the bitmap
+	atomic_uint_fast64_t words_scanned;
+	atomic_uint_fast64_t scan_words[HISTOGRAM_BUCKETS];
+} stats_shard_t;
+
+typedef struct
+{
+	_Atomic(stats_shard_t *) shards; //Only grows at its head, a snapshot is safe to walk
+	uint64_t serial; //Tells a thread's cached shard apart from one of a device that used to live at the same address
+} stats_state_t;
+#endif
+
 struct block_store
 {
 	uint8_t *blocks; //Each point in the array represents a byte of data, every 4 bytes or uint8_t should be a block
+	block_memory_t memory; //Where blocks came from and how to give it back
 	bitmap_t *fbm; //Represents the free block manager
+	zone_map_t *zones; //Free space summary of fbm, not kept for shared stores whose bitmap other processes change
+	size_t num_blocks; //Size of this device, BLOCK_STORE_NUM_BLOCKS unless it was created with another size
+	size_t bitmap_blocks; //Blocks from BITMAP_START_BLOCK on that hold fbm
+	lazy_state_t *lazy; //Only set for stores opened with block_store_deserialize_lazy
+	readahead_t *readahead; //Only set once read-ahead has been turned on
+	shared_header_t *shared; //Only set for stores in a shared memory segment, see shared_claim
+	buddy_t *buddy; //Only set when the buddy allocator was selected, mirrors the free bits of fbm
+	block_store_policy_t policy; //How block_store_allocate picks among free blocks
+	size_t next_fit; //Where the next fit scan resumes
+	size_t next_group; //Allocation group the next round robin allocation starts in
+	bool defrag_active; //A defrag pass is in progress and the cursors below are valid
+	size_t defrag_low; //Lowest possible hole
+	size_t used_blocks; //Set bits in fbm, maintained by mark_used and mark_free
+	bool discard; //Zero released blocks and give their pages back
+	replica_log_t *replica; //Only set while replicating, every change is logged to it
+	persist_t *persist; //Only set while the device is kept in an image file, every change marks its blocks dirty
+#ifdef BLOCK_STORE_STATS
+	stats_state_t *stats; //Per operation counters and latency histograms
+#endif
 };
 
+#ifdef BLOCK_STORE_STATS
+static pthread_once_t ticks_once = PTHREAD_ONCE_INIT;
 
-block_store_t *block_store_create()
+static uint64_t clock_ns(void)
 {
-	block_store_t *bs = (block_store_t *)calloc(1, sizeof(block_store_t));
-	if(bs == NULL)
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// The TSC is far cheaper to read than the clock, its rate comes from two samples of both: one taken when
+// the first device is created, the other by the first timed operation once the clock has moved on enough
+static uint64_t clock_base, tick_base;
+static _Atomic double ns_per_tick; //0 until the samples are far enough apart to trust
+
+static void sample_ticks(void)
+{
+	clock_base = clock_ns();
+	tick_base = __rdtsc();
+}
+
+static inline uint64_t stats_ticks(void)
+{
+	return __rdtsc();
+}
+
+static uint64_t ticks_to_ns(const uint64_t ticks)
+{
+	double rate = atomic_load_explicit(&ns_per_tick, memory_order_relaxed);
+	if(rate == 0)
 	{
-		perror("Failed to allocate memory for block store");
-		return NULL; //Failed allocation.
+		const uint64_t elapsed = clock_ns() - clock_base;
+		const uint64_t ticked = __rdtsc() - tick_base;
+		rate = ticked == 0 ? 1.0 : (double)elapsed / (double)ticked;
+		if(elapsed >= 1000000)
+		{
+			atomic_store_explicit(&ns_per_tick, rate, memory_order_relaxed); //A millisecond apart, good enough to keep
+		}
 	}
+	return (uint64_t)((double)ticks * rate);
+}
+#else
+static void sample_ticks(void)
+{
+}
 
-	bs->blocks  = (uint8_t *)calloc(BLOCK_STORE_NUM_BLOCKS, BLOCK_SIZE_BYTES);
-        if(bs->blocks == NULL)
-        {	
-		perror("Failed to allocate memory for the blocks for our block store");
-		free(bs);
-           	return NULL; //Failed allocation
-        }
+static inline uint64_t stats_ticks(void)
+{
+	return clock_ns(); //Ticks are nanoseconds here
+}
 
+static uint64_t ticks_to_ns(const uint64_t ticks)
+{
+	return ticks;
+}
+#endif
 
-	bs->fbm = bitmap_overlay(BITMAP_SIZE_BITS, bs->blocks +  BITMAP_START_BLOCK); //This creates a bitmap depending on the total number of bytes from the set of blocks
+static pthread_mutex_t slots_lock = PTHREAD_MUTEX_INITIALIZER;
+static stats_slot_t *free_slots; //Slots whose threads exited
+static pthread_key_t slot_key; //Puts the slot back on the free list when its thread exits
+static pthread_once_t slot_key_once = PTHREAD_ONCE_INIT;
+static atomic_uint_fast64_t next_serial;
 
-	if(bs->fbm == NULL)
-	{	
-		perror("Failed to create bitmap overlay");
-		free(bs->blocks);		
-	   	free(bs); //Free the allocated data
-		return NULL; //Failed allocation
+static void slot_release(void *arg)
+{
+	stats_slot_t *slot = (stats_slot_t *)arg;
+	pthread_mutex_lock(&slots_lock);
+	slot->next = free_slots;
+	free_slots = slot;
+	pthread_mutex_unlock(&slots_lock);
+}
+
+static void slot_key_create(void)
+{
+	pthread_key_create(&slot_key, slot_release);
+}
+
+// The calling thread's slot, taken the first time it counts anything
+static const stats_slot_t *stats_slot(void)
+{
+	static _Thread_local stats_slot_t *my_slot;
+	if(my_slot == NULL)
+	{
+		pthread_once(&slot_key_once, slot_key_create);
+		pthread_mutex_lock(&slots_lock);
+		stats_slot_t *slot = free_slots;
+		if(slot != NULL)
+		{
+			free_slots = slot->next;
+		}
+		pthread_mutex_unlock(&slots_lock);
+		if(slot == NULL && (slot = (stats_slot_t *)calloc(1, sizeof(stats_slot_t))) == NULL)
+		{
+			return NULL;
+		}
+		pthread_setspecific(slot_key, slot);
+		my_slot = slot;
 	}
-	
+	return my_slot;
+}
 
-	for(size_t i = BITMAP_START_BLOCK; i < BITMAP_START_BLOCK + BITMAP_NUM_BLOCKS; i++)
+// The calling thread's shard of a device, found once per device and then remembered
+static stats_shard_t *stats_shard(const block_store_t *const bs)
+{
+	static _Thread_local struct
+	{
+		const stats_state_t *state;
+		uint64_t serial;
+		stats_shard_t *shard;
+	} cached;
+	stats_state_t *const state = bs->stats;
+	if(cached.state == state && cached.serial == state->serial)
 	{
-		bitmap_set(bs->fbm, i); // We set up the bitmap at the starting block position and allocate any additional space
+		return cached.shard;
 	}
 
-	return bs;
+	const stats_slot_t *const slot = stats_slot();
+	if(slot == NULL)
+	{
+		return NULL; //Just don't count this one
+	}
+	stats_shard_t *shard = atomic_load_explicit(&state->shards, memory_order_acquire);
+	while(shard != NULL && shard->slot != slot)
+	{
+		shard = shard->next; //A shard left by an exited thread that held this slot counts on from where it was
+	}
+	if(shard == NULL)
+	{
+		if((shard = (stats_shard_t *)calloc(1, sizeof(stats_shard_t))) == NULL)
+		{
+			return NULL;
+		}
+		shard->slot = slot;
+		shard->next = atomic_load_explicit(&state->shards, memory_order_relaxed);
+		while(!atomic_compare_exchange_weak_explicit(&state->shards, &shard->next, shard, memory_order_release, memory_order_relaxed))
+		{
+		}
+	}
+	cached.state = state;
+	cached.serial = state->serial;
+	cached.shard = shard;
+	return shard;
 }
 
+// The calling thread is the only one writing its shard, readers just need whole values
+static inline void stats_add(atomic_uint_fast64_t *const counter, const uint64_t amount)
+{
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + amount, memory_order_relaxed);
+}
 
-void block_store_destroy(block_store_t *const bs)
+static void stats_record(const block_store_t *const bs, const block_store_op_t op, const uint64_t start)
 {
- 	if(bs){
-		bitmap_destroy(bs->fbm); //Frees the bitmap
-		free(bs->blocks); //Fress the block data
-		free(bs); //Frees the block_store_t object
+	if(bs == NULL || bs->stats == NULL)
+	{
+		return;
+	}
+	stats_shard_t *shard = stats_shard(bs);
+	if(shard)
+	{
+		const uint64_t ns = ticks_to_ns(stats_ticks() - start);
+		stats_add(&shard->count[op], 1);
+		stats_add(&shard->total_ns[op], ns);
+		stats_add(&shard->latency[op][histogram_bucket(ns)], 1);
 	}
 }
 
-size_t block_store_allocate(block_store_t *const bs)
+static void stats_scan(const block_store_t *const bs, const size_t bits)
 {
-	if(bs == NULL || bs->fbm == NULL)
+	stats_shard_t *shard = stats_shard(bs);
+	if(shard && bits != 0)
 	{
-		return SIZE_MAX; //If our block store is null then we return null
+		const size_t words = (bits + 63) / 64;
+		stats_add(&shard->scans, 1);
+		stats_add(&shard->words_scanned, words);
+		stats_add(&shard->scan_words[histogram_bucket(words)], 1);
 	}
- 
-	size_t block_id = bitmap_ffz(bs->fbm); //We seek out the first zero bit (i.e. the next bit that hasn't been allocated)
+}
 
-	if(block_id == SIZE_MAX)
+// Bits a scan went through from start (wrapping) until it stopped at found, or the whole map if it found nothing
+static size_t scan_distance(const size_t start, const size_t found, const size_t num_blocks)
+{
+	return found == SIZE_MAX ? num_blocks : (found + num_blocks - start) % num_blocks + 1;
+}
+
+static void stats_destroy(stats_state_t *const stats)
+{
+	if(stats)
+	{
+		stats_shard_t *shard = atomic_load(&stats->shards);
+		while(shard != NULL)
+		{
+			stats_shard_t *next = shard->next;
+			free(shard);
+			shard = next;
+		}
+		free(stats);
+	}
+}
+
+#define STATS_START() const uint64_t stats_start = stats_ticks()
+#define STATS_STOP(bs, op) stats_record((bs), (op), stats_start)
+#define STATS_SCAN(bs, bits) stats_scan((bs), (bits))
+#else
+#define STATS_START()
+#define STATS_STOP(bs, op)
+#define STATS_SCAN(bs, bits)
+#endif
+
+// Logs one change for the standby, block is the new contents for writes
+// Records only hold 32 bit counts, so longer ranges go out in pieces
+static void replicate(block_store_t *const bs, const replica_op_t op, size_t block_id, size_t count, const void *const block)
+{
+	do
+	{
+		const uint32_t piece = count > UINT32_MAX ? UINT32_MAX : (uint32_t)count;
+		const replica_record_t record = {op, piece, block_id};
+		replica_log_append(bs->replica, &record, block, false); //Once detached the standby is rebuilt from scratch, nothing to do here
+		block_id += piece;
+		count -= piece;
+	} while(count > 0);
+}
+
+// Marks changed blocks for the image file of a persistent store
+static void persist_blocks(block_store_t *const bs, const size_t block_id, const size_t count)
+{
+	if(bs->persist != NULL)
+	{
+		persist_mark(bs->persist, bs->blocks, block_id, count);
+	}
+}
+
+// Bitmap changes dirty the bitmap blocks their bits live in
+static void persist_bits(block_store_t *const bs, const size_t block_id, const size_t count)
+{
+	if(bs->persist != NULL)
+	{
+		const size_t first = BITMAP_START_BLOCK + block_id / (BLOCK_SIZE_BYTES * 8);
+		const size_t last = BITMAP_START_BLOCK + (block_id + count - 1) / (BLOCK_SIZE_BYTES * 8);
+		persist_mark(bs->persist, bs->blocks, first, last - first + 1);
+	}
+}
+
+// A persistent store's flusher thread reads the blocks, so they change, and the change is reported, between these two
+static void persist_enter(const block_store_t *const bs)
+{
+	if(bs->persist != NULL)
+	{
+		persist_lock(bs->persist);
+	}
+}
+
+static void persist_leave(const block_store_t *const bs)
+{
+	if(bs->persist != NULL)
+	{
+		persist_unlock(bs->persist);
+	}
+}
+
+// Counts the bitmap again after it was replaced wholesale, rather than changed through the functions below
+static void recount(block_store_t *const bs)
+{
+	bs->used_blocks = bitmap_total_set(bs->fbm);
+	if(bs->zones != NULL)
+	{
+		zone_map_rebuild(bs->zones, bs->fbm);
+	}
+}
+
+// Every change to the free block bitmap goes through these two so the used count stays exact
+// Callers check the bit first, setting a set bit or clearing a clear one would skew the count
+static void mark_used(block_store_t *const bs, const size_t block_id)
+{
+	persist_enter(bs);
+	bitmap_set(bs->fbm, block_id);
+	bs->used_blocks++;
+	if(bs->zones != NULL)
+	{
+		zone_map_used(bs->zones, block_id, 1);
+	}
+	if(bs->replica != NULL)
+	{
+		replicate(bs, REPLICA_OP_SET, block_id, 1, NULL);
+	}
+	persist_bits(bs, block_id, 1);
+	persist_leave(bs);
+}
+
+static void mark_free(block_store_t *const bs, const size_t block_id)
+{
+	persist_enter(bs);
+	bitmap_reset(bs->fbm, block_id);
+	bs->used_blocks--;
+	if(bs->zones != NULL)
+	{
+		zone_map_freed(bs->zones, block_id, 1);
+	}
+	if(bs->replica != NULL)
+	{
+		replicate(bs, REPLICA_OP_CLEAR, block_id, 1, NULL);
+	}
+	persist_bits(bs, block_id, 1);
+	persist_leave(bs);
+}
+
+// Whole extent versions, the range has to be entirely free (or entirely in use) already
+static void mark_used_range(block_store_t *const bs, const size_t block_id, const size_t count)
+{
+	persist_enter(bs);
+	bitmap_set_range(bs->fbm, block_id, count);
+	bs->used_blocks += count;
+	if(bs->zones != NULL)
+	{
+		zone_map_used(bs->zones, block_id, count);
+	}
+	if(bs->replica != NULL)
+	{
+		replicate(bs, REPLICA_OP_SET, block_id, count, NULL);
+	}
+	persist_bits(bs, block_id, count);
+	persist_leave(bs);
+}
+
+static void mark_free_range(block_store_t *const bs, const size_t block_id, const size_t count)
+{
+	persist_enter(bs);
+	bitmap_reset_range(bs->fbm, block_id, count);
+	bs->used_blocks -= count;
+	if(bs->zones != NULL)
+	{
+		zone_map_freed(bs->zones, block_id, count);
+	}
+	if(bs->replica != NULL)
+	{
+		replicate(bs, REPLICA_OP_CLEAR, block_id, count, NULL);
+	}
+	persist_bits(bs, block_id, count);
+	persist_leave(bs);
+}
+
+// Shared stores go through these instead of mark_used and mark_free, straight on the bitmap words
+// The bitmap is in block order byte by byte, which a big endian word load sees reversed
+// Bitmap blocks are whole words, so the last word never reaches past them
+_Static_assert(BLOCK_SIZE_BYTES % sizeof(uint64_t) == 0, "shared stores load the bitmap a word at a time");
+static _Atomic uint64_t *shared_word(const block_store_t *const bs, const size_t block_id)
+{
+	return (_Atomic uint64_t *)(bs->blocks + (BITMAP_START_BLOCK * BLOCK_SIZE_BYTES)) + block_id / 64;
+}
+
+static uint64_t shared_mask(const size_t block_id)
+{
+	const uint64_t mask = (uint64_t)1 << (block_id % 64);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	return __builtin_bswap64(mask);
+#else
+	return mask;
+#endif
+}
+
+// 64 bits of the bitmap, bit i is block word * 64 + i
+static uint64_t shared_load(const block_store_t *const bs, const size_t word)
+{
+	const uint64_t bits = atomic_load_explicit(shared_word(bs, word * 64), memory_order_acquire);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	return __builtin_bswap64(bits);
+#else
+	return bits;
+#endif
+}
+
+// Sets the bit if nobody else has, in this process or any other
+static bool shared_claim(block_store_t *const bs, const size_t block_id)
+{
+	const uint64_t mask = shared_mask(block_id);
+	if(atomic_fetch_or_explicit(shared_word(bs, block_id), mask, memory_order_acq_rel) & mask)
+	{
+		return false;
+	}
+	atomic_fetch_add_explicit(&bs->shared->used_blocks, 1, memory_order_relaxed);
+	return true;
+}
+
+static void shared_release(block_store_t *const bs, const size_t block_id)
+{
+	const uint64_t mask = shared_mask(block_id);
+	if(atomic_fetch_and_explicit(shared_word(bs, block_id), ~mask, memory_order_acq_rel) & mask)
+	{
+		atomic_fetch_sub_explicit(&bs->shared->used_blocks, 1, memory_order_relaxed);
+	}
+}
+
+// Claims the first free block at or after start, wrapping once
+// The scan only sees a snapshot, so a block another process takes first just means scanning on
+static size_t shared_allocate(block_store_t *const bs, size_t start)
+{
+	const size_t words = (bs->num_blocks + 63) / 64;
+	for(;;)
+	{
+		size_t block_id = SIZE_MAX;
+		for(size_t i = 0; i <= words && block_id == SIZE_MAX; i++) //Back to the start word last, for the bits below start
+		{
+			const size_t word = (start / 64 + i) % words;
+			uint64_t free_bits = ~shared_load(bs, word);
+			if(word == words - 1 && bs->num_blocks % 64 != 0)
+			{
+				free_bits &= ((uint64_t)1 << (bs->num_blocks % 64)) - 1; //Past the end of the device
+			}
+			if(i == 0)
+			{
+				free_bits &= ~(uint64_t)0 << (start % 64);
+			}
+			if(free_bits != 0)
+			{
+				block_id = word * 64 + __builtin_ctzll(free_bits);
+			}
+		}
+		if(block_id == SIZE_MAX || shared_claim(bs, block_id))
+		{
+			return block_id;
+		}
+		start = block_id;
+	}
+}
+
+static size_t used_blocks(const block_store_t *const bs)
+{
+	return bs->shared != NULL ? atomic_load_explicit(&bs->shared->used_blocks, memory_order_relaxed) : bs->used_blocks;
+}
+
+// Blocks needed to hold one bit per block of the device
+static size_t bitmap_blocks_for(const size_t num_blocks)
+{
+	const size_t bits_per_block = BLOCK_SIZE_BYTES * 8;
+	return (num_blocks + bits_per_block - 1) / bits_per_block;
+}
+
+// The blocks holding the free block bitmap, which must never be handed out or moved
+static bool is_bitmap_block(const block_store_t *const bs, const size_t block_id)
+{
+	return block_id >= BITMAP_START_BLOCK && block_id < BITMAP_START_BLOCK + bs->bitmap_blocks;
+}
+
+// Whether a range of blocks takes in any of the bitmap's
+static bool overlaps_bitmap(const block_store_t *const bs, const size_t block_id, const size_t count)
+{
+	return block_id < BITMAP_START_BLOCK + bs->bitmap_blocks && block_id + count > BITMAP_START_BLOCK;
+}
+
+// read and write may stop short on large transfers, so keep going until everything is through
+static bool read_all(const int fd, void *buffer, const size_t length)
+{
+	size_t done = 0;
+	while(done < length)
+	{
+		ssize_t bytes = read(fd, (uint8_t *)buffer + done, length - done);
+		if(bytes <= 0)
+		{
+			if(bytes < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			return false; //Error or the file was shorter than expected
+		}
+		done += bytes;
+	}
+	return true;
+}
+
+static bool write_all(const int fd, const void *buffer, const size_t length)
+{
+	size_t done = 0;
+	while(done < length)
+	{
+		ssize_t bytes = write(fd, (const uint8_t *)buffer + done, length - done);
+		if(bytes < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			return false;
+		}
+		done += bytes;
+	}
+	return true;
+}
+
+// Writes an image (or one piece of it at offset), leaving every all zero chunk as a hole so discarded space costs no disk either
+// The file has to be empty past offset to start with, the holes read back as zeros
+#define SPARSE_CHUNK_BYTES 4096
+static bool write_sparse(const int fd, const uint8_t *buffer, const size_t length, const size_t offset)
+{
+	static const uint8_t zeros[SPARSE_CHUNK_BYTES];
+	size_t done = 0;
+	while(done < length)
+	{
+		size_t chunk = length - done < SPARSE_CHUNK_BYTES ? length - done : SPARSE_CHUNK_BYTES;
+		if(memcmp(buffer + done, zeros, chunk) == 0)
+		{
+			done += chunk; //Hole, nothing to write
+			continue;
+		}
+		size_t end = done + chunk;
+		while(end < length)
+		{
+			chunk = length - end < SPARSE_CHUNK_BYTES ? length - end : SPARSE_CHUNK_BYTES;
+			if(memcmp(buffer + end, zeros, chunk) == 0)
+			{
+				break;
+			}
+			end += chunk; //More data, make it one write
+		}
+		if(lseek(fd, offset + done, SEEK_SET) < 0 || !write_all(fd, buffer + done, end - done))
+		{
+			return false;
+		}
+		done = end;
+	}
+	return ftruncate(fd, offset + length) == 0; //Gives the file its full size when it ends in a hole
+}
+
+// Where a block sits in an image file, behind the header page
+static off_t image_offset(const size_t block_id)
+{
+	return BLOCK_STORE_IMAGE_HEADER_BYTES + (off_t)block_id * BLOCK_SIZE_BYTES;
+}
+
+// Writes the header page of an image, the superblock and then zeros, from the start of the file
+static bool write_header(const int fd, const image_superblock_t *const sb)
+{
+	uint8_t page[BLOCK_STORE_IMAGE_HEADER_BYTES] = {0};
+	memcpy(page, sb, sizeof(*sb));
+	return lseek(fd, 0, SEEK_SET) == 0 && write_all(fd, page, sizeof(page));
+}
+
+// Whether the bitmap in a file marks its own blocks as used, reading only the bytes that hold those bits
+static bool bitmap_claims_itself(const int fd, const off_t data_offset, const size_t bitmap_blocks)
+{
+	const off_t bitmap_offset = data_offset + (off_t)BITMAP_START_BLOCK * BLOCK_SIZE_BYTES;
+	uint8_t chunk[4096];
+	size_t chunk_first = SIZE_MAX; //Byte of the bitmap chunk[0] holds
+	for(size_t bit = BITMAP_START_BLOCK; bit < BITMAP_START_BLOCK + bitmap_blocks; bit++)
+	{
+		const size_t byte = bit / 8;
+		if(chunk_first == SIZE_MAX || byte >= chunk_first + sizeof(chunk))
+		{
+			chunk_first = byte;
+			const size_t want = (BITMAP_START_BLOCK + bitmap_blocks - 1) / 8 - byte + 1;
+			const size_t length = want < sizeof(chunk) ? want : sizeof(chunk);
+			if(pread(fd, chunk, length, bitmap_offset + (off_t)byte) != (ssize_t)length)
+			{
+				return false;
+			}
+		}
+		if(!(chunk[byte - chunk_first] & (1u << (bit % 8))))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// A raw image from before images had a header: whole blocks, room for the bitmap, and the bitmap holding its own blocks
+static bool is_legacy_image(const int fd, const size_t size)
+{
+	const size_t num_blocks = size / BLOCK_SIZE_BYTES;
+	return size % BLOCK_SIZE_BYTES == 0 && num_blocks >= BITMAP_START_BLOCK + bitmap_blocks_for(num_blocks)
+		&& bitmap_claims_itself(fd, 0, bitmap_blocks_for(num_blocks));
+}
+
+// Reads and checks an image's superblock and that the file is as long as it says, leaving the file at the first block
+// Only the header is read, the blocks are left to whoever loads them
+static block_store_image_status_t read_superblock(const int fd, image_superblock_t *const sb)
+{
+	struct stat st;
+	if(fstat(fd, &st) != 0)
+	{
+		return BLOCK_STORE_IMAGE_UNREADABLE;
+	}
+	block_store_image_status_t status = BLOCK_STORE_IMAGE_UNREADABLE;
+	if((size_t)st.st_size >= sizeof(*sb) && pread(fd, sb, sizeof(*sb), 0) == (ssize_t)sizeof(*sb))
+	{
+		status = image_superblock_check(sb, BLOCK_SIZE_BYTES);
+	}
+	if(status == BLOCK_STORE_IMAGE_UNREADABLE || status == BLOCK_STORE_IMAGE_BAD_MAGIC)
+	{
+		return is_legacy_image(fd, st.st_size) ? BLOCK_STORE_IMAGE_LEGACY : status;
+	}
+	if(status != BLOCK_STORE_IMAGE_OK)
+	{
+		return status;
+	}
+	if((uint64_t)st.st_size != sb->header_bytes + sb->file_blocks * BLOCK_SIZE_BYTES)
+	{
+		return BLOCK_STORE_IMAGE_BAD_GEOMETRY; //Cut short, or something tacked on
+	}
+	return lseek(fd, sb->header_bytes, SEEK_SET) == (off_t)sb->header_bytes ? BLOCK_STORE_IMAGE_OK : BLOCK_STORE_IMAGE_UNREADABLE;
+}
+
+// Smallest order whose block holds count blocks
+static unsigned extent_order(const size_t count)
+{
+	unsigned order = 0;
+	while(((size_t)1 << order) < count)
+	{
+		order++;
+	}
+	return order;
+}
+
+// Scans forward from start for a free block, wrapping around the end of the device once
+// Zones with nothing free are skipped without looking at their bits
+static size_t find_free_from(const block_store_t *const bs, const size_t start)
+{
+	size_t block_id = zone_map_next_free(bs->zones, bs->fbm, start);
+	if(block_id == SIZE_MAX && start > 0)
+	{
+		block_id = zone_map_next_free(bs->zones, bs->fbm, 0); //Nothing past start, try again from the front
+	}
+	return block_id; //SIZE_MAX when every block is in use
+}
+
+// Closest free block to the goal, checking both sides so related data ends up next to each other
+static size_t find_free_near(const block_store_t *const bs, const size_t goal)
+{
+	const size_t above = zone_map_next_free(bs->zones, bs->fbm, goal);
+	if(above == goal || goal == 0)
+	{
+		return above;
+	}
+	//Below the goal only blocks strictly closer than the one above can win, ties go up, the direction sequential data grows in
+	const size_t below = zone_map_prev_free(bs->zones, bs->fbm, goal - 1);
+	return below != SIZE_MAX && (above == SIZE_MAX || goal - below < above - goal) ? below : above;
+}
+
+// Brings a single block into memory if it is still only in the image file
+// When the caller is about to overwrite the whole block we skip the read entirely
+static bool lazy_fault(lazy_state_t *const lazy, uint8_t *const blocks, const size_t block_id, const bool overwrite)
+{
+	bool success = true;
+	pthread_mutex_lock(&lazy->lock);
+	if(!bitmap_test(lazy->resident, block_id))
+	{
+		if(!overwrite)
+		{
+			ssize_t bytes_read = pread(lazy->fd, blocks + (block_id * BLOCK_SIZE_BYTES), BLOCK_SIZE_BYTES, image_offset(block_id));
+			success = (bytes_read == BLOCK_SIZE_BYTES);
+		}
+		if(success)
+		{
+			bitmap_set(lazy->resident, block_id);
+			atomic_fetch_sub_explicit(&lazy->missing, 1, memory_order_release); //Publishes the block contents along with the count
+		}
+	}
+	pthread_mutex_unlock(&lazy->lock);
+	return success;
+}
+
+// Returns the address of a block, faulting it in first if the store is still loading
+static uint8_t *block_data(const block_store_t *const bs, const size_t block_id, const bool overwrite)
+{
+	if(bs->lazy != NULL && atomic_load_explicit(&bs->lazy->missing, memory_order_acquire) != 0)
+	{
+		if(!lazy_fault(bs->lazy, bs->blocks, block_id, overwrite))
+		{
+			return NULL; //Could not read the block back from the image
+		}
+	}
+	return bs->blocks + (block_id * BLOCK_SIZE_BYTES);
+}
+
+// Brings the blocks from first up to end in with one read of the image per chunk rather than one per block
+// The chunk is read outside the lock and only blocks that are still missing get copied over, as a
+// write may have made the others resident, and newer than the image, in the meantime
+static bool lazy_fault_range(lazy_state_t *const lazy, uint8_t *const blocks, size_t first, const size_t end)
+{
+	uint8_t chunk[PREFETCH_CHUNK_BLOCKS * BLOCK_SIZE_BYTES];
+	for(; first < end; first += PREFETCH_CHUNK_BLOCKS)
+	{
+		const size_t count = end - first < PREFETCH_CHUNK_BLOCKS ? end - first : PREFETCH_CHUNK_BLOCKS;
+		pthread_mutex_lock(&lazy->lock);
+		const bool resident = bitmap_test_range_all(lazy->resident, first, count);
+		pthread_mutex_unlock(&lazy->lock);
+		if(resident)
+		{
+			continue;
+		}
+		if(pread(lazy->fd, chunk, count * BLOCK_SIZE_BYTES, image_offset(first)) != (ssize_t)(count * BLOCK_SIZE_BYTES))
+		{
+			return false;
+		}
+		size_t loaded = 0;
+		pthread_mutex_lock(&lazy->lock);
+		for(size_t i = 0; i < count; i++)
+		{
+			if(!bitmap_test(lazy->resident, first + i))
+			{
+				memcpy(blocks + (first + i) * BLOCK_SIZE_BYTES, chunk + i * BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES);
+				bitmap_set(lazy->resident, first + i);
+				loaded++;
+			}
+		}
+		atomic_fetch_sub_explicit(&lazy->missing, loaded, memory_order_release);
+		pthread_mutex_unlock(&lazy->lock);
+	}
+	return true;
+}
+
+static bool lazy_resident(lazy_state_t *const lazy, const size_t block_id)
+{
+	pthread_mutex_lock(&lazy->lock);
+	const bool resident = bitmap_test(lazy->resident, block_id);
+	pthread_mutex_unlock(&lazy->lock);
+	return resident;
+}
+
+// Works through the hinted ranges until it is stopped
+static void *lazy_prefetcher(void *arg)
+{
+	block_store_t *bs = (block_store_t *)arg;
+	lazy_state_t *lazy = bs->lazy;
+	pthread_mutex_lock(&lazy->lock);
+	while(!lazy->stop_prefetcher)
+	{
+		if(lazy->prefetch_queued == 0)
+		{
+			pthread_cond_wait(&lazy->prefetch_wake, &lazy->lock);
+			continue;
+		}
+		const size_t first = lazy->prefetch_first[lazy->prefetch_head];
+		const size_t end = lazy->prefetch_end[lazy->prefetch_head];
+		lazy->prefetch_head = (lazy->prefetch_head + 1) % PREFETCH_QUEUE;
+		lazy->prefetch_queued--;
+		pthread_mutex_unlock(&lazy->lock);
+		lazy_fault_range(lazy, bs->blocks, first, end); //A failed read leaves the blocks to fault on demand
+		pthread_mutex_lock(&lazy->lock);
+	}
+	pthread_mutex_unlock(&lazy->lock);
+	return NULL;
+}
+
+// Asks the kernel to start reading a range of the image and queues it for the prefetch thread
+static void lazy_prefetch(const block_store_t *const bs, const size_t first, const size_t end)
+{
+	lazy_state_t *const lazy = bs->lazy;
+	posix_fadvise(lazy->fd, image_offset(first), (end - first) * BLOCK_SIZE_BYTES, POSIX_FADV_WILLNEED);
+	pthread_mutex_lock(&lazy->lock);
+	if(!lazy->has_prefetcher && !lazy->stop_prefetcher)
+	{
+		lazy->has_prefetcher = (pthread_create(&lazy->prefetcher, NULL, lazy_prefetcher, (void *)bs) == 0);
+	}
+	if(lazy->has_prefetcher && lazy->prefetch_queued < PREFETCH_QUEUE)
+	{
+		const size_t slot = (lazy->prefetch_head + lazy->prefetch_queued) % PREFETCH_QUEUE;
+		lazy->prefetch_first[slot] = first;
+		lazy->prefetch_end[slot] = end;
+		lazy->prefetch_queued++;
+		pthread_cond_signal(&lazy->prefetch_wake);
+	}
+	pthread_mutex_unlock(&lazy->lock);
+}
+
+// Stops the prefetch thread, dropping whatever is still queued, before the blocks move or go away
+static void lazy_stop_prefetcher(lazy_state_t *const lazy)
+{
+	pthread_mutex_lock(&lazy->lock);
+	lazy->stop_prefetcher = true;
+	lazy->prefetch_queued = 0;
+	pthread_cond_signal(&lazy->prefetch_wake);
+	const bool running = lazy->has_prefetcher;
+	lazy->has_prefetcher = false;
+	pthread_mutex_unlock(&lazy->lock);
+	if(running)
+	{
+		pthread_join(lazy->prefetcher, NULL);
+	}
+}
+
+// Gets the blocks from first up to end on their way: a lazy store still loading reads them from
+// the image in the background, a resident one just pulls them towards the cache
+static void prefetch_blocks(const block_store_t *const bs, const size_t first, const size_t end)
+{
+	if(bs->lazy != NULL && atomic_load_explicit(&bs->lazy->missing, memory_order_acquire) != 0)
+	{
+		lazy_prefetch(bs, first, end);
+	}
+	else
+	{
+		block_memory_prefetch(&bs->memory, first * BLOCK_SIZE_BYTES, (end - first) * BLOCK_SIZE_BYTES);
+	}
+}
+
+// Follows the scans reading through the store; once one reads two blocks in a row its window opens at
+// BLOCK_STORE_READAHEAD_MIN_BLOCKS, and every time the reader comes within half a window of what was
+// prefetched the window doubles (up to the maximum) and is topped up from there
+// A lazy store reader that gets to a block before the prefetch thread does reads the whole window itself
+static void readahead_access(const block_store_t *const bs, const size_t block_id)
+{
+	readahead_t *const readahead = bs->readahead;
+	size_t first = 0;
+	size_t end = 0;
+	pthread_mutex_lock(&readahead->lock);
+	if(readahead->max_window == 0)
+	{
+		pthread_mutex_unlock(&readahead->lock);
+		return;
+	}
+	readahead_stream_t *stream = &readahead->streams[0];
+	for(size_t i = 0; i < READAHEAD_STREAMS && stream->next != block_id; i++)
+	{
+		if(readahead->streams[i].next == block_id || readahead->streams[i].used < stream->used)
+		{
+			stream = &readahead->streams[i];
+		}
+	}
+	if(stream->next == block_id)
+	{
+		const bool opening = (stream->window == 0);
+		if(opening)
+		{
+			stream->window = BLOCK_STORE_READAHEAD_MIN_BLOCKS < readahead->max_window ? BLOCK_STORE_READAHEAD_MIN_BLOCKS : readahead->max_window;
+		}
+		if(stream->ahead < block_id + 1 + stream->window / 2)
+		{
+			if(!opening)
+			{
+				stream->window = 2 * stream->window < readahead->max_window ? 2 * stream->window : readahead->max_window;
+			}
+			first = stream->ahead > block_id ? stream->ahead : block_id;
+			end = block_id + 1 + stream->window;
+			end = end < bs->num_blocks ? end : bs->num_blocks;
+			stream->ahead = end;
+		}
+		stream->next = block_id + 1;
+	}
+	else
+	{
+		stream->next = block_id + 1; //A scan may be starting here, we'll know on its next read
+		stream->ahead = block_id + 1;
+		stream->window = 0;
+	}
+	stream->used = ++readahead->clock;
+	const size_t window_end = stream->window == 0 ? 0 : stream->ahead;
+	pthread_mutex_unlock(&readahead->lock);
+
+	if(window_end != 0 && bs->lazy != NULL && atomic_load_explicit(&bs->lazy->missing, memory_order_acquire) != 0 && !lazy_resident(bs->lazy, block_id))
+	{
+		lazy_fault_range(bs->lazy, bs->blocks, block_id, window_end); //Failures are left to block_data to report
+	}
+	else if(first < end)
+	{
+		prefetch_blocks(bs, first, end);
+	}
+}
+
+// Zeroes a run of free blocks, widened to whole pages when the rest of their blocks are free as well,
+// so block_memory_discard can give those pages back rather than just clearing them
+static void discard_free_run(block_store_t *const bs, size_t first, size_t end)
+{
+	size_t page_blocks = block_memory_page_size() / BLOCK_SIZE_BYTES;
+	page_blocks = page_blocks == 0 ? 1 : page_blocks;
+	const size_t page_first = first - first % page_blocks;
+	if(!bitmap_test_range_any(bs->fbm, page_first, first - page_first))
+	{
+		first = page_first;
+	}
+	size_t page_end = (end + page_blocks - 1) / page_blocks * page_blocks;
+	page_end = page_end > bs->num_blocks ? bs->num_blocks : page_end;
+	if(!bitmap_test_range_any(bs->fbm, end, page_end - end))
+	{
+		end = page_end;
+	}
+	if(bs->lazy != NULL && atomic_load_explicit(&bs->lazy->missing, memory_order_acquire) != 0)
+	{
+		for(size_t i = first; i < end; i++)
+		{
+			lazy_fault(bs->lazy, bs->blocks, i, true); //Zeros from here on, never read them from the image
+		}
+	}
+	persist_enter(bs);
+	block_memory_discard(&bs->memory, first * BLOCK_SIZE_BYTES, (end - first) * BLOCK_SIZE_BYTES);
+	if(bs->replica != NULL)
+	{
+		replicate(bs, REPLICA_OP_ZERO, first, end - first, NULL);
+	}
+	if(bs->persist != NULL)
+	{
+		persist_zero(bs->persist, bs->blocks, first, end - first);
+	}
+	persist_leave(bs);
+}
+
+// Faults in every block that is not resident yet, in batches so foreground calls can interleave
+static void *lazy_loader(void *arg)
+{
+	block_store_t *bs = (block_store_t *)arg;
+	lazy_state_t *lazy = bs->lazy;
+	for(size_t start = 0; start < bs->num_blocks && !atomic_load(&lazy->stop_loader); start += LAZY_LOAD_BATCH_BLOCKS)
+	{
+		for(size_t i = start; i < start + LAZY_LOAD_BATCH_BLOCKS && i < bs->num_blocks; i++)
+		{
+			lazy_fault(lazy, bs->blocks, i, false);
+		}
+	}
+	return NULL;
+}
+
+// Makes every block resident, a no-op for stores that were never lazy
+static bool load_all_blocks(const block_store_t *const bs)
+{
+	for(size_t i = 0; bs->lazy != NULL && i < bs->num_blocks; i++)
+	{
+		if(block_data(bs, i, false) == NULL)
+		{
+			return false; //Stop at the first block the image could not give us
+		}
+	}
+	return true;
+}
+
+static void lazy_destroy(lazy_state_t *const lazy)
+{
+	if(lazy)
+	{
+		lazy_stop_prefetcher(lazy);
+		if(lazy->has_loader)
+		{
+			atomic_store(&lazy->stop_loader, true);
+			pthread_join(lazy->loader, NULL); //The loader only ever runs while the store exists
+		}
+		pthread_cond_destroy(&lazy->prefetch_wake);
+		pthread_mutex_destroy(&lazy->lock);
+		bitmap_destroy(lazy->resident);
+		close(lazy->fd);
+		free(lazy);
+	}
+}
+
+static void readahead_destroy(readahead_t *const readahead)
+{
+	if(readahead)
+	{
+		pthread_mutex_destroy(&readahead->lock);
+		free(readahead);
+	}
+}
+
+// The device itself without any blocks yet, every way of making a store starts here
+static block_store_t *store_alloc(const size_t num_blocks)
+{
+	block_store_t *bs = (block_store_t *)calloc(1, sizeof(block_store_t));
+	if(bs == NULL)
+	{
+		perror("Failed to allocate memory for block store");
+		return NULL; //Failed allocation.
+	}
+	bs->num_blocks = num_blocks;
+	bs->bitmap_blocks = bitmap_blocks_for(num_blocks);
+#ifdef BLOCK_STORE_STATS
+	pthread_once(&ticks_once, sample_ticks);
+	bs->stats = (stats_state_t *)calloc(1, sizeof(stats_state_t));
+	if(bs->stats == NULL)
+	{
+		free(bs);
+		return NULL;
+	}
+	bs->stats->serial = atomic_fetch_add_explicit(&next_serial, 1, memory_order_relaxed);
+#endif
+	return bs;
+}
+
+block_store_t *block_store_create()
+{
+	return block_store_create_with(NULL); //Defaults to the first fit bitmap allocator
+}
+
+block_store_t *block_store_create_with(const block_store_options_t *const options)
+{
+	size_t num_blocks = BLOCK_STORE_NUM_BLOCKS;
+	if(options != NULL && options->num_blocks != 0)
+	{
+		num_blocks = options->num_blocks;
+	}
+	if(num_blocks < BITMAP_START_BLOCK + bitmap_blocks_for(num_blocks))
+	{
+		return NULL; //Too small to hold its own bitmap where it belongs
+	}
+
+	block_store_t *bs = store_alloc(num_blocks);
+	if(bs == NULL)
+	{
+		return NULL; //Failed allocation.
+	}
+
+	if(!block_memory_create(&bs->memory, num_blocks * BLOCK_SIZE_BYTES, options))
+        {	
+		perror("Failed to allocate memory for the blocks for our block store");
+		block_store_destroy(bs);
+           	return NULL; //Failed allocation
+        }
+	bs->blocks = bs->memory.data;
+
+
+	bs->fbm = bitmap_overlay(num_blocks, bs->blocks + (BITMAP_START_BLOCK * BLOCK_SIZE_BYTES)); //This creates a bitmap depending on the total number of bytes from the set of blocks
+
+	if(bs->fbm == NULL)
+	{	
+		perror("Failed to create bitmap overlay");
+		block_store_destroy(bs); //Free the allocated data
+		return NULL; //Failed allocation
+	}
+	bs->zones = zone_map_create(num_blocks);
+	if(bs->zones == NULL)
+	{
+		block_store_destroy(bs);
+		return NULL;
+	}
+	zone_map_rebuild(bs->zones, bs->fbm); //Every zone starts out free
+	
+
+	mark_used_range(bs, BITMAP_START_BLOCK, bs->bitmap_blocks); // We set up the bitmap at the starting block position and allocate any additional space
+
+	if(options != NULL)
+	{
+		bs->policy = options->policy;
+		bs->discard = options->discard;
+	}
+
+	if(options != NULL && options->allocator == BLOCK_STORE_ALLOCATOR_BUDDY)
+	{
+		bs->buddy = buddy_create(num_blocks); //Starts fully allocated, so we only hand it the free blocks
+		if(bs->buddy == NULL)
+		{
+			perror("Failed to create buddy allocator");
+			block_store_destroy(bs);
+			return NULL;
+		}
+		for(size_t i = bitmap_next_zero(bs->fbm, 0); i != SIZE_MAX; i = bitmap_next_zero(bs->fbm, i + 1))
+		{
+			buddy_free(bs->buddy, i, 0); //Coalescing builds the largest blocks around the bitmap for us
+		}
+	}
+
+	return bs;
+}
+
+
+block_store_t *block_store_create_shared(const char *const name, const block_store_options_t *const options)
+{
+	size_t num_blocks = (options != NULL && options->num_blocks != 0) ? options->num_blocks : BLOCK_STORE_NUM_BLOCKS;
+	if(name == NULL || (options != NULL && options->allocator == BLOCK_STORE_ALLOCATOR_BUDDY)
+		|| num_blocks < BITMAP_START_BLOCK + bitmap_blocks_for(num_blocks) || sizeof(shared_header_t) > block_memory_page_size())
+	{
+		return NULL;
+	}
+	block_store_t *bs = store_alloc(num_blocks);
+	if(bs == NULL)
+	{
+		return NULL;
+	}
+	if(!block_memory_create_shared(&bs->memory, name, num_blocks * BLOCK_SIZE_BYTES, options != NULL && options->prefault))
+	{
+		perror("Failed to create the shared memory segment");
+		block_store_destroy(bs);
+		return NULL;
+	}
+	bs->blocks = bs->memory.data;
+	bs->fbm = bitmap_overlay(num_blocks, bs->blocks + (BITMAP_START_BLOCK * BLOCK_SIZE_BYTES));
+	if(bs->fbm == NULL)
+	{
+		block_store_destroy(bs);
+		block_memory_unlink_shared(name);
+		return NULL;
+	}
+	mark_used_range(bs, BITMAP_START_BLOCK, bs->bitmap_blocks); //Nobody else can see the segment before ready is set
+	bs->policy = options != NULL ? options->policy : BLOCK_STORE_POLICY_FIRST_FIT;
+
+	shared_header_t *header = (shared_header_t *)bs->memory.header;
+	memcpy(header->magic, SHARED_MAGIC, sizeof(header->magic));
+	header->num_blocks = num_blocks;
+	atomic_init(&header->used_blocks, bs->used_blocks);
+	atomic_store_explicit(&header->ready, true, memory_order_release);
+	bs->shared = header;
+	return bs;
+}
+
+block_store_t *block_store_attach(const char *const name)
+{
+	block_memory_t memory;
+	if(name == NULL || !block_memory_attach_shared(&memory, name))
+	{
+		return NULL;
+	}
+	shared_header_t *header = (shared_header_t *)memory.header;
+	const size_t num_blocks = header->num_blocks;
+	if(!atomic_load_explicit(&header->ready, memory_order_acquire) || memcmp(header->magic, SHARED_MAGIC, sizeof(header->magic)) != 0
+		|| num_blocks > memory.length / BLOCK_SIZE_BYTES || num_blocks < BITMAP_START_BLOCK + bitmap_blocks_for(num_blocks))
+	{
+		block_memory_destroy(&memory);
+		return NULL; //Not a block store, or one still being set up
+	}
+	block_store_t *bs = store_alloc(num_blocks);
+	if(bs == NULL)
+	{
+		block_memory_destroy(&memory);
+		return NULL;
+	}
+	bs->memory = memory;
+	bs->blocks = memory.data;
+	bs->fbm = bitmap_overlay(num_blocks, bs->blocks + (BITMAP_START_BLOCK * BLOCK_SIZE_BYTES));
+	if(bs->fbm == NULL)
+	{
+		block_store_destroy(bs);
+		return NULL;
+	}
+	bs->shared = header;
+	return bs;
+}
+
+bool block_store_unlink_shared(const char *const name)
+{
+	return name != NULL && block_memory_unlink_shared(name);
+}
+
+void block_store_destroy(block_store_t *const bs)
+{
+ 	if(bs){
+		replica_log_destroy(bs->replica); //Ships what is left, the standby outlives us
+		persist_destroy(bs->persist, bs->blocks); //Whatever is still buffered goes to the image
+		lazy_destroy(bs->lazy); //Stops the background loader before the blocks go away
+		readahead_destroy(bs->readahead);
+		buddy_destroy(bs->buddy);
+		zone_map_destroy(bs->zones);
+#ifdef BLOCK_STORE_STATS
+		stats_destroy(bs->stats);
+#endif
+		bitmap_destroy(bs->fbm); //Frees the bitmap
+		block_memory_destroy(&bs->memory); //Fress the block data
+		free(bs); //Frees the block_store_t object
+	}
+}
+
+size_t block_store_allocate(block_store_t *const bs)
+{
+	if(bs == NULL || bs->fbm == NULL)
+	{
+		return SIZE_MAX; //If our block store is null then we return null
+	}
+ 
+	STATS_START();
+	size_t block_id;
+	size_t start = 0; //Where the bitmap scan began
+	if(bs->buddy != NULL)
+	{
+		block_id = buddy_alloc(bs->buddy, 0); //Smallest free block, split down to a single one
+	}
+	else if(bs->policy == BLOCK_STORE_POLICY_NEXT_FIT)
+	{
+		start = bs->next_fit;
+		block_id = bs->shared ? shared_allocate(bs, start) : find_free_from(bs, start); //Carry on from where the last allocation left off
+	}
+	else if(bs->policy == BLOCK_STORE_POLICY_ROUND_ROBIN)
+	{
+		start = bs->next_group * BLOCK_STORE_GROUP_BLOCKS;
+		block_id = bs->shared ? shared_allocate(bs, start) : find_free_from(bs, start); //Each call starts in the next group
+		bs->next_group = (bs->next_group + 1) % ((bs->num_blocks + BLOCK_STORE_GROUP_BLOCKS - 1) / BLOCK_STORE_GROUP_BLOCKS);
+	}
+	else if(bs->shared != NULL)
+	{
+		block_id = shared_allocate(bs, 0); //Already claimed, other processes may be allocating at the same time
+	}
+	else
+	{
+		block_id = zone_map_next_free(bs->zones, bs->fbm, 0); //We seek out the first zero bit (i.e. the next bit that hasn't been allocated), from the first zone with one
+	}
+	STATS_SCAN(bs, bs->buddy != NULL ? 0 : scan_distance(start, block_id, bs->num_blocks));
+
+	if(block_id == SIZE_MAX)
+	{
+		STATS_STOP(bs, BLOCK_STORE_OP_ALLOCATE);
+		trace_record(TRACE_OP_ALLOCATE, 0, SIZE_MAX);
+		return SIZE_MAX; //We return this if all bits have been allocated
+	}
+	
+	
+	if(bs->shared == NULL)
+	{
+		mark_used(bs, block_id); //Allocate the bit on the bitmap at the next zero bit found in block_id if all bits haven't been allocated
+	}
+	bs->next_fit = (block_id + 1) % bs->num_blocks;
+
+	STATS_STOP(bs, BLOCK_STORE_OP_ALLOCATE);
+	trace_record(TRACE_OP_ALLOCATE, 0, block_id);
+	return block_id; //Return the id of the block that was allocated on the bitmap
+}
+
+size_t block_store_allocate_near(block_store_t *const bs, const size_t hint)
+{
+	if(bs == NULL || bs->fbm == NULL)
+	{
+		return SIZE_MAX;
+	}
+	if(hint >= bs->num_blocks)
+	{
+		return block_store_allocate(bs); //No usable goal, fall back to the normal policy
+	}
+
+	STATS_START();
+	size_t block_id = bs->shared ? shared_allocate(bs, hint) : find_free_near(bs, hint); //Shared stores settle for the first free block at or after hint
+	STATS_SCAN(bs, block_id == SIZE_MAX ? bs->num_blocks : 2 * (block_id > hint ? block_id - hint : hint - block_id) + 1);
+	if(block_id == SIZE_MAX || (bs->buddy != NULL && !buddy_claim(bs->buddy, block_id)))
+	{
+		STATS_STOP(bs, BLOCK_STORE_OP_ALLOCATE);
+		trace_record(TRACE_OP_ALLOCATE_NEAR, hint, SIZE_MAX);
+		return SIZE_MAX; //Full, or the buddy allocator disagrees with the bitmap
+	}
+	if(bs->shared == NULL)
+	{
+		mark_used(bs, block_id);
+	}
+	STATS_STOP(bs, BLOCK_STORE_OP_ALLOCATE);
+	trace_record(TRACE_OP_ALLOCATE_NEAR, hint, block_id);
+	return block_id;
+}
+
+bool block_store_set_policy(block_store_t *const bs, const block_store_policy_t policy)
+{
+	if(bs == NULL || policy > BLOCK_STORE_POLICY_ROUND_ROBIN)
+	{
+		return false;
+	}
+	bs->policy = policy;
+	return true;
+}
+
+// Takes a free block out of the bitmap and the buddy lists, with none of the stats or trace a request records
+static bool claim_block(block_store_t *const bs, const size_t block_id)
+{
+	if(bs->buddy != NULL && !buddy_claim(bs->buddy, block_id))
+	{
+		return false; //The allocator disagrees with the bitmap, don't make it worse
+	}
+	mark_used(bs, block_id);
+	return true;
+}
+
+bool block_store_request(block_store_t *const bs, const size_t block_id)
+{	
+	if(bs != NULL && bs->shared != NULL)
+	{
+		const bool claimed = block_id < bs->num_blocks && shared_claim(bs, block_id); //Testing first would race with other processes
+		trace_record(TRACE_OP_REQUEST, block_id, claimed);
+		return claimed;
+	}
+	if(bs != NULL) //Check to seen if the block store is null if it is we assume that the bitmap is allocated since that would have to been allocated to a block store via the block store create function
+	{
+		if(block_id < bs->num_blocks) //Check if in-bounds
+		{
+			if(bitmap_test(bs->fbm, block_id) == false) //We see if the bit hasn't been allocated
+			{
+				STATS_START();
+				const bool claimed = claim_block(bs, block_id); //Allocate the bit on the bitmap
+				STATS_STOP(bs, BLOCK_STORE_OP_ALLOCATE);
+				trace_record(TRACE_OP_REQUEST, block_id, claimed);
+				return claimed; //Return true since the requested bit was allocated through the request
+			}
+		}
+		trace_record(TRACE_OP_REQUEST, block_id, 0);
+	}
+	return false; //Since block store is null there is nothing to find or that block has been allocated
+}
+
+// Gives a block in use back to the bitmap and the buddy lists, the counterpart of claim_block
+static void free_block(block_store_t *const bs, const size_t block_id)
+{
+	if(bs->buddy != NULL)
+	{
+		buddy_free(bs->buddy, block_id, 0); //Only free blocks we own, a double free would corrupt the free lists
+	}
+	mark_free(bs, block_id); //We set the bit at the provided position to 0 (i.e. we deallocated it)
+	if(bs->discard)
+	{
+		discard_free_run(bs, block_id, block_id + 1);
+	}
+}
+
+// Release without the trace record, for calls that already traced themselves
+static void release_block(block_store_t *const bs, const size_t block_id)
+{
+	if(bs->shared != NULL)
+	{
+		if(block_id < bs->num_blocks && !is_bitmap_block(bs, block_id))
+		{
+			shared_release(bs, block_id);
+		}
+		return;
+	}
+	if(block_id < bs->num_blocks && bitmap_test(bs->fbm, block_id) && !is_bitmap_block(bs, block_id)){ //Releasing a free block changes nothing, and the bitmap's own blocks are never ours to give back
+		STATS_START();
+		free_block(bs, block_id);
+		STATS_STOP(bs, BLOCK_STORE_OP_RELEASE);
+	}
+}
+
+void block_store_release(block_store_t *const bs, const size_t block_id)
+{
+	if(bs != NULL) //511 since we have 512 blocks
+        {
+		trace_record(TRACE_OP_RELEASE, block_id, 0);
+		release_block(bs, block_id);
+	}
+}
+
+size_t block_store_allocate_extent(block_store_t *const bs, const size_t count)
+{
+	if(bs == NULL || bs->shared != NULL || count == 0 || count > bs->num_blocks)
+	{
+		return SIZE_MAX;
+	}
+
+	STATS_START();
+	size_t length = count;
+	size_t block_id;
+	if(bs->buddy != NULL)
+	{
+		unsigned order = extent_order(count);
+		length = (size_t)1 << order; //Buddy blocks only come in powers of two
+		block_id = buddy_alloc(bs->buddy, order);
+	}
+	else
+	{
+		block_id = zone_map_find_run(bs->zones, bs->fbm, count);
+		STATS_SCAN(bs, block_id == SIZE_MAX ? bs->num_blocks : block_id + count);
+	}
+
+	if(block_id == SIZE_MAX)
+	{
+		STATS_STOP(bs, BLOCK_STORE_OP_ALLOCATE);
+		trace_record(TRACE_OP_ALLOCATE_EXTENT, count, SIZE_MAX);
+		return SIZE_MAX; //No run long enough
+	}
+	mark_used_range(bs, block_id, length);
+	STATS_STOP(bs, BLOCK_STORE_OP_ALLOCATE);
+	trace_record(TRACE_OP_ALLOCATE_EXTENT, count, block_id);
+	return block_id;
+}
+
+void block_store_release_extent(block_store_t *const bs, const size_t block_id, const size_t count)
+{
+	if(bs == NULL || count == 0 || block_id >= bs->num_blocks)
+	{
+		return;
+	}
+
+	trace_record(TRACE_OP_RELEASE_EXTENT, block_id, count);
+	size_t length = count;
+	if(bs->buddy != NULL)
+	{
+		length = (size_t)1 << extent_order(count); //Same rounding as the allocation
+	}
+	if(length > bs->num_blocks - block_id)
+	{
+		length = bs->num_blocks - block_id;
+	}
+	if(bs->buddy == NULL && bs->shared == NULL && !overlaps_bitmap(bs, block_id, length) && bitmap_test_range_all(bs->fbm, block_id, length))
+	{
+		STATS_START();
+		mark_free_range(bs, block_id, length); //The usual case, the whole extent is still ours
+		if(bs->discard)
+		{
+			discard_free_run(bs, block_id, block_id + length);
+		}
+		STATS_STOP(bs, BLOCK_STORE_OP_RELEASE);
+		return;
+	}
+	for(size_t i = block_id; i < block_id + length; i++)
+	{
+		release_block(bs, i); //Releasing one at a time lets the buddies coalesce back up, and skips holes
+	}
+}
+
+size_t block_store_discard(block_store_t *const bs, const size_t block_id, const size_t count)
+{
+	if(bs == NULL || bs->shared != NULL || block_id >= bs->num_blocks)
+	{
+		return SIZE_MAX;
+	}
+	const size_t end = count > bs->num_blocks - block_id ? bs->num_blocks : block_id + count;
+	size_t discarded = 0;
+	size_t start = bitmap_next_zero(bs->fbm, block_id);
+	while(start < end) //SIZE_MAX once there are no free blocks left
+	{
+		size_t run_end = bitmap_next_set(bs->fbm, start);
+		run_end = run_end > end ? end : run_end;
+		discard_free_run(bs, start, run_end);
+		discarded += run_end - start;
+		start = bitmap_next_zero(bs->fbm, run_end);
+	}
+	return discarded;
+}
+
+size_t block_store_defrag(block_store_t *const bs, const size_t max_moves, void (*relocate)(size_t, size_t, void *), void *arg)
+{
+	if(bs == NULL || bs->shared != NULL)
+	{
+		return 0;
+	}
+	if(!bs->defrag_active)
+	{
+		bs->defrag_active = true; //Start a new pass from the bottom of the device
+		bs->defrag_low = 0;
+	}
+
+	//Blocks slide down in order, the lowest block in use above the lowest hole fills it,
+	// so extents stay contiguous and in the same order they were in before
+	//Foreground calls may have changed anything between slices, so every position is checked again here
+	size_t moves = 0;
+	while(moves < max_moves)
+	{
+		const size_t new_id = bitmap_next_zero(bs->fbm, bs->defrag_low); //The bitmap blocks are always in use, never a hole
+		size_t old_id = new_id == SIZE_MAX ? SIZE_MAX : bitmap_next_set(bs->fbm, new_id);
+		if(old_id != SIZE_MAX && is_bitmap_block(bs, old_id))
+		{
+			old_id = bitmap_next_set(bs->fbm, BITMAP_START_BLOCK + bs->bitmap_blocks); //Those stay where they are
+		}
+		if(old_id == SIZE_MAX)
+		{
+			bs->defrag_active = false; //Everything movable is packed at the low end
+			break;
+		}
+		bs->defrag_low = new_id;
+
+		const uint8_t *source = block_data(bs, old_id, false);
+		uint8_t *destination = block_data(bs, new_id, true);
+		if(source == NULL || destination == NULL || !claim_block(bs, new_id))
+		{
+			bs->defrag_active = false; //The block could not be loaded or the hole taken, leave it where it is
+			break;
+		}
+		persist_enter(bs);
+		memcpy(destination, source, BLOCK_SIZE_BYTES);
+		if(bs->replica != NULL)
+		{
+			replicate(bs, REPLICA_OP_WRITE, new_id, 1, destination);
+		}
+		persist_blocks(bs, new_id, 1);
+		persist_leave(bs);
+		free_block(bs, old_id); //Not a request or release of the caller's, so neither traced nor counted as one
+		if(relocate != NULL)
+		{
+			relocate(old_id, new_id, arg);
+		}
+		moves++;
+	}
+	return moves;
+}
+
+// Fills a block the device already counts as used with new contents, passing them on to the standby and the image
+static bool put_block(block_store_t *const bs, const size_t block_id, const uint8_t *const data)
+{
+	uint8_t *destination = block_data(bs, block_id, true);
+	if(destination == NULL)
+	{
+		return false;
+	}
+	persist_enter(bs);
+	memcpy(destination, data, BLOCK_SIZE_BYTES);
+	if(bs->replica != NULL)
+	{
+		replicate(bs, REPLICA_OP_WRITE, block_id, 1, destination);
+	}
+	persist_blocks(bs, block_id, 1);
+	persist_leave(bs);
+	return true;
+}
+
+// Blocks in use that a longer bitmap would spill over, copied aside while the device grows
+typedef struct
+{
+	size_t count;
+	size_t *ids;
+	uint8_t *data;
+} evicted_t;
+
+// Copies out and frees every block in use from first up to end, on failure nothing is freed
+static bool evict_blocks(block_store_t *const bs, const size_t first, const size_t end, evicted_t *const evicted)
+{
+	for(size_t id = bitmap_next_set(bs->fbm, first); id < end; id = bitmap_next_set(bs->fbm, id + 1)) //SIZE_MAX once there are none left
+	{
+		evicted->count++;
+	}
+	evicted->ids = (size_t *)malloc(evicted->count * sizeof(size_t));
+	evicted->data = (uint8_t *)malloc(evicted->count * BLOCK_SIZE_BYTES);
+	size_t i = 0;
+	for(size_t id = bitmap_next_set(bs->fbm, first); evicted->ids != NULL && evicted->data != NULL && id < end; id = bitmap_next_set(bs->fbm, id + 1), i++)
+	{
+		const uint8_t *source = block_data(bs, id, false);
+		if(source == NULL)
+		{
+			break;
+		}
+		evicted->ids[i] = id;
+		memcpy(evicted->data + i * BLOCK_SIZE_BYTES, source, BLOCK_SIZE_BYTES);
+	}
+	if(i < evicted->count)
+	{
+		free(evicted->ids);
+		free(evicted->data);
+		return false;
+	}
+	for(i = 0; i < evicted->count; i++)
+	{
+		free_block(bs, evicted->ids[i]);
+	}
+	return true;
+}
+
+// Puts evicted blocks back, in the lowest free blocks once the device has grown or where they were if it could not
+static void restore_blocks(block_store_t *const bs, const evicted_t *const evicted, const bool moved, void (*relocate)(size_t, size_t, void *), void *arg)
+{
+	for(size_t i = 0; i < evicted->count; i++)
+	{
+		const size_t old_id = evicted->ids[i];
+		const size_t new_id = moved ? bitmap_next_zero(bs->fbm, 0) : old_id; //Growing always frees at least as many blocks as the bitmap takes
+		if(new_id != SIZE_MAX && claim_block(bs, new_id) && put_block(bs, new_id, evicted->data + i * BLOCK_SIZE_BYTES) && moved && relocate != NULL)
+		{
+			relocate(old_id, new_id, arg);
+		}
+	}
+	free(evicted->ids);
+	free(evicted->data);
+}
+
+static bool resize_blocks(block_store_t *const bs, const size_t num_blocks);
+
+bool block_store_resize(block_store_t *const bs, const size_t num_blocks, void (*relocate)(size_t, size_t, void *), void *arg)
+{
+	if(bs == NULL || bs->fbm == NULL || bs->shared != NULL || num_blocks < BITMAP_START_BLOCK + bitmap_blocks_for(num_blocks))
+	{
+		return false; //Too small to hold its own bitmap where it belongs, or mapped by other processes
+	}
+	if(num_blocks < bs->num_blocks && bitmap_test_range_any(bs->fbm, num_blocks, bs->num_blocks - num_blocks))
+	{
+		return false; //Something still lives in the tail we would cut off
+	}
+	if(num_blocks == bs->num_blocks)
+	{
+		return true;
+	}
+
+	//The longer bitmap spills into the blocks after it, whatever lives there moves somewhere else
+	evicted_t evicted = {0, NULL, NULL};
+	const size_t first = BITMAP_START_BLOCK + bs->bitmap_blocks;
+	const size_t spill = BITMAP_START_BLOCK + bitmap_blocks_for(num_blocks);
+	const size_t end = spill < bs->num_blocks ? spill : bs->num_blocks;
+	if(end > first && bitmap_test_range_any(bs->fbm, first, end - first))
+	{
+		if(relocate == NULL)
+		{
+			return false; //Nobody to tell where the blocks went
+		}
+		if(!evict_blocks(bs, first, end, &evicted))
+		{
+			return false;
+		}
+	}
+	const bool resized = resize_blocks(bs, num_blocks);
+	restore_blocks(bs, &evicted, resized, relocate, arg);
+	return resized;
+}
+
+// The resize itself, the blocks the bitmap grows into are free by now
+static bool resize_blocks(block_store_t *const bs, const size_t num_blocks)
+{
+	const size_t old_blocks = bs->num_blocks;
+	const size_t old_bitmap_blocks = bs->bitmap_blocks;
+	const size_t bitmap_blocks = bitmap_blocks_for(num_blocks);
+
+	//Done up front so nothing past this point can fail on an allocation we could have avoided
+	buddy_t *buddy = NULL;
+	if(bs->buddy != NULL && (buddy = buddy_create(num_blocks)) == NULL)
+	{
+		return false;
+	}
+	zone_map_t *zones = NULL;
+	if(bs->zones != NULL && (zones = zone_map_create(num_blocks)) == NULL)
+	{
+		buddy_destroy(buddy);
+		return false;
+	}
+	if(bs->lazy != NULL)
+	{
+		if(bs->lazy->has_loader)
+		{
+			atomic_store(&bs->lazy->stop_loader, true); //It reads through bs->blocks, which may move
+			pthread_join(bs->lazy->loader, NULL);
+			bs->lazy->has_loader = false;
+		}
+		lazy_stop_prefetcher(bs->lazy); //So does the prefetcher
+		if(!load_all_blocks(bs))
+		{
+			buddy_destroy(buddy);
+			zone_map_destroy(zones);
+			return false;
+		}
+	}
+
+	persist_t *const persist = bs->persist;
+	persist_enter(bs); //The blocks may move, held until the image has caught up with the new size
+	if(!block_memory_resize(&bs->memory, num_blocks * BLOCK_SIZE_BYTES))
+	{
+		persist_leave(bs);
+		buddy_destroy(buddy);
+		zone_map_destroy(zones);
+		return false;
+	}
+	zone_map_destroy(bs->zones);
+	bs->zones = NULL; //Rebuilt for the new size once the bitmap is final
+	replica_log_t *const replica = bs->replica;
+	bs->replica = NULL; //The standby makes the same bitmap changes itself when it resizes
+	bs->persist = NULL; //Its dirty map is still the old size, the bitmap blocks are marked below instead
+	bs->blocks = bs->memory.data;
+	bitmap_destroy(bs->fbm); //Only the overlay, its bits live in the blocks
+	bs->fbm = bitmap_overlay(num_blocks, bs->blocks + (BITMAP_START_BLOCK * BLOCK_SIZE_BYTES));
+	if(bs->fbm == NULL)
+	{
+		buddy_destroy(buddy);
+		zone_map_destroy(zones);
+		bs->replica = replica;
+		bs->persist = persist;
+		persist_leave(bs);
+		return false; //Reusing the struct we just freed, this can't really happen, but the device is lost if it does
+	}
+
+	if(num_blocks > old_blocks)
+	{
+		bitmap_reset_range(bs->fbm, old_blocks, num_blocks - old_blocks); //The new bitmap bytes held whatever those free blocks did
+	}
+	bs->num_blocks = num_blocks;
+	if(bitmap_blocks > bs->bitmap_blocks)
+	{
+		mark_used_range(bs, BITMAP_START_BLOCK + bs->bitmap_blocks, bitmap_blocks - bs->bitmap_blocks);
+	}
+	else if(bitmap_blocks < bs->bitmap_blocks)
+	{
+		mark_free_range(bs, BITMAP_START_BLOCK + bitmap_blocks, bs->bitmap_blocks - bitmap_blocks); //Only ever held bits for the tail, which were all clear
+	}
+	bs->bitmap_blocks = bitmap_blocks;
+	if(zones != NULL)
+	{
+		zone_map_rebuild(zones, bs->fbm);
+		bs->zones = zones;
+	}
+
+	if(buddy != NULL)
+	{
+		buddy_destroy(bs->buddy);
+		bs->buddy = buddy;
+		for(size_t i = bitmap_next_zero(bs->fbm, 0); i != SIZE_MAX; i = bitmap_next_zero(bs->fbm, i + 1))
+		{
+			buddy_free(bs->buddy, i, 0);
+		}
+	}
+	bs->next_fit %= num_blocks;
+	bs->next_group = 0;
+	bs->defrag_active = false; //Its cursors may be past the end now
+	bs->replica = replica;
+	if(bs->replica != NULL)
+	{
+		replicate(bs, REPLICA_OP_RESIZE, num_blocks, 1, NULL);
+	}
+	bs->persist = persist;
+	if(bs->persist != NULL)
+	{
+		persist_resize(bs->persist, bs->blocks, num_blocks);
+		persist_blocks(bs, BITMAP_START_BLOCK, bitmap_blocks > old_bitmap_blocks ? bitmap_blocks : old_bitmap_blocks);
+	}
+	persist_leave(bs);
+	return true;
+}
+
+// Makes one logged change on a standby, false if it doesn't fit the device
+// Changes that are already there are skipped so a record can be applied twice
+static bool apply_record(block_store_t *const replica, const replica_record_t *const record, const uint8_t *const block)
+{
+	const size_t first = (size_t)record->block;
+	const bool in_range = first < replica->num_blocks && record->count <= replica->num_blocks - first;
+	switch(record->op)
+	{
+		case REPLICA_OP_RESET:
+			if(first != replica->num_blocks || !load_all_blocks(replica))
+			{
+				return false;
+			}
+			persist_enter(replica);
+			memset(replica->blocks, 0, replica->num_blocks * BLOCK_SIZE_BYTES); //Bitmap included, the snapshot brings it back
+			if(replica->persist != NULL)
+			{
+				persist_zero(replica->persist, replica->blocks, 0, replica->num_blocks);
+			}
+			persist_leave(replica);
+			recount(replica);
+			replica->next_fit = 0;
+			replica->next_group = 0;
+			replica->defrag_active = false;
+			return true;
+		case REPLICA_OP_WRITE:
+		{
+			uint8_t *destination = first < replica->num_blocks ? block_data(replica, first, true) : NULL;
+			if(destination == NULL)
+			{
+				return false;
+			}
+			persist_enter(replica);
+			memcpy(destination, block, BLOCK_SIZE_BYTES);
+			persist_blocks(replica, first, 1);
+			persist_leave(replica);
+			return true;
+		}
+		case REPLICA_OP_SET:
+		case REPLICA_OP_CLEAR:
+			if(!in_range)
+			{
+				return false;
+			}
+			for(size_t i = first; i < first + record->count; i++)
+			{
+				if(record->op == REPLICA_OP_SET && !bitmap_test(replica->fbm, i))
+				{
+					mark_used(replica, i);
+				}
+				else if(record->op == REPLICA_OP_CLEAR && bitmap_test(replica->fbm, i))
+				{
+					mark_free(replica, i);
+				}
+			}
+			return true;
+		case REPLICA_OP_ZERO:
+			if(!in_range || !load_all_blocks(replica))
+			{
+				return false;
+			}
+			persist_enter(replica);
+			memset(replica->blocks + first * BLOCK_SIZE_BYTES, 0, record->count * BLOCK_SIZE_BYTES);
+			if(replica->persist != NULL)
+			{
+				persist_zero(replica->persist, replica->blocks, first, record->count);
+			}
+			persist_leave(replica);
+			return true;
+		case REPLICA_OP_RESIZE:
+			return block_store_resize(replica, first, NULL, NULL); //The primary moved anything in the bitmap's way already
+		case REPLICA_OP_SYNC:
+			recount(replica); //The snapshot wrote the bitmap blocks behind mark_used's back
+			return true;
+		default:
+			return false;
+	}
+}
+
+size_t replica_apply(block_store_t *const replica, const uint8_t *const log, const size_t length, size_t *const records, bool *const failed)
+{
+	size_t offset = 0;
+	while(length - offset >= sizeof(replica_record_t))
+	{
+		replica_record_t record;
+		memcpy(&record, log + offset, sizeof(record));
+		const size_t size = sizeof(record) + (record.op == REPLICA_OP_WRITE ? BLOCK_SIZE_BYTES : 0);
+		if(length - offset < size)
+		{
+			break; //The block is still on its way
+		}
+		if(!apply_record(replica, &record, log + offset + sizeof(record)))
+		{
+			*failed = true;
+			break;
+		}
+		offset += size;
+		(*records)++;
+	}
+	return offset;
+}
+
+// Standbys need the exact bitmap layout, and nobody else may be changing them
+static bool replica_compatible(const block_store_t *const replica)
+{
+	return replica != NULL && replica->fbm != NULL && replica->buddy == NULL && replica->shared == NULL;
+}
+
+bool block_store_replicate_start(block_store_t *const bs, const block_store_replication_t *const config)
+{
+	if(bs == NULL || bs->fbm == NULL || bs->shared != NULL || bs->replica != NULL || config == NULL || config->replica == bs)
+	{
+		return false;
+	}
+	if(config->replica != NULL && (!replica_compatible(config->replica) || config->replica->num_blocks != bs->num_blocks || !load_all_blocks(config->replica)))
+	{
+		return false;
+	}
+	if(!load_all_blocks(bs))
+	{
+		return false; //The snapshot reads every block
+	}
+	replica_log_t *log = replica_log_create(config);
+	if(log == NULL)
+	{
+		return false;
+	}
+
+	//Only the blocks holding something are sent, a fresh or sparse device costs next to nothing
+	static const uint8_t zero[BLOCK_SIZE_BYTES];
+	const replica_record_t reset = {REPLICA_OP_RESET, 1, bs->num_blocks};
+	bool shipped = replica_log_append(log, &reset, NULL, true);
+	for(size_t i = 0; shipped && i < bs->num_blocks; i++)
+	{
+		const uint8_t *block = bs->blocks + i * BLOCK_SIZE_BYTES;
+		if(memcmp(block, zero, BLOCK_SIZE_BYTES) != 0)
+		{
+			const replica_record_t write = {REPLICA_OP_WRITE, 1, i};
+			shipped = replica_log_append(log, &write, block, true);
+		}
+	}
+	const replica_record_t sync = {REPLICA_OP_SYNC, 1, 0};
+	shipped = shipped && replica_log_append(log, &sync, NULL, true);
+	if(!shipped)
+	{
+		replica_log_destroy(log); //The standby failed on the snapshot, it is no use
+		return false;
+	}
+	bs->replica = log;
+	return true;
+}
+
+bool block_store_replicate_flush(block_store_t *const bs)
+{
+	return bs != NULL && bs->replica != NULL && replica_log_flush(bs->replica);
+}
+
+bool block_store_replicate_stop(block_store_t *const bs)
+{
+	if(bs == NULL || bs->replica == NULL)
+	{
+		return false;
+	}
+	const bool complete = replica_log_destroy(bs->replica);
+	bs->replica = NULL;
+	return complete;
+}
+
+size_t block_store_apply_log(block_store_t *const replica, const int fd)
+{
+	if(!replica_compatible(replica) || fd < 0 || !load_all_blocks(replica))
+	{
+		return SIZE_MAX;
+	}
+	//Read in big chunks and apply each one in a batch, a partial record waits for the next chunk
+	const size_t chunk = (size_t)64 << 10;
+	uint8_t *buffer = (uint8_t *)malloc(chunk + sizeof(replica_record_t) + BLOCK_SIZE_BYTES);
+	if(buffer == NULL)
+	{
+		return SIZE_MAX;
+	}
+	size_t records = 0, pending = 0;
+	bool failed = false;
+	for(;;)
+	{
+		ssize_t bytes = read(fd, buffer + pending, chunk);
+		if(bytes < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if(bytes <= 0)
+		{
+			failed = failed || bytes < 0 || pending != 0; //A log cut off mid record is missing changes
+			break;
+		}
+		pending += bytes;
+		const size_t applied = replica_apply(replica, buffer, pending, &records, &failed);
+		if(failed)
+		{
+			break;
+		}
+		memmove(buffer, buffer + applied, pending - applied);
+		pending -= applied;
+	}
+	free(buffer);
+	return failed ? SIZE_MAX : records;
+}
+
+bool block_store_persist_start(block_store_t *const bs, const char *const filename, const block_store_persistence_t *const config)
+{
+	if(bs == NULL || filename == NULL || bs->fbm == NULL || bs->shared != NULL || bs->persist != NULL)
+	{
+		return false;
+	}
+	if(block_store_serialize(bs, filename) != BLOCK_STORE_IMAGE_HEADER_BYTES + bs->num_blocks * BLOCK_SIZE_BYTES)
+	{
+		return false; //Also loads a lazy store, the image is complete from here on
+	}
+	int file = open(filename, O_WRONLY);
+	if(file < 0)
+	{
+		return false;
+	}
+	const bool buffered = (config == NULL || config->durability == BLOCK_STORE_DURABILITY_BUFFERED);
+	if(!buffered && fdatasync(file) != 0)
+	{
+		close(file);
+		return false;
+	}
+	bs->persist = persist_create(file, bs->blocks, bs->num_blocks, config);
+	if(bs->persist == NULL)
+	{
+		close(file);
+		return false;
+	}
+	return true;
+}
+
+bool block_store_persist_barrier(block_store_t *const bs)
+{
+	if(bs == NULL || bs->persist == NULL)
 	{
-		return SIZE_MAX; //We return this if all bits have been allocated
+		return false;
 	}
-	
-	
-	bitmap_set(bs->fbm, block_id); //Allocate the bit on the bitmap at the next zero bit found in block_id if all bits haven't been allocated
-
-	return block_id; //Return the id of the block that was allocated on the bitmap
+	persist_lock(bs->persist);
+	const bool complete = persist_flush(bs->persist, bs->blocks, true);
+	persist_unlock(bs->persist);
+	return complete;
 }
 
-bool block_store_request(block_store_t *const bs, const size_t block_id)
-{	
-	if(bs != NULL) //Check to seen if the block store is null if it is we assume that the bitmap is allocated since that would have to been allocated to a block store via the block store create function
+bool block_store_persist_stop(block_store_t *const bs)
+{
+	if(bs == NULL || bs->persist == NULL)
 	{
-		if(block_id < BLOCK_STORE_NUM_BLOCKS) //Check if in-bounds
-		{
-			if(bitmap_test(bs->fbm, block_id) == false) //We see if the bit hasn't been allocated
-			{
-				bitmap_set(bs->fbm, block_id); //Allocate the bit on the bitmap
-				return true; //Return true since the requested bit was allocated through the request
-			}
-		}
+		return false;
 	}
-	return false; //Since block store is null there is nothing to find or that block has been allocated
+	const bool complete = persist_destroy(bs->persist, bs->blocks);
+	bs->persist = NULL;
+	return complete;
 }
 
-void block_store_release(block_store_t *const bs, const size_t block_id)
+bool block_store_get_persist_stats(const block_store_t *const bs, block_store_persist_stats_t *const stats)
 {
-	if(bs != NULL) //511 since we have 512 blocks
-        {
-		if(block_id < BLOCK_STORE_NUM_BLOCKS ){
-			bitmap_reset(bs->fbm, block_id); //We set the bit at the provided position to 0 (i.e. we deallocated it)
-		}
+	if(bs == NULL || stats == NULL || bs->persist == NULL)
+	{
+		return false;
 	}
+	persist_lock(bs->persist);
+	persist_get_stats(bs->persist, stats);
+	persist_unlock(bs->persist);
+	return true;
 }
 
 size_t block_store_get_used_blocks(const block_store_t *const bs)
@@ -114,7 +2107,7 @@ size_t block_store_get_used_blocks(const block_store_t *const bs)
 	{
 		return SIZE_MAX; //Return null if either
 	}
-	return bitmap_total_set(bs->fbm); //Gets the total amount of allocated bits on the bitmap
+	return used_blocks(bs); //Kept up to date on every allocation and release, so no counting needed
 }
 
 size_t block_store_get_free_blocks(const block_store_t *const bs)
@@ -123,7 +2116,46 @@ size_t block_store_get_free_blocks(const block_store_t *const bs)
 	{
 		return SIZE_MAX; //Return null if either
 	}
-	return BLOCK_STORE_NUM_BLOCKS - bitmap_total_set(bs->fbm); //Finds the total amount of allocated bits and subtracts it by the number of blocks we have to find the number of free blocks
+	return bs->num_blocks - used_blocks(bs); //Finds the total amount of allocated bits and subtracts it by the number of blocks we have to find the number of free blocks
+}
+
+// Adds one free run to the report, bucketed by the power of two at or below its length
+static void record_free_run(size_t start, size_t length, void *arg)
+{
+	(void)start;
+	block_store_frag_report_t *report = (block_store_frag_report_t *)arg;
+	unsigned bucket = 0;
+	while(bucket + 1 < BLOCK_STORE_FRAG_BUCKETS && ((size_t)2 << bucket) <= length)
+	{
+		bucket++;
+	}
+	report->run_histogram[bucket]++;
+	report->free_runs++;
+	report->free_blocks += length;
+	if(length > report->largest_free_run)
+	{
+		report->largest_free_run = length;
+	}
+}
+
+bool block_store_get_frag_report(const block_store_t *const bs, block_store_frag_report_t *const report)
+{
+	if(bs == NULL || bs->fbm == NULL || report == NULL)
+	{
+		return false;
+	}
+	memset(report, 0, sizeof(*report));
+	bitmap_for_each_zero_run(bs->fbm, record_free_run, report); //Word at a time, whole used or free words are skipped
+	return true;
+}
+
+bool block_store_get_zone(const block_store_t *const bs, const size_t zone, block_store_zone_t *const info)
+{
+	if(bs == NULL || info == NULL || bs->zones == NULL)
+	{
+		return false;
+	}
+	return zone_map_get(bs->zones, bs->fbm, zone, info);
 }
 
 size_t block_store_get_total_blocks()
@@ -131,35 +2163,92 @@ size_t block_store_get_total_blocks()
 	return BLOCK_STORE_NUM_BLOCKS; //Returns this constant because this constant tells us the number of blocks we have
 }
 
+size_t block_store_get_num_blocks(const block_store_t *const bs)
+{
+	if(bs == NULL)
+	{
+		return SIZE_MAX;
+	}
+	return bs->num_blocks;
+}
+
 size_t block_store_read(const block_store_t *const bs, const size_t block_id, void *buffer)
 {
-	if(bs == NULL || buffer == NULL || block_id >= BLOCK_STORE_NUM_BLOCKS)
+	if(bs == NULL || buffer == NULL || block_id >= bs->num_blocks)
 	{
 		return 0; //Invalid parameters 
 	}
 
-	uint8_t *temp = bs-> blocks + (block_id * BLOCK_SIZE_BYTES); //Gets the starting address to read from
+	STATS_START();
+	if(bs->readahead != NULL)
+	{
+		readahead_access(bs, block_id);
+	}
+	uint8_t *temp = block_data(bs, block_id, false); //Gets the starting address to read from, faulting it in if needed
+	if(temp == NULL)
+	{
+		STATS_STOP(bs, BLOCK_STORE_OP_READ);
+		return 0; //The block could not be loaded from the image
+	}
 	memcpy(buffer, temp, BLOCK_SIZE_BYTES); //Copies the memory from the address temp to our buffer
+	STATS_STOP(bs, BLOCK_STORE_OP_READ);
+	trace_record(TRACE_OP_READ, block_id, 0);
 	
 	return BLOCK_SIZE_BYTES; //Returns the amount of bytes used for copying
 }
 
 size_t block_store_write(block_store_t *const bs, const size_t block_id, const void *buffer)
 {
-	if(bs == NULL || buffer == NULL || block_id >= BLOCK_STORE_NUM_BLOCKS)
+	if(bs == NULL || buffer == NULL || block_id >= bs->num_blocks)
 	{
 		return 0; //Invalid parameters
 	}
 
-	//grab the location where we want to write to
-	uint8_t *temp = bs-> blocks + (block_id * BLOCK_SIZE_BYTES);
+	//grab the location where we want to write to, the whole block is replaced so there is nothing to fetch
+	STATS_START();
+	uint8_t *temp = block_data(bs, block_id, true);
+	if(temp == NULL)
+	{
+		STATS_STOP(bs, BLOCK_STORE_OP_WRITE);
+		return 0;
+	}
 
 	//this time copy the contents of the buffer into the correct block
+	persist_enter(bs);
 	memcpy(temp, buffer, BLOCK_SIZE_BYTES);
+	if(bs->replica != NULL)
+	{
+		replicate(bs, REPLICA_OP_WRITE, block_id, 1, temp);
+	}
+	persist_blocks(bs, block_id, 1);
+	persist_leave(bs);
+	STATS_STOP(bs, BLOCK_STORE_OP_WRITE);
+	trace_record(TRACE_OP_WRITE, block_id, 0);
 	
 	return BLOCK_SIZE_BYTES;
 }
 
+// Creates an empty device with the geometry of the image behind file, which is left at its first block
+static block_store_t *create_for_image(const int file)
+{
+	image_superblock_t sb;
+	if(read_superblock(file, &sb) != BLOCK_STORE_IMAGE_OK || (sb.incompat_features & IMAGE_INCOMPAT_STRIPED))
+	{
+		return NULL; //Not an image we know how to read, or only part of one
+	}
+	block_store_options_t options = {0};
+	options.num_blocks = sb.num_blocks;
+	return block_store_create_with(&options);
+}
+
+// Counts the bitmap an image brought with it, false if the image can't have come from a device
+// Its own blocks have to be marked in use, otherwise they would be handed out and overwrite it
+static bool adopt_bitmap(block_store_t *const bs)
+{
+	recount(bs);
+	return bitmap_test_range_all(bs->fbm, BITMAP_START_BLOCK, bs->bitmap_blocks);
+}
+
 block_store_t *block_store_deserialize(const char *const filename)
 {
         if(filename == NULL)
@@ -168,6 +2257,7 @@ block_store_t *block_store_deserialize(const char *const filename)
         }
 
         //read the file
+        STATS_START();
         int file = open(filename, O_RDONLY);
         if(file < 0)
         {
@@ -175,8 +2265,8 @@ block_store_t *block_store_deserialize(const char *const filename)
                 return NULL;
         }
 
-        //new block store
-        block_store_t * bs = block_store_create();
+        //new block store, its bitmap is overlaid on the blocks so reading the image restores it too
+        block_store_t * bs = create_for_image(file);
         if (bs == NULL)
         {
                 close(file);
@@ -184,30 +2274,408 @@ block_store_t *block_store_deserialize(const char *const filename)
         }
 
         //ok, now we can read the blocks
-	size_t bytes_read = read(file, bs->blocks, BLOCK_STORE_NUM_BYTES);
-        if (bytes_read != BLOCK_STORE_NUM_BYTES)
+        if (!read_all(file, bs->blocks, bs->num_blocks * BLOCK_SIZE_BYTES))
         {
 		perror("Failed to read from file");
-		free(bs);
-                close(file);
-                return NULL;
-        }
-
-        //recreate bitmap
-        bs -> fbm = bitmap_overlay(BITMAP_SIZE_BITS, bs->blocks + BITMAP_START_BLOCK);
-        if(bs-> fbm == NULL)
-        {
-		perror("Failed to make the bitmap");
-		free(bs->blocks);
-		free(bs);
+		block_store_destroy(bs);
                 close(file);
                 return NULL;
         }
-
         close(file);
+	if(!adopt_bitmap(bs)) //The image replaced the bitmap, so count it once here
+	{
+		block_store_destroy(bs);
+		return NULL;
+	}
+        STATS_STOP(bs, BLOCK_STORE_OP_DESERIALIZE); //Counted on the device it produced
+        trace_record(TRACE_OP_DESERIALIZE, 0, bs->num_blocks);
         return bs;
 }
 
+block_store_image_status_t block_store_check_image(const char *const filename)
+{
+	if(filename == NULL)
+	{
+		return BLOCK_STORE_IMAGE_UNREADABLE;
+	}
+	int file = open(filename, O_RDONLY);
+	if(file < 0)
+	{
+		return BLOCK_STORE_IMAGE_UNREADABLE;
+	}
+	image_superblock_t sb;
+	block_store_image_status_t status = read_superblock(file, &sb);
+	if(status == BLOCK_STORE_IMAGE_OK && !(sb.incompat_features & IMAGE_INCOMPAT_STRIPED) && !bitmap_claims_itself(file, sb.header_bytes, sb.bitmap_blocks))
+	{
+		status = BLOCK_STORE_IMAGE_BAD_BITMAP; //A stripe file may not hold the bitmap, only the whole set can be checked for that
+	}
+	close(file);
+	return status;
+}
+
+size_t block_store_convert_legacy(const char *const legacy, const char *const filename)
+{
+	if(legacy == NULL || filename == NULL)
+	{
+		return 0;
+	}
+	int file = open(legacy, O_RDONLY);
+	if(file < 0)
+	{
+		perror("Failed to open file for reading");
+		return 0;
+	}
+	//A legacy image is nothing but the blocks, so its size tells us how many there are
+	struct stat st;
+	image_superblock_t sb;
+	block_store_t *bs = NULL;
+	if(fstat(file, &st) == 0 && read_superblock(file, &sb) == BLOCK_STORE_IMAGE_LEGACY)
+	{
+		block_store_options_t options = {0};
+		options.num_blocks = st.st_size / BLOCK_SIZE_BYTES;
+		bs = block_store_create_with(&options);
+	}
+	if(bs == NULL || lseek(file, 0, SEEK_SET) != 0 || !read_all(file, bs->blocks, bs->num_blocks * BLOCK_SIZE_BYTES) || !adopt_bitmap(bs))
+	{
+		block_store_destroy(bs);
+		close(file);
+		return 0;
+	}
+	close(file);
+	const size_t written = block_store_serialize(bs, filename); //Everything is in memory, so filename may be the old image
+	block_store_destroy(bs);
+	return written;
+}
+
+block_store_t *block_store_deserialize_lazy(const char *const filename, const bool background)
+{
+	if(filename == NULL)
+	{
+		return NULL; //Invalid file name
+	}
+
+	STATS_START();
+	int file = open(filename, O_RDONLY);
+	if(file < 0)
+	{
+		perror("Failed to open file for reading");
+		return NULL;
+	}
+
+	block_store_t *bs = create_for_image(file);
+	if(bs == NULL)
+	{
+		close(file);
+		return NULL;
+	}
+
+	lazy_state_t *lazy = (lazy_state_t *)calloc(1, sizeof(lazy_state_t));
+	if(lazy == NULL)
+	{
+		block_store_destroy(bs);
+		close(file);
+		return NULL;
+	}
+	lazy->fd = file;
+	lazy->resident = bitmap_create(bs->num_blocks);
+	if(lazy->resident == NULL || pthread_mutex_init(&lazy->lock, NULL) != 0)
+	{
+		bitmap_destroy(lazy->resident);
+		free(lazy);
+		block_store_destroy(bs);
+		close(file);
+		return NULL;
+	}
+	if(pthread_cond_init(&lazy->prefetch_wake, NULL) != 0)
+	{
+		pthread_mutex_destroy(&lazy->lock);
+		bitmap_destroy(lazy->resident);
+		free(lazy);
+		block_store_destroy(bs);
+		close(file);
+		return NULL;
+	}
+	atomic_init(&lazy->missing, bs->num_blocks);
+	atomic_init(&lazy->stop_loader, false);
+	bs->lazy = lazy; //From here on destroy cleans up the file and the lock for us
+
+	//The free block map is the only thing needed eagerly, every other block waits for its first access
+	for(size_t i = BITMAP_START_BLOCK; i < BITMAP_START_BLOCK + bs->bitmap_blocks; i++)
+	{
+		if(!lazy_fault(lazy, bs->blocks, i, false))
+		{
+			perror("Failed to read the bitmap from file");
+			block_store_destroy(bs);
+			return NULL;
+		}
+	}
+	if(!adopt_bitmap(bs) || !block_store_set_readahead(bs, BLOCK_STORE_READAHEAD_DEFAULT_BLOCKS))
+	{
+		block_store_destroy(bs);
+		return NULL;
+	}
+
+	if(background)
+	{
+		lazy->has_loader = (pthread_create(&lazy->loader, NULL, lazy_loader, bs) == 0); //Blocks still fault on demand if this fails
+	}
+	STATS_STOP(bs, BLOCK_STORE_OP_DESERIALIZE);
+	trace_record(TRACE_OP_DESERIALIZE, 0, bs->num_blocks);
+	return bs;
+}
+
+// Stripe s of a striped image (blocks s * width on) lives in file s % files, after the stripes before it in that file
+typedef struct
+{
+	int fd;
+	uint8_t *blocks;
+	size_t num_blocks;
+	size_t file; //Which of the files this is
+	size_t files;
+	size_t stripe_blocks;
+	bool writing;
+	bool ok;
+} stripe_job_t;
+
+// Blocks one file of a striped image holds, the last stripe of the device may be short
+// Worked out rather than counted, a superblock read from a file can claim any size
+static size_t stripe_file_blocks(const size_t num_blocks, const size_t file, const size_t files, const size_t stripe_blocks)
+{
+	const size_t whole = num_blocks / stripe_blocks; //Full stripes, the short one after them is stripe number whole
+	size_t blocks = (whole / files + (file < whole % files)) * stripe_blocks;
+	if(whole % files == file)
+	{
+		blocks += num_blocks % stripe_blocks;
+	}
+	return blocks;
+}
+
+// Moves every stripe of one file, in file order so reads stay sequential
+// Readers have already been through the file's header, writers start by writing it
+static void *stripe_transfer(void *arg)
+{
+	stripe_job_t *job = (stripe_job_t *)arg;
+	size_t offset = BLOCK_STORE_IMAGE_HEADER_BYTES;
+	job->ok = true;
+	if(job->writing)
+	{
+		image_superblock_t sb;
+		image_superblock_init(&sb, job->num_blocks, BLOCK_SIZE_BYTES);
+		sb.incompat_features |= IMAGE_INCOMPAT_STRIPED;
+		sb.stripe_blocks = job->stripe_blocks;
+		sb.stripe_file = job->file;
+		sb.stripe_files = job->files;
+		sb.file_blocks = stripe_file_blocks(job->num_blocks, job->file, job->files, job->stripe_blocks);
+		image_superblock_seal(&sb);
+		job->ok = write_header(job->fd, &sb);
+	}
+	for(size_t first = job->file * job->stripe_blocks; job->ok && first < job->num_blocks; first += job->files * job->stripe_blocks)
+	{
+		const size_t blocks = job->num_blocks - first < job->stripe_blocks ? job->num_blocks - first : job->stripe_blocks;
+		uint8_t *data = job->blocks + first * BLOCK_SIZE_BYTES;
+		job->ok = job->writing ? write_sparse(job->fd, data, blocks * BLOCK_SIZE_BYTES, offset) : read_all(job->fd, data, blocks * BLOCK_SIZE_BYTES);
+		offset += blocks * BLOCK_SIZE_BYTES;
+	}
+	return NULL;
+}
+
+// Runs one job per file, each on its own thread (the calling thread takes the first)
+// Files on different disks transfer at the same time, so the device loads and saves at their combined speed
+static bool stripe_run(stripe_job_t *const jobs, const size_t files)
+{
+	pthread_t *threads = (pthread_t *)calloc(files, sizeof(pthread_t));
+	bool *started = (bool *)calloc(files, sizeof(bool));
+	if(threads == NULL || started == NULL)
+	{
+		free(threads);
+		free(started);
+		return false;
+	}
+	for(size_t i = 1; i < files; i++)
+	{
+		started[i] = (pthread_create(&threads[i], NULL, stripe_transfer, &jobs[i]) == 0);
+	}
+	bool ok = true;
+	for(size_t i = 0; i < files; i++)
+	{
+		if(i == 0 || !started[i])
+		{
+			stripe_transfer(&jobs[i]); //No thread to spare, do it here
+		}
+		else
+		{
+			pthread_join(threads[i], NULL);
+		}
+		ok = ok && jobs[i].ok;
+	}
+	free(threads);
+	free(started);
+	return ok;
+}
+
+static void stripe_close(stripe_job_t *const jobs, const size_t files)
+{
+	for(size_t i = 0; i < files; i++)
+	{
+		if(jobs[i].fd >= 0)
+		{
+			close(jobs[i].fd);
+		}
+	}
+	free(jobs);
+}
+
+// Opens every file of a striped image, NULL if any of them won't open
+static stripe_job_t *stripe_open(const char *const *const filenames, const size_t files, const size_t stripe_blocks, const bool writing)
+{
+	stripe_job_t *jobs = (stripe_job_t *)calloc(files, sizeof(stripe_job_t));
+	if(jobs == NULL)
+	{
+		return NULL;
+	}
+	for(size_t i = 0; i < files; i++)
+	{
+		jobs[i].fd = -1;
+	}
+	for(size_t i = 0; i < files; i++)
+	{
+		jobs[i].fd = filenames[i] == NULL ? -1 : writing ? open(filenames[i], O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR) : open(filenames[i], O_RDONLY);
+		if(jobs[i].fd < 0)
+		{
+			perror("Failed to open stripe file");
+			stripe_close(jobs, files);
+			return NULL;
+		}
+		jobs[i].file = i;
+		jobs[i].files = files;
+		jobs[i].stripe_blocks = stripe_blocks;
+		jobs[i].writing = writing;
+	}
+	return jobs;
+}
+
+block_store_t *block_store_deserialize_striped(const char *const *const filenames, const size_t files, const size_t stripe_blocks)
+{
+	if(filenames == NULL || files == 0 || stripe_blocks == 0)
+	{
+		return NULL;
+	}
+
+	STATS_START();
+	stripe_job_t *jobs = stripe_open(filenames, files, stripe_blocks, false);
+	if(jobs == NULL)
+	{
+		return NULL;
+	}
+	//Every file has to say it is this one of this many, of the same device, striped the same way
+	size_t num_blocks = 0;
+	bool sized = true;
+	for(size_t i = 0; i < files && sized; i++)
+	{
+		image_superblock_t sb;
+		sized = read_superblock(jobs[i].fd, &sb) == BLOCK_STORE_IMAGE_OK && (sb.incompat_features & IMAGE_INCOMPAT_STRIPED)
+			&& sb.stripe_file == i && sb.stripe_files == files && sb.stripe_blocks == stripe_blocks && (i == 0 || sb.num_blocks == num_blocks)
+			&& sb.file_blocks == stripe_file_blocks(sb.num_blocks, i, files, stripe_blocks);
+		num_blocks = sb.num_blocks;
+	}
+	block_store_options_t options = {0};
+	options.num_blocks = num_blocks;
+	block_store_t *bs = (sized && num_blocks != 0) ? block_store_create_with(&options) : NULL;
+	if(bs == NULL)
+	{
+		stripe_close(jobs, files); //Missing a file, files in the wrong order or another stripe width
+		return NULL;
+	}
+
+	for(size_t i = 0; i < files; i++)
+	{
+		jobs[i].blocks = bs->blocks;
+		jobs[i].num_blocks = num_blocks;
+	}
+	if(!stripe_run(jobs, files))
+	{
+		perror("Failed to read from stripe file");
+		stripe_close(jobs, files);
+		block_store_destroy(bs);
+		return NULL;
+	}
+	stripe_close(jobs, files);
+	if(!adopt_bitmap(bs)) //The image replaced the bitmap, so count it once here
+	{
+		block_store_destroy(bs);
+		return NULL;
+	}
+	STATS_STOP(bs, BLOCK_STORE_OP_DESERIALIZE);
+	trace_record(TRACE_OP_DESERIALIZE, 0, bs->num_blocks);
+	return bs;
+}
+
+size_t block_store_get_resident_blocks(const block_store_t *const bs)
+{
+	if(bs == NULL)
+	{
+		return SIZE_MAX;
+	}
+	if(bs->lazy == NULL)
+	{
+		return bs->num_blocks; //Eagerly created stores are always fully in memory
+	}
+	return bs->num_blocks - atomic_load(&bs->lazy->missing);
+}
+
+bool block_store_load_all(block_store_t *const bs)
+{
+	if(bs == NULL)
+	{
+		return false;
+	}
+	return load_all_blocks(bs);
+}
+
+bool block_store_set_readahead(block_store_t *const bs, const size_t max_blocks)
+{
+	if(bs == NULL)
+	{
+		return false;
+	}
+	if(bs->readahead == NULL)
+	{
+		if(max_blocks == 0)
+		{
+			return true; //Already off
+		}
+		readahead_t *readahead = (readahead_t *)calloc(1, sizeof(readahead_t));
+		if(readahead == NULL || pthread_mutex_init(&readahead->lock, NULL) != 0)
+		{
+			free(readahead);
+			return false;
+		}
+		for(size_t i = 0; i < READAHEAD_STREAMS; i++)
+		{
+			readahead->streams[i].next = SIZE_MAX; //Matches no block
+		}
+		bs->readahead = readahead;
+	}
+	pthread_mutex_lock(&bs->readahead->lock);
+	bs->readahead->max_window = max_blocks;
+	for(size_t i = 0; i < READAHEAD_STREAMS; i++)
+	{
+		bs->readahead->streams[i].window = 0; //Scans start over with the new maximum
+	}
+	pthread_mutex_unlock(&bs->readahead->lock);
+	return true;
+}
+
+bool block_store_prefetch(const block_store_t *const bs, const size_t block_id, const size_t count)
+{
+	if(bs == NULL || block_id >= bs->num_blocks || count == 0)
+	{
+		return false;
+	}
+	prefetch_blocks(bs, block_id, count < bs->num_blocks - block_id ? block_id + count : bs->num_blocks);
+	return true;
+}
+
 
 size_t block_store_serialize(const block_store_t *const bs, const char *const filename)
 {
@@ -216,23 +2684,114 @@ size_t block_store_serialize(const block_store_t *const bs, const char *const fi
 		return 0; //Invalid parameters
 	}
 
+	STATS_START();
+	//Anything still sitting in the old image has to be pulled in first, it may be the file we are about to truncate
+	if(!load_all_blocks(bs))
+	{
+		STATS_STOP(bs, BLOCK_STORE_OP_SERIALIZE);
+		return 0;
+	}
+
 	//read binary file to get ready to write to
         int file  = open(filename, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
         if(file < 0)
         {
 		perror("Failed to open file for writing");
+		STATS_STOP(bs, BLOCK_STORE_OP_SERIALIZE);
                 return 0; //failed allocation
         }
 
-	size_t blocks_written = write(file, bs->blocks, BLOCK_STORE_NUM_BLOCKS * BLOCK_SIZE_BYTES); //Writes our total file size to our file of our choice
+	size_t blocks_written = bs->num_blocks * BLOCK_SIZE_BYTES;
+	image_superblock_t sb;
+	image_superblock_init(&sb, bs->num_blocks, BLOCK_SIZE_BYTES);
 
-	if(blocks_written != BLOCK_STORE_NUM_BLOCKS * BLOCK_SIZE_BYTES)
+	if(!write_header(file, &sb) || !write_sparse(file, bs->blocks, blocks_written, BLOCK_STORE_IMAGE_HEADER_BYTES)) //Writes our total file size to our file of our choice, free zeroed space as holes
 	{
 		perror("Failed to write to file");
 		close(file); //Closes the file
+		STATS_STOP(bs, BLOCK_STORE_OP_SERIALIZE);
 		return 0; //Return 0 since we wrote outside our total block range
 	}
 
 	close(file); //Close the file
-	return blocks_written; //Provides of total bytes used from our blocks written with the amount of bytes per each block
+	STATS_STOP(bs, BLOCK_STORE_OP_SERIALIZE);
+	trace_record(TRACE_OP_SERIALIZE, 0, 0);
+	return BLOCK_STORE_IMAGE_HEADER_BYTES + blocks_written; //Provides of total bytes used from our blocks written with the amount of bytes per each block, and the header
+}
+
+size_t block_store_serialize_striped(const block_store_t *const bs, const char *const *const filenames, const size_t files, const size_t stripe_blocks)
+{
+	if(bs == NULL || filenames == NULL || files == 0 || stripe_blocks == 0)
+	{
+		return 0;
+	}
+
+	STATS_START();
+	if(!load_all_blocks(bs))
+	{
+		STATS_STOP(bs, BLOCK_STORE_OP_SERIALIZE);
+		return 0; //Same as block_store_serialize, the old image may be one we are about to truncate
+	}
+	stripe_job_t *jobs = stripe_open(filenames, files, stripe_blocks, true);
+	if(jobs == NULL)
+	{
+		STATS_STOP(bs, BLOCK_STORE_OP_SERIALIZE);
+		return 0;
+	}
+	for(size_t i = 0; i < files; i++)
+	{
+		jobs[i].blocks = bs->blocks;
+		jobs[i].num_blocks = bs->num_blocks;
+	}
+	const bool ok = stripe_run(jobs, files);
+	stripe_close(jobs, files);
+	if(!ok)
+	{
+		perror("Failed to write to stripe file");
+		STATS_STOP(bs, BLOCK_STORE_OP_SERIALIZE);
+		return 0;
+	}
+	STATS_STOP(bs, BLOCK_STORE_OP_SERIALIZE);
+	trace_record(TRACE_OP_SERIALIZE, 0, 0);
+	return files * BLOCK_STORE_IMAGE_HEADER_BYTES + bs->num_blocks * BLOCK_SIZE_BYTES;
+}
+
+bool block_store_get_stats(const block_store_t *const bs, block_store_stats_t *const stats)
+{
+#ifdef BLOCK_STORE_STATS
+	if(bs == NULL || stats == NULL)
+	{
+		return false;
+	}
+	memset(stats, 0, sizeof(*stats));
+	//Sum up the shards, each counter is read on its own so a busy device gives a close but not exact snapshot
+	for(stats_shard_t *shard = atomic_load_explicit(&bs->stats->shards, memory_order_acquire); shard != NULL; shard = shard->next)
+	{
+		for(size_t op = 0; op < BLOCK_STORE_OP_COUNT; op++)
+		{
+			stats->ops[op].count += atomic_load_explicit(&shard->count[op], memory_order_relaxed);
+			stats->ops[op].total_ns += atomic_load_explicit(&shard->total_ns[op], memory_order_relaxed);
+			for(size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++)
+			{
+				stats->ops[op].latency_ns[bucket] += atomic_load_explicit(&shard->latency[op][bucket], memory_order_relaxed);
+			}
+		}
+		stats->scans += atomic_load_explicit(&shard->scans, memory_order_relaxed);
+		stats->words_scanned += atomic_load_explicit(&shard->words_scanned, memory_order_relaxed);
+		for(size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++)
+		{
+			stats->scan_words[bucket] += atomic_load_explicit(&shard->scan_words[bucket], memory_order_relaxed);
+		}
+	}
+	return true;
+#else
+	(void)bs;
+	(void)stats;
+	return false; //Compiled out
+#endif
+}
+
+uint64_t block_store_stats_percentile(const uint64_t *const histogram, const double percentile)
+{
+	return histogram_percentile(histogram, percentile);
 }
@@ -0,0 +1,180 @@
+#include "buddy.h"
+#include <string.h>
+
+// Orders are stored in a byte, and size_t can't hold more than 64 of them anyway
+#define BUDDY_MAX_ORDERS 64
+
+// Marks a unit that does not start a free block
+#define NOT_FREE 0xFF
+
+struct buddy
+{
+	size_t unit_count;
+	unsigned max_order;
+	size_t heads[BUDDY_MAX_ORDERS];  // First free block of each order, SIZE_MAX when empty
+	size_t *next, *prev;  // Doubly linked free lists threaded through per-unit arrays
+	uint8_t *free_order;  // Order of the free block starting at each unit, NOT_FREE otherwise
+};
+
+static void list_push(buddy_t *const buddy, const size_t unit, const unsigned order)
+{
+	buddy->free_order[unit] = (uint8_t) order;
+	buddy->prev[unit] = SIZE_MAX;
+	buddy->next[unit] = buddy->heads[order];
+	if (buddy->heads[order] != SIZE_MAX)
+	{
+		buddy->prev[buddy->heads[order]] = unit;
+	}
+	buddy->heads[order] = unit;
+}
+
+static void list_remove(buddy_t *const buddy, const size_t unit)
+{
+	const unsigned order = buddy->free_order[unit];
+	if (buddy->prev[unit] != SIZE_MAX)
+	{
+		buddy->next[buddy->prev[unit]] = buddy->next[unit];
+	}
+	else
+	{
+		buddy->heads[order] = buddy->next[unit];
+	}
+	if (buddy->next[unit] != SIZE_MAX)
+	{
+		buddy->prev[buddy->next[unit]] = buddy->prev[unit];
+	}
+	buddy->free_order[unit] = NOT_FREE;
+}
+
+buddy_t *buddy_create(const size_t n_units)
+{
+	if (n_units == 0)
+	{
+		return NULL;
+	}
+	buddy_t *buddy = (buddy_t *) calloc(1, sizeof(buddy_t));
+	if (buddy)
+	{
+		buddy->unit_count = n_units;
+		while (buddy->max_order + 1 < BUDDY_MAX_ORDERS && ((size_t) 1 << (buddy->max_order + 1)) <= n_units)
+		{
+			++buddy->max_order;
+		}
+		for (unsigned order = 0; order < BUDDY_MAX_ORDERS; ++order)
+		{
+			buddy->heads[order] = SIZE_MAX;
+		}
+		buddy->next = (size_t *) malloc(n_units * sizeof(size_t));
+		buddy->prev = (size_t *) malloc(n_units * sizeof(size_t));
+		buddy->free_order = (uint8_t *) malloc(n_units);
+		if (buddy->next && buddy->prev && buddy->free_order)
+		{
+			memset(buddy->free_order, NOT_FREE, n_units);
+			return buddy;
+		}
+		buddy_destroy(buddy);
+	}
+	return NULL;
+}
+
+void buddy_destroy(buddy_t *buddy)
+{
+	if (buddy)
+	{
+		free(buddy->next);
+		free(buddy->prev);
+		free(buddy->free_order);
+		free(buddy);
+	}
+}
+
+size_t buddy_alloc(buddy_t *const buddy, const unsigned order)
+{
+	if (buddy == NULL || order > buddy->max_order)
+	{
+		return SIZE_MAX;
+	}
+	unsigned found = order;
+	while (found <= buddy->max_order && buddy->heads[found] == SIZE_MAX)
+	{
+		++found;
+	}
+	if (found > buddy->max_order)
+	{
+		return SIZE_MAX;
+	}
+	const size_t unit = buddy->heads[found];
+	list_remove(buddy, unit);
+	// Hand the upper halves back until the block is the size we were asked for
+	while (found > order)
+	{
+		--found;
+		list_push(buddy, unit + ((size_t) 1 << found), found);
+	}
+	return unit;
+}
+
+bool buddy_claim(buddy_t *const buddy, const size_t unit)
+{
+	if (buddy == NULL || unit >= buddy->unit_count)
+	{
+		return false;
+	}
+	// Walk up the orders until we hit the free block that contains the unit, if there is one
+	unsigned order = 0;
+	size_t base = unit;
+	while (buddy->free_order[base] != order)
+	{
+		if (++order > buddy->max_order)
+		{
+			return false;
+		}
+		base = unit & ~(((size_t) 1 << order) - 1);
+	}
+	list_remove(buddy, base);
+	// Split towards the unit, freeing whichever half it isn't in
+	while (order > 0)
+	{
+		--order;
+		const size_t half = (size_t) 1 << order;
+		if (unit >= base + half)
+		{
+			list_push(buddy, base, order);
+			base += half;
+		}
+		else
+		{
+			list_push(buddy, base + half, order);
+		}
+	}
+	return true;
+}
+
+void buddy_free(buddy_t *const buddy, const size_t unit, const unsigned order)
+{
+	if (buddy == NULL || order > buddy->max_order)
+	{
+		return;
+	}
+	size_t base = unit;
+	unsigned merged = order;
+	while (merged < buddy->max_order)
+	{
+		const size_t size = (size_t) 1 << merged;
+		const size_t partner = base ^ size;
+		// The tail of a non power of two range has buddies that don't exist
+		if (partner + size > buddy->unit_count || buddy->free_order[partner] != merged)
+		{
+			break;
+		}
+		list_remove(buddy, partner);
+		base &= ~size;
+		++merged;
+	}
+	list_push(buddy, base, merged);
+}
+
+unsigned buddy_max_order(const buddy_t *const buddy)
+{
+	return buddy->max_order;
+}
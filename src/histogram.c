@@ -0,0 +1,68 @@
+#include "histogram.h"
+
+size_t histogram_bucket(const uint64_t value)
+{
+	if (value < 2 * HISTOGRAM_SUB_BUCKETS)
+	{
+		return (size_t) value;  // Small enough to count exactly
+	}
+	// Top bit picks the power of two, the next HISTOGRAM_SUB_BITS bits pick the slice of it
+	const unsigned top = 63 - (unsigned) __builtin_clzll(value);
+	const size_t sub = (size_t) (value >> (top - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1);
+	return 2 * HISTOGRAM_SUB_BUCKETS + (top - HISTOGRAM_SUB_BITS - 1) * HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+uint64_t histogram_bucket_floor(const size_t bucket)
+{
+	if (bucket < 2 * HISTOGRAM_SUB_BUCKETS)
+	{
+		return bucket;
+	}
+	const size_t linear = bucket - 2 * HISTOGRAM_SUB_BUCKETS;
+	const unsigned top = (unsigned) (linear / HISTOGRAM_SUB_BUCKETS) + HISTOGRAM_SUB_BITS + 1;
+	const uint64_t sub = linear % HISTOGRAM_SUB_BUCKETS;
+	return (UINT64_C(1) << top) | (sub << (top - HISTOGRAM_SUB_BITS));
+}
+
+uint64_t histogram_bucket_ceiling(const size_t bucket)
+{
+	if (bucket + 1 >= HISTOGRAM_BUCKETS)
+	{
+		return UINT64_MAX;
+	}
+	return histogram_bucket_floor(bucket + 1) - 1;
+}
+
+uint64_t histogram_percentile(const uint64_t *const counts, const double percentile)
+{
+	if (counts == NULL)
+	{
+		return 0;
+	}
+	uint64_t total = 0;
+	for (size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; ++bucket)
+	{
+		total += counts[bucket];
+	}
+	if (total == 0)
+	{
+		return 0;
+	}
+	// Rank of the sample we want, rounding up so p100 is the last one
+	double wanted = percentile / 100.0 * (double) total;
+	uint64_t rank = (uint64_t) wanted;
+	if ((double) rank < wanted || rank == 0)
+	{
+		++rank;
+	}
+	uint64_t seen = 0;
+	for (size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; ++bucket)
+	{
+		seen += counts[bucket];
+		if (seen >= rank)
+		{
+			return histogram_bucket_ceiling(bucket);
+		}
+	}
+	return histogram_bucket_ceiling(HISTOGRAM_BUCKETS - 1);
+}
@@ -0,0 +1,323 @@
+// fallocate's hole punching and the coarse monotonic clock are Linux extensions
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bitmap.h"
+#include "image.h"
+#include "persist.h"
+
+#define PERSIST_DEFAULT_BLOCKS 1024
+#define PERSIST_GAP_BLOCKS 8  // Clean blocks a flush writes over rather than make another call, they match the image anyway
+
+struct persist
+{
+	int fd;
+	block_store_persistence_t config;
+	bitmap_t *dirty;
+	size_t num_blocks;
+	size_t dirty_blocks;  // Set bits in dirty
+	size_t low, high;     // Every dirty block is in [low, high), so flushes don't scan the whole map
+	uint64_t oldest_ns;   // When the oldest buffered change was made
+	bool unsynced;        // Written out since the last fdatasync
+	bool failed;
+	block_store_persist_stats_t stats;
+	const uint8_t *blocks;   // The device's block array as of the last call, what the flusher writes from
+	pthread_mutex_t lock;    // Held by the device around every change and by the flusher while it flushes
+	pthread_cond_t wake;     // The first change of a batch was buffered, or it's time to stop
+	pthread_t flusher;
+	bool has_flusher;
+	bool stopping;
+};
+
+static uint64_t clock_ns(const clockid_t clock)
+{
+	struct timespec now;
+	clock_gettime(clock, &now);
+	return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+static uint64_t now_ns(void)
+{
+	return clock_ns(CLOCK_MONOTONIC_COARSE);  // Milliseconds are all the flush interval needs
+}
+
+static bool write_at(persist_t *const persist, const uint8_t *data, size_t length, size_t offset)
+{
+	while(length > 0)
+	{
+		persist->stats.write_calls++;
+		const ssize_t written = pwrite(persist->fd, data, length, offset);
+		if(written < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			return false;
+		}
+		data += written;
+		length -= written;
+		offset += written;
+	}
+	return true;
+}
+
+static void sync_image(persist_t *const persist)
+{
+	persist->stats.sync_calls++;
+	if(fdatasync(persist->fd) != 0)
+	{
+		persist->failed = true;
+	}
+	persist->unsynced = false;
+}
+
+// Flushes whatever has waited out the flush interval, so changes to a device that went quiet still reach the image in time
+static void *persist_flusher(void *arg)
+{
+	persist_t *persist = (persist_t *)arg;
+	const uint64_t interval_ns = (uint64_t)persist->config.flush_interval_ms * 1000000u;
+	pthread_mutex_lock(&persist->lock);
+	while(!persist->stopping)
+	{
+		const uint64_t due = persist->oldest_ns + interval_ns;
+		if(persist->dirty_blocks == 0)
+		{
+			pthread_cond_wait(&persist->wake, &persist->lock);
+		}
+		else if(clock_ns(CLOCK_MONOTONIC) >= due) //The precise clock never lags the coarse one the changes were stamped with
+		{
+			persist_flush(persist, persist->blocks, false);
+		}
+		else
+		{
+			const struct timespec deadline = {(time_t)(due / 1000000000u), (long)(due % 1000000000u)};
+			pthread_cond_timedwait(&persist->wake, &persist->lock, &deadline);
+		}
+	}
+	pthread_mutex_unlock(&persist->lock);
+	return NULL;
+}
+
+// The flusher sleeps on the monotonic clock, like the change timestamps
+static bool start_flusher(persist_t *const persist)
+{
+	pthread_condattr_t attr;
+	if(pthread_condattr_init(&attr) != 0)
+	{
+		return false;
+	}
+	const bool ready = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) == 0 && pthread_cond_init(&persist->wake, &attr) == 0;
+	pthread_condattr_destroy(&attr);
+	if(!ready)
+	{
+		return false;
+	}
+	if(pthread_create(&persist->flusher, NULL, persist_flusher, persist) != 0)
+	{
+		pthread_cond_destroy(&persist->wake);
+		return false;
+	}
+	persist->has_flusher = true;
+	return true;
+}
+
+persist_t *persist_create(const int fd, const uint8_t *const blocks, const size_t num_blocks, const block_store_persistence_t *const config)
+{
+	persist_t *persist = (persist_t *)calloc(1, sizeof(persist_t));
+	if(persist == NULL)
+	{
+		return NULL;
+	}
+	persist->dirty = bitmap_create(num_blocks);
+	if(persist->dirty == NULL || pthread_mutex_init(&persist->lock, NULL) != 0)
+	{
+		bitmap_destroy(persist->dirty);
+		free(persist);
+		return NULL;
+	}
+	if(config != NULL)
+	{
+		persist->config = *config;
+	}
+	if(persist->config.buffer_blocks == 0)
+	{
+		persist->config.buffer_blocks = PERSIST_DEFAULT_BLOCKS;
+	}
+	persist->fd = fd;
+	persist->blocks = blocks;
+	persist->num_blocks = num_blocks;
+	persist->low = SIZE_MAX;
+	if(persist->config.flush_interval_ms != 0 && persist->config.durability != BLOCK_STORE_DURABILITY_IMMEDIATE && !start_flusher(persist))
+	{
+		pthread_mutex_destroy(&persist->lock);
+		bitmap_destroy(persist->dirty);
+		free(persist);
+		return NULL;
+	}
+	return persist;
+}
+
+void persist_lock(persist_t *const persist)
+{
+	pthread_mutex_lock(&persist->lock);
+}
+
+void persist_unlock(persist_t *const persist)
+{
+	pthread_mutex_unlock(&persist->lock);
+}
+
+void persist_mark(persist_t *const persist, const uint8_t *const blocks, const size_t first, const size_t count)
+{
+	persist->blocks = blocks;
+	if(persist->dirty_blocks == 0)
+	{
+		persist->oldest_ns = persist->config.flush_interval_ms != 0 ? now_ns() : 0;
+		if(persist->has_flusher)
+		{
+			pthread_cond_signal(&persist->wake); //Its clock starts now
+		}
+	}
+	for(size_t i = first; i < first + count; i++)
+	{
+		if(!bitmap_test(persist->dirty, i))
+		{
+			bitmap_set(persist->dirty, i);
+			persist->dirty_blocks++;
+		}
+	}
+	persist->low = first < persist->low ? first : persist->low;
+	persist->high = first + count > persist->high ? first + count : persist->high;
+	persist->stats.changes += count;
+
+	const bool due = persist->config.flush_interval_ms != 0 && now_ns() - persist->oldest_ns >= (uint64_t)persist->config.flush_interval_ms * 1000000u;
+	if(persist->config.durability == BLOCK_STORE_DURABILITY_IMMEDIATE || persist->dirty_blocks >= persist->config.buffer_blocks || due)
+	{
+		persist_flush(persist, blocks, false);
+	}
+}
+
+void persist_zero(persist_t *const persist, const uint8_t *const blocks, const size_t first, const size_t count)
+{
+	persist->blocks = blocks;
+	if(fallocate(persist->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, BLOCK_STORE_IMAGE_HEADER_BYTES + first * BLOCK_SIZE_BYTES, count * BLOCK_SIZE_BYTES) != 0)
+	{
+		persist_mark(persist, blocks, first, count);  // Not every file system punches holes, write the zeros instead, the pwrite counts itself
+		return;
+	}
+	persist->stats.write_calls++;
+	persist->stats.changes += count;
+	persist->unsynced = true;
+	for(size_t i = first; i < first + count; i++)
+	{
+		if(bitmap_test(persist->dirty, i))
+		{
+			bitmap_reset(persist->dirty, i);  // Buffered contents are zeros now, and so is the image
+			persist->dirty_blocks--;
+		}
+	}
+	if(persist->config.durability == BLOCK_STORE_DURABILITY_IMMEDIATE)
+	{
+		sync_image(persist);
+	}
+}
+
+bool persist_flush(persist_t *const persist, const uint8_t *const blocks, const bool sync)
+{
+	persist->blocks = blocks;
+	size_t start = persist->dirty_blocks == 0 ? SIZE_MAX : bitmap_next_set(persist->dirty, persist->low);
+	if(start != SIZE_MAX)
+	{
+		persist->stats.flushes++;
+	}
+	while(start != SIZE_MAX && start < persist->high)
+	{
+		size_t end = start;
+		for(;;)
+		{
+			end = bitmap_next_zero(persist->dirty, end);
+			end = end == SIZE_MAX ? persist->num_blocks : end;
+			const size_t next = bitmap_next_set(persist->dirty, end);
+			if(next == SIZE_MAX || next >= persist->high || next - end > PERSIST_GAP_BLOCKS)
+			{
+				break;
+			}
+			end = next;
+		}
+		if(!write_at(persist, blocks + start * BLOCK_SIZE_BYTES, (end - start) * BLOCK_SIZE_BYTES, BLOCK_STORE_IMAGE_HEADER_BYTES + start * BLOCK_SIZE_BYTES))
+		{
+			persist->failed = true;
+		}
+		persist->stats.blocks_written += end - start;
+		persist->unsynced = true;
+		bitmap_reset_range(persist->dirty, start, end - start);
+		start = end < persist->num_blocks ? bitmap_next_set(persist->dirty, end) : SIZE_MAX;
+	}
+	persist->dirty_blocks = 0;
+	persist->low = SIZE_MAX;
+	persist->high = 0;
+	if(persist->unsynced && (sync || persist->config.durability != BLOCK_STORE_DURABILITY_BUFFERED))
+	{
+		sync_image(persist);  // One for the whole batch, the group commit
+	}
+	return !persist->failed;
+}
+
+void persist_resize(persist_t *const persist, const uint8_t *const blocks, const size_t num_blocks)
+{
+	persist->blocks = blocks; //The array may have moved
+	bitmap_t *dirty = bitmap_create(num_blocks);
+	image_superblock_t sb;
+	image_superblock_init(&sb, num_blocks, BLOCK_SIZE_BYTES);
+	if(dirty == NULL || ftruncate(persist->fd, BLOCK_STORE_IMAGE_HEADER_BYTES + num_blocks * BLOCK_SIZE_BYTES) != 0
+		|| !write_at(persist, (const uint8_t *)&sb, sizeof(sb), 0)) // The new geometry, the rest of the header page stays zeros
+	{
+		bitmap_destroy(dirty);
+		persist->failed = true;  // Keep the old map, the image is lost either way
+		return;
+	}
+	persist->dirty_blocks = 0;
+	for(size_t i = bitmap_next_set(persist->dirty, 0); i != SIZE_MAX && i < num_blocks; i = bitmap_next_set(persist->dirty, i + 1))
+	{
+		bitmap_set(dirty, i);
+		persist->dirty_blocks++;
+	}
+	bitmap_destroy(persist->dirty);
+	persist->dirty = dirty;
+	persist->num_blocks = num_blocks;
+	persist->high = persist->high < num_blocks ? persist->high : num_blocks;
+	persist->unsynced = true;
+}
+
+void persist_get_stats(const persist_t *const persist, block_store_persist_stats_t *const stats)
+{
+	*stats = persist->stats;
+}
+
+bool persist_destroy(persist_t *const persist, const uint8_t *const blocks)
+{
+	if(persist == NULL)
+	{
+		return true;
+	}
+	if(persist->has_flusher)
+	{
+		pthread_mutex_lock(&persist->lock);
+		persist->stopping = true;
+		pthread_cond_signal(&persist->wake);
+		pthread_mutex_unlock(&persist->lock);
+		pthread_join(persist->flusher, NULL);
+		pthread_cond_destroy(&persist->wake);
+	}
+	const bool ok = persist_flush(persist, blocks, true); //Nobody else is left to take the lock
+	const bool closed = (close(persist->fd) == 0);
+	bitmap_destroy(persist->dirty);
+	pthread_mutex_destroy(&persist->lock);
+	free(persist);
+	return ok && closed;
+}
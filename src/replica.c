@@ -0,0 +1,217 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "replica.h"
+#include "block_store.h"
+
+#define REPLICA_DEFAULT_BYTES ((size_t)1 << 20)
+#define REPLICA_MIN_BYTES ((size_t)64 << 10)
+#define REPLICA_BATCH_BYTES ((size_t)64 << 10)  // Most the shipper takes per pass
+
+// The primary appends to a byte ring, the shipper drains it in batches
+// head and tail only ever grow, their difference is the number of bytes waiting
+struct replica_log
+{
+	block_store_replication_t config;
+	uint8_t *ring;
+	size_t capacity;
+	size_t head, tail;
+	size_t shipped;  // Bytes applied or written out, what flush waits on
+	bool abandoned;  // Detached by backpressure or failed, nothing more gets logged
+	bool stop;
+	pthread_mutex_t lock;
+	pthread_cond_t data;   // Signalled when bytes arrive or stop is set
+	pthread_cond_t space;  // Signalled when the shipper makes room or ships a batch
+	pthread_t shipper;
+	uint8_t batch[REPLICA_BATCH_BYTES + sizeof(replica_record_t) + BLOCK_SIZE_BYTES];  // Shipper only, may hold a partial record
+	size_t batch_length;
+};
+
+static void ring_copy_in(replica_log_t *const log, const void *const data, const size_t length)
+{
+	const size_t offset = log->head % log->capacity;
+	const size_t first = length < log->capacity - offset ? length : log->capacity - offset;
+	memcpy(log->ring + offset, data, first);
+	memcpy(log->ring, (const uint8_t *)data + first, length - first);
+	log->head += length;
+}
+
+static void ring_copy_out(replica_log_t *const log, uint8_t *const data, const size_t length)
+{
+	const size_t offset = log->tail % log->capacity;
+	const size_t first = length < log->capacity - offset ? length : log->capacity - offset;
+	memcpy(data, log->ring + offset, first);
+	memcpy(data + first, log->ring, length - first);
+	log->tail += length;
+}
+
+static bool write_out(const int fd, const uint8_t *data, size_t length)
+{
+	while(length > 0)
+	{
+		ssize_t written = write(fd, data, length);
+		if(written < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			return false;
+		}
+		data += written;
+		length -= written;
+	}
+	return true;
+}
+
+// Sends one batch on, returns false if the standby can't take it
+static bool ship_batch(replica_log_t *const log)
+{
+	if(log->config.replica == NULL)
+	{
+		const bool ok = write_out(log->config.fd, log->batch, log->batch_length);
+		log->batch_length = 0;
+		return ok;
+	}
+	bool failed = false;
+	size_t records = 0;
+	const size_t applied = replica_apply(log->config.replica, log->batch, log->batch_length, &records, &failed); //Whole records only
+	memmove(log->batch, log->batch + applied, log->batch_length - applied);
+	log->batch_length -= applied;
+	return !failed;
+}
+
+static void *replica_shipper(void *arg)
+{
+	replica_log_t *log = (replica_log_t *)arg;
+	pthread_mutex_lock(&log->lock);
+	for(;;)
+	{
+		while(log->head == log->tail && !log->stop)
+		{
+			pthread_cond_wait(&log->data, &log->lock);
+		}
+		if(log->head == log->tail)
+		{
+			break; //Stopped and drained
+		}
+		size_t length = log->head - log->tail;
+		length = length < REPLICA_BATCH_BYTES ? length : REPLICA_BATCH_BYTES;
+		ring_copy_out(log, log->batch + log->batch_length, length);
+		log->batch_length += length;
+		const bool drain_only = log->abandoned; //Once abandoned the rest is thrown away
+		pthread_cond_broadcast(&log->space); //The primary can carry on while we ship
+		pthread_mutex_unlock(&log->lock);
+
+		const bool ok = drain_only || ship_batch(log);
+		pthread_mutex_lock(&log->lock);
+		if(!ok)
+		{
+			perror("Replication failed, the standby is incomplete");
+			log->abandoned = true;
+		}
+		log->shipped += length;
+		pthread_cond_broadcast(&log->space);
+	}
+	pthread_mutex_unlock(&log->lock);
+	return NULL;
+}
+
+replica_log_t *replica_log_create(const block_store_replication_t *const config)
+{
+	if(config == NULL || (config->replica == NULL && config->fd < 0))
+	{
+		return NULL;
+	}
+	replica_log_t *log = (replica_log_t *)calloc(1, sizeof(replica_log_t));
+	if(log == NULL)
+	{
+		return NULL;
+	}
+	log->config = *config;
+	log->capacity = config->buffer_bytes == 0 ? REPLICA_DEFAULT_BYTES : config->buffer_bytes;
+	log->capacity = log->capacity < REPLICA_MIN_BYTES ? REPLICA_MIN_BYTES : log->capacity; //Always room for a whole record
+	log->ring = (uint8_t *)malloc(log->capacity);
+	if(log->ring == NULL || pthread_mutex_init(&log->lock, NULL) != 0)
+	{
+		free(log->ring);
+		free(log);
+		return NULL;
+	}
+	pthread_cond_init(&log->data, NULL);
+	pthread_cond_init(&log->space, NULL);
+	if(pthread_create(&log->shipper, NULL, replica_shipper, log) != 0)
+	{
+		pthread_cond_destroy(&log->data);
+		pthread_cond_destroy(&log->space);
+		pthread_mutex_destroy(&log->lock);
+		free(log->ring);
+		free(log);
+		return NULL;
+	}
+	return log;
+}
+
+bool replica_log_append(replica_log_t *const log, const replica_record_t *const record, const void *const block, const bool snapshot)
+{
+	const size_t length = sizeof(*record) + (block != NULL ? BLOCK_SIZE_BYTES : 0);
+	pthread_mutex_lock(&log->lock);
+	while(!log->abandoned && log->capacity - (log->head - log->tail) < length)
+	{
+		if(log->config.backpressure == BLOCK_STORE_BACKPRESSURE_DETACH && !snapshot)
+		{
+			log->abandoned = true; //Keep the primary at full speed, the standby needs a fresh start
+			break;
+		}
+		pthread_cond_wait(&log->space, &log->lock); //Hold the primary back to the standby's pace
+	}
+	const bool logged = !log->abandoned;
+	if(logged)
+	{
+		ring_copy_in(log, record, sizeof(*record));
+		if(block != NULL)
+		{
+			ring_copy_in(log, block, BLOCK_SIZE_BYTES);
+		}
+		pthread_cond_signal(&log->data);
+	}
+	pthread_mutex_unlock(&log->lock);
+	return logged;
+}
+
+bool replica_log_flush(replica_log_t *const log)
+{
+	pthread_mutex_lock(&log->lock);
+	const size_t target = log->head;
+	while(log->shipped < target)
+	{
+		pthread_cond_wait(&log->space, &log->lock);
+	}
+	const bool complete = !log->abandoned;
+	pthread_mutex_unlock(&log->lock);
+	return complete;
+}
+
+bool replica_log_destroy(replica_log_t *const log)
+{
+	if(log == NULL)
+	{
+		return false;
+	}
+	pthread_mutex_lock(&log->lock);
+	log->stop = true;
+	pthread_cond_signal(&log->data);
+	pthread_mutex_unlock(&log->lock);
+	pthread_join(log->shipper, NULL);
+
+	const bool complete = !log->abandoned && log->batch_length == 0; //Nothing left half applied
+	pthread_cond_destroy(&log->data);
+	pthread_cond_destroy(&log->space);
+	pthread_mutex_destroy(&log->lock);
+	free(log->ring);
+	free(log);
+	return complete;
+}
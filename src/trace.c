@@ -0,0 +1,293 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "trace.h"
+#include "block_store.h"
+
+#define TRACE_RING_RECORDS 16384   // Per thread, must be a power of two
+#define TRACE_FLUSH_NS 1000000     // How long the flusher sleeps between drains
+
+// Single producer (the owning thread), single consumer (the flusher) ring of records
+// head and tail only ever grow, their difference is the number of records waiting
+// Rings outlive traces, a thread keeps its ring for every later trace and a new thread takes over one whose thread exited
+typedef struct trace_ring
+{
+	trace_record_t records[TRACE_RING_RECORDS];
+	atomic_size_t head;  // Next slot the owning thread fills
+	atomic_size_t tail;  // Next slot the flusher writes out
+	atomic_bool busy;    // The owning thread may be holding a pointer to the active session
+	bool owned;          // Guarded by rings_lock
+	uint64_t generation; // Trace the two below are for, written by the owning thread while busy
+	uint32_t thread;     // Per trace, a thread taking the ring over mid trace gets a number of its own
+	uint64_t dropped;
+	struct trace_ring *next;
+} trace_ring_t;
+
+typedef struct
+{
+	FILE *file;
+	uint64_t generation;  // Tells threads their ring's thread number and drop count are from an older trace
+	uint64_t start_ns;
+	atomic_uint threads;
+	pthread_t flusher;
+	atomic_bool stop;
+	uint64_t written;  // Flusher only
+	bool failed;       // Flusher only
+} trace_session_t;
+
+static _Atomic(trace_session_t *) active_session;
+static pthread_mutex_t control_lock = PTHREAD_MUTEX_INITIALIZER;  // Serializes start and stop
+static uint64_t next_generation = 1;
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;  // Only taken the first time a thread traces, and by the flusher and stop
+static trace_ring_t *rings;  // Every ring there is, the list only grows at its head so a snapshot is safe to walk
+static atomic_uint_fast64_t ringless_dropped;  // Records from threads that could not get a ring
+static pthread_key_t ring_key;  // Hands the ring back when its thread exits
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static _Thread_local trace_ring_t *my_ring;
+static _Thread_local uint64_t my_generation;  // Trace this thread has its number in
+
+static uint64_t now_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+// Ids and counts are stored in 32 bits, anything that doesn't fit reads back as no block
+static uint32_t trace_field(const size_t value)
+{
+	return value >= TRACE_NONE ? TRACE_NONE : (uint32_t)value;
+}
+
+static void ring_release(void *arg)
+{
+	pthread_mutex_lock(&rings_lock);
+	((trace_ring_t *)arg)->owned = false; //Anything still in it is drained as usual
+	pthread_mutex_unlock(&rings_lock);
+}
+
+static void ring_key_create(void)
+{
+	pthread_key_create(&ring_key, ring_release);
+}
+
+// The calling thread's ring, picked up the first time the thread traces
+static trace_ring_t *thread_ring(void)
+{
+	if(my_ring == NULL)
+	{
+		pthread_once(&ring_key_once, ring_key_create);
+		pthread_mutex_lock(&rings_lock);
+		trace_ring_t *ring = rings;
+		while(ring != NULL && ring->owned)
+		{
+			ring = ring->next;
+		}
+		if(ring == NULL && (ring = (trace_ring_t *)calloc(1, sizeof(trace_ring_t))) != NULL)
+		{
+			ring->next = rings;
+			rings = ring;
+		}
+		if(ring != NULL)
+		{
+			ring->owned = true;
+		}
+		pthread_mutex_unlock(&rings_lock);
+		if(ring == NULL)
+		{
+			return NULL; //Try again next call, the record is counted as dropped
+		}
+		pthread_setspecific(ring_key, ring);
+		my_ring = ring;
+	}
+	return my_ring;
+}
+
+void trace_record(const trace_op_t op, const size_t arg, const size_t result)
+{
+	if(atomic_load_explicit(&active_session, memory_order_relaxed) == NULL)
+	{
+		return; //Not tracing, the only cost is this load
+	}
+	trace_ring_t *ring = thread_ring();
+	if(ring == NULL)
+	{
+		atomic_fetch_add_explicit(&ringless_dropped, 1, memory_order_relaxed);
+		return;
+	}
+	//Stop clears the session and then waits for busy rings, the fence makes sure one of the two sides sees the other
+	//It only orders this thread's own stores, no other thread writes this ring's line
+	atomic_store_explicit(&ring->busy, true, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	trace_session_t *session = atomic_load_explicit(&active_session, memory_order_acquire);
+	if(session != NULL)
+	{
+		if(ring->generation != session->generation)
+		{
+			ring->generation = session->generation; //First record in this ring in this trace
+			ring->dropped = 0;
+		}
+		if(my_generation != session->generation)
+		{
+			my_generation = session->generation; //First record of this thread in this trace
+			ring->thread = atomic_fetch_add_explicit(&session->threads, 1, memory_order_relaxed);
+		}
+		const size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+		if(head - atomic_load_explicit(&ring->tail, memory_order_acquire) == TRACE_RING_RECORDS)
+		{
+			ring->dropped++; //Full, the caller never waits on the flusher
+		}
+		else
+		{
+			trace_record_t *record = &ring->records[head & (TRACE_RING_RECORDS - 1)];
+			record->timestamp_ns = now_ns() - session->start_ns;
+			record->arg = trace_field(arg);
+			record->result = trace_field(result);
+			record->thread = ring->thread;
+			record->op = (uint16_t)op;
+			record->reserved = 0;
+			atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+		}
+	}
+	atomic_store_explicit(&ring->busy, false, memory_order_release);
+}
+
+static trace_ring_t *rings_snapshot(void)
+{
+	pthread_mutex_lock(&rings_lock);
+	trace_ring_t *ring = rings;
+	pthread_mutex_unlock(&rings_lock);
+	return ring;
+}
+
+// Writes out everything buffered so far
+static void drain_rings(trace_session_t *const session)
+{
+	for(trace_ring_t *ring = rings_snapshot(); ring != NULL; ring = ring->next)
+	{
+		size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+		const size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+		while(tail != head)
+		{
+			const size_t slot = tail & (TRACE_RING_RECORDS - 1);
+			size_t count = head - tail;
+			if(count > TRACE_RING_RECORDS - slot)
+			{
+				count = TRACE_RING_RECORDS - slot; //Up to the wrap, the rest goes next time round
+			}
+			if(!session->failed && fwrite(&ring->records[slot], sizeof(trace_record_t), count, session->file) != count)
+			{
+				session->failed = true;
+			}
+			session->written += count;
+			tail += count;
+		}
+		atomic_store_explicit(&ring->tail, tail, memory_order_release);
+	}
+}
+
+static void *trace_flusher(void *arg)
+{
+	trace_session_t *session = (trace_session_t *)arg;
+	const struct timespec pause = {0, TRACE_FLUSH_NS};
+	while(!atomic_load(&session->stop))
+	{
+		drain_rings(session);
+		nanosleep(&pause, NULL);
+	}
+	drain_rings(session); //Whatever was logged before stop was called
+	return NULL;
+}
+
+bool block_store_trace_start(const char *const filename)
+{
+	if(filename == NULL)
+	{
+		return false;
+	}
+	pthread_mutex_lock(&control_lock);
+	if(atomic_load(&active_session) != NULL)
+	{
+		pthread_mutex_unlock(&control_lock);
+		return false; //One trace at a time
+	}
+
+	trace_session_t *session = (trace_session_t *)calloc(1, sizeof(trace_session_t));
+	if(session == NULL)
+	{
+		pthread_mutex_unlock(&control_lock);
+		return false;
+	}
+	session->file = fopen(filename, "wb");
+	trace_header_t header = {{0}, TRACE_VERSION, sizeof(trace_record_t), 0, 0};
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	if(session->file == NULL || fwrite(&header, sizeof(header), 1, session->file) != 1)
+	{
+		perror("Failed to open trace file");
+		if(session->file != NULL)
+		{
+			fclose(session->file);
+		}
+		free(session);
+		pthread_mutex_unlock(&control_lock);
+		return false;
+	}
+	session->generation = next_generation++;
+	session->start_ns = now_ns();
+	atomic_init(&session->threads, 0);
+	atomic_init(&session->stop, false);
+	atomic_store_explicit(&ringless_dropped, 0, memory_order_relaxed);
+	if(pthread_create(&session->flusher, NULL, trace_flusher, session) != 0)
+	{
+		fclose(session->file);
+		free(session);
+		pthread_mutex_unlock(&control_lock);
+		return false;
+	}
+
+	atomic_store(&active_session, session);
+	pthread_mutex_unlock(&control_lock);
+	return true;
+}
+
+size_t block_store_trace_stop(void)
+{
+	pthread_mutex_lock(&control_lock);
+	trace_session_t *session = atomic_exchange(&active_session, NULL);
+	if(session == NULL)
+	{
+		pthread_mutex_unlock(&control_lock);
+		return SIZE_MAX; //Nothing running
+	}
+
+	//Nobody can pick the session up any more, wait out the threads that already did
+	//Rings made after this snapshot belong to threads that can only see the session gone
+	const struct timespec pause = {0, 1000};
+	uint64_t dropped = atomic_load_explicit(&ringless_dropped, memory_order_relaxed);
+	for(trace_ring_t *ring = rings_snapshot(); ring != NULL; ring = ring->next)
+	{
+		while(atomic_load_explicit(&ring->busy, memory_order_acquire))
+		{
+			nanosleep(&pause, NULL);
+		}
+		dropped += ring->generation == session->generation ? ring->dropped : 0;
+	}
+	atomic_store(&session->stop, true);
+	pthread_join(session->flusher, NULL);
+
+	//The header goes in last, now that the totals are known
+	trace_header_t header = {{0}, TRACE_VERSION, sizeof(trace_record_t), session->written, dropped};
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	bool ok = !session->failed && fseek(session->file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, session->file) == 1;
+	ok = (fclose(session->file) == 0) && ok;
+	const size_t written = session->written;
+
+	free(session);
+	pthread_mutex_unlock(&control_lock);
+	return ok ? written : SIZE_MAX;
+}
@@ -0,0 +1,238 @@
+#include <string.h>
+
+#include "zone_map.h"
+
+_Static_assert(BLOCK_STORE_ZONE_BLOCKS % 64 == 0 && BLOCK_STORE_ZONE_BLOCKS <= UINT32_MAX, "zones are whole bitmap words with 32 bit counts");
+
+typedef struct
+{
+	uint32_t free;     // Always exact
+	uint32_t head;     // Free run the zone starts with
+	uint32_t tail;     // Free run the zone ends with
+	uint32_t largest;  // Longest free run inside the zone
+	bool stale;        // Changed since head, tail and largest were measured
+} zone_t;
+
+struct zone_map
+{
+	size_t num_blocks;
+	size_t count;        // Number of zones, the last one may be short
+	zone_t *zones;
+	bitmap_t *has_free;  // A bit per zone, set while it has a free block
+};
+
+static size_t zone_end(const zone_map_t *const zones, const size_t zone)
+{
+	const size_t end = (zone + 1) * BLOCK_STORE_ZONE_BLOCKS;
+	return end < zones->num_blocks ? end : zones->num_blocks;
+}
+
+// Where the free run starting at start ends, never past end
+static size_t run_end(const bitmap_t *const fbm, const size_t start, const size_t end)
+{
+	if(!bitmap_test_range_any(fbm, start, end - start))
+	{
+		return end;  // Checked first so a mostly free device isn't scanned to its end from every zone
+	}
+	return bitmap_next_set(fbm, start);
+}
+
+// Next free block from start, SIZE_MAX if there is none before end
+static size_t next_free(const bitmap_t *const fbm, const size_t start, const size_t end)
+{
+	if(start >= end || bitmap_test_range_all(fbm, start, end - start))
+	{
+		return SIZE_MAX;
+	}
+	return bitmap_next_zero(fbm, start);
+}
+
+// Walks the free runs of a zone for its summary
+static void zone_measure(zone_map_t *const zones, const bitmap_t *const fbm, const size_t zone)
+{
+	const size_t first = zone * BLOCK_STORE_ZONE_BLOCKS;
+	const size_t end = zone_end(zones, zone);
+	size_t free = 0, head = 0, tail = 0, largest = 0;
+	for(size_t start = next_free(fbm, first, end); start != SIZE_MAX; )
+	{
+		const size_t stop = run_end(fbm, start, end);
+		const size_t length = stop - start;
+		free += length;
+		largest = length > largest ? length : largest;
+		head = start == first ? length : head;
+		tail = stop == end ? length : 0;
+		start = next_free(fbm, stop, end);
+	}
+	zones->zones[zone] = (zone_t){(uint32_t)free, (uint32_t)head, (uint32_t)tail, (uint32_t)largest, false};
+}
+
+zone_map_t *zone_map_create(const size_t num_blocks)
+{
+	zone_map_t *zones = (zone_map_t *)calloc(1, sizeof(zone_map_t));
+	if(zones == NULL)
+	{
+		return NULL;
+	}
+	zones->num_blocks = num_blocks;
+	zones->count = (num_blocks + BLOCK_STORE_ZONE_BLOCKS - 1) / BLOCK_STORE_ZONE_BLOCKS;
+	zones->zones = (zone_t *)calloc(zones->count, sizeof(zone_t));
+	zones->has_free = bitmap_create(zones->count);
+	if(zones->zones == NULL || zones->has_free == NULL)
+	{
+		zone_map_destroy(zones);
+		return NULL;
+	}
+	return zones;
+}
+
+void zone_map_rebuild(zone_map_t *const zones, const bitmap_t *const fbm)
+{
+	for(size_t zone = 0; zone < zones->count; zone++)
+	{
+		zone_measure(zones, fbm, zone);
+		if(zones->zones[zone].free != 0)
+		{
+			bitmap_set(zones->has_free, zone);
+		}
+		else
+		{
+			bitmap_reset(zones->has_free, zone);
+		}
+	}
+}
+
+static void zone_change(zone_map_t *const zones, size_t first, size_t count, const bool used)
+{
+	while(count > 0)
+	{
+		const size_t zone = first / BLOCK_STORE_ZONE_BLOCKS;
+		const size_t end = zone_end(zones, zone);
+		const size_t piece = count < end - first ? count : end - first;
+		zone_t *const summary = &zones->zones[zone];
+		summary->free = used ? summary->free - (uint32_t)piece : summary->free + (uint32_t)piece;
+		summary->stale = true;
+		if(summary->free != 0)
+		{
+			bitmap_set(zones->has_free, zone);
+		}
+		else
+		{
+			bitmap_reset(zones->has_free, zone);
+		}
+		first += piece;
+		count -= piece;
+	}
+}
+
+void zone_map_used(zone_map_t *const zones, const size_t first, const size_t count)
+{
+	zone_change(zones, first, count, true);
+}
+
+void zone_map_freed(zone_map_t *const zones, const size_t first, const size_t count)
+{
+	zone_change(zones, first, count, false);
+}
+
+size_t zone_map_next_free(const zone_map_t *const zones, const bitmap_t *const fbm, const size_t from)
+{
+	if(from >= zones->num_blocks)
+	{
+		return SIZE_MAX;
+	}
+	size_t zone = from / BLOCK_STORE_ZONE_BLOCKS;
+	if(bitmap_test(zones->has_free, zone))
+	{
+		const size_t found = next_free(fbm, from, zone_end(zones, zone));
+		if(found != SIZE_MAX)
+		{
+			return found;
+		}
+	}
+	zone = bitmap_next_set(zones->has_free, zone + 1);
+	return zone == SIZE_MAX ? SIZE_MAX : bitmap_next_zero(fbm, zone * BLOCK_STORE_ZONE_BLOCKS);
+}
+
+size_t zone_map_prev_free(const zone_map_t *const zones, const bitmap_t *const fbm, const size_t from)
+{
+	if(from >= zones->num_blocks)
+	{
+		return SIZE_MAX;
+	}
+	size_t zone = from / BLOCK_STORE_ZONE_BLOCKS;
+	if(bitmap_test(zones->has_free, zone))
+	{
+		const size_t found = bitmap_prev_zero(fbm, from);
+		if(found != SIZE_MAX && found >= zone * BLOCK_STORE_ZONE_BLOCKS)
+		{
+			return found;
+		}
+	}
+	zone = zone == 0 ? SIZE_MAX : bitmap_prev_set(zones->has_free, zone - 1);
+	return zone == SIZE_MAX ? SIZE_MAX : bitmap_prev_zero(fbm, zone_end(zones, zone) - 1);
+}
+
+size_t zone_map_find_run(zone_map_t *const zones, const bitmap_t *const fbm, const size_t count)
+{
+	size_t carry = 0;  // Free blocks running up to the start of the zone, from the zones before it
+	for(size_t zone = 0; zone < zones->count; zone++)
+	{
+		zone_t *const summary = &zones->zones[zone];
+		const size_t first = zone * BLOCK_STORE_ZONE_BLOCKS;
+		const size_t end = zone_end(zones, zone);
+		if(summary->free == 0)
+		{
+			carry = 0;
+			continue;
+		}
+		if(summary->stale)
+		{
+			zone_measure(zones, fbm, zone);
+		}
+		if(carry + summary->head >= count)
+		{
+			return first - carry;  // Starts in an earlier zone, or right at the front of this one
+		}
+		if(summary->largest >= count)
+		{
+			for(size_t start = next_free(fbm, first, end); start != SIZE_MAX; )
+			{
+				const size_t stop = run_end(fbm, start, end);
+				if(stop - start >= count)
+				{
+					return start;
+				}
+				start = next_free(fbm, stop, end);
+			}
+		}
+		carry = summary->head == end - first ? carry + (end - first) : summary->tail;
+	}
+	return SIZE_MAX;
+}
+
+bool zone_map_get(zone_map_t *const zones, const bitmap_t *const fbm, const size_t zone, block_store_zone_t *const info)
+{
+	if(zone >= zones->count)
+	{
+		return false;
+	}
+	if(zones->zones[zone].stale)
+	{
+		zone_measure(zones, fbm, zone);
+	}
+	info->first_block = zone * BLOCK_STORE_ZONE_BLOCKS;
+	info->blocks = zone_end(zones, zone) - info->first_block;
+	info->free_blocks = zones->zones[zone].free;
+	info->largest_free_run = zones->zones[zone].largest;
+	return true;
+}
+
+void zone_map_destroy(zone_map_t *const zones)
+{
+	if(zones)
+	{
+		bitmap_destroy(zones->has_free);
+		free(zones->zones);
+		free(zones);
+	}
+}
@@ -1,6 +1,25 @@
 #include <gtest/gtest.h>
+#include <algorithm>
+#include <chrono>
+#include <dirent.h>
+#include <fcntl.h>
+#include <map>
+#include <random>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <string>
+#include <thread>
+#include <vector>
 #include "block_store.h"
+#include "block_store.hpp"
+#include "bitmap.h"
+#include "image.h"
+#include "trace.h"
+#include "block_server.h"
+#include "block_client.h"
+#include "block_fs.h"
+#include "block_kv.h"
 
 // The object is opaque, so we can't really test things directly....
 
@@ -22,8 +41,40 @@ class GradeEnvironment : public testing::Environment {
 };
 
 
+// Tests make their images and traces under relative names, so they all run inside a directory of
+// their own under TMPDIR (or /tmp) and nothing is left behind wherever the suite was started from
+class ScratchDirEnvironment : public testing::Environment {
+	public:
+		virtual void SetUp() {
+			const char *tmp = getenv("TMPDIR");
+			dir = std::string(tmp != nullptr && tmp[0] != '\0' ? tmp : "/tmp") + "/hw3_test.XXXXXX";
+			ASSERT_NE(nullptr, mkdtemp(&dir[0])) << "can't make a scratch directory in " << dir;
+			ASSERT_NE(nullptr, getcwd(start, sizeof(start)));
+			ASSERT_EQ(0, chdir(dir.c_str()));
+		}
+		virtual void TearDown() {
+			if (chdir(start) != 0) {
+				return;
+			}
+			DIR *scratch = opendir(dir.c_str());
+			for (struct dirent *entry = scratch != nullptr ? readdir(scratch) : nullptr; entry != nullptr; entry = readdir(scratch)) {
+				if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+					unlink((dir + "/" + entry->d_name).c_str());
+				}
+			}
+			if (scratch != nullptr) {
+				closedir(scratch);
+			}
+			rmdir(dir.c_str());
+		}
+	private:
+		std::string dir;
+		char start[4096];
+};
+
 int main(int argc, char **argv) {
 	::testing::InitGoogleTest(&argc, argv);
+	::testing::AddGlobalTestEnvironment(new ScratchDirEnvironment);
 	::testing::AddGlobalTestEnvironment(new GradeEnvironment);
 	return RUN_ALL_TESTS();
 }
@@ -368,7 +419,7 @@ TEST(block_store_serialize, valid_serialize)
 	// Try to call serialize...
 	size_t bytesSerialized;
 	bytesSerialized = block_store_serialize(bs, "test.bs");
-	ASSERT_EQ(bytesSerialized, BLOCK_STORE_NUM_BYTES);
+	ASSERT_EQ(bytesSerialized, BLOCK_STORE_IMAGE_HEADER_BYTES + BLOCK_STORE_NUM_BYTES);
 
 	free(write_buffer);
 	block_store_destroy(bs);
@@ -401,18 +452,121 @@ TEST(block_store_serialize, check_file_size)
 	// Try to call serialize...
 	size_t bytesSerialized;
 	bytesSerialized = block_store_serialize(bs, "test.bs");
-	ASSERT_EQ(bytesSerialized, BLOCK_STORE_NUM_BYTES);
+	ASSERT_EQ(bytesSerialized, BLOCK_STORE_IMAGE_HEADER_BYTES + BLOCK_STORE_NUM_BYTES);
 
 	block_store_destroy(bs);
 
 	// Just in case your bytesSerialized is lying...
 	struct stat st;
 	stat("test.bs", &st);
-	ASSERT_EQ(st.st_size,BLOCK_STORE_NUM_BYTES);
+	ASSERT_EQ(st.st_size,BLOCK_STORE_IMAGE_HEADER_BYTES + BLOCK_STORE_NUM_BYTES);
 
 	score += 4;
 }
 
+// Writes bytes over a file, for handing the image checks damaged or old images
+static void write_image(const char *path, const std::vector<uint8_t> &bytes)
+{
+	FILE *file = fopen(path, "wb");
+	ASSERT_NE(nullptr, file);
+	ASSERT_EQ(bytes.size(), fwrite(bytes.data(), 1, bytes.size(), file));
+	fclose(file);
+}
+
+TEST(block_store_serialize, image_format)
+{
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs);
+	char buffer[BLOCK_SIZE_BYTES] = "Versioned";
+	ASSERT_EQ(true, block_store_request(bs, 9));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 9, buffer));
+	ASSERT_EQ(BLOCK_STORE_IMAGE_HEADER_BYTES + BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "test_image.bs"));
+	const size_t used = block_store_get_used_blocks(bs);
+	block_store_destroy(bs);
+
+	std::vector<uint8_t> image(BLOCK_STORE_IMAGE_HEADER_BYTES + BLOCK_STORE_NUM_BYTES);
+	FILE *file = fopen("test_image.bs", "rb");
+	ASSERT_NE(nullptr, file);
+	ASSERT_EQ(image.size(), fread(image.data(), 1, image.size(), file));
+	fclose(file);
+	image_superblock_t sb;
+	memcpy(&sb, image.data(), sizeof(sb));
+	ASSERT_EQ(0, memcmp(IMAGE_MAGIC, sb.magic, sizeof(sb.magic)));
+	ASSERT_EQ(IMAGE_VERSION, sb.version);
+	ASSERT_EQ(BLOCK_STORE_IMAGE_HEADER_BYTES, sb.header_bytes);
+	ASSERT_EQ(BLOCK_SIZE_BYTES, sb.block_size);
+	ASSERT_EQ(BLOCK_STORE_NUM_BLOCKS, sb.num_blocks);
+	ASSERT_EQ(BITMAP_START_BLOCK, sb.bitmap_start);
+	ASSERT_EQ(0u, sb.incompat_features);
+	ASSERT_EQ(image_checksum(&sb), sb.checksum);
+	ASSERT_EQ(BLOCK_STORE_IMAGE_OK, block_store_check_image("test_image.bs"));
+	ASSERT_EQ(BLOCK_STORE_IMAGE_UNREADABLE, block_store_check_image("test_missing.bs"));
+	ASSERT_EQ(BLOCK_STORE_IMAGE_UNREADABLE, block_store_check_image(nullptr));
+
+	// Each kind of damage is told apart, and none of it gets past deserialize
+	std::vector<uint8_t> damaged = image;
+	damaged[offsetof(image_superblock_t, num_blocks)] ^= 1;
+	write_image("test_image.bs", damaged);
+	ASSERT_EQ(BLOCK_STORE_IMAGE_BAD_CHECKSUM, block_store_check_image("test_image.bs"));
+	ASSERT_EQ(nullptr, block_store_deserialize("test_image.bs"));
+	ASSERT_EQ(nullptr, block_store_deserialize_lazy("test_image.bs", false));
+
+	damaged = image;
+	damaged[0] = 'X';
+	write_image("test_image.bs", damaged);
+	ASSERT_EQ(BLOCK_STORE_IMAGE_BAD_MAGIC, block_store_check_image("test_image.bs"));
+
+	image_superblock_t changed = sb;
+	changed.version = IMAGE_VERSION + 1;
+	image_superblock_seal(&changed);
+	damaged = image;
+	memcpy(damaged.data(), &changed, sizeof(changed));
+	write_image("test_image.bs", damaged);
+	ASSERT_EQ(BLOCK_STORE_IMAGE_BAD_VERSION, block_store_check_image("test_image.bs"));
+
+	changed = sb;
+	changed.incompat_features = 0x80000000u;
+	changed.compat_features = 0x1u;
+	image_superblock_seal(&changed);
+	memcpy(damaged.data(), &changed, sizeof(changed));
+	write_image("test_image.bs", damaged);
+	ASSERT_EQ(BLOCK_STORE_IMAGE_UNSUPPORTED, block_store_check_image("test_image.bs"));
+	changed.incompat_features = 0;
+	image_superblock_seal(&changed);
+	memcpy(damaged.data(), &changed, sizeof(changed));
+	write_image("test_image.bs", damaged);
+	ASSERT_EQ(BLOCK_STORE_IMAGE_OK, block_store_check_image("test_image.bs")); // Unknown compat features are fine
+
+	damaged = image;
+	damaged.resize(damaged.size() - BLOCK_SIZE_BYTES);
+	write_image("test_image.bs", damaged);
+	ASSERT_EQ(BLOCK_STORE_IMAGE_BAD_GEOMETRY, block_store_check_image("test_image.bs"));
+	ASSERT_EQ(nullptr, block_store_deserialize("test_image.bs"));
+
+	damaged = image;
+	damaged[BLOCK_STORE_IMAGE_HEADER_BYTES + BITMAP_START_BLOCK * BLOCK_SIZE_BYTES + BITMAP_START_BLOCK / 8] = 0;
+	write_image("test_image.bs", damaged);
+	ASSERT_EQ(BLOCK_STORE_IMAGE_BAD_BITMAP, block_store_check_image("test_image.bs"));
+	ASSERT_EQ(nullptr, block_store_deserialize("test_image.bs"));
+
+	// An image from before the header is only taken through the converter
+	const std::vector<uint8_t> legacy(image.begin() + BLOCK_STORE_IMAGE_HEADER_BYTES, image.end());
+	write_image("test_image.bs", legacy);
+	ASSERT_EQ(BLOCK_STORE_IMAGE_LEGACY, block_store_check_image("test_image.bs"));
+	ASSERT_EQ(nullptr, block_store_deserialize("test_image.bs"));
+	ASSERT_EQ(BLOCK_STORE_IMAGE_HEADER_BYTES + BLOCK_STORE_NUM_BYTES, block_store_convert_legacy("test_image.bs", "test_image.bs"));
+	ASSERT_EQ(BLOCK_STORE_IMAGE_OK, block_store_check_image("test_image.bs"));
+	ASSERT_EQ(0, block_store_convert_legacy("test_image.bs", "test_image.bs")); // Already converted
+	bs = block_store_deserialize("test_image.bs");
+	ASSERT_NE(nullptr, bs);
+	char read_buffer[BLOCK_SIZE_BYTES];
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 9, read_buffer));
+	ASSERT_EQ(0, memcmp(buffer, read_buffer, BLOCK_SIZE_BYTES));
+	ASSERT_EQ(used, block_store_get_used_blocks(bs));
+	block_store_destroy(bs);
+	remove("test_image.bs");
+}
+
 TEST(block_store_serialize, null_filename)
 {
 	block_store_t *bs = NULL;
@@ -469,7 +623,7 @@ TEST(block_store_deserialize, valid_deserialize)
 	// Try to call serialize...
 	size_t bytesSerialized;
 	bytesSerialized = block_store_serialize(bsWrite, "test.bs");
-	ASSERT_EQ(bytesSerialized, BLOCK_STORE_NUM_BYTES);
+	ASSERT_EQ(bytesSerialized, BLOCK_STORE_IMAGE_HEADER_BYTES + BLOCK_STORE_NUM_BYTES);
 
 	// Don't free the write_buffer because we will use it later to compare
 	// to the read
@@ -515,3 +669,1966 @@ TEST(block_store_deserialize, null_filename)
 	score += 2;
 }
 
+
+TEST(block_store_deserialize, lazy_deserialize)
+{
+	block_store_t *bsWrite = block_store_create();
+	ASSERT_NE(nullptr, bsWrite) << "block_store_create returned NULL when it should not have\n";
+
+	uint8_t write_buffer[BLOCK_SIZE_BYTES];
+	memset(write_buffer, 'L', BLOCK_SIZE_BYTES);
+	ASSERT_EQ(true, block_store_request(bsWrite, 200));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bsWrite, 200, write_buffer));
+	ASSERT_EQ(BLOCK_STORE_IMAGE_HEADER_BYTES + BLOCK_STORE_NUM_BYTES, block_store_serialize(bsWrite, "test_lazy.bs"));
+	block_store_destroy(bsWrite);
+
+	block_store_t *bsRead = block_store_deserialize_lazy("test_lazy.bs", false);
+	ASSERT_NE(nullptr, bsRead);
+
+	// Only the bitmap should have been read so far, but it has to be complete
+	ASSERT_EQ(BITMAP_NUM_BLOCKS, block_store_get_resident_blocks(bsRead));
+	ASSERT_EQ(false, block_store_request(bsRead, 200));
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 1, block_store_get_used_blocks(bsRead));
+
+	uint8_t read_buffer[BLOCK_SIZE_BYTES] = {0};
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bsRead, 200, read_buffer));
+	ASSERT_EQ(0, memcmp(read_buffer, write_buffer, BLOCK_SIZE_BYTES));
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 1, block_store_get_resident_blocks(bsRead));
+
+	// Writes replace the whole block, so they become resident without touching the file
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bsRead, 201, write_buffer));
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 2, block_store_get_resident_blocks(bsRead));
+
+	ASSERT_EQ(true, block_store_load_all(bsRead));
+	ASSERT_EQ(BLOCK_STORE_NUM_BLOCKS, block_store_get_resident_blocks(bsRead));
+	block_store_destroy(bsRead);
+}
+
+TEST(block_store_deserialize, lazy_background_load)
+{
+	block_store_t *bsWrite = block_store_create();
+	ASSERT_NE(nullptr, bsWrite) << "block_store_create returned NULL when it should not have\n";
+	char write_buffer[BLOCK_SIZE_BYTES] = "Loaded in the background";
+	ASSERT_EQ(true, block_store_request(bsWrite, 300));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bsWrite, 300, write_buffer));
+	ASSERT_EQ(BLOCK_STORE_IMAGE_HEADER_BYTES + BLOCK_STORE_NUM_BYTES, block_store_serialize(bsWrite, "test_lazy.bs"));
+	block_store_destroy(bsWrite);
+
+	block_store_t *bsRead = block_store_deserialize_lazy("test_lazy.bs", true);
+	ASSERT_NE(nullptr, bsRead);
+	char read_buffer[BLOCK_SIZE_BYTES] = {0};
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bsRead, 300, read_buffer));
+	ASSERT_EQ(0, memcmp(read_buffer, write_buffer, BLOCK_SIZE_BYTES));
+
+	// Serializing over the backing file must pull in everything first
+	ASSERT_EQ(BLOCK_STORE_IMAGE_HEADER_BYTES + BLOCK_STORE_NUM_BYTES, block_store_serialize(bsRead, "test_lazy.bs"));
+	ASSERT_EQ(BLOCK_STORE_NUM_BLOCKS, block_store_get_resident_blocks(bsRead));
+	block_store_destroy(bsRead);
+
+	block_store_t *bsCheck = block_store_deserialize("test_lazy.bs");
+	ASSERT_NE(nullptr, bsCheck);
+	memset(read_buffer, 0, BLOCK_SIZE_BYTES);
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bsCheck, 300, read_buffer));
+	ASSERT_EQ(0, memcmp(read_buffer, write_buffer, BLOCK_SIZE_BYTES));
+	block_store_destroy(bsCheck);
+}
+
+TEST(block_store_deserialize, lazy_readahead)
+{
+	block_store_options_t options = {};
+	options.num_blocks = 4096;
+	block_store_t *bsWrite = block_store_create_with(&options);
+	ASSERT_NE(nullptr, bsWrite);
+	uint8_t buffer[BLOCK_SIZE_BYTES];
+	for (size_t i = 1000; i < 4096; i++)
+	{
+		memset(buffer, int(i % 251), BLOCK_SIZE_BYTES);
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bsWrite, i, buffer));
+	}
+	ASSERT_EQ(BLOCK_STORE_IMAGE_HEADER_BYTES + 4096 * BLOCK_SIZE_BYTES, block_store_serialize(bsWrite, "test_lazy.bs"));
+
+	// Resident stores only take hints, but they still check them
+	ASSERT_EQ(true, block_store_prefetch(bsWrite, 4000, 1000));
+	ASSERT_EQ(false, block_store_prefetch(bsWrite, 4096, 1));
+	ASSERT_EQ(false, block_store_prefetch(bsWrite, 0, 0));
+	ASSERT_EQ(false, block_store_prefetch(nullptr, 0, 1));
+	ASSERT_EQ(false, block_store_set_readahead(nullptr, 16));
+	ASSERT_EQ(true, block_store_set_readahead(bsWrite, 64));
+	for (size_t i = 1000; i < 1200; i++)
+	{
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bsWrite, i, buffer));
+		ASSERT_EQ(i % 251, buffer[0]);
+	}
+	block_store_destroy(bsWrite);
+
+	block_store_t *bs = block_store_deserialize_lazy("test_lazy.bs", false);
+	ASSERT_NE(nullptr, bs);
+	const size_t base = block_store_get_resident_blocks(bs);
+	uint8_t written[BLOCK_SIZE_BYTES];
+	memset(written, 'W', BLOCK_SIZE_BYTES);
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 1050, written));
+
+	// One read could be anything, the second in a row opens a window the reader fills itself
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 1000, buffer));
+	ASSERT_EQ(base + 2, block_store_get_resident_blocks(bs));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 1001, buffer));
+	ASSERT_EQ(base + 2 + 1 + BLOCK_STORE_READAHEAD_MIN_BLOCKS, block_store_get_resident_blocks(bs));
+
+	// Keeping it up hands the next, doubled, window to the prefetch thread
+	for (size_t i = 1002; i <= 1010; i++)
+	{
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, i, buffer));
+	}
+	const size_t ahead = base + 2 + (1011 + 2 * BLOCK_STORE_READAHEAD_MIN_BLOCKS - 1001);
+	for (int wait = 0; wait < 5000 && block_store_get_resident_blocks(bs) < ahead; wait++)
+	{
+		usleep(1000);
+	}
+	ASSERT_EQ(ahead, block_store_get_resident_blocks(bs));
+
+	// With it off, scans fault in one block at a time again
+	ASSERT_EQ(true, block_store_set_readahead(bs, 0));
+	for (size_t i = 3500; i < 3510; i++)
+	{
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, i, buffer));
+	}
+	ASSERT_EQ(ahead + 10, block_store_get_resident_blocks(bs));
+
+	// Explicit hints load in the background whatever the setting
+	ASSERT_EQ(true, block_store_prefetch(bs, 3900, 1000));
+	for (int wait = 0; wait < 5000 && block_store_get_resident_blocks(bs) < ahead + 10 + 196; wait++)
+	{
+		usleep(1000);
+	}
+	ASSERT_EQ(ahead + 10 + 196, block_store_get_resident_blocks(bs));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 4095, buffer));
+	ASSERT_EQ(4095 % 251, buffer[0]);
+
+	// Read-ahead never brings back image contents over a block written since
+	ASSERT_EQ(true, block_store_set_readahead(bs, BLOCK_STORE_READAHEAD_DEFAULT_BLOCKS));
+	std::vector<uint8_t> expected(BLOCK_SIZE_BYTES);
+	for (size_t i = 1011; i < 4096; i++)
+	{
+		std::fill(expected.begin(), expected.end(), uint8_t(i % 251));
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, i, buffer));
+		ASSERT_EQ(0, memcmp(buffer, i == 1050 ? written : expected.data(), BLOCK_SIZE_BYTES)) << i;
+	}
+	block_store_destroy(bs);
+}
+
+TEST(block_store_extent, bitmap_first_fit)
+{
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+
+	ASSERT_EQ(true, block_store_request(bs, 2));
+	// Blocks 0 and 1 are too short a run, so the first fit is right after the requested block
+	ASSERT_EQ(3, block_store_allocate_extent(bs, 4));
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 5, block_store_get_used_blocks(bs));
+	ASSERT_EQ(0, block_store_allocate_extent(bs, 2));
+
+	block_store_release_extent(bs, 3, 4);
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 3, block_store_get_used_blocks(bs));
+	ASSERT_EQ(SIZE_MAX, block_store_allocate_extent(bs, BLOCK_STORE_NUM_BLOCKS));
+	ASSERT_EQ(SIZE_MAX, block_store_allocate_extent(bs, 0));
+	ASSERT_EQ(SIZE_MAX, block_store_allocate_extent(NULL, 1));
+	block_store_destroy(bs);
+}
+
+TEST(block_store_extent, buddy_aligned_extents)
+{
+	block_store_options_t options = {};
+	options.allocator = BLOCK_STORE_ALLOCATOR_BUDDY;
+	block_store_t *bs = block_store_create_with(&options);
+	ASSERT_NE(nullptr, bs) << "block_store_create_with returned NULL when it should not have\n";
+
+	size_t eight = block_store_allocate_extent(bs, 8);
+	ASSERT_NE(SIZE_MAX, eight);
+	ASSERT_EQ(0, eight % 8);
+	// Three blocks get rounded up to an aligned four
+	size_t three = block_store_allocate_extent(bs, 3);
+	ASSERT_NE(SIZE_MAX, three);
+	ASSERT_EQ(0, three % 4);
+	ASSERT_TRUE(three + 4 <= eight || eight + 8 <= three);
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 12, block_store_get_used_blocks(bs));
+
+	// The bitmap blocks must never be handed out
+	size_t single = block_store_allocate(bs);
+	ASSERT_NE(SIZE_MAX, single);
+	ASSERT_TRUE(single < BITMAP_START_BLOCK || single >= BITMAP_START_BLOCK + BITMAP_NUM_BLOCKS);
+	ASSERT_EQ(false, block_store_request(bs, BITMAP_START_BLOCK));
+	block_store_destroy(bs);
+}
+
+TEST(block_store_extent, buddy_coalesces_on_release)
+{
+	block_store_options_t options = {};
+	options.allocator = BLOCK_STORE_ALLOCATOR_BUDDY;
+	block_store_t *bs = block_store_create_with(&options);
+	ASSERT_NE(nullptr, bs) << "block_store_create_with returned NULL when it should not have\n";
+
+	std::vector<size_t> ids;
+	for (size_t id = block_store_allocate(bs); id != SIZE_MAX; id = block_store_allocate(bs))
+	{
+		ids.push_back(id);
+	}
+	ASSERT_EQ(BLOCK_STORE_NUM_BLOCKS - BITMAP_NUM_BLOCKS, ids.size());
+	ASSERT_EQ(SIZE_MAX, block_store_allocate_extent(bs, 1));
+
+	for (size_t id : ids)
+	{
+		block_store_release(bs, id);
+	}
+	// Releasing twice must not corrupt the free lists
+	block_store_release(bs, ids[0]);
+	ASSERT_EQ(BITMAP_NUM_BLOCKS, block_store_get_used_blocks(bs));
+
+	// The upper half of the device has no bitmap in it, so it must have merged back into one block
+	ASSERT_EQ(BLOCK_STORE_NUM_BLOCKS / 2, block_store_allocate_extent(bs, BLOCK_STORE_NUM_BLOCKS / 2));
+	ASSERT_EQ(true, block_store_request(bs, 5));
+	ASSERT_EQ(false, block_store_request(bs, 5));
+	block_store_destroy(bs);
+}
+
+static void record_relocation(size_t old_id, size_t new_id, void *arg)
+{
+	std::vector<std::pair<size_t, size_t>> *moves = (std::vector<std::pair<size_t, size_t>> *) arg;
+	moves->push_back(std::make_pair(old_id, new_id));
+}
+
+TEST(block_store_defrag, compacts_in_slices)
+{
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+
+	// Scatter a few blocks across the device, each tagged with its original id, one of them a four block extent
+	const size_t scattered[] = {3, 60, 200, 301, 400, 401, 402, 403, 450, 511};
+	for (size_t id : scattered)
+	{
+		ASSERT_EQ(true, block_store_request(bs, id));
+		uint8_t buffer[BLOCK_SIZE_BYTES];
+		memset(buffer, (int) (id & 0xFF), BLOCK_SIZE_BYTES);
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, id, buffer));
+	}
+	size_t used = block_store_get_used_blocks(bs);
+
+	// One move per slice, with a foreground allocation in between
+	std::vector<std::pair<size_t, size_t>> moves;
+	ASSERT_EQ(1, block_store_defrag(bs, 1, record_relocation, &moves));
+	ASSERT_NE(SIZE_MAX, block_store_allocate(bs));
+	used++;
+	while (block_store_defrag(bs, 1, record_relocation, &moves) > 0)
+	{
+	}
+	ASSERT_EQ(used, block_store_get_used_blocks(bs));
+
+	// The scattered blocks and the new allocation are now packed at the bottom of the device
+	for (size_t id = 0; id < BITMAP_START_BLOCK; id++)
+	{
+		bool was_free = block_store_request(bs, id);
+		ASSERT_EQ(id >= 11, was_free) << "block " << id;
+		if (was_free)
+		{
+			block_store_release(bs, id);
+		}
+	}
+
+	// Follow the reported mapping and make sure every block's data came along, in the order it had
+	size_t previous = 0;
+	for (size_t id : scattered)
+	{
+		size_t current = id;
+		for (auto &move : moves)
+		{
+			if (move.first == current)
+			{
+				current = move.second;
+			}
+		}
+		uint8_t buffer[BLOCK_SIZE_BYTES];
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, current, buffer));
+		ASSERT_EQ((uint8_t) (id & 0xFF), buffer[0]) << "block " << id << " moved to " << current;
+		if (id > 400 && id <= 403)
+		{
+			ASSERT_EQ(previous + 1, current) << "extent block " << id;
+		}
+		if (id != scattered[0])
+		{
+			ASSERT_LT(previous, current) << "block " << id;
+		}
+		previous = current;
+	}
+
+	// Compacted devices have nothing left to do
+	ASSERT_EQ(0, block_store_defrag(bs, 16, NULL, NULL));
+	ASSERT_EQ(0, block_store_defrag(NULL, 16, NULL, NULL));
+	block_store_destroy(bs);
+}
+
+TEST(block_store_policy, next_fit_rotates)
+{
+	block_store_options_t options = {};
+	options.policy = BLOCK_STORE_POLICY_NEXT_FIT;
+	block_store_t *bs = block_store_create_with(&options);
+	ASSERT_NE(nullptr, bs) << "block_store_create_with returned NULL when it should not have\n";
+
+	ASSERT_EQ(0, block_store_allocate(bs));
+	ASSERT_EQ(1, block_store_allocate(bs));
+	block_store_release(bs, 0);
+	// First fit would go back to 0, next fit keeps moving forward
+	ASSERT_EQ(2, block_store_allocate(bs));
+
+	ASSERT_EQ(true, block_store_set_policy(bs, BLOCK_STORE_POLICY_FIRST_FIT));
+	ASSERT_EQ(0, block_store_allocate(bs));
+	ASSERT_EQ(false, block_store_set_policy(NULL, BLOCK_STORE_POLICY_FIRST_FIT));
+	block_store_destroy(bs);
+}
+
+TEST(block_store_policy, round_robin_groups)
+{
+	block_store_options_t options = {};
+	options.policy = BLOCK_STORE_POLICY_ROUND_ROBIN;
+	block_store_t *bs = block_store_create_with(&options);
+	ASSERT_NE(nullptr, bs) << "block_store_create_with returned NULL when it should not have\n";
+
+	const size_t groups = BLOCK_STORE_NUM_BLOCKS / BLOCK_STORE_GROUP_BLOCKS;
+	for (size_t group = 0; group < groups; group++)
+	{
+		size_t id = block_store_allocate(bs);
+		size_t expected = group * BLOCK_STORE_GROUP_BLOCKS;
+		// The bitmap sits at the end of its group, so it only shifts the group after it
+		if (expected >= BITMAP_START_BLOCK && expected < BITMAP_START_BLOCK + BITMAP_NUM_BLOCKS)
+		{
+			expected = BITMAP_START_BLOCK + BITMAP_NUM_BLOCKS;
+		}
+		ASSERT_EQ(expected, id);
+	}
+	// Back around to the first group
+	ASSERT_EQ(1, block_store_allocate(bs));
+	block_store_destroy(bs);
+}
+
+TEST(block_store_policy, allocate_near_goal)
+{
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+
+	ASSERT_EQ(300, block_store_allocate_near(bs, 300));
+	ASSERT_EQ(301, block_store_allocate_near(bs, 300));
+	ASSERT_EQ(true, block_store_request(bs, 302));
+	ASSERT_EQ(299, block_store_allocate_near(bs, 300));
+	// Goals inside the bitmap land just beside it
+	size_t id = block_store_allocate_near(bs, BITMAP_START_BLOCK);
+	ASSERT_TRUE(id == BITMAP_START_BLOCK - 1 || id == BITMAP_START_BLOCK + BITMAP_NUM_BLOCKS);
+	// Out of range goals fall back to the normal policy
+	ASSERT_EQ(0, block_store_allocate_near(bs, BLOCK_STORE_NUM_BLOCKS));
+	ASSERT_EQ(SIZE_MAX, block_store_allocate_near(NULL, 0));
+	block_store_destroy(bs);
+}
+
+TEST(block_store, frag_report)
+{
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+
+	block_store_frag_report_t report;
+	ASSERT_EQ(true, block_store_get_frag_report(bs, &report));
+	// Fresh device: the bitmap splits the free space in two
+	ASSERT_EQ(2, report.free_runs);
+	ASSERT_EQ(BLOCK_STORE_NUM_BLOCKS - BITMAP_NUM_BLOCKS, report.free_blocks);
+	ASSERT_EQ(BLOCK_STORE_NUM_BLOCKS - BITMAP_START_BLOCK - BITMAP_NUM_BLOCKS, report.largest_free_run);
+
+	// Punch single block holes into the low run: 0 1 [2] 3 [4] 5 ...
+	ASSERT_EQ(true, block_store_request(bs, 2));
+	ASSERT_EQ(true, block_store_request(bs, 4));
+	ASSERT_EQ(true, block_store_request(bs, 70));
+	ASSERT_EQ(true, block_store_get_frag_report(bs, &report));
+	ASSERT_EQ(5, report.free_runs);
+	ASSERT_EQ(1, report.run_histogram[0]); // block 3
+	ASSERT_EQ(1, report.run_histogram[1]); // blocks 0-1
+	ASSERT_EQ(1, report.run_histogram[6]); // blocks 5-69
+	ASSERT_EQ(1, report.run_histogram[5]); // blocks 71-126
+	ASSERT_EQ(block_store_get_free_blocks(bs), report.free_blocks);
+
+	// A full device has nothing to report
+	while (block_store_allocate(bs) != SIZE_MAX)
+	{
+	}
+	ASSERT_EQ(0, block_store_get_free_blocks(bs));
+	ASSERT_EQ(BLOCK_STORE_NUM_BLOCKS, block_store_get_used_blocks(bs));
+	ASSERT_EQ(true, block_store_get_frag_report(bs, &report));
+	ASSERT_EQ(0, report.free_runs);
+	ASSERT_EQ(0, report.largest_free_run);
+	ASSERT_EQ(false, block_store_get_frag_report(NULL, &report));
+	block_store_destroy(bs);
+}
+
+// Zone summaries checked against a model of which blocks are in use
+static void expect_zones_match(block_store_t *bs, const std::vector<bool> &used)
+{
+	const size_t zones = (used.size() + BLOCK_STORE_ZONE_BLOCKS - 1) / BLOCK_STORE_ZONE_BLOCKS;
+	block_store_zone_t zone;
+	for (size_t z = 0; z < zones; z++)
+	{
+		ASSERT_EQ(true, block_store_get_zone(bs, z, &zone));
+		size_t free = 0, largest = 0, run = 0;
+		for (size_t i = z * BLOCK_STORE_ZONE_BLOCKS; i < std::min(used.size(), (z + 1) * BLOCK_STORE_ZONE_BLOCKS); i++)
+		{
+			run = used[i] ? 0 : run + 1;
+			free += !used[i];
+			largest = std::max(largest, run);
+		}
+		ASSERT_EQ(z * BLOCK_STORE_ZONE_BLOCKS, zone.first_block);
+		ASSERT_EQ(free, zone.free_blocks) << z;
+		ASSERT_EQ(largest, zone.largest_free_run) << z;
+	}
+	ASSERT_EQ(false, block_store_get_zone(bs, zones, &zone));
+}
+
+TEST(block_store, zones)
+{
+	block_store_options_t options = {};
+	options.num_blocks = 3 * BLOCK_STORE_ZONE_BLOCKS + 1000;
+	block_store_t *bs = block_store_create_with(&options);
+	ASSERT_NE(nullptr, bs);
+	std::vector<bool> used(options.num_blocks, false);
+	const size_t bitmap_blocks = block_store_get_used_blocks(bs);
+	std::fill(used.begin() + BITMAP_START_BLOCK, used.begin() + BITMAP_START_BLOCK + bitmap_blocks, true);
+	expect_zones_match(bs, used);
+	block_store_zone_t zone;
+	ASSERT_EQ(true, block_store_get_zone(bs, 3, &zone));
+	ASSERT_EQ(1000, zone.blocks);
+	ASSERT_EQ(false, block_store_get_zone(nullptr, 0, &zone));
+
+	// First fit skips zones with nothing free and searches only the first one with room
+	size_t id;
+	while ((id = block_store_allocate(bs)) < 2 * BLOCK_STORE_ZONE_BLOCKS)
+	{
+		used[id] = true;
+	}
+	ASSERT_EQ(2 * BLOCK_STORE_ZONE_BLOCKS, id);
+	used[id] = true;
+	block_store_release(bs, BLOCK_STORE_ZONE_BLOCKS + 5);
+	ASSERT_EQ(BLOCK_STORE_ZONE_BLOCKS + 5, block_store_allocate(bs));
+	ASSERT_EQ(2 * BLOCK_STORE_ZONE_BLOCKS + 1, block_store_allocate_near(bs, BLOCK_STORE_ZONE_BLOCKS - 3));
+	used[2 * BLOCK_STORE_ZONE_BLOCKS + 1] = true;
+	// Below the goal the full zone is skipped the same way, the free block past it is closer than the one above
+	block_store_release(bs, BLOCK_STORE_ZONE_BLOCKS - 2);
+	ASSERT_EQ(BLOCK_STORE_ZONE_BLOCKS - 2, block_store_allocate_near(bs, BLOCK_STORE_ZONE_BLOCKS + 3));
+
+	// Extents find runs that cross from one zone into the next
+	block_store_release_extent(bs, BLOCK_STORE_ZONE_BLOCKS - 10, 20);
+	std::fill(used.begin() + BLOCK_STORE_ZONE_BLOCKS - 10, used.begin() + BLOCK_STORE_ZONE_BLOCKS + 10, false);
+	expect_zones_match(bs, used);
+	ASSERT_EQ(2 * BLOCK_STORE_ZONE_BLOCKS + 2, block_store_allocate_extent(bs, 21));
+	std::fill(used.begin() + 2 * BLOCK_STORE_ZONE_BLOCKS + 2, used.begin() + 2 * BLOCK_STORE_ZONE_BLOCKS + 23, true);
+	ASSERT_EQ(BLOCK_STORE_ZONE_BLOCKS - 10, block_store_allocate_extent(bs, 20));
+	std::fill(used.begin() + BLOCK_STORE_ZONE_BLOCKS - 10, used.begin() + BLOCK_STORE_ZONE_BLOCKS + 10, true);
+	ASSERT_EQ(2 * BLOCK_STORE_ZONE_BLOCKS + 23, block_store_allocate_extent(bs, BLOCK_STORE_ZONE_BLOCKS));
+	std::fill(used.begin() + 2 * BLOCK_STORE_ZONE_BLOCKS + 23, used.begin() + 3 * BLOCK_STORE_ZONE_BLOCKS + 23, true);
+	expect_zones_match(bs, used);
+
+	// Random churn, then the summaries must survive a resize and a round trip through an image
+	std::mt19937 rng(48);
+	for (int i = 0; i < 5000; i++)
+	{
+		const size_t block = rng() % used.size();
+		const size_t count = 1 + rng() % 64;
+		if (rng() % 2 == 0)
+		{
+			const size_t first = block_store_allocate_extent(bs, count);
+			if (first != SIZE_MAX)
+			{
+				std::fill(used.begin() + first, used.begin() + first + count, true);
+			}
+		}
+		else if (used[block] && (block < BITMAP_START_BLOCK || block >= BITMAP_START_BLOCK + bitmap_blocks))
+		{
+			block_store_release(bs, block);
+			used[block] = false;
+		}
+	}
+	expect_zones_match(bs, used);
+	ASSERT_EQ(true, block_store_resize(bs, bitmap_blocks * BLOCK_SIZE_BYTES * 8, nullptr, nullptr)); // As far as the bitmap reaches
+	used.resize(bitmap_blocks * BLOCK_SIZE_BYTES * 8, false);
+	expect_zones_match(bs, used);
+	ASSERT_EQ(BLOCK_STORE_IMAGE_HEADER_BYTES + used.size() * BLOCK_SIZE_BYTES, block_store_serialize(bs, "test_zones.bs"));
+	block_store_destroy(bs);
+	bs = block_store_deserialize("test_zones.bs");
+	ASSERT_NE(nullptr, bs);
+	expect_zones_match(bs, used);
+	block_store_destroy(bs);
+	remove("test_zones.bs");
+}
+
+TEST(block_store_create, bitmap_at_block_start)
+{
+	// The bitmap starts at the first byte of BITMAP_START_BLOCK, not BITMAP_START_BLOCK bytes into the device
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs);
+	ASSERT_EQ(0, block_store_allocate(bs));
+	uint8_t block[BLOCK_SIZE_BYTES];
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, BITMAP_START_BLOCK, block));
+	ASSERT_EQ(0x01, block[0]);
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, BITMAP_START_BLOCK / BLOCK_SIZE_BYTES, block));
+	ASSERT_EQ(0, block[BITMAP_START_BLOCK % BLOCK_SIZE_BYTES]);
+	ASSERT_EQ(BLOCK_STORE_IMAGE_HEADER_BYTES + BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "test_bitmap_start.bs"));
+	block_store_destroy(bs);
+
+	FILE *file = fopen("test_bitmap_start.bs", "rb");
+	ASSERT_NE(nullptr, file);
+	std::vector<uint8_t> image(BLOCK_STORE_NUM_BYTES);
+	ASSERT_EQ(0, fseek(file, BLOCK_STORE_IMAGE_HEADER_BYTES, SEEK_SET)); // Blocks start after the header page
+	ASSERT_EQ(image.size(), fread(image.data(), 1, image.size(), file));
+	fclose(file);
+	remove("test_bitmap_start.bs");
+	ASSERT_EQ(0x01, image[BITMAP_START_BLOCK * BLOCK_SIZE_BYTES]);
+	ASSERT_EQ(0, image[BITMAP_START_BLOCK]);
+	ASSERT_EQ(0x80, image[BITMAP_START_BLOCK * BLOCK_SIZE_BYTES + BITMAP_START_BLOCK / 8]); // The bitmap's own block
+}
+
+// Reference model for the randomized tests: which blocks are in use and what every block holds
+// The default policy is first fit, so allocations are checked for the exact block and not just a free one
+struct store_model
+{
+	std::vector<bool> used;
+	std::vector<std::vector<uint8_t>> data;
+	size_t bitmap_blocks;
+	size_t used_blocks;
+
+	explicit store_model(size_t num_blocks)
+		: used(num_blocks, false), data(num_blocks, std::vector<uint8_t>(BLOCK_SIZE_BYTES, 0)),
+		  bitmap_blocks((num_blocks + BLOCK_SIZE_BYTES * 8 - 1) / (BLOCK_SIZE_BYTES * 8)), used_blocks(0)
+	{
+		take(BITMAP_START_BLOCK, bitmap_blocks);
+	}
+
+	bool is_bitmap(size_t block) const
+	{
+		return block >= BITMAP_START_BLOCK && block < BITMAP_START_BLOCK + bitmap_blocks;
+	}
+
+	size_t first_fit(size_t count) const
+	{
+		size_t run = 0;
+		for (size_t i = 0; i < used.size(); i++)
+		{
+			run = used[i] ? 0 : run + 1;
+			if (run == count)
+			{
+				return i + 1 - count;
+			}
+		}
+		return SIZE_MAX;
+	}
+
+	void take(size_t first, size_t count)
+	{
+		std::fill(used.begin() + first, used.begin() + first + count, true);
+		used_blocks += count;
+	}
+
+	void release(size_t block)
+	{
+		if (block < used.size() && used[block] && !is_bitmap(block))
+		{
+			used[block] = false;
+			used_blocks--;
+		}
+	}
+
+	// Bitmap blocks read back as the model's bits, bit b in byte b / 8
+	std::vector<uint8_t> expected(size_t block) const
+	{
+		if (!is_bitmap(block))
+		{
+			return data[block];
+		}
+		std::vector<uint8_t> bits(BLOCK_SIZE_BYTES, 0);
+		const size_t first = (block - BITMAP_START_BLOCK) * BLOCK_SIZE_BYTES * 8;
+		for (size_t i = 0; i < BLOCK_SIZE_BYTES * 8 && first + i < used.size(); i++)
+		{
+			bits[i / 8] |= used[first + i] << (i % 8);
+		}
+		return bits;
+	}
+};
+
+// Long random sequences of every basic operation, each checked against the model as it happens
+// BLOCK_STORE_MODEL_OPS makes the run longer (or shorter) than the default
+static void run_model(uint32_t seed, size_t num_blocks, size_t ops)
+{
+	block_store_options_t options = {};
+	options.num_blocks = num_blocks;
+	block_store_t *bs = block_store_create_with(&options);
+	ASSERT_NE(nullptr, bs);
+	store_model model(num_blocks);
+	std::mt19937 rng(seed);
+	uint8_t block[BLOCK_SIZE_BYTES];
+	for (size_t op = 0; op < ops; op++)
+	{
+		const size_t id = rng() % (num_blocks + 8); // Now and then past the end
+		const size_t count = 1 + rng() % 16;
+		switch (rng() % 16)
+		{
+			case 0:
+			case 1:
+			case 2:
+			{
+				const size_t expected = model.first_fit(1);
+				ASSERT_EQ(expected, block_store_allocate(bs)) << "seed " << seed << " op " << op;
+				if (expected != SIZE_MAX)
+				{
+					model.take(expected, 1);
+				}
+				break;
+			}
+			case 3:
+			{
+				const size_t expected = model.first_fit(count);
+				ASSERT_EQ(expected, block_store_allocate_extent(bs, count)) << "seed " << seed << " op " << op;
+				if (expected != SIZE_MAX)
+				{
+					model.take(expected, count);
+				}
+				break;
+			}
+			case 4:
+			{
+				const bool expected = id < num_blocks && !model.used[id];
+				ASSERT_EQ(expected, block_store_request(bs, id)) << "seed " << seed << " op " << op;
+				if (expected)
+				{
+					model.take(id, 1);
+				}
+				break;
+			}
+			case 5:
+			case 6:
+			case 7:
+				block_store_release(bs, id); // Free blocks, bitmap blocks and blocks past the end included
+				model.release(id);
+				break;
+			case 8:
+				block_store_release_extent(bs, id, count);
+				for (size_t i = id; i < id + count; i++)
+				{
+					model.release(i);
+				}
+				break;
+			case 9:
+			case 10:
+			case 11:
+				if (model.is_bitmap(id))
+				{
+					break; // Writing there rewrites the bitmap behind the store's back
+				}
+				for (uint8_t &byte : block)
+				{
+					byte = uint8_t(rng());
+				}
+				ASSERT_EQ(id < num_blocks ? BLOCK_SIZE_BYTES : 0, block_store_write(bs, id, block)) << "seed " << seed << " op " << op;
+				if (id < num_blocks)
+				{
+					model.data[id].assign(block, block + BLOCK_SIZE_BYTES);
+				}
+				break;
+			case 12:
+			case 13:
+			case 14:
+				ASSERT_EQ(id < num_blocks ? BLOCK_SIZE_BYTES : 0, block_store_read(bs, id, block)) << "seed " << seed << " op " << op;
+				if (id < num_blocks)
+				{
+					ASSERT_EQ(model.expected(id), std::vector<uint8_t>(block, block + BLOCK_SIZE_BYTES)) << "seed " << seed << " op " << op << " block " << id;
+				}
+				break;
+			default:
+				if (rng() % 32 == 0) // Round trips are slow next to everything else, keep them rare
+				{
+					ASSERT_EQ(BLOCK_STORE_IMAGE_HEADER_BYTES + num_blocks * BLOCK_SIZE_BYTES, block_store_serialize(bs, "test_model.bs"));
+					block_store_destroy(bs);
+					bs = rng() % 2 ? block_store_deserialize("test_model.bs") : block_store_deserialize_lazy("test_model.bs", false);
+					ASSERT_NE(nullptr, bs) << "seed " << seed << " op " << op;
+				}
+				break;
+		}
+		ASSERT_EQ(model.used_blocks, block_store_get_used_blocks(bs)) << "seed " << seed << " op " << op;
+		ASSERT_EQ(num_blocks - model.used_blocks, block_store_get_free_blocks(bs));
+	}
+	for (size_t i = 0; i < num_blocks; i++)
+	{
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, i, block));
+		ASSERT_EQ(model.expected(i), std::vector<uint8_t>(block, block + BLOCK_SIZE_BYTES)) << "seed " << seed << " block " << i;
+	}
+	block_store_destroy(bs);
+	remove("test_model.bs");
+}
+
+TEST(block_store_model, random_ops)
+{
+	const char *const env = getenv("BLOCK_STORE_MODEL_OPS");
+	const size_t ops = env != nullptr ? strtoull(env, nullptr, 10) : 20000;
+	run_model(49, BLOCK_STORE_NUM_BLOCKS, ops);
+	run_model(490, 2000, ops); // Several bitmap blocks, the last one partly past the end of the device
+}
+
+// Latency budgets: the best mean of a few batches of each operation has to stay under a ceiling
+// tens of times what it costs now, so only a change in how the work scales trips one, not a busy machine
+// BLOCK_STORE_BUDGET_SCALE multiplies every ceiling, for sanitizer and coverage builds
+template <typename Op>
+static double best_mean_ns(size_t per_batch, Op op)
+{
+	double best = 1e18;
+	for (int batch = 0; batch < 5; batch++)
+	{
+		const auto start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < per_batch; i++)
+		{
+			op(i);
+		}
+		const std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+		best = std::min(best, elapsed.count() / per_batch);
+	}
+	return best;
+}
+
+TEST(block_store_model, latency_budgets)
+{
+	const char *const env = getenv("BLOCK_STORE_BUDGET_SCALE");
+	const double scale = env != nullptr ? atof(env) : 1.0;
+	const size_t num_blocks = size_t(1) << 20;
+	block_store_options_t options = {};
+	options.num_blocks = num_blocks;
+	block_store_t *bs = block_store_create_with(&options);
+	ASSERT_NE(nullptr, bs);
+	while (block_store_allocate(bs) < BITMAP_START_BLOCK)
+	{
+	}
+	while (block_store_get_used_blocks(bs) + 4096 <= num_blocks / 100 * 99)
+	{
+		ASSERT_NE(SIZE_MAX, block_store_allocate_extent(bs, 4096));
+	}
+	const size_t first_data = block_store_get_used_blocks(bs) / 2;
+	uint8_t block[BLOCK_SIZE_BYTES] = {0};
+
+	// Allocations on a device this full and this big are where a lost summary or an extra pass shows
+	const double allocate = best_mean_ns(2000, [&](size_t) { block_store_release(bs, block_store_allocate(bs)); });
+	EXPECT_LT(allocate, 50000 * scale) << "allocate + release";
+	const double extent = best_mean_ns(2000, [&](size_t) { block_store_release_extent(bs, block_store_allocate_extent(bs, 64), 64); });
+	EXPECT_LT(extent, 100000 * scale) << "allocate_extent + release_extent";
+	const double read = best_mean_ns(100000, [&](size_t i) { block_store_read(bs, first_data + i, block); });
+	EXPECT_LT(read, 2000 * scale) << "read";
+	const double write = best_mean_ns(100000, [&](size_t i) { block_store_write(bs, first_data + i, block); });
+	EXPECT_LT(write, 2000 * scale) << "write";
+	RecordProperty("allocate_ns", int(allocate));
+	RecordProperty("extent_ns", int(extent));
+	RecordProperty("read_ns", int(read));
+	RecordProperty("write_ns", int(write));
+	block_store_destroy(bs);
+}
+
+TEST(block_store_create, custom_size)
+{
+	block_store_options_t options = {};
+	options.num_blocks = 4 * BLOCK_STORE_NUM_BLOCKS;
+	block_store_t *bs = block_store_create_with(&options);
+	ASSERT_NE(nullptr, bs) << "block_store_create_with returned NULL when it should not have\n";
+	ASSERT_EQ(4 * BLOCK_STORE_NUM_BLOCKS, block_store_get_num_blocks(bs));
+	// Bigger devices need a bigger bitmap
+	ASSERT_EQ(4 * BITMAP_NUM_BLOCKS, block_store_get_used_blocks(bs));
+
+	char write_buffer[BLOCK_SIZE_BYTES] = "Past the default end";
+	size_t id = 4 * BLOCK_STORE_NUM_BLOCKS - 1;
+	ASSERT_EQ(true, block_store_request(bs, id));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, id, write_buffer));
+	ASSERT_EQ(BLOCK_STORE_IMAGE_HEADER_BYTES + 4 * BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "test_big.bs"));
+	block_store_destroy(bs);
+
+	// The image size carries the geometry
+	bs = block_store_deserialize("test_big.bs");
+	ASSERT_NE(nullptr, bs);
+	ASSERT_EQ(4 * BLOCK_STORE_NUM_BLOCKS, block_store_get_num_blocks(bs));
+	ASSERT_EQ(false, block_store_request(bs, id));
+	char read_buffer[BLOCK_SIZE_BYTES] = {0};
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, id, read_buffer));
+	ASSERT_EQ(0, memcmp(read_buffer, write_buffer, BLOCK_SIZE_BYTES));
+	block_store_destroy(bs);
+
+	// Too small to hold the bitmap at BITMAP_START_BLOCK
+	options.num_blocks = BITMAP_START_BLOCK;
+	ASSERT_EQ(nullptr, block_store_create_with(&options));
+	ASSERT_EQ(SIZE_MAX, block_store_get_num_blocks(NULL));
+}
+
+TEST(block_store, stats)
+{
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+	block_store_stats_t stats;
+#ifdef BLOCK_STORE_STATS
+	ASSERT_EQ(true, block_store_get_stats(bs, &stats));
+	ASSERT_EQ(0, stats.ops[BLOCK_STORE_OP_READ].count);
+
+	uint8_t buffer[BLOCK_SIZE_BYTES] = {0};
+	size_t id = block_store_allocate(bs);
+	ASSERT_EQ(0, id);
+	// Fill the first bitmap word so the next allocation has to scan into the second
+	for (size_t i = 1; i < 64; i++)
+	{
+		block_store_request(bs, i);
+	}
+	ASSERT_EQ(64, block_store_allocate(bs));
+	block_store_write(bs, id, buffer);
+	block_store_read(bs, id, buffer);
+	block_store_read(bs, id, buffer);
+	block_store_release(bs, id);
+	block_store_release(bs, id); // Already free, nothing to count
+
+	ASSERT_EQ(true, block_store_get_stats(bs, &stats));
+	ASSERT_EQ(2, stats.ops[BLOCK_STORE_OP_READ].count);
+	ASSERT_EQ(1, stats.ops[BLOCK_STORE_OP_WRITE].count);
+	ASSERT_EQ(65, stats.ops[BLOCK_STORE_OP_ALLOCATE].count);
+	ASSERT_EQ(1, stats.ops[BLOCK_STORE_OP_RELEASE].count);
+	ASSERT_EQ(2, stats.scans);
+	ASSERT_EQ(1 + 2, stats.words_scanned);
+
+	uint64_t histogram_total = 0;
+	for (size_t bucket = 0; bucket < BLOCK_STORE_HIST_BUCKETS; bucket++)
+	{
+		histogram_total += stats.ops[BLOCK_STORE_OP_READ].latency_ns[bucket];
+	}
+	ASSERT_EQ(2, histogram_total);
+	ASSERT_LE(block_store_stats_percentile(stats.ops[BLOCK_STORE_OP_READ].latency_ns, 50),
+			block_store_stats_percentile(stats.ops[BLOCK_STORE_OP_READ].latency_ns, 100));
+	ASSERT_EQ(0, block_store_stats_percentile(stats.ops[BLOCK_STORE_OP_SERIALIZE].latency_ns, 99));
+
+	ASSERT_EQ(BLOCK_STORE_IMAGE_HEADER_BYTES + BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "test_stats.bs"));
+	ASSERT_EQ(0, block_store_serialize(bs, "no_such_dir/test_stats.bs"));
+	ASSERT_EQ(true, block_store_get_stats(bs, &stats));
+	ASSERT_EQ(2, stats.ops[BLOCK_STORE_OP_SERIALIZE].count); // Failures are counted too
+	block_store_t *loaded = block_store_deserialize("test_stats.bs");
+	ASSERT_NE(nullptr, loaded);
+	ASSERT_EQ(true, block_store_get_stats(loaded, &stats));
+	ASSERT_EQ(1, stats.ops[BLOCK_STORE_OP_DESERIALIZE].count);
+	block_store_destroy(loaded);
+	ASSERT_EQ(false, block_store_get_stats(NULL, &stats));
+#else
+	ASSERT_EQ(false, block_store_get_stats(bs, &stats));
+#endif
+	block_store_destroy(bs);
+}
+
+TEST(block_store, trace)
+{
+	ASSERT_EQ(SIZE_MAX, block_store_trace_stop());
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+	ASSERT_EQ(true, block_store_trace_start("test_trace.bin"));
+	ASSERT_EQ(false, block_store_trace_start("test_trace.bin"));
+
+	uint8_t buffer[BLOCK_SIZE_BYTES] = {0};
+	size_t id = block_store_allocate(bs);
+	block_store_write(bs, id, buffer);
+	block_store_read(bs, id, buffer);
+	ASSERT_EQ(false, block_store_request(bs, id));
+	block_store_release(bs, id);
+	ASSERT_EQ(5, block_store_trace_stop());
+	block_store_allocate(bs); // Not traced any more
+	block_store_destroy(bs);
+
+	FILE *file = fopen("test_trace.bin", "rb");
+	ASSERT_NE(nullptr, file);
+	trace_header_t header;
+	ASSERT_EQ(1, fread(&header, sizeof(header), 1, file));
+	ASSERT_EQ(0, memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)));
+	ASSERT_EQ(5, header.records);
+	ASSERT_EQ(0, header.dropped);
+	trace_record_t records[6];
+	ASSERT_EQ(5, fread(records, sizeof(trace_record_t), 6, file));
+	fclose(file);
+
+	// One thread, so the file is already in call order
+	const trace_op_t expected[] = {TRACE_OP_ALLOCATE, TRACE_OP_WRITE, TRACE_OP_READ, TRACE_OP_REQUEST, TRACE_OP_RELEASE};
+	for (size_t i = 0; i < 5; i++)
+	{
+		ASSERT_EQ(expected[i], records[i].op);
+		ASSERT_EQ(id, i == 0 ? records[i].result : records[i].arg);
+		ASSERT_LE(i == 0 ? 0 : records[i - 1].timestamp_ns, records[i].timestamp_ns);
+	}
+	ASSERT_EQ(0, records[3].result);
+}
+
+TEST(block_store, stats_threads)
+{
+#ifdef BLOCK_STORE_STATS
+	// Every thread counts on its own, the totals still add up, also once new threads take over the slots of exited ones
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+	const size_t id = block_store_allocate(bs);
+	const size_t threads = 4, calls = 1000;
+	for (int pass = 0; pass < 2; pass++)
+	{
+		std::vector<std::thread> workers;
+		for (size_t t = 0; t < threads; t++)
+		{
+			workers.emplace_back([bs, id, calls]() {
+				uint8_t buffer[BLOCK_SIZE_BYTES];
+				for (size_t i = 0; i < calls; i++)
+				{
+					block_store_read(bs, id, buffer);
+				}
+			});
+		}
+		for (auto &worker : workers)
+		{
+			worker.join();
+		}
+	}
+	block_store_stats_t stats;
+	ASSERT_EQ(true, block_store_get_stats(bs, &stats));
+	ASSERT_EQ(2 * threads * calls, stats.ops[BLOCK_STORE_OP_READ].count);
+	uint64_t histogram_total = 0;
+	for (size_t bucket = 0; bucket < BLOCK_STORE_HIST_BUCKETS; bucket++)
+	{
+		histogram_total += stats.ops[BLOCK_STORE_OP_READ].latency_ns[bucket];
+	}
+	ASSERT_EQ(2 * threads * calls, histogram_total);
+	block_store_destroy(bs);
+#endif
+}
+
+TEST(block_store, trace_threads)
+{
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+	const size_t id = block_store_allocate(bs);
+	const size_t threads = 4, calls = 1000;
+
+	// The second trace runs on new threads, which take over the rings the first ones left behind
+	for (int pass = 0; pass < 2; pass++)
+	{
+		ASSERT_EQ(true, block_store_trace_start("test_trace.bin"));
+		std::vector<std::thread> workers;
+		for (size_t t = 0; t < threads; t++)
+		{
+			workers.emplace_back([bs, id, calls]() {
+				uint8_t buffer[BLOCK_SIZE_BYTES];
+				for (size_t i = 0; i < calls; i++)
+				{
+					block_store_read(bs, id, buffer);
+				}
+			});
+		}
+		for (auto &worker : workers)
+		{
+			worker.join();
+		}
+		const size_t written = block_store_trace_stop();
+
+		FILE *file = fopen("test_trace.bin", "rb");
+		ASSERT_NE(nullptr, file);
+		trace_header_t header;
+		ASSERT_EQ(1, fread(&header, sizeof(header), 1, file));
+		ASSERT_EQ(written, header.records);
+		ASSERT_EQ(threads * calls, header.records + header.dropped);
+		trace_record_t record;
+		std::vector<size_t> per_thread(threads);
+		while (fread(&record, sizeof(record), 1, file) == 1)
+		{
+			ASSERT_LT(record.thread, threads);
+			ASSERT_EQ(TRACE_OP_READ, record.op);
+			per_thread[record.thread]++;
+		}
+		fclose(file);
+		for (size_t count : per_thread)
+		{
+			ASSERT_LE(count, calls);
+		}
+	}
+	block_store_destroy(bs);
+}
+
+TEST(bitmap, range_ops)
+{
+	// Odd sizes so the ranges start and end in the middle of bytes and vectors
+	bitmap_t *bitmap = bitmap_create(1001);
+	ASSERT_NE(nullptr, bitmap);
+	bitmap_set_range(bitmap, 3, 900);
+	ASSERT_EQ(900, bitmap_total_set(bitmap));
+	ASSERT_EQ(false, bitmap_test(bitmap, 2));
+	ASSERT_EQ(true, bitmap_test(bitmap, 3));
+	ASSERT_EQ(true, bitmap_test(bitmap, 902));
+	ASSERT_EQ(false, bitmap_test(bitmap, 903));
+	ASSERT_EQ(true, bitmap_test_range_all(bitmap, 3, 900));
+	ASSERT_EQ(false, bitmap_test_range_all(bitmap, 2, 900));
+	ASSERT_EQ(false, bitmap_test_range_all(bitmap, 4, 900));
+
+	bitmap_reset_range(bitmap, 500, 5);
+	ASSERT_EQ(895, bitmap_total_set(bitmap));
+	ASSERT_EQ(false, bitmap_test_range_all(bitmap, 3, 900));
+	ASSERT_EQ(false, bitmap_test_range_any(bitmap, 500, 5));
+	ASSERT_EQ(true, bitmap_test_range_any(bitmap, 500, 6));
+	ASSERT_EQ(false, bitmap_test_range_any(bitmap, 903, 98));
+	ASSERT_EQ(false, bitmap_test_range_any(bitmap, 903, 99)); // Runs past the end
+
+	bitmap_t *other = bitmap_create(1001);
+	bitmap_set_range(other, 0, 200);
+	ASSERT_EQ(true, bitmap_and(other, bitmap));
+	ASSERT_EQ(197, bitmap_total_set(other));
+	ASSERT_EQ(true, bitmap_xor(other, bitmap)); // Now the bits past 199
+	ASSERT_EQ(895 - 197, bitmap_total_set(other));
+	ASSERT_EQ(true, bitmap_or(other, bitmap));
+	ASSERT_EQ(895, bitmap_total_set(other));
+	ASSERT_EQ(true, bitmap_andnot(other, bitmap));
+	ASSERT_EQ(0, bitmap_total_set(other));
+
+	bitmap_t *small = bitmap_create(1000);
+	ASSERT_EQ(false, bitmap_or(small, bitmap));
+	bitmap_destroy(small);
+	bitmap_destroy(other);
+	bitmap_destroy(bitmap);
+}
+
+static void collect_bit(size_t bit, void *arg)
+{
+	static_cast<std::vector<size_t> *>(arg)->push_back(bit);
+}
+
+TEST(bitmap, next_set_iteration)
+{
+	bitmap_t *bitmap = bitmap_create(200);
+	ASSERT_NE(nullptr, bitmap);
+	ASSERT_EQ(SIZE_MAX, bitmap_next_set(bitmap, 0));
+	ASSERT_EQ(0, bitmap_next_zero(bitmap, 0));
+	const size_t bits[] = {0, 63, 64, 65, 130, 199};
+	for (size_t bit : bits)
+	{
+		bitmap_set(bitmap, bit);
+	}
+	ASSERT_EQ(63, bitmap_next_set(bitmap, 1));
+	ASSERT_EQ(130, bitmap_next_set(bitmap, 66));
+	ASSERT_EQ(SIZE_MAX, bitmap_next_set(bitmap, 200));
+	ASSERT_EQ(66, bitmap_next_zero(bitmap, 63));
+	ASSERT_EQ(SIZE_MAX, bitmap_next_zero(bitmap, 199));
+
+	// Going down stops at the same bits, from past the end starts at the last one
+	ASSERT_EQ(65, bitmap_prev_set(bitmap, 129));
+	ASSERT_EQ(0, bitmap_prev_set(bitmap, 62));
+	ASSERT_EQ(199, bitmap_prev_set(bitmap, 1000));
+	ASSERT_EQ(62, bitmap_prev_zero(bitmap, 65));
+	ASSERT_EQ(198, bitmap_prev_zero(bitmap, SIZE_MAX));
+	ASSERT_EQ(SIZE_MAX, bitmap_prev_zero(bitmap, 0));
+	ASSERT_EQ(SIZE_MAX, bitmap_prev_set(nullptr, 0));
+
+	// Small batches have to pick up exactly where the last one stopped
+	size_t batch[4];
+	ASSERT_EQ(4, bitmap_next_set_batch(bitmap, 0, batch, 4));
+	ASSERT_EQ(65, batch[3]);
+	ASSERT_EQ(2, bitmap_next_set_batch(bitmap, batch[3] + 1, batch, 4));
+	ASSERT_EQ(130, batch[0]);
+	ASSERT_EQ(199, batch[1]);
+
+	std::vector<size_t> visited;
+	bitmap_for_each(bitmap, collect_bit, &visited);
+	ASSERT_EQ(std::vector<size_t>(bits, bits + 6), visited);
+	bitmap_destroy(bitmap);
+}
+
+TEST(block_store_template, matches_c_image_format)
+{
+	BlockStore<> store;
+	ASSERT_EQ(true, store.valid());
+	ASSERT_EQ(BITMAP_NUM_BLOCKS, store.used_blocks());
+	ASSERT_EQ(0, store.allocate());
+	ASSERT_EQ(true, store.request(BITMAP_START_BLOCK + BITMAP_NUM_BLOCKS));
+	ASSERT_EQ(false, store.request(BITMAP_START_BLOCK)); // The bitmap lives there
+	auto view = store.block(0);
+	ASSERT_EQ(BLOCK_SIZE_BYTES, view.size());
+	for (auto &byte : view)
+	{
+		byte = 0x5A;
+	}
+	ASSERT_EQ(BLOCK_STORE_IMAGE_HEADER_BYTES + BLOCK_STORE_NUM_BYTES, store.serialize("test_template.bs"));
+
+	// The C device reads the same image back, bitmap included
+	block_store_t *bs = block_store_deserialize("test_template.bs");
+	ASSERT_NE(nullptr, bs);
+	ASSERT_EQ(store.used_blocks(), block_store_get_used_blocks(bs));
+	ASSERT_EQ(false, block_store_request(bs, 0));
+	uint8_t buffer[BLOCK_SIZE_BYTES];
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 0, buffer));
+	ASSERT_EQ(0x5A, buffer[BLOCK_SIZE_BYTES - 1]);
+	ASSERT_EQ(1, block_store_allocate(bs));
+	ASSERT_EQ(BLOCK_STORE_IMAGE_HEADER_BYTES + BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "test_template.bs"));
+	block_store_destroy(bs);
+
+	// And the other way round, into a moved store
+	BlockStore<> loaded(std::move(store));
+	ASSERT_EQ(false, store.valid());
+	ASSERT_EQ(true, loaded.deserialize("test_template.bs"));
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 3, loaded.used_blocks());
+	ASSERT_EQ(true, loaded.test(1));
+	ASSERT_EQ(2, loaded.allocate());
+	loaded.release(0);
+	ASSERT_EQ(0, loaded.allocate());
+	ASSERT_EQ(0x5A, loaded.block(0)[0]);
+
+	// The bitmap's own blocks are never handed back, like on the C side
+	const std::size_t used = loaded.used_blocks();
+	loaded.release(BITMAP_START_BLOCK);
+	ASSERT_EQ(used, loaded.used_blocks());
+	ASSERT_EQ(true, loaded.test(BITMAP_START_BLOCK));
+	BlockStore<> &alias = loaded;
+	loaded = std::move(alias); // Self move leaves the store as it was
+	ASSERT_EQ(true, loaded.valid());
+	ASSERT_EQ(used, loaded.used_blocks());
+
+	BlockStore<64, 512> other_geometry;
+	ASSERT_EQ(false, other_geometry.deserialize("test_template.bs")); // Wrong size
+	ASSERT_EQ(1, other_geometry.used_blocks());
+}
+
+TEST(block_store_create, memory_options)
+{
+	block_store_options_t options = {};
+	options.num_blocks = 1 << 16;
+	options.memory = BLOCK_STORE_MEMORY_HUGE_PAGES;
+	options.prefault = true;
+	options.numa_local = true;
+	block_store_t *bs = block_store_create_with(&options);
+	ASSERT_NE(nullptr, bs); // Falls back to ordinary pages when there are no huge ones
+	uint8_t buffer[BLOCK_SIZE_BYTES] = {0};
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, options.num_blocks - 1, buffer));
+	ASSERT_EQ(0, buffer[0]);
+	block_store_destroy(bs);
+
+	// Arenas are zeroed and hold the blocks in place
+	std::vector<uint8_t> arena(BLOCK_STORE_NUM_BYTES, 0xFF);
+	options = block_store_options_t();
+	options.memory = BLOCK_STORE_MEMORY_ARENA;
+	options.arena = arena.data();
+	options.arena_bytes = arena.size() - 1;
+	ASSERT_EQ(nullptr, block_store_create_with(&options)); // Too small
+	options.arena_bytes = arena.size();
+	bs = block_store_create_with(&options);
+	ASSERT_NE(nullptr, bs);
+	ASSERT_EQ(BITMAP_NUM_BLOCKS, block_store_get_used_blocks(bs));
+	ASSERT_EQ(0, arena[0]);
+	memset(buffer, 0x42, sizeof(buffer));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 3, buffer));
+	ASSERT_EQ(0x42, arena[3 * BLOCK_SIZE_BYTES]);
+	block_store_destroy(bs);
+	ASSERT_EQ(0x42, arena[3 * BLOCK_SIZE_BYTES]); // Still the caller's
+}
+
+TEST(block_store, discard)
+{
+	// Big enough for whole pages of free blocks
+	block_store_options_t options = {};
+	options.num_blocks = 1 << 14;
+	options.discard = true;
+	block_store_t *bs = block_store_create_with(&options);
+	ASSERT_NE(nullptr, bs);
+	uint8_t buffer[BLOCK_SIZE_BYTES];
+	memset(buffer, 0xAB, sizeof(buffer));
+	size_t first = block_store_allocate_extent(bs, 4096);
+	ASSERT_NE(SIZE_MAX, first);
+	for (size_t i = first; i < first + 4096; i++)
+	{
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, i, buffer));
+	}
+	block_store_release(bs, first);
+	ASSERT_EQ(true, block_store_request(bs, first));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, first, buffer));
+	ASSERT_EQ(0, buffer[0]); // Freed blocks come back as zeros
+	ASSERT_EQ(0, buffer[BLOCK_SIZE_BYTES - 1]);
+	block_store_release_extent(bs, first, 4096);
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, first + 1000, buffer));
+	ASSERT_EQ(0, buffer[0]);
+
+	// Without the option release leaves the data, an explicit discard only touches free blocks
+	options.discard = false;
+	block_store_t *plain = block_store_create_with(&options);
+	memset(buffer, 0xAB, sizeof(buffer));
+	block_store_write(plain, 0, buffer);
+	block_store_write(plain, 1, buffer);
+	ASSERT_EQ(0, block_store_allocate(plain));
+	ASSERT_EQ(block_store_get_free_blocks(plain), block_store_discard(plain, 0, SIZE_MAX));
+	block_store_read(plain, 0, buffer);
+	ASSERT_EQ(0xAB, buffer[0]);
+	block_store_read(plain, 1, buffer);
+	ASSERT_EQ(0, buffer[0]);
+	ASSERT_EQ(SIZE_MAX, block_store_discard(NULL, 0, 1));
+
+	// Discarded space turns into holes in the image
+	ASSERT_EQ(BLOCK_STORE_IMAGE_HEADER_BYTES + options.num_blocks * BLOCK_SIZE_BYTES, block_store_serialize(bs, "test_discard.bs"));
+	struct stat st;
+	ASSERT_EQ(0, stat("test_discard.bs", &st));
+	ASSERT_EQ(BLOCK_STORE_IMAGE_HEADER_BYTES + options.num_blocks * BLOCK_SIZE_BYTES, st.st_size);
+	ASSERT_LT(st.st_blocks * 512, st.st_size);
+	block_store_t *loaded = block_store_deserialize("test_discard.bs");
+	ASSERT_NE(nullptr, loaded);
+	ASSERT_EQ(block_store_get_used_blocks(bs), block_store_get_used_blocks(loaded));
+	block_store_destroy(loaded);
+	block_store_destroy(plain);
+	block_store_destroy(bs);
+}
+
+TEST(block_store, resize)
+{
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs);
+	uint8_t buffer[BLOCK_SIZE_BYTES];
+	memset(buffer, 0x5A, sizeof(buffer));
+	ASSERT_EQ(true, block_store_request(bs, 5));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 5, buffer));
+
+	// Doubling the device doubles the bitmap, which needs the two blocks after it
+	ASSERT_EQ(true, block_store_request(bs, BITMAP_START_BLOCK + BITMAP_NUM_BLOCKS));
+	ASSERT_EQ(false, block_store_resize(bs, 2 * BLOCK_STORE_NUM_BLOCKS, nullptr, nullptr));
+	ASSERT_EQ(BLOCK_STORE_NUM_BLOCKS, block_store_get_num_blocks(bs));
+	block_store_release(bs, BITMAP_START_BLOCK + BITMAP_NUM_BLOCKS);
+	ASSERT_EQ(true, block_store_resize(bs, 2 * BLOCK_STORE_NUM_BLOCKS, nullptr, nullptr));
+	ASSERT_EQ(2 * BLOCK_STORE_NUM_BLOCKS, block_store_get_num_blocks(bs));
+	ASSERT_EQ(2 * BITMAP_NUM_BLOCKS + 1, block_store_get_used_blocks(bs));
+	ASSERT_EQ(false, block_store_request(bs, BITMAP_START_BLOCK + BITMAP_NUM_BLOCKS)); // Holds bitmap now
+	memset(buffer, 0, sizeof(buffer));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 5, buffer));
+	ASSERT_EQ(0x5A, buffer[0]);
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 2 * BLOCK_STORE_NUM_BLOCKS - 1, buffer));
+	ASSERT_EQ(0, buffer[0]);
+
+	// Shrinking only drops free blocks
+	ASSERT_EQ(true, block_store_request(bs, 1000));
+	ASSERT_EQ(false, block_store_resize(bs, 600, nullptr, nullptr));
+	block_store_release(bs, 1000);
+	ASSERT_EQ(true, block_store_resize(bs, 600, nullptr, nullptr));
+	ASSERT_EQ(600, block_store_get_num_blocks(bs));
+	ASSERT_EQ(3 + 1, block_store_get_used_blocks(bs));
+	ASSERT_EQ(false, block_store_request(bs, 600));
+	ASSERT_EQ(false, block_store_resize(bs, BITMAP_START_BLOCK, nullptr, nullptr));
+	ASSERT_EQ(false, block_store_resize(NULL, 600, nullptr, nullptr));
+	block_store_destroy(bs);
+
+	// Arenas can only grow into what the caller gave, mapped memory and the buddy lists grow too
+	std::vector<uint8_t> arena(2 * BLOCK_STORE_NUM_BYTES);
+	block_store_options_t options = {};
+	options.memory = BLOCK_STORE_MEMORY_ARENA;
+	options.arena = arena.data();
+	options.arena_bytes = arena.size();
+	bs = block_store_create_with(&options);
+	ASSERT_EQ(true, block_store_resize(bs, 2 * BLOCK_STORE_NUM_BLOCKS, nullptr, nullptr));
+	ASSERT_EQ(false, block_store_resize(bs, 2 * BLOCK_STORE_NUM_BLOCKS + 1, nullptr, nullptr));
+	block_store_destroy(bs);
+	options = block_store_options_t();
+	options.memory = BLOCK_STORE_MEMORY_HUGE_PAGES;
+	options.allocator = BLOCK_STORE_ALLOCATOR_BUDDY;
+	bs = block_store_create_with(&options);
+	ASSERT_EQ(true, block_store_resize(bs, 1 << 16, nullptr, nullptr));
+	ASSERT_EQ(true, block_store_request(bs, (1 << 16) - 1));
+	ASSERT_EQ((1 << 16) - 1 - (1 << 16) / (BLOCK_SIZE_BYTES * 8), block_store_get_free_blocks(bs));
+	ASSERT_NE(SIZE_MAX, block_store_allocate_extent(bs, 1 << 14));
+	block_store_destroy(bs);
+}
+
+TEST(block_store, striped_image)
+{
+	block_store_options_t options = {};
+	options.num_blocks = 1000; // Not a whole number of stripes
+	block_store_t *bs = block_store_create_with(&options);
+	ASSERT_NE(nullptr, bs);
+	uint8_t buffer[BLOCK_SIZE_BYTES];
+	for (size_t i = 0; i < options.num_blocks; i += 7)
+	{
+		memset(buffer, (int) (i & 0xFF) | 1, sizeof(buffer));
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, i, buffer));
+		block_store_request(bs, i);
+	}
+	const char *files[] = {"test_stripe0.bs", "test_stripe1.bs", "test_stripe2.bs"};
+	ASSERT_EQ(3 * BLOCK_STORE_IMAGE_HEADER_BYTES + options.num_blocks * BLOCK_SIZE_BYTES, block_store_serialize_striped(bs, files, 3, 64));
+	struct stat st;
+	ASSERT_EQ(0, stat(files[0], &st));
+	ASSERT_EQ(BLOCK_STORE_IMAGE_HEADER_BYTES + (64 * 6 - 24) * BLOCK_SIZE_BYTES, st.st_size); // Stripes 0, 3, 6, 9 and 12, the last one short
+	ASSERT_EQ(0, stat(files[1], &st));
+	ASSERT_EQ(BLOCK_STORE_IMAGE_HEADER_BYTES + 64 * 5 * BLOCK_SIZE_BYTES, st.st_size);
+
+	ASSERT_EQ(BLOCK_STORE_IMAGE_OK, block_store_check_image(files[2]));
+	ASSERT_EQ(nullptr, block_store_deserialize(files[0])); // One file is not the whole device
+
+	block_store_t *loaded = block_store_deserialize_striped(files, 3, 64);
+	ASSERT_NE(nullptr, loaded);
+	ASSERT_EQ(options.num_blocks, block_store_get_num_blocks(loaded));
+	ASSERT_EQ(block_store_get_used_blocks(bs), block_store_get_used_blocks(loaded));
+	uint8_t expected[BLOCK_SIZE_BYTES];
+	for (size_t i = 0; i < options.num_blocks; i++)
+	{
+		block_store_read(bs, i, expected);
+		block_store_read(loaded, i, buffer);
+		ASSERT_EQ(0, memcmp(expected, buffer, sizeof(buffer))) << "block " << i;
+	}
+	block_store_destroy(loaded);
+
+	// The layout has to match what was written
+	ASSERT_EQ(nullptr, block_store_deserialize_striped(files, 3, 32));
+	const char *swapped[] = {files[1], files[0], files[2]};
+	ASSERT_EQ(nullptr, block_store_deserialize_striped(swapped, 3, 64));
+	ASSERT_EQ(0, block_store_serialize_striped(bs, files, 0, 64));
+	block_store_destroy(bs);
+}
+
+TEST(block_server, serves_clients)
+{
+	block_store_t *bs = block_store_create();
+	block_server_t *server = block_server_create(bs, "test_server.sock");
+	ASSERT_NE(nullptr, server);
+	ASSERT_EQ(nullptr, block_server_create(bs, "test_server.sock")); // Already being served
+	std::thread loop([server] { block_server_run(server); });
+
+	block_client_t *client = block_client_connect("test_server.sock");
+	ASSERT_NE(nullptr, client);
+	ASSERT_EQ(BLOCK_STORE_NUM_BLOCKS, block_client_get_num_blocks(client));
+	size_t id = block_client_allocate(client);
+	ASSERT_EQ(0, id);
+	ASSERT_EQ(true, block_client_request(client, 1));
+	ASSERT_EQ(false, block_client_request(client, 1));
+	uint8_t buffer[BLOCK_SIZE_BYTES];
+	memset(buffer, 0x77, sizeof(buffer));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_client_write(client, id, buffer));
+	ASSERT_EQ(0, block_client_write(client, BLOCK_STORE_NUM_BLOCKS, buffer));
+
+	// A second process sees the same device
+	block_client_t *other = block_client_connect("test_server.sock");
+	ASSERT_NE(nullptr, other);
+	memset(buffer, 0, sizeof(buffer));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_client_read(other, id, buffer));
+	ASSERT_EQ(0x77, buffer[BLOCK_SIZE_BYTES - 1]);
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 2, block_client_get_used_blocks(other));
+
+	// Pipelined, more than fits in the socket buffers at once
+	const size_t count = 20000;
+	std::vector<block_client_op_t> ops(count);
+	std::vector<uint8_t> blocks(count * BLOCK_SIZE_BYTES);
+	for (size_t i = 0; i < count; i++)
+	{
+		ops[i].op = (i % 2) ? BLOCK_PROTOCOL_READ : BLOCK_PROTOCOL_WRITE;
+		ops[i].arg = (i / 2) % 100;
+		ops[i].buffer = &blocks[i * BLOCK_SIZE_BYTES];
+		blocks[i * BLOCK_SIZE_BYTES] = (uint8_t) i;
+	}
+	ASSERT_EQ(true, block_client_batch(other, ops.data(), count));
+	for (size_t i = 1; i < count; i += 2)
+	{
+		ASSERT_EQ(BLOCK_SIZE_BYTES, ops[i].result);
+		ASSERT_EQ((uint8_t) (i - 1), blocks[i * BLOCK_SIZE_BYTES]); // Answered in order, right after its write
+	}
+	block_client_release(client, 1);
+	ASSERT_EQ(BLOCK_STORE_NUM_BLOCKS - BITMAP_NUM_BLOCKS - 1, block_client_get_free_blocks(client));
+	block_client_close(other);
+	block_client_close(client);
+
+	block_server_stop(server);
+	loop.join();
+	block_server_destroy(server);
+	ASSERT_EQ(nullptr, block_client_connect("test_server.sock"));
+	ASSERT_EQ(BITMAP_NUM_BLOCKS + 1, block_store_get_used_blocks(bs));
+	block_store_destroy(bs);
+}
+
+TEST(block_store, shared_memory)
+{
+	const std::string name = "/hw3_test_shared_" + std::to_string(getpid());
+	block_store_unlink_shared(name.c_str());
+	block_store_options_t options = {};
+	options.num_blocks = 1 << 14;
+	block_store_t *bs = block_store_create_shared(name.c_str(), &options);
+	ASSERT_NE(nullptr, bs);
+	ASSERT_EQ(nullptr, block_store_create_shared(name.c_str(), &options)); // Already exists
+	ASSERT_EQ(nullptr, block_store_attach("/hw3_test_shared_missing"));
+
+	// Two processes allocating at once never get the same block
+	const size_t each = 4000;
+	pid_t child = fork();
+	ASSERT_GE(child, 0);
+	block_store_t *mine = child == 0 ? block_store_attach(name.c_str()) : bs;
+	uint8_t buffer[BLOCK_SIZE_BYTES];
+	memset(buffer, child == 0 ? 0xC1 : 0xBA, sizeof(buffer));
+	bool ok = mine != nullptr;
+	for (size_t i = 0; ok && i < each; i++)
+	{
+		size_t id = block_store_allocate(mine);
+		uint8_t old[BLOCK_SIZE_BYTES];
+		ok = id != SIZE_MAX && block_store_read(mine, id, old) == BLOCK_SIZE_BYTES && old[0] == 0 && block_store_write(mine, id, buffer) == BLOCK_SIZE_BYTES;
+	}
+	if (child == 0)
+	{
+		block_store_destroy(mine);
+		_exit(ok ? 0 : 1);
+	}
+	int status = 0;
+	ASSERT_EQ(child, waitpid(child, &status, 0));
+	ASSERT_EQ(true, ok);
+	ASSERT_EQ(0, WEXITSTATUS(status));
+	ASSERT_EQ(2 * each + options.num_blocks / (BLOCK_SIZE_BYTES * 8), block_store_get_used_blocks(bs));
+	size_t ours = 0, theirs = 0;
+	for (size_t id = 0; id < options.num_blocks; id++)
+	{
+		block_store_read(bs, id, buffer);
+		ours += buffer[0] == 0xBA;
+		theirs += buffer[0] == 0xC1;
+	}
+	ASSERT_EQ(each, ours);
+	ASSERT_EQ(each, theirs);
+
+	// Attached handles see and change the same device, the multi block operations are off
+	block_store_t *other = block_store_attach(name.c_str());
+	ASSERT_NE(nullptr, other);
+	ASSERT_EQ(options.num_blocks, block_store_get_num_blocks(other));
+	ASSERT_EQ(true, block_store_request(other, options.num_blocks - 1));
+	ASSERT_EQ(false, block_store_request(bs, options.num_blocks - 1));
+	block_store_release(bs, options.num_blocks - 1);
+	ASSERT_EQ(true, block_store_request(other, options.num_blocks - 1));
+	ASSERT_EQ(SIZE_MAX, block_store_allocate_extent(other, 4));
+	ASSERT_EQ(false, block_store_resize(other, options.num_blocks * 2, nullptr, nullptr));
+	block_store_destroy(other);
+	ASSERT_EQ(true, block_store_unlink_shared(name.c_str()));
+	ASSERT_EQ(nullptr, block_store_attach(name.c_str()));
+	ASSERT_EQ(2 * each + options.num_blocks / (BLOCK_SIZE_BYTES * 8) + 1, block_store_get_used_blocks(bs)); // Still mapped here
+	block_store_destroy(bs);
+}
+
+// Same size, same used count and every block byte for byte, bitmap blocks included
+static void expect_same_device(block_store_t *a, block_store_t *b)
+{
+	ASSERT_EQ(block_store_get_num_blocks(a), block_store_get_num_blocks(b));
+	ASSERT_EQ(block_store_get_used_blocks(a), block_store_get_used_blocks(b));
+	uint8_t left[BLOCK_SIZE_BYTES], right[BLOCK_SIZE_BYTES];
+	for (size_t id = 0; id < block_store_get_num_blocks(a); id++)
+	{
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(a, id, left));
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(b, id, right));
+		ASSERT_EQ(0, memcmp(left, right, BLOCK_SIZE_BYTES)) << "block " << id;
+	}
+}
+
+// Follows a block through the moves reported to record_relocation
+static size_t relocated(const std::vector<std::pair<size_t, size_t>> &moves, size_t id)
+{
+	for (auto &move : moves)
+	{
+		if (move.first == id)
+		{
+			id = move.second;
+		}
+	}
+	return id;
+}
+
+TEST(block_store, resize_moves_blocks_in_the_way)
+{
+	// A quarter full, first fit has handed out the block right after the bitmap, which a longer bitmap needs
+	block_store_t *bs = block_store_create();
+	ASSERT_NE(nullptr, bs);
+	block_store_t *standby = block_store_create();
+	block_store_replication_t config = {};
+	config.replica = standby;
+	ASSERT_EQ(true, block_store_replicate_start(bs, &config));
+	uint8_t buffer[BLOCK_SIZE_BYTES];
+	std::vector<size_t> ids;
+	for (size_t i = 0; i < 128; i++)
+	{
+		ids.push_back(block_store_allocate(bs));
+		memset(buffer, (int) (i + 1), BLOCK_SIZE_BYTES);
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, ids.back(), buffer));
+	}
+	const size_t in_the_way = BITMAP_START_BLOCK + BITMAP_NUM_BLOCKS;
+	ASSERT_EQ(false, block_store_request(bs, in_the_way));
+	const size_t used = block_store_get_used_blocks(bs);
+
+	// Without a way to tell the caller, the blocks stay put and so does the size
+	ASSERT_EQ(false, block_store_resize(bs, 1024, nullptr, nullptr));
+	ASSERT_EQ(BLOCK_STORE_NUM_BLOCKS, block_store_get_num_blocks(bs));
+
+	std::vector<std::pair<size_t, size_t>> moves;
+	ASSERT_EQ(true, block_store_resize(bs, 1024, record_relocation, &moves));
+	ASSERT_EQ(1, moves.size());
+	ASSERT_EQ(in_the_way, moves[0].first);
+	ASSERT_EQ(true, block_store_resize(bs, 4096, record_relocation, &moves));
+	ASSERT_EQ(4096, block_store_get_num_blocks(bs));
+	ASSERT_EQ(used - BITMAP_NUM_BLOCKS + 4096 / (BLOCK_SIZE_BYTES * 8), block_store_get_used_blocks(bs));
+	for (size_t i = 0; i < ids.size(); i++)
+	{
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, relocated(moves, ids[i]), buffer));
+		ASSERT_EQ((uint8_t) (i + 1), buffer[0]) << "block " << ids[i];
+	}
+
+	// Completely full, the grown device has room for the blocks in the way
+	while (block_store_allocate(bs) != SIZE_MAX)
+	{
+	}
+	for (size_t block = BITMAP_START_BLOCK + 4096 / (BLOCK_SIZE_BYTES * 8); block < 4096; block++)
+	{
+		memset(buffer, (int) (block & 0xFF), BLOCK_SIZE_BYTES);
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, block, buffer));
+	}
+	moves.clear();
+	ASSERT_EQ(true, block_store_resize(bs, 8192, record_relocation, &moves));
+	ASSERT_EQ(4096 / (BLOCK_SIZE_BYTES * 8), moves.size());
+	for (auto &move : moves)
+	{
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, move.second, buffer));
+		ASSERT_EQ((uint8_t) (move.first & 0xFF), buffer[0]) << "block " << move.first;
+	}
+
+	// The standby saw the moves as ordinary changes and ends up the same
+	ASSERT_EQ(true, block_store_replicate_flush(bs));
+	expect_same_device(bs, standby);
+	ASSERT_EQ(true, block_store_replicate_stop(bs));
+	block_store_destroy(standby);
+	block_store_destroy(bs);
+}
+
+TEST(block_store, replication)
+{
+	block_store_options_t options = {};
+	options.discard = true; // Released blocks are zeroed, which has to reach the standby too
+	block_store_t *bs = block_store_create_with(&options);
+	block_store_t *standby = block_store_create();
+	uint8_t buffer[BLOCK_SIZE_BYTES];
+	memset(buffer, 0x77, sizeof(buffer));
+	ASSERT_EQ(true, block_store_request(bs, 300));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 300, buffer)); // Before replication, goes in the snapshot
+	block_store_write(standby, 10, buffer); // Whatever the standby held is wiped
+
+	block_store_replication_t config = {};
+	config.replica = standby;
+	ASSERT_EQ(false, block_store_replicate_start(bs, nullptr));
+	config.replica = bs;
+	ASSERT_EQ(false, block_store_replicate_start(bs, &config));
+	config.replica = standby;
+	ASSERT_EQ(true, block_store_replicate_start(bs, &config));
+	ASSERT_EQ(false, block_store_replicate_start(bs, &config)); // Already replicating
+
+	// Writes, allocations, releases, defrag and resize all come across
+	for (size_t i = 0; i < 100; i++)
+	{
+		size_t id = block_store_allocate(bs);
+		buffer[0] = (uint8_t)i;
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, id, buffer));
+	}
+	for (size_t i = 0; i < 100; i += 3)
+	{
+		block_store_release(bs, i);
+	}
+	ASSERT_NE(SIZE_MAX, block_store_allocate_extent(bs, 8));
+	ASSERT_NE(0, block_store_defrag(bs, 1000, nullptr, nullptr));
+	ASSERT_EQ(true, block_store_resize(bs, 2 * BLOCK_STORE_NUM_BLOCKS, nullptr, nullptr));
+	ASSERT_EQ(true, block_store_replicate_flush(bs));
+	expect_same_device(bs, standby);
+	ASSERT_EQ(true, block_store_replicate_stop(bs));
+	ASSERT_EQ(false, block_store_replicate_flush(bs));
+
+	// Through a pipe, applied on the other end by block_store_apply_log
+	int pipe_fds[2];
+	ASSERT_EQ(0, pipe(pipe_fds));
+	block_store_t *remote = block_store_create();
+	ASSERT_EQ(true, block_store_resize(remote, 2 * BLOCK_STORE_NUM_BLOCKS, nullptr, nullptr));
+	size_t applied = 0;
+	std::thread reader([&] { applied = block_store_apply_log(remote, pipe_fds[0]); });
+	config = block_store_replication_t();
+	config.fd = pipe_fds[1];
+	ASSERT_EQ(true, block_store_replicate_start(bs, &config));
+	for (size_t i = 0; i < 5000; i++)
+	{
+		buffer[0] = (uint8_t)i;
+		block_store_write(bs, i % 100, buffer);
+	}
+	block_store_release_extent(bs, 0, 50);
+	ASSERT_EQ(true, block_store_replicate_stop(bs));
+	close(pipe_fds[1]);
+	reader.join();
+	close(pipe_fds[0]);
+	ASSERT_GT(applied, 5000);
+	expect_same_device(bs, remote);
+
+	// A standby that stops keeping up is dropped under the detach policy instead of slowing the primary
+	ASSERT_EQ(0, pipe(pipe_fds));
+	config.fd = pipe_fds[1];
+	config.buffer_bytes = 1;
+	config.backpressure = BLOCK_STORE_BACKPRESSURE_DETACH;
+	ASSERT_EQ(true, block_store_replicate_start(bs, &config));
+	for (size_t i = 0; i < 20000; i++) // Far more than the pipe and the buffer hold, nobody is reading yet
+	{
+		block_store_write(bs, 400, buffer);
+	}
+	std::thread drain([&] {
+		while (read(pipe_fds[0], buffer, sizeof(buffer)) > 0) {}
+	});
+	ASSERT_EQ(false, block_store_replicate_stop(bs));
+	close(pipe_fds[1]);
+	drain.join();
+	close(pipe_fds[0]);
+
+	// A log cut short is an error
+	block_store_t *wrong_size = block_store_create();
+	ASSERT_EQ(0, pipe(pipe_fds));
+	ASSERT_EQ(1, write(pipe_fds[1], buffer, 1));
+	close(pipe_fds[1]);
+	ASSERT_EQ(SIZE_MAX, block_store_apply_log(wrong_size, pipe_fds[0]));
+	close(pipe_fds[0]);
+	block_store_destroy(wrong_size);
+	block_store_destroy(remote);
+	block_store_destroy(standby);
+	block_store_destroy(bs);
+}
+
+// The image on disk must read back as exactly the device in memory
+static void expect_same_image(block_store_t *bs, const char *path)
+{
+	block_store_t *image = block_store_deserialize(path);
+	ASSERT_NE(nullptr, image);
+	ASSERT_EQ(block_store_get_num_blocks(bs), block_store_get_num_blocks(image));
+	ASSERT_EQ(block_store_get_used_blocks(bs), block_store_get_used_blocks(image));
+	uint8_t expected[BLOCK_SIZE_BYTES], actual[BLOCK_SIZE_BYTES];
+	for (size_t i = 0; i < block_store_get_num_blocks(bs); i++)
+	{
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, i, expected));
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(image, i, actual));
+		ASSERT_EQ(0, memcmp(expected, actual, BLOCK_SIZE_BYTES)) << i;
+	}
+	block_store_destroy(image);
+}
+
+TEST(block_store, persistence)
+{
+	block_store_options_t options = {};
+	options.num_blocks = 4096;
+	options.discard = true;
+	block_store_t *bs = block_store_create_with(&options);
+	ASSERT_NE(nullptr, bs);
+	block_store_persistence_t config = {};
+	config.durability = BLOCK_STORE_DURABILITY_BATCHED;
+	config.buffer_blocks = 64;
+	block_store_persist_stats_t stats;
+	ASSERT_EQ(false, block_store_get_persist_stats(bs, &stats));
+	ASSERT_EQ(false, block_store_persist_barrier(bs));
+	ASSERT_EQ(true, block_store_persist_start(bs, "test_persist.bs", &config));
+	ASSERT_EQ(false, block_store_persist_start(bs, "test_persist.bs", &config));
+
+	// Every block written twice, plus its bit: a few hundred changes, a handful of writes and syncs
+	uint8_t buffer[BLOCK_SIZE_BYTES];
+	for (int round = 0; round < 2; round++)
+	{
+		for (size_t i = 1000; i < 1100; i++)
+		{
+			memset(buffer, int(i + round), BLOCK_SIZE_BYTES);
+			ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, i, buffer));
+			if (round == 0)
+			{
+				ASSERT_EQ(true, block_store_request(bs, i));
+			}
+		}
+	}
+	ASSERT_EQ(true, block_store_get_persist_stats(bs, &stats));
+	ASSERT_EQ(300, stats.changes);
+	ASSERT_GE(stats.changes / 10, stats.write_calls);
+	ASSERT_EQ(stats.flushes, stats.sync_calls);
+	ASSERT_EQ(true, block_store_persist_barrier(bs));
+	expect_same_image(bs, "test_persist.bs");
+
+	// Released, discarded, grown and defragmented, the image follows every change
+	for (size_t i = 1000; i < 1050; i++)
+	{
+		block_store_release(bs, i);
+	}
+	ASSERT_EQ(50, block_store_discard(bs, 1000, 50));
+	ASSERT_EQ(true, block_store_resize(bs, 8192, nullptr, nullptr));
+	ASSERT_EQ(true, block_store_request(bs, 8000));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 8000, buffer));
+	while (block_store_defrag(bs, 16, nullptr, nullptr) != 0)
+	{
+	}
+	ASSERT_EQ(true, block_store_persist_barrier(bs));
+	ASSERT_EQ(BLOCK_STORE_IMAGE_OK, block_store_check_image("test_persist.bs")); // The superblock grew with the device
+	expect_same_image(bs, "test_persist.bs");
+	ASSERT_EQ(true, block_store_persist_stop(bs));
+	ASSERT_EQ(false, block_store_persist_stop(bs));
+
+	// Immediate durability writes and syncs each change on its own
+	config.durability = BLOCK_STORE_DURABILITY_IMMEDIATE;
+	ASSERT_EQ(true, block_store_persist_start(bs, "test_persist.bs", &config));
+	for (size_t i = 2000; i < 2010; i++)
+	{
+		ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, i, buffer));
+	}
+	ASSERT_EQ(true, block_store_get_persist_stats(bs, &stats));
+	ASSERT_EQ(10, stats.write_calls);
+	ASSERT_EQ(10, stats.sync_calls);
+	ASSERT_EQ(true, block_store_persist_stop(bs));
+
+	// Buffered changes still go out once the oldest has waited out the interval
+	config.durability = BLOCK_STORE_DURABILITY_BUFFERED;
+	config.buffer_blocks = 1 << 20;
+	config.flush_interval_ms = 1;
+	ASSERT_EQ(true, block_store_persist_start(bs, "test_persist.bs", &config));
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 3000, buffer));
+	usleep(100000);
+	ASSERT_EQ(true, block_store_get_persist_stats(bs, &stats));
+	ASSERT_EQ(1, stats.flushes);
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 3001, buffer)); // The flusher may or may not get to this one before destroy does
+	ASSERT_EQ(true, block_store_get_persist_stats(bs, &stats));
+	ASSERT_EQ(0, stats.sync_calls);
+	block_store_destroy(bs); // Flushes the rest
+	block_store_t *image = block_store_deserialize("test_persist.bs");
+	ASSERT_NE(nullptr, image);
+	uint8_t read_buffer[BLOCK_SIZE_BYTES];
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(image, 3001, read_buffer));
+	ASSERT_EQ(0, memcmp(buffer, read_buffer, BLOCK_SIZE_BYTES));
+	block_store_destroy(image);
+	remove("test_persist.bs");
+}
+
+// Reads one block straight out of an image file, to see what actually reached it
+static void expect_image_block(const char *path, size_t block_id, const uint8_t *expected)
+{
+	const int fd = open(path, O_RDONLY);
+	ASSERT_GE(fd, 0);
+	uint8_t actual[BLOCK_SIZE_BYTES];
+	ASSERT_EQ(BLOCK_SIZE_BYTES, pread(fd, actual, BLOCK_SIZE_BYTES, BLOCK_STORE_IMAGE_HEADER_BYTES + block_id * BLOCK_SIZE_BYTES));
+	close(fd);
+	ASSERT_EQ(0, memcmp(expected, actual, BLOCK_SIZE_BYTES)) << block_id;
+}
+
+TEST(block_store, persistence_flush_interval)
+{
+	// A device that goes quiet after a change still gets it to the image once the interval is up
+	block_store_options_t options = {};
+	options.num_blocks = 1024;
+	block_store_t *bs = block_store_create_with(&options);
+	ASSERT_NE(nullptr, bs);
+	block_store_persistence_t config = {};
+	config.buffer_blocks = 1 << 20;
+	config.flush_interval_ms = 20;
+	ASSERT_EQ(true, block_store_persist_start(bs, "test_persist_idle.bs", &config));
+	uint8_t buffer[BLOCK_SIZE_BYTES];
+	memset(buffer, 0x3C, BLOCK_SIZE_BYTES);
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 500, buffer));
+	usleep(200000);
+	block_store_persist_stats_t stats;
+	ASSERT_EQ(true, block_store_get_persist_stats(bs, &stats));
+	ASSERT_EQ(1, stats.flushes);
+	expect_image_block("test_persist_idle.bs", 500, buffer);
+
+	// The block array may move when the device grows, the flusher follows it
+	ASSERT_EQ(true, block_store_resize(bs, 4096, nullptr, nullptr));
+	memset(buffer, 0xC3, BLOCK_SIZE_BYTES);
+	ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 3000, buffer));
+	usleep(200000);
+	expect_image_block("test_persist_idle.bs", 3000, buffer);
+	ASSERT_EQ(BLOCK_STORE_IMAGE_OK, block_store_check_image("test_persist_idle.bs"));
+	block_store_destroy(bs);
+	remove("test_persist_idle.bs");
+}
+
+TEST(block_fs, files)
+{
+	block_store_t *bs = block_store_create();
+	const size_t baseline = block_store_get_used_blocks(bs);
+	block_fs_t *fs = block_fs_format(bs);
+	ASSERT_NE(nullptr, fs);
+	ASSERT_EQ(nullptr, block_fs_format(bs)); // Block 0 is taken now
+	ASSERT_EQ(nullptr, block_fs_create(fs, "a_name_that_is_too_long_"));
+	ASSERT_EQ(nullptr, block_fs_open(fs, "missing"));
+
+	// A file written in pieces reads back whole, and sequential growth stays in few extents
+	block_fs_file_t *file = block_fs_create(fs, "data");
+	ASSERT_NE(nullptr, file);
+	ASSERT_EQ(nullptr, block_fs_create(fs, "data"));
+	std::vector<uint8_t> data(5000);
+	for (size_t i = 0; i < data.size(); i++)
+	{
+		data[i] = (uint8_t)(i * 7 + 3);
+	}
+	for (size_t offset = 0; offset < data.size(); offset += 100)
+	{
+		ASSERT_EQ(100, block_fs_write(file, offset, &data[offset], 100));
+	}
+	ASSERT_EQ(data.size(), block_fs_size(file));
+	ASSERT_LE(block_fs_extents(file), 4);
+	std::vector<uint8_t> back(data.size() + 10, 0xEE);
+	ASSERT_EQ(data.size(), block_fs_read(file, 0, back.data(), back.size()));
+	ASSERT_EQ(0, memcmp(data.data(), back.data(), data.size()));
+	ASSERT_EQ(0, block_fs_read(file, data.size(), back.data(), 1));
+
+	// Small sequential reads come out of the read-ahead window, writes through another handle show up in them
+	block_fs_file_t *other = block_fs_open(fs, "data");
+	ASSERT_NE(nullptr, other);
+	uint8_t chunk[10];
+	for (size_t offset = 0; offset < 2000; offset += sizeof(chunk))
+	{
+		if (offset == 1000)
+		{
+			memset(&data[1500], 0x42, 64);
+			ASSERT_EQ(64, block_fs_write(other, 1500, &data[1500], 64));
+		}
+		ASSERT_EQ(sizeof(chunk), block_fs_read(file, offset, chunk, sizeof(chunk)));
+		ASSERT_EQ(0, memcmp(&data[offset], chunk, sizeof(chunk))) << "offset " << offset;
+	}
+	ASSERT_EQ(3, block_fs_read(file, 4997, chunk, sizeof(chunk)));
+	ASSERT_EQ(0, memcmp(&data[4997], chunk, 3));
+
+	// Writing past the end leaves zeros in the gap, truncating gives the blocks back
+	uint8_t byte = 0x99;
+	ASSERT_EQ(1, block_fs_write(other, 9000, &byte, 1));
+	ASSERT_EQ(9001, block_fs_size(file));
+	ASSERT_EQ(10, block_fs_read(file, 5000, chunk, 10));
+	for (uint8_t c : chunk)
+	{
+		ASSERT_EQ(0, c);
+	}
+	ASSERT_EQ(true, block_fs_truncate(file, 1001));
+	ASSERT_EQ(true, block_fs_truncate(file, 1100));
+	ASSERT_EQ(99, block_fs_read(file, 1001, back.data(), 200));
+	for (size_t i = 0; i < 99; i++)
+	{
+		ASSERT_EQ(0, back[i]);
+	}
+	ASSERT_EQ(SIZE_MAX, block_fs_write(file, 0, data.data(), BLOCK_STORE_NUM_BYTES)); // Doesn't fit, nothing changes
+	ASSERT_EQ(1100, block_fs_size(file));
+	block_fs_close(other);
+	block_fs_close(file);
+
+	// A fragmented device spreads a file over many extents, which go in map blocks
+	std::vector<size_t> taken;
+	for (size_t id = block_store_allocate(bs); id != SIZE_MAX; id = block_store_allocate(bs))
+	{
+		taken.push_back(id);
+	}
+	for (size_t i = 0; i < taken.size(); i += 2)
+	{
+		block_store_release(bs, taken[i]);
+	}
+	block_fs_file_t *scattered = block_fs_create(fs, "scattered");
+	ASSERT_EQ(3000, block_fs_write(scattered, 0, data.data(), 3000));
+	ASSERT_GT(block_fs_extents(scattered), 10);
+	block_fs_close(scattered);
+	ASSERT_EQ(false, block_fs_unlink(fs, "missing"));
+
+	// Everything is in the device, so it mounts again from the image
+	block_fs_unmount(fs);
+	ASSERT_EQ(true, block_store_serialize(bs, "test_fs.bs") != 0);
+	block_store_t *loaded = block_store_deserialize("test_fs.bs");
+	fs = block_fs_mount(loaded);
+	ASSERT_NE(nullptr, fs);
+	scattered = block_fs_open(fs, "scattered");
+	ASSERT_NE(nullptr, scattered);
+	ASSERT_EQ(3000, block_fs_read(scattered, 0, back.data(), back.size()));
+	ASSERT_EQ(0, memcmp(data.data(), back.data(), 3000));
+	ASSERT_EQ(false, block_fs_unlink(fs, "scattered")); // Open
+	block_fs_close(scattered);
+	ASSERT_EQ(true, block_fs_unlink(fs, "scattered"));
+	ASSERT_EQ(true, block_fs_unlink(fs, "data"));
+	ASSERT_EQ(nullptr, block_fs_open(fs, "data"));
+	ASSERT_EQ(baseline + 2 + taken.size() / 2, block_store_get_used_blocks(loaded)); // Superblock, root and the blocks between the holes
+	block_fs_unmount(fs);
+	fs = block_fs_mount(bs); // The original device was never touched
+	ASSERT_NE(nullptr, fs);
+	block_fs_unmount(fs);
+	block_store_destroy(loaded);
+	block_store_destroy(bs);
+}
+
+static bool collect_pair(uint64_t key, uint64_t value, void *arg)
+{
+	static_cast<std::vector<std::pair<uint64_t, uint64_t>> *>(arg)->emplace_back(key, value);
+	return true;
+}
+
+TEST(block_kv, btree)
+{
+	block_store_options_t options = {};
+	options.num_blocks = 1 << 16;
+	block_store_t *bs = block_store_create_with(&options);
+	const size_t baseline = block_store_get_used_blocks(bs);
+	block_kv_t *kv = block_kv_create(bs, 8); // A tiny cache, so pages keep going out and coming back
+	ASSERT_NE(nullptr, kv);
+
+	// Random puts, overwrites and deletes agree with std::map all the way through
+	std::map<uint64_t, uint64_t> model;
+	std::mt19937_64 rng(45);
+	for (size_t i = 0; i < 20000; i++)
+	{
+		const uint64_t key = rng() % 5000;
+		if (rng() % 4 == 0)
+		{
+			ASSERT_EQ(model.erase(key) == 1, block_kv_delete(kv, key));
+		}
+		else
+		{
+			ASSERT_EQ(true, block_kv_put(kv, key, i));
+			model[key] = i;
+		}
+	}
+	ASSERT_EQ(model.size(), block_kv_count(kv));
+	ASSERT_GT(block_kv_height(kv), 2);
+	for (uint64_t key = 0; key < 5000; key++)
+	{
+		uint64_t value = 0;
+		ASSERT_EQ(model.count(key) == 1, block_kv_get(kv, key, &value));
+		if (model.count(key))
+		{
+			ASSERT_EQ(model[key], value);
+		}
+	}
+	std::vector<std::pair<uint64_t, uint64_t>> found;
+	std::vector<std::pair<uint64_t, uint64_t>> expected(model.lower_bound(1000), model.upper_bound(2000));
+	ASSERT_EQ(expected.size(), block_kv_scan(kv, 1000, 2000, collect_pair, &found));
+	ASSERT_EQ(expected, found);
+
+	// Flushed pages survive a serialize and open again from the image
+	const size_t id = block_kv_id(kv);
+	ASSERT_EQ(true, block_kv_close(kv));
+	ASSERT_NE(0, block_store_serialize(bs, "test_kv.bs"));
+	block_store_t *loaded = block_store_deserialize("test_kv.bs");
+	kv = block_kv_open(loaded, id, 0);
+	ASSERT_NE(nullptr, kv);
+	ASSERT_EQ(nullptr, block_kv_open(loaded, id + 1, 0));
+	found.clear();
+	ASSERT_EQ(model.size(), block_kv_scan(kv, 0, UINT64_MAX, collect_pair, &found));
+	expected.assign(model.begin(), model.end());
+	ASSERT_EQ(expected, found);
+
+	// Deleting everything gives every page back but the root
+	for (const auto &entry : model)
+	{
+		ASSERT_EQ(true, block_kv_delete(kv, entry.first));
+	}
+	ASSERT_EQ(0, block_kv_count(kv));
+	ASSERT_EQ(1, block_kv_height(kv));
+	ASSERT_EQ(true, block_kv_flush(kv));
+	ASSERT_EQ(baseline + 1 + BLOCK_KV_PAGE_BLOCKS, block_store_get_used_blocks(loaded));
+
+	// Bulk loading sorted keys builds full pages bottom up
+	std::vector<uint64_t> keys(10000), values(10000);
+	for (size_t i = 0; i < keys.size(); i++)
+	{
+		keys[i] = 3 * i + 1;
+		values[i] = i;
+	}
+	std::vector<uint64_t> unsorted = {5, 3};
+	ASSERT_EQ(false, block_kv_bulk_load(kv, unsorted.data(), unsorted.data(), 2));
+	ASSERT_EQ(true, block_kv_bulk_load(kv, keys.data(), values.data(), keys.size()));
+	ASSERT_EQ(false, block_kv_bulk_load(kv, keys.data(), values.data(), keys.size())); // Only into an empty tree
+	ASSERT_EQ(keys.size(), block_kv_count(kv));
+	uint64_t value = 0;
+	ASSERT_EQ(true, block_kv_get(kv, 3 * 4321 + 1, &value));
+	ASSERT_EQ(4321, value);
+	ASSERT_EQ(false, block_kv_get(kv, 3 * 4321, &value));
+	ASSERT_EQ(true, block_kv_put(kv, 3 * 4321, 7)); // Splits a full page
+	ASSERT_EQ(true, block_kv_get(kv, 3 * 4321, &value));
+	ASSERT_EQ(7, value);
+	found.clear();
+	ASSERT_EQ(5, block_kv_scan(kv, 3 * 4320, 3 * 4324, collect_pair, &found));
+	ASSERT_EQ(true, block_kv_close(kv));
+	block_store_destroy(loaded);
+	block_store_destroy(bs);
+}
@@ -0,0 +1,48 @@
+// Checks block store images and brings old ones up to the current format
+//
+// usage: hw3_image check <file>...            says what is wrong with each file, exits 1 if any is bad
+//        hw3_image convert <legacy> [output]  rewrites a headerless image, in place without an output
+//
+// check reads only the superblocks and the bitmap's bits for its own blocks, so it is quick on
+// images of any size; images written before the format had a header show up as legacy
+
+#include <stdio.h>
+#include <string.h>
+
+#include "block_store.h"
+
+static const char *const status_names[] = {
+	"ok", "unreadable", "legacy, needs converting", "bad magic", "unknown version", "bad checksum",
+	"unsupported features or block size", "bad geometry", "bitmap doesn't cover itself",
+};
+_Static_assert(sizeof(status_names) / sizeof(status_names[0]) == BLOCK_STORE_IMAGE_BAD_BITMAP + 1, "a name for every status");
+
+int main(int argc, char **argv)
+{
+	if(argc >= 3 && strcmp(argv[1], "check") == 0)
+	{
+		int status = 0;
+		for(int i = 2; i < argc; i++)
+		{
+			const block_store_image_status_t result = block_store_check_image(argv[i]);
+			printf("%s: %s\n", argv[i], status_names[result]);
+			status = result == BLOCK_STORE_IMAGE_OK ? status : 1;
+		}
+		return status;
+	}
+	if((argc == 3 || argc == 4) && strcmp(argv[1], "convert") == 0)
+	{
+		const char *output = argc == 4 ? argv[3] : argv[2];
+		const size_t written = block_store_convert_legacy(argv[2], output);
+		if(written == 0)
+		{
+			const block_store_image_status_t result = block_store_check_image(argv[2]);
+			fprintf(stderr, "Failed to convert %s: %s\n", argv[2], result == BLOCK_STORE_IMAGE_OK ? "already in the current format" : status_names[result]);
+			return 1;
+		}
+		printf("wrote %zu bytes to %s\n", written, output);
+		return 0;
+	}
+	fprintf(stderr, "usage: %s check <file>... | convert <legacy> [output]\n", argv[0]);
+	return 1;
+}
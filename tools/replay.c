@@ -0,0 +1,266 @@
+// Plays a trace from block_store_trace_start back against a fresh device and reports
+// throughput and per operation latency, so allocator and caching changes can be compared
+// on recorded workloads
+//
+// usage: hw3_replay <trace> [--allocator bitmap|buddy] [--policy first|next|round] [--blocks n]
+//
+// Calls are replayed on one thread in timestamp order, as fast as possible
+// Block ids handed out in the trace are mapped to whatever the new device hands out,
+// so a different allocator still reads and frees the blocks the workload meant
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "block_store.h"
+#include "histogram.h"
+#include "trace.h"
+
+typedef struct
+{
+	trace_record_t record;
+	size_t index;  // File order, breaks timestamp ties so each thread keeps its own order
+} replay_entry_t;
+
+static const char *const op_names[TRACE_OP_COUNT] = {
+	"allocate", "allocate_near", "allocate_extent", "request", "release", "read", "write", "serialize", "deserialize", "release_extent",
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+	const replay_entry_t *left = (const replay_entry_t *)a;
+	const replay_entry_t *right = (const replay_entry_t *)b;
+	if(left->record.timestamp_ns != right->record.timestamp_ns)
+	{
+		return left->record.timestamp_ns < right->record.timestamp_ns ? -1 : 1;
+	}
+	return left->index < right->index ? -1 : (left->index > right->index);
+}
+
+// Reads the whole trace, sorted into call order
+static replay_entry_t *load_trace(const char *const filename, trace_header_t *const header, size_t *const count)
+{
+	FILE *file = fopen(filename, "rb");
+	if(file == NULL)
+	{
+		perror("Failed to open trace");
+		return NULL;
+	}
+	if(fread(header, sizeof(*header), 1, file) != 1 || memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) != 0
+		|| header->version != TRACE_VERSION || header->record_size != sizeof(trace_record_t))
+	{
+		fprintf(stderr, "%s is not a trace this replay understands\n", filename);
+		fclose(file);
+		return NULL;
+	}
+	replay_entry_t *entries = (replay_entry_t *)calloc(header->records ? header->records : 1, sizeof(replay_entry_t));
+	if(entries == NULL)
+	{
+		fclose(file);
+		return NULL;
+	}
+	size_t read = 0;
+	while(read < header->records && fread(&entries[read].record, sizeof(trace_record_t), 1, file) == 1)
+	{
+		entries[read].index = read;
+		read++;
+	}
+	fclose(file);
+	if(read != header->records)
+	{
+		fprintf(stderr, "Trace is truncated, replaying the %zu records that are there\n", read);
+	}
+	qsort(entries, read, sizeof(replay_entry_t), compare_entries);
+	*count = read;
+	return entries;
+}
+
+static bool parse_options(const int argc, char **argv, block_store_options_t *const options)
+{
+	for(int i = 2; i + 1 < argc; i += 2)
+	{
+		const char *value = argv[i + 1];
+		if(strcmp(argv[i], "--allocator") == 0)
+		{
+			options->allocator = strcmp(value, "buddy") == 0 ? BLOCK_STORE_ALLOCATOR_BUDDY : BLOCK_STORE_ALLOCATOR_BITMAP;
+		}
+		else if(strcmp(argv[i], "--policy") == 0)
+		{
+			options->policy = strcmp(value, "next") == 0 ? BLOCK_STORE_POLICY_NEXT_FIT
+				: strcmp(value, "round") == 0 ? BLOCK_STORE_POLICY_ROUND_ROBIN : BLOCK_STORE_POLICY_FIRST_FIT;
+		}
+		else if(strcmp(argv[i], "--blocks") == 0)
+		{
+			options->num_blocks = strtoull(value, NULL, 10);
+		}
+		else
+		{
+			return false;
+		}
+	}
+	return argc >= 2 && argc % 2 == 0;
+}
+
+int main(int argc, char **argv)
+{
+	block_store_options_t options = {0};
+	if(!parse_options(argc, argv, &options))
+	{
+		fprintf(stderr, "usage: %s <trace> [--allocator bitmap|buddy] [--policy first|next|round] [--blocks n]\n", argv[0]);
+		return 1;
+	}
+	trace_header_t header;
+	size_t count = 0;
+	replay_entry_t *entries = load_trace(argv[1], &header, &count);
+	block_store_t *bs = block_store_create_with(&options);
+	if(entries == NULL || bs == NULL)
+	{
+		free(entries);
+		block_store_destroy(bs);
+		return 1;
+	}
+
+	//Trace id -> device id, ids the trace never allocated map to themselves
+	size_t map_size = block_store_get_num_blocks(bs);
+	for(size_t i = 0; i < count; i++)
+	{
+		const trace_record_t *record = &entries[i].record;
+		size_t highest = record->arg == TRACE_NONE ? 0 : record->arg;
+		const bool allocates = record->op == TRACE_OP_ALLOCATE || record->op == TRACE_OP_ALLOCATE_NEAR || record->op == TRACE_OP_ALLOCATE_EXTENT;
+		if(allocates && record->result != TRACE_NONE)
+		{
+			highest = record->result + (record->op == TRACE_OP_ALLOCATE_EXTENT ? record->arg : 0);
+		}
+		if(highest >= map_size)
+		{
+			map_size = highest + 1;
+		}
+	}
+	size_t *map = (size_t *)malloc(map_size * sizeof(size_t));
+	static uint64_t latency[TRACE_OP_COUNT][HISTOGRAM_BUCKETS];
+	uint64_t ops[TRACE_OP_COUNT] = {0};
+	uint64_t total_ns[TRACE_OP_COUNT] = {0};
+	size_t mismatches = 0, skipped = 0;
+	if(map == NULL)
+	{
+		free(entries);
+		block_store_destroy(bs);
+		return 1;
+	}
+	for(size_t i = 0; i < map_size; i++)
+	{
+		map[i] = i;
+	}
+#define MAPPED(id) ((id) < map_size ? map[(id)] : (size_t)(id))
+
+	char image[4096];
+	snprintf(image, sizeof(image), "%s.replay.img", argv[1]);
+	uint8_t buffer[BLOCK_SIZE_BYTES] = {0};
+
+	const uint64_t replay_start = now_ns();
+	for(size_t i = 0; i < count; i++)
+	{
+		const trace_record_t *record = &entries[i].record;
+		const bool succeeded = record->result != TRACE_NONE;
+		size_t result = 0;
+		const uint64_t start = now_ns();
+		switch(record->op)
+		{
+			case TRACE_OP_ALLOCATE:
+				result = block_store_allocate(bs);
+				break;
+			case TRACE_OP_ALLOCATE_NEAR:
+				result = block_store_allocate_near(bs, record->arg == TRACE_NONE ? SIZE_MAX : MAPPED(record->arg));
+				break;
+			case TRACE_OP_ALLOCATE_EXTENT:
+				result = block_store_allocate_extent(bs, record->arg);
+				break;
+			case TRACE_OP_REQUEST:
+				result = block_store_request(bs, MAPPED(record->arg));
+				if(record->result == 1 && !result)
+				{
+					result = block_store_allocate(bs); //Our copy of the block is somewhere else, stand in any free one
+					if(result != SIZE_MAX && record->arg < map_size)
+					{
+						map[record->arg] = result;
+					}
+					result = (result != SIZE_MAX);
+				}
+				break;
+			case TRACE_OP_RELEASE:
+				block_store_release(bs, MAPPED(record->arg));
+				break;
+			case TRACE_OP_RELEASE_EXTENT:
+				block_store_release_extent(bs, MAPPED(record->arg), record->result);
+				break;
+			case TRACE_OP_READ:
+				block_store_read(bs, MAPPED(record->arg), buffer);
+				break;
+			case TRACE_OP_WRITE:
+				block_store_write(bs, MAPPED(record->arg), buffer);
+				break;
+			case TRACE_OP_SERIALIZE:
+				block_store_serialize(bs, image);
+				break;
+			default:
+				skipped++; //Deserialize would replace the device we are measuring
+				continue;
+		}
+		const uint64_t elapsed = now_ns() - start;
+		ops[record->op]++;
+		total_ns[record->op] += elapsed;
+		latency[record->op][histogram_bucket(elapsed)]++;
+
+		//Remember where the new device put what the trace allocated
+		if(record->op == TRACE_OP_ALLOCATE || record->op == TRACE_OP_ALLOCATE_NEAR || record->op == TRACE_OP_ALLOCATE_EXTENT)
+		{
+			const size_t length = record->op == TRACE_OP_ALLOCATE_EXTENT ? record->arg : 1;
+			if(succeeded != (result != SIZE_MAX))
+			{
+				mismatches++;
+			}
+			for(size_t j = 0; succeeded && result != SIZE_MAX && j < length && record->result + j < map_size; j++)
+			{
+				map[record->result + j] = result + j;
+			}
+		}
+		else if(record->op == TRACE_OP_REQUEST && (record->result == 1) != (result != 0))
+		{
+			mismatches++;
+		}
+	}
+	const uint64_t replay_ns = now_ns() - replay_start;
+#undef MAPPED
+
+	const size_t replayed = count - skipped;
+	printf("trace      %s\n", argv[1]);
+	printf("records    %zu (%llu dropped while tracing, %zu not replayable)\n", count, (unsigned long long)header.dropped, skipped);
+	printf("device     %zu blocks, %s allocator\n", block_store_get_num_blocks(bs), options.allocator == BLOCK_STORE_ALLOCATOR_BUDDY ? "buddy" : "bitmap");
+	printf("elapsed    %.3f ms\n", replay_ns / 1e6);
+	printf("throughput %.0f ops/s\n", replay_ns ? replayed * 1e9 / replay_ns : 0.0);
+	printf("mismatches %zu (allocations that failed on one side only)\n\n", mismatches);
+	printf("%-16s %10s %10s %10s %10s %10s\n", "op", "count", "mean ns", "p50 ns", "p99 ns", "max ns");
+	for(size_t op = 0; op < TRACE_OP_COUNT; op++)
+	{
+		if(ops[op] == 0)
+		{
+			continue;
+		}
+		printf("%-16s %10llu %10llu %10llu %10llu %10llu\n", op_names[op], (unsigned long long)ops[op],
+			(unsigned long long)(total_ns[op] / ops[op]), (unsigned long long)histogram_percentile(latency[op], 50),
+			(unsigned long long)histogram_percentile(latency[op], 99), (unsigned long long)histogram_percentile(latency[op], 100));
+	}
+
+	remove(image);
+	free(map);
+	free(entries);
+	block_store_destroy(bs);
+	return 0;
+}
@@ -0,0 +1,87 @@
+// Owns one block store and serves it to other processes over a Unix domain socket,
+// so they share a device instead of each deserializing a private copy
+//
+// usage: hw3_server <socket> [--image file] [--blocks n]
+//
+// With --image the device is loaded from the file if it exists and saved back to it on
+// SIGINT or SIGTERM; without one it starts empty and is gone when the server stops
+// Clients connect with block_client_connect, see block_client.h
+
+// sigaction is outside of plain C
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "block_server.h"
+#include "block_store.h"
+
+static block_server_t *running;
+
+static void stop_running(int signal)
+{
+	(void)signal;
+	block_server_stop(running); //Only writes to an eventfd, fine in a handler
+}
+
+int main(int argc, char **argv)
+{
+	const char *image = NULL;
+	block_store_options_t options = {0};
+	bool usage = argc < 2 || argc % 2 != 0;
+	for(int i = 2; !usage && i + 1 < argc; i += 2)
+	{
+		if(strcmp(argv[i], "--image") == 0)
+		{
+			image = argv[i + 1];
+		}
+		else if(strcmp(argv[i], "--blocks") == 0)
+		{
+			options.num_blocks = strtoull(argv[i + 1], NULL, 10);
+		}
+		else
+		{
+			usage = true;
+		}
+	}
+	if(usage)
+	{
+		fprintf(stderr, "usage: %s <socket> [--image file] [--blocks n]\n", argv[0]);
+		return 1;
+	}
+
+	block_store_t *bs = (image != NULL && access(image, F_OK) == 0) ? block_store_deserialize(image) : block_store_create_with(&options);
+	if(bs == NULL)
+	{
+		fprintf(stderr, "Failed to %s the device\n", image != NULL && access(image, F_OK) == 0 ? "load" : "create");
+		if(image != NULL && block_store_check_image(image) == BLOCK_STORE_IMAGE_LEGACY)
+		{
+			fprintf(stderr, "%s predates the image header, convert it with hw3_image convert\n", image);
+		}
+		return 1;
+	}
+	running = block_server_create(bs, argv[1]);
+	if(running == NULL)
+	{
+		block_store_destroy(bs);
+		return 1;
+	}
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = stop_running;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	printf("serving %zu blocks on %s\n", block_store_get_num_blocks(bs), argv[1]);
+	fflush(stdout);
+	const bool stopped = block_server_run(running);
+	block_server_destroy(running);
+	int status = stopped ? 0 : 1;
+	if(image != NULL && block_store_serialize(bs, image) == 0)
+	{
+		status = 1;
+	}
+	block_store_destroy(bs);
+	return status;
+}